@@ -5,7 +5,7 @@
 #
 
 ARCHIVE=credis${1}
-FILES="credis.c credis.h credis-test.c Makefile README"
+FILES="credis.c credis.h credis-epoll.h credis-libevent.h credis-test.c credis-bench.c Makefile README"
 
 # remove archive directory if it exists
 if [ -d ${ARCHIVE} ]; then
@@ -0,0 +1,642 @@
+/* credis-bench.c -- a benchmark application for credis (C client library 
+ * for Redis), modelled after redis-benchmark
+ *
+ * Copyright (c) 2009-2012, Jonas Romfelt <jonas at romfelt dot se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Credis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "credis.h"
+
+#define BENCH_MAX_ARGS 32
+#define BENCH_MGET_KEYS 10
+#define BENCH_HMGET_FIELDS 10
+#define BENCH_LIST_SIZE 600
+#define BENCH_LRANGE_SIZE 100
+#define BENCH_KEY_SIZE 32
+
+/* latency histogram with 16 sub-buckets per power of two, i.e. values are
+ * recorded with an error of at most about 6% */
+#define BENCH_SUB_BUCKETS 16
+#define BENCH_SUB_BITS 4
+#define BENCH_BUCKETS (BENCH_SUB_BUCKETS * 40)
+
+typedef struct _bench_config {
+  const char *host;
+  int port;
+  int timeout;
+  int requests;
+  int connections;
+  int threads;
+  int pipeline;
+  int datasize;
+  int keyspace;
+  int blocking;
+  int quiet;
+  char *value;
+} bench_config;
+
+typedef struct _bench_thread bench_thread;
+
+typedef struct _bench_test {
+  const char *name;
+  /* fills command arguments, returns number of arguments */
+  int (*command)(bench_thread *bt, const char **argv);
+  /* prepares data set for test, may be NULL */
+  int (*prepare)(REDIS rh, bench_config *cfg);
+} bench_test;
+
+typedef struct _bench_conn {
+  REDIS rh;
+  REDIS_ASYNC ah;
+  bench_thread *bt;
+  long long *sent; /* send time stamps of commands in flight, circular */
+  int head;
+  int inflight;
+} bench_conn;
+
+struct _bench_thread {
+  pthread_t thread;
+  bench_config *cfg;
+  bench_test *test;
+  int connc;
+  bench_conn *connv;
+  int requests; /* number of requests to issue */
+  int issued;
+  int completed;
+  int errors;
+  unsigned int seed;
+  char keys[BENCH_MAX_ARGS][BENCH_KEY_SIZE];
+  unsigned long long histogram[BENCH_BUCKETS];
+  long long max;
+};
+
+static long long bench_usecs(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((long long)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int bench_bucket(long long usecs)
+{
+  int e = 0, i;
+
+  if (usecs < BENCH_SUB_BUCKETS)
+    return (int)usecs;
+
+  while ((usecs >> e) >= 2 * BENCH_SUB_BUCKETS)
+    e++;
+  i = BENCH_SUB_BUCKETS * (e + 1) + (int)((usecs >> e) - BENCH_SUB_BUCKETS);
+
+  return i < BENCH_BUCKETS ? i : BENCH_BUCKETS - 1;
+}
+
+/* returns lowest value recorded in bucket `i' */
+static long long bench_bucketvalue(int i)
+{
+  int e;
+
+  if (i < BENCH_SUB_BUCKETS)
+    return i;
+
+  e = i / BENCH_SUB_BUCKETS - 1;
+  return ((long long)(BENCH_SUB_BUCKETS + i % BENCH_SUB_BUCKETS)) << e;
+}
+
+static void bench_record(bench_thread *bt, long long usecs)
+{
+  bt->histogram[bench_bucket(usecs)]++;
+  if (usecs > bt->max)
+    bt->max = usecs;
+  bt->completed++;
+}
+
+static long long bench_percentile(unsigned long long *histogram, long long total, double p)
+{
+  long long n = 0, target = (long long)(total * p / 100.0);
+  int i;
+
+  for (i = 0; i < BENCH_BUCKETS; i++) {
+    n += histogram[i];
+    if (n > target)
+      return bench_bucketvalue(i);
+  }
+  return bench_bucketvalue(BENCH_BUCKETS - 1);
+}
+
+/* returns `i'th random key of current command, formatted into thread's key
+ * buffers */
+static const char * bench_key(bench_thread *bt, const char *prefix, int i)
+{
+  int r = bt->cfg->keyspace > 0 ? rand_r(&bt->seed) % bt->cfg->keyspace : 0;
+
+  snprintf(bt->keys[i], BENCH_KEY_SIZE, "%s%012d", prefix, r);
+  return bt->keys[i];
+}
+
+static int bench_get(bench_thread *bt, const char **argv)
+{
+  argv[0] = "GET";
+  argv[1] = bench_key(bt, "key:", 0);
+  return 2;
+}
+
+static int bench_set(bench_thread *bt, const char **argv)
+{
+  argv[0] = "SET";
+  argv[1] = bench_key(bt, "key:", 0);
+  argv[2] = bt->cfg->value;
+  return 3;
+}
+
+static int bench_incr(bench_thread *bt, const char **argv)
+{
+  argv[0] = "INCR";
+  argv[1] = bench_key(bt, "counter:", 0);
+  return 2;
+}
+
+static int bench_lpush(bench_thread *bt, const char **argv)
+{
+  argv[0] = "LPUSH";
+  argv[1] = "mylist";
+  argv[2] = bt->cfg->value;
+  return 3;
+}
+
+static int bench_lrange(bench_thread *bt, const char **argv)
+{
+  argv[0] = "LRANGE";
+  argv[1] = "benchlist";
+  argv[2] = "0";
+  argv[3] = "99";
+  return 4;
+}
+
+static int bench_mget(bench_thread *bt, const char **argv)
+{
+  int i;
+
+  argv[0] = "MGET";
+  for (i = 0; i < BENCH_MGET_KEYS; i++)
+    argv[i+1] = bench_key(bt, "key:", i);
+  return BENCH_MGET_KEYS + 1;
+}
+
+static int bench_zadd(bench_thread *bt, const char **argv)
+{
+  snprintf(bt->keys[1], BENCH_KEY_SIZE, "%d", rand_r(&bt->seed) % 1000);
+  argv[0] = "ZADD";
+  argv[1] = "myzset";
+  argv[2] = bt->keys[1];
+  argv[3] = bench_key(bt, "element:", 0);
+  return 4;
+}
+
+static int bench_hmget(bench_thread *bt, const char **argv)
+{
+  int i;
+
+  argv[0] = "HMGET";
+  argv[1] = "benchhash";
+  for (i = 0; i < BENCH_HMGET_FIELDS; i++) {
+    snprintf(bt->keys[i], BENCH_KEY_SIZE, "field:%d", i);
+    argv[i+2] = bt->keys[i];
+  }
+  return BENCH_HMGET_FIELDS + 2;
+}
+
+static int bench_preparelist(REDIS rh, bench_config *cfg)
+{
+  int i;
+
+  credis_del(rh, "benchlist");
+  for (i = 0; i < BENCH_LIST_SIZE; i++)
+    if (credis_rpush(rh, "benchlist", cfg->value) < 0)
+      return -1;
+  return 0;
+}
+
+static int bench_preparehash(REDIS rh, bench_config *cfg)
+{
+  char field[BENCH_KEY_SIZE];
+  int i;
+
+  credis_del(rh, "benchhash");
+  for (i = 0; i < BENCH_HMGET_FIELDS; i++) {
+    snprintf(field, sizeof(field), "field:%d", i);
+    if (credis_hset(rh, "benchhash", field, cfg->value) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static bench_test bench_tests[] = {
+  {"SET", bench_set, NULL},
+  {"GET", bench_get, NULL},
+  {"INCR", bench_incr, NULL},
+  {"LPUSH", bench_lpush, NULL},
+  {"LRANGE_100", bench_lrange, bench_preparelist},
+  {"MGET_10", bench_mget, NULL},
+  {"ZADD", bench_zadd, NULL},
+  {"HMGET_10", bench_hmget, bench_preparehash},
+  {NULL, NULL, NULL}
+};
+
+static int bench_isok(REDIS_REPLY *reply)
+{
+  return reply != NULL && reply->type != CREDIS_REPLY_ERROR;
+}
+
+/* Blocking mode, connections of thread take turns to run a pipeline of 
+ * commands. All commands of a pipeline get the latency of the pipeline */
+static void bench_runblocking(bench_thread *bt)
+{
+  const char *argv[BENCH_MAX_ARGS];
+  REDIS_REPLY reply;
+  bench_conn *conn;
+  long long start, usecs;
+  int argc, i, n, ok, c = 0;
+
+  /* each request counts either as completed or as an error */
+  while (bt->issued < bt->requests) {
+    conn = &(bt->connv[c++ % bt->connc]);
+    n = bt->requests - bt->issued;
+    if (n > bt->cfg->pipeline)
+      n = bt->cfg->pipeline;
+    bt->issued += n;
+
+    start = bench_usecs();
+    if (bt->cfg->pipeline == 1) {
+      argc = bt->test->command(bt, argv);
+      ok = credis_command(conn->rh, argc, argv, NULL, &reply) == 0;
+    }
+    else {
+      for (i = 0; i < n; i++) {
+        argc = bt->test->command(bt, argv);
+        credis_command(conn->rh, argc, argv, NULL, &reply);
+      }
+      ok = 0;
+      /* commands whose replies never arrive are errors as well */
+      if (credis_pipeline_flush(conn->rh) >= 0)
+        while (credis_pipeline_next(conn->rh, &reply) == 0)
+          ok += bench_isok(&reply);
+    }
+    usecs = bench_usecs() - start;
+
+    bt->errors += n - ok;
+    for (i = 0; i < ok; i++)
+      bench_record(bt, usecs);
+  }
+}
+
+static void bench_issue(bench_conn *conn);
+
+static void bench_onreply(REDIS_ASYNC ah, REDIS_REPLY *reply, void *privdata)
+{
+  bench_conn *conn = (bench_conn *)privdata;
+  bench_thread *bt = conn->bt;
+
+  if (!bench_isok(reply))
+    bt->errors++;
+  else
+    bench_record(bt, bench_usecs() - conn->sent[conn->head]);
+  conn->head = (conn->head + 1) % bt->cfg->pipeline;
+  conn->inflight--;
+
+  if (reply != NULL)
+    bench_issue(conn);
+}
+
+/* keeps connection's pipeline filled with commands */
+static void bench_issue(bench_conn *conn)
+{
+  const char *argv[BENCH_MAX_ARGS];
+  bench_thread *bt = conn->bt;
+  int argc, i;
+
+  while (conn->inflight < bt->cfg->pipeline && bt->issued < bt->requests) {
+    argc = bt->test->command(bt, argv);
+    i = (conn->head + conn->inflight) % bt->cfg->pipeline;
+    conn->sent[i] = bench_usecs();
+    if (credis_async_command(conn->ah, bench_onreply, conn, argc, argv, NULL) != 0) {
+      bt->issued++;
+      bt->errors++;
+      return;
+    }
+    conn->inflight++;
+    bt->issued++;
+  }
+}
+
+/* Asynchronous mode, all connections of thread are driven by one poll() 
+ * loop, each keeping up to `pipeline' commands in flight */
+static void bench_runasync(bench_thread *bt)
+{
+  struct pollfd *fds;
+  int i, n;
+
+  if ((fds = calloc(sizeof(struct pollfd), bt->connc)) == NULL)
+    return;
+
+  for (i = 0; i < bt->connc; i++) {
+    fds[i].fd = credis_async_fd(bt->connv[i].ah);
+    bench_issue(&(bt->connv[i]));
+  }
+
+  while (bt->completed + bt->errors < bt->requests) {
+    for (i = 0; i < bt->connc; i++) {
+      fds[i].events = POLLIN;
+      if (credis_async_events(bt->connv[i].ah) & CREDIS_ASYNC_WRITE)
+        fds[i].events |= POLLOUT;
+    }
+    if ((n = poll(fds, bt->connc, bt->cfg->timeout)) <= 0) {
+      fprintf(stderr, "timeout waiting for replies\n");
+      break;
+    }
+    for (i = 0; i < bt->connc; i++) {
+      if ((fds[i].revents & POLLOUT) && credis_async_onwritable(bt->connv[i].ah) < 0)
+        goto error;
+      if ((fds[i].revents & (POLLIN | POLLERR | POLLHUP)) && 
+          credis_async_onreadable(bt->connv[i].ah) < 0)
+        goto error;
+    }
+  }
+
+  free(fds);
+  return;
+
+error:
+  fprintf(stderr, "connection error\n");
+  free(fds);
+}
+
+static void * bench_thread_main(void *arg)
+{
+  bench_thread *bt = (bench_thread *)arg;
+
+  if (bt->cfg->blocking)
+    bench_runblocking(bt);
+  else
+    bench_runasync(bt);
+
+  return NULL;
+}
+
+static int bench_connect(bench_thread *bt)
+{
+  bench_config *cfg = bt->cfg;
+  bench_conn *conn;
+  int i;
+
+  if ((bt->connv = calloc(sizeof(bench_conn), bt->connc)) == NULL)
+    return -1;
+
+  for (i = 0; i < bt->connc; i++) {
+    conn = &(bt->connv[i]);
+    conn->bt = bt;
+    if (cfg->blocking) {
+      if ((conn->rh = credis_connect(cfg->host, cfg->port, cfg->timeout)) == NULL)
+        return -1;
+      if (cfg->pipeline > 1)
+        credis_pipeline_begin(conn->rh);
+    }
+    else if ((conn->ah = credis_async_connect(cfg->host, cfg->port, cfg->timeout)) == NULL ||
+             (conn->sent = calloc(sizeof(long long), cfg->pipeline)) == NULL)
+      return -1;
+  }
+  return 0;
+}
+
+static void bench_disconnect(bench_thread *bt)
+{
+  int i;
+
+  for (i = 0; bt->connv != NULL && i < bt->connc; i++) {
+    credis_close(bt->connv[i].rh);
+    credis_async_close(bt->connv[i].ah);
+    if (bt->connv[i].sent != NULL)
+      free(bt->connv[i].sent);
+  }
+  if (bt->connv != NULL)
+    free(bt->connv);
+}
+
+static int bench_run(bench_config *cfg, bench_test *test)
+{
+  unsigned long long histogram[BENCH_BUCKETS];
+  bench_thread *threads;
+  long long start, usecs, completed = 0, errors = 0, max = 0;
+  REDIS rh;
+  int i, j, connected, rc = 0;
+
+  if (test->prepare != NULL) {
+    if ((rh = credis_connect(cfg->host, cfg->port, cfg->timeout)) == NULL ||
+        test->prepare(rh, cfg) != 0) {
+      fprintf(stderr, "%s: failed to prepare data set\n", test->name);
+      credis_close(rh);
+      return -1;
+    }
+    credis_close(rh);
+  }
+
+  if ((threads = calloc(sizeof(bench_thread), cfg->threads)) == NULL)
+    return -1;
+
+  /* threads that have connections to close, the config is shared by tests */
+  connected = cfg->threads;
+  for (i = 0; i < cfg->threads; i++) {
+    threads[i].cfg = cfg;
+    threads[i].test = test;
+    threads[i].seed = (unsigned int)(i + 1) * 2654435761u;
+    threads[i].connc = cfg->connections / cfg->threads + (i < cfg->connections % cfg->threads);
+    threads[i].requests = cfg->requests / cfg->threads + (i < cfg->requests % cfg->threads);
+    if (bench_connect(&threads[i]) != 0) {
+      fprintf(stderr, "%s: failed to connect to %s:%d\n", test->name, 
+              cfg->host ? cfg->host : "127.0.0.1", cfg->port ? cfg->port : 6379);
+      rc = -1;
+      connected = i + 1;
+      goto done;
+    }
+  }
+
+  start = bench_usecs();
+  for (i = 0; i < cfg->threads; i++)
+    pthread_create(&(threads[i].thread), NULL, bench_thread_main, &threads[i]);
+  for (i = 0; i < cfg->threads; i++)
+    pthread_join(threads[i].thread, NULL);
+  usecs = bench_usecs() - start;
+
+  memset(histogram, 0, sizeof(histogram));
+  for (i = 0; i < cfg->threads; i++) {
+    for (j = 0; j < BENCH_BUCKETS; j++)
+      histogram[j] += threads[i].histogram[j];
+    completed += threads[i].completed;
+    errors += threads[i].errors;
+    if (threads[i].max > max)
+      max = threads[i].max;
+  }
+  if (usecs == 0)
+    usecs = 1;
+
+  if (cfg->quiet)
+    printf("%s: %.2f requests per second, p50=%lld p99=%lld p99.9=%lld usec\n",
+           test->name, completed * 1000000.0 / usecs,
+           bench_percentile(histogram, completed, 50.0),
+           bench_percentile(histogram, completed, 99.0),
+           bench_percentile(histogram, completed, 99.9));
+  else {
+    printf("====== %s ======\n", test->name);
+    printf("  %lld requests completed in %.2f seconds\n", completed, usecs / 1000000.0);
+    printf("  %d connections, %d threads, pipeline %d, %s API\n", cfg->connections,
+           cfg->threads, cfg->pipeline, cfg->blocking ? "blocking" : "asynchronous");
+    printf("  %d bytes payload, keyspace %d\n\n", cfg->datasize, cfg->keyspace);
+    printf("  latency (usec): p50=%lld p90=%lld p99=%lld p99.9=%lld max=%lld\n",
+           bench_percentile(histogram, completed, 50.0),
+           bench_percentile(histogram, completed, 90.0),
+           bench_percentile(histogram, completed, 99.0),
+           bench_percentile(histogram, completed, 99.9), max);
+    if (errors > 0)
+      printf("  errors: %lld\n", errors);
+    printf("  %.2f requests per second\n\n", completed * 1000000.0 / usecs);
+  }
+
+done:
+  for (i = 0; i < connected; i++)
+    bench_disconnect(&threads[i]);
+  free(threads);
+
+  return rc;
+}
+
+static void bench_usage(const char *prog)
+{
+  bench_test *test;
+
+  printf("Usage: %s [-h <host>] [-p <port>] [-c <connections>] [-T <threads>] [-n <requests>]\n"
+         "       [-d <size>] [-r <keyspace>] [-P <pipeline>] [-t <tests>] [-b] [-q]\n\n"
+         " -h <host>         server hostname (default 127.0.0.1)\n"
+         " -p <port>         server port (default 6379)\n"
+         " -c <connections>  number of parallel connections (default 50)\n"
+         " -T <threads>      number of threads sharing the connections (default 1)\n"
+         " -n <requests>     total number of requests (default 100000)\n"
+         " -d <size>         data size of SET/LPUSH values in bytes (default 3)\n"
+         " -r <keyspace>     use random keys in range [0, keyspace) (default 0, one key)\n"
+         " -P <pipeline>     number of requests in flight per connection (default 1)\n"
+         " -t <tests>        comma separated list of tests to run (default all)\n"
+         " -b                use blocking API rather than asynchronous API\n"
+         " -q                quiet, only show requests per second and latency\n\n"
+         "Available tests:", prog);
+  for (test = bench_tests; test->name != NULL; test++)
+    printf(" %s", test->name);
+  printf("\n");
+}
+
+static int bench_selected(const char *tests, const char *name)
+{
+  const char *p;
+  size_t len;
+
+  if (tests == NULL)
+    return 1;
+
+  for (p = tests; *p; p += len + (p[len] == ',')) {
+    len = strcspn(p, ",");
+    if (len == strlen(name) && strncasecmp(p, name, len) == 0)
+      return 1;
+    /* allow for instance "lrange" to select LRANGE_100 */
+    if (len < strlen(name) && name[len] == '_' && strncasecmp(p, name, len) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  bench_config cfg;
+  bench_test *test;
+  const char *tests = NULL;
+  int opt, rc = 0;
+
+  memset(&cfg, 0, sizeof(cfg));
+  cfg.timeout = 10000;
+  cfg.requests = 100000;
+  cfg.connections = 50;
+  cfg.threads = 1;
+  cfg.pipeline = 1;
+  cfg.datasize = 3;
+
+  while ((opt = getopt(argc, argv, "h:p:c:T:n:d:r:P:t:bq")) != -1) {
+    switch (opt) {
+    case 'h': cfg.host = optarg; break;
+    case 'p': cfg.port = atoi(optarg); break;
+    case 'c': cfg.connections = atoi(optarg); break;
+    case 'T': cfg.threads = atoi(optarg); break;
+    case 'n': cfg.requests = atoi(optarg); break;
+    case 'd': cfg.datasize = atoi(optarg); break;
+    case 'r': cfg.keyspace = atoi(optarg); break;
+    case 'P': cfg.pipeline = atoi(optarg); break;
+    case 't': tests = optarg; break;
+    case 'b': cfg.blocking = 1; break;
+    case 'q': cfg.quiet = 1; break;
+    default:
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (cfg.connections < 1 || cfg.threads < 1 || cfg.requests < 1 || 
+      cfg.datasize < 0 || cfg.pipeline < 1) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+  if (cfg.threads > cfg.connections)
+    cfg.threads = cfg.connections;
+
+  if ((cfg.value = malloc(cfg.datasize + 1)) == NULL)
+    return 1;
+  memset(cfg.value, 'x', cfg.datasize);
+  cfg.value[cfg.datasize] = '\0';
+
+  for (test = bench_tests; test->name != NULL; test++)
+    if (bench_selected(tests, test->name) && bench_run(&cfg, test) != 0)
+      rc = 1;
+
+  free(cfg.value);
+
+  return rc;
+}
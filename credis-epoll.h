@@ -0,0 +1,135 @@
+/* credis-epoll.h -- epoll adapter for the credis asynchronous API.
+ *
+ * Copyright (c) 2009-2012, Jonas Romfelt <jonas at romfelt dot se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Credis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CREDIS_EPOLL_H
+#define __CREDIS_EPOLL_H
+
+#include <stdlib.h>
+#include <sys/epoll.h>
+
+#include "credis.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 
+ * Attach an asynchronous handle to an epoll instance and pass every event
+ * returned by epoll_wait() for it to credis_epoll_handle(). Events are
+ * registered with `data.ptr' referring to the returned adapter, which may be
+ * used to tell credis events apart from the application's own.
+ *
+ * EXAMPLE
+ *
+ *    credis_epoll *ce = credis_epoll_attach(epfd, ah);
+ *
+ *    n = epoll_wait(epfd, events, MAXEVENTS, -1);
+ *    for (i = 0; i < n; i++)
+ *      if (events[i].data.ptr == ce && credis_epoll_handle(&events[i]) < 0)
+ *        ... close connection ...
+ */
+
+typedef struct _credis_epoll {
+  REDIS_ASYNC ahnd;
+  int epfd;
+  void *data; /* free for application use */
+} credis_epoll;
+
+static inline int credis_epoll_ctl(credis_epoll *ce, int op, int events)
+{
+  struct epoll_event ev;
+
+  ev.events = 0;
+  if (events & CREDIS_ASYNC_READ)
+    ev.events |= EPOLLIN;
+  if (events & CREDIS_ASYNC_WRITE)
+    ev.events |= EPOLLOUT;
+  ev.data.ptr = ce;
+
+  return epoll_ctl(ce->epfd, op, credis_async_fd(ce->ahnd), &ev);
+}
+
+static inline void credis_epoll_eventhook(REDIS_ASYNC ahnd, int events, void *data)
+{
+  /* the old socket was removed from epoll instance as it was closed */
+  if (events & CREDIS_ASYNC_RECONNECTED)
+    credis_epoll_ctl((credis_epoll *)data, EPOLL_CTL_ADD, events);
+  else
+    credis_epoll_ctl((credis_epoll *)data, EPOLL_CTL_MOD, events);
+}
+
+/* returns NULL on error */
+static inline credis_epoll * credis_epoll_attach(int epfd, REDIS_ASYNC ahnd)
+{
+  credis_epoll *ce;
+
+  if ((ce = calloc(sizeof(credis_epoll), 1)) == NULL)
+    return NULL;
+
+  ce->ahnd = ahnd;
+  ce->epfd = epfd;
+
+  if (credis_epoll_ctl(ce, EPOLL_CTL_ADD, credis_async_events(ahnd)) != 0) {
+    free(ce);
+    return NULL;
+  }
+  credis_async_seteventhook(ahnd, credis_epoll_eventhook, ce);
+
+  return ce;
+}
+
+/* removes handle from epoll instance, the handle itself is not closed */
+static inline void credis_epoll_detach(credis_epoll *ce)
+{
+  credis_async_seteventhook(ce->ahnd, NULL, NULL);
+  credis_epoll_ctl(ce, EPOLL_CTL_DEL, 0);
+  free(ce);
+}
+
+/* returns a negative CREDIS_ERR_* code on error, in which case the handle
+ * should be detached and closed */
+static inline int credis_epoll_handle(struct epoll_event *ev)
+{
+  credis_epoll *ce = (credis_epoll *)ev->data.ptr;
+  int rc = 0;
+
+  if (ev->events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    rc = credis_async_onreadable(ce->ahnd);
+  if (rc >= 0 && (ev->events & EPOLLOUT))
+    rc = credis_async_onwritable(ce->ahnd);
+
+  return rc < 0 ? rc : 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CREDIS_EPOLL_H */
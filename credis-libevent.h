@@ -0,0 +1,156 @@
+/* credis-libevent.h -- libevent adapter for the credis asynchronous API.
+ *
+ * Copyright (c) 2009-2012, Jonas Romfelt <jonas at romfelt dot se>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Credis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __CREDIS_LIBEVENT_H
+#define __CREDIS_LIBEVENT_H
+
+#include <stdlib.h>
+#include <event2/event.h>
+
+#include "credis.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 
+ * Attach an asynchronous handle to a libevent event base. Reading and 
+ * writing is then driven by the event loop. Should an error occur, both 
+ * events are removed and `onerror' is called with the CREDIS_ERR_* code, 
+ * typically to detach and close the handle.
+ *
+ * EXAMPLE
+ *
+ *    credis_libevent *cl = credis_libevent_attach(base, ah, onerror);
+ *    credis_async_command(ah, onget, NULL, 2, argv, NULL);
+ *    event_base_dispatch(base);
+ */
+
+typedef struct _credis_libevent credis_libevent;
+
+typedef void (*credis_libevent_onerror)(credis_libevent *cl, int rc);
+
+struct _credis_libevent {
+  REDIS_ASYNC ahnd;
+  struct event *rev;
+  struct event *wev;
+  credis_libevent_onerror onerror;
+  void *data; /* free for application use */
+};
+
+static inline void credis_libevent_error(credis_libevent *cl, int rc)
+{
+  event_del(cl->rev);
+  event_del(cl->wev);
+  if (cl->onerror != NULL)
+    cl->onerror(cl, rc);
+}
+
+static inline void credis_libevent_onread(evutil_socket_t fd, short what, void *arg)
+{
+  credis_libevent *cl = (credis_libevent *)arg;
+  int rc;
+
+  if ((rc = credis_async_onreadable(cl->ahnd)) < 0)
+    credis_libevent_error(cl, rc);
+}
+
+static inline void credis_libevent_onwrite(evutil_socket_t fd, short what, void *arg)
+{
+  credis_libevent *cl = (credis_libevent *)arg;
+  int rc;
+
+  if ((rc = credis_async_onwritable(cl->ahnd)) < 0)
+    credis_libevent_error(cl, rc);
+}
+
+static inline void credis_libevent_eventhook(REDIS_ASYNC ahnd, int events, void *data)
+{
+  credis_libevent *cl = (credis_libevent *)data;
+  int fd = credis_async_fd(ahnd);
+
+  /* events are assigned again for the new socket */
+  if (events & CREDIS_ASYNC_RECONNECTED) {
+    event_del(cl->rev);
+    event_del(cl->wev);
+    event_assign(cl->rev, event_get_base(cl->rev), fd, EV_READ | EV_PERSIST, 
+                 credis_libevent_onread, cl);
+    event_assign(cl->wev, event_get_base(cl->wev), fd, EV_WRITE | EV_PERSIST, 
+                 credis_libevent_onwrite, cl);
+    event_add(cl->rev, NULL);
+  }
+
+  if (events & CREDIS_ASYNC_WRITE)
+    event_add(cl->wev, NULL);
+  else
+    event_del(cl->wev);
+}
+
+static inline void credis_libevent_detach(credis_libevent *cl)
+{
+  credis_async_seteventhook(cl->ahnd, NULL, NULL);
+  if (cl->rev != NULL)
+    event_free(cl->rev);
+  if (cl->wev != NULL)
+    event_free(cl->wev);
+  free(cl);
+}
+
+/* returns NULL on error */
+static inline credis_libevent * credis_libevent_attach(struct event_base *base, REDIS_ASYNC ahnd,
+                                                       credis_libevent_onerror onerror)
+{
+  credis_libevent *cl;
+  int fd = credis_async_fd(ahnd);
+
+  if ((cl = calloc(sizeof(credis_libevent), 1)) == NULL)
+    return NULL;
+
+  cl->ahnd = ahnd;
+  cl->onerror = onerror;
+
+  if ((cl->rev = event_new(base, fd, EV_READ | EV_PERSIST, credis_libevent_onread, cl)) == NULL ||
+      (cl->wev = event_new(base, fd, EV_WRITE | EV_PERSIST, credis_libevent_onwrite, cl)) == NULL ||
+      event_add(cl->rev, NULL) != 0) {
+    credis_libevent_detach(cl);
+    return NULL;
+  }
+
+  credis_async_seteventhook(ahnd, credis_libevent_eventhook, cl);
+  credis_libevent_eventhook(ahnd, credis_async_events(ahnd), cl);
+
+  return cl;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CREDIS_LIBEVENT_H */
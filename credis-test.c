@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/select.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -57,6 +58,117 @@ long timer(int reset)
   return 0;
 }
 
+/* callback for asynchronous tests, counts replies and keeps last one */
+static int async_replies;
+static REDIS_REPLY async_reply;
+static char async_str[64];
+
+void async_callback(REDIS_ASYNC ahnd, REDIS_REPLY *reply, void *privdata)
+{
+  async_replies++;
+  if (reply != NULL) {
+    async_reply = *reply;
+    if (reply->str != NULL) {
+      strncpy(async_str, reply->str, sizeof(async_str) - 1);
+      async_reply.str = async_str;
+    }
+  }
+}
+
+/* makes server close connection of `rhnd', for reconnect tests */
+int kill_client(REDIS rhnd, long long id)
+{
+  const char *killv[] = {"CLIENT", "KILL", "ID", NULL};
+  char idstr[32];
+  REDIS_REPLY reply;
+
+  sprintf(idstr, "%lld", id);
+  killv[3] = idstr;
+  return credis_command(rhnd, 4, killv, NULL, &reply);
+}
+
+/* command hook for statistics tests, keeps name of last command */
+static int hook_calls;
+static char hook_command[32];
+
+void stats_hook(REDIS rhnd, const char *command, int rc, long long usecs, void *data)
+{
+  hook_calls++;
+  strncpy(hook_command, command, sizeof(hook_command) - 1);
+}
+
+/* allocator for memory allocation tests, counts allocations */
+static int allocs;
+
+void *count_malloc(size_t size)
+{
+  allocs++;
+  return malloc(size);
+}
+
+void *count_realloc(void *ptr, size_t size)
+{
+  if (ptr == NULL)
+    allocs++;
+  return realloc(ptr, size);
+}
+
+void count_free(void *ptr)
+{
+  if (ptr != NULL)
+    allocs--;
+  free(ptr);
+}
+
+/* callback for streaming tests, counts elements and compares bulk data 
+ * against `stream_expect' if set, stops after `stream_stop' elements */
+static int stream_elements, stream_parts, stream_depth, stream_stop, stream_mismatch;
+static long stream_bytes;
+static const char *stream_expect;
+
+int stream_callback(const REDIS_REPLY *element, int depth, int offset, int remaining, 
+                    void *data)
+{
+  stream_parts++;
+  if (depth > stream_depth)
+    stream_depth = depth;
+  if (element->type == CREDIS_REPLY_BULK) {
+    if (stream_expect != NULL && memcmp(element->str, stream_expect + offset, element->len))
+      stream_mismatch++;
+    stream_bytes += element->len;
+  }
+  if (remaining == 0 && ++stream_elements == stream_stop)
+    return 1;
+  return 0;
+}
+
+/* drive asynchronous handle using select() until no replies are pending */
+int async_run(REDIS_ASYNC ahnd)
+{
+  fd_set rfds, wfds;
+  struct timeval tv;
+  int fd;
+
+  /* socket changes if handle reconnects */
+  while (credis_async_pending(ahnd) > 0) {
+    fd = credis_async_fd(ahnd);
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_SET(fd, &rfds);
+    if (credis_async_events(ahnd) & CREDIS_ASYNC_WRITE)
+      FD_SET(fd, &wfds);
+    tv.tv_sec = 5;
+    tv.tv_usec = 0;
+    if (select(fd+1, &rfds, &wfds, NULL, &tv) <= 0)
+      return -1;
+    if (FD_ISSET(fd, &wfds) && credis_async_onwritable(ahnd) < 0)
+      return -1;
+    if (FD_ISSET(fd, &rfds) && credis_async_onreadable(ahnd) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 unsigned long getrandom(unsigned long max)
 {
   return (1 + (unsigned long) ( ((double)max) * (rand() / (RAND_MAX + 1.0))));
@@ -198,6 +310,7 @@ int test_suite2(void)
 {
   REDIS redis;
   REDIS_INFO info;
+  REDIS_REPLY reply;
   char *val, **valv, lstr[50000];
   const char *keys[] = {"key1", "key2", "key3", "key4", "key5"};
   const char *values[] = {"abcdefg", "hijklmn", "opqr", "stuvw", "xyz"};
@@ -217,6 +330,60 @@ int test_suite2(void)
   credis_close(redis);
   TEST_DONE();
   
+  TEST_BEGIN("connect by name and over other transports");
+  {
+    REDIS rh;
+
+    EXPECT_TRUE(credis_connect("", 0, 10000) == NULL);
+    /* resolved address is tried again at next connect */
+    for (i = 0; i < 2; i++) {
+      EXPECT_TRUE((rh = credis_connect("localhost", 0, 10000)) != NULL);
+      EXPECT_EQ(credis_ping(rh), 0);
+      credis_close(rh);
+    }
+    /* only possible if server listens to IPv6 and to a unix domain socket */
+    if ((rh = credis_connect("::1", 0, 10000)) != NULL) {
+      EXPECT_EQ(credis_ping(rh), 0);
+      credis_close(rh);
+    }
+    if ((rh = credis_connect("/tmp/redis.sock", 0, 10000)) != NULL) {
+      EXPECT_EQ(credis_set(rh, "credis1", "value1"), 0);
+      EXPECT_EQ(credis_get(rh, "credis1", &val), 0);
+      EXPECT_EQ(strcmp(val, "value1"), 0);
+      credis_close(rh);
+    }
+    EXPECT_TRUE(credis_connect("/tmp/no-such-redis.sock", 0, 10000) == NULL);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("preset server version");
+  {
+    REDIS rh;
+    REDIS_STATS stats;
+
+    EXPECT_EQ(credis_setserverversion("x.y"), CREDIS_ERR);
+    EXPECT_EQ(credis_setserverversion("5.0.7"), 0);
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    /* no INFO sent, RESP3 is refused as for a real 5.0 server */
+    if (credis_getstats(rh, &stats) == 0)
+      EXPECT_EQ(stats.commands, 0);
+    EXPECT_EQ(credis_hello(rh, 3), CREDIS_ERR_PROTOCOL);
+    credis_close(rh);
+    /* commands are picked for version at connect, GETRANGE is SUBSTR */
+    EXPECT_EQ(credis_setserverversion("2.0.0"), 0);
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_set(rh, "credis1", "value1"), 0);
+    hook_command[0] = '\0';
+    i = credis_setcommandhook(rh, stats_hook, NULL);
+    EXPECT_EQ(credis_getrange(rh, "credis1", 0, 2, &val), 0);
+    EXPECT_EQ(strcmp(val, "val"), 0);
+    if (i == 0)
+      EXPECT_EQ(strcmp(hook_command, "SUBSTR"), 0);
+    credis_close(rh);
+    EXPECT_EQ(credis_setserverversion(NULL), 0);
+  }
+  TEST_DONE();
+
   TEST_BEGIN("connect and stay connected");
   EXPECT_TRUE((redis = credis_connect(NULL, 0, 10000)) != NULL);
   TEST_DONE();
@@ -236,6 +403,11 @@ int test_suite2(void)
 
   TEST_BEGIN("info");
   EXPECT_EQ(credis_info(redis, &info), 0);
+  EXPECT_TRUE(info.redis_version[0] != '\0');
+  EXPECT_TRUE(info.arch_bits == 32 || info.arch_bits == 64);
+  EXPECT_GT(info.process_id, 0);
+  EXPECT_TRUE(info.total_commands_processed > 0);
+  EXPECT_EQ(info.role, CREDIS_SERVER_MASTER);
   TEST_DONE();
 
   TEST_BEGIN("auth");
@@ -325,6 +497,30 @@ int test_suite2(void)
   EXPECT_EQ(value, 20);  
   TEST_DONE();
 
+  TEST_BEGIN("64-bit integers and scores");
+  {
+    const char *argv[] = {"INCRBY", "credis1", "-9000000000"};
+    double scores[] = {0.1, -42, 123.456789, 1e20, -2.5e-5};
+
+    EXPECT_EQ(credis_set(redis, "credis1", "9000000000"), 0);
+    EXPECT_EQ(credis_incrby(redis, "credis1", 5, NULL), 0);
+    EXPECT_TRUE(credis_integerreply(redis) == 9000000005LL);
+    EXPECT_EQ(credis_command(redis, 3, argv, NULL, &reply), 0);
+    EXPECT_TRUE(reply.integer64 == 5);
+    EXPECT_EQ(credis_set(redis, "credis1", "-9223372036854775807"), 0);
+    EXPECT_EQ(credis_decr(redis, "credis1", NULL), 0);
+    EXPECT_TRUE(credis_integerreply(redis) == -9223372036854775807LL - 1);
+    credis_del(redis, "credis1");
+    /* scores make it to server and back without losing precision */
+    for (i = 0; i < 5; i++) {
+      EXPECT_EQ(credis_zadd(redis, "credis1", scores[i], "member1"), 0);
+      EXPECT_EQ(credis_zscore(redis, "credis1", "member1", &score1), 0);
+      EXPECT_TRUE(score1 == scores[i]);
+      credis_del(redis, "credis1");
+    }
+  }
+  TEST_DONE();
+
   TEST_BEGIN("append");
   EXPECT_EQ(credis_set(redis, "credis1", "12345"), 0);
   EXPECT_EQ(credis_append(redis, "credis1", "6789"), 9);
@@ -348,6 +544,275 @@ int test_suite2(void)
   EXPECT_EQ(strcmp(val, "bcdef"), 0);
   TEST_DONE();
 
+  TEST_BEGIN("set and get value with spaces and newlines");
+  EXPECT_EQ(credis_set(redis, "credis1", "value with spaces\r\nand newline"), 0);
+  EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+  EXPECT_EQ(strcmp(val, "value with spaces\r\nand newline"), 0);
+  TEST_DONE();
+
+  TEST_BEGIN("setbin");
+  EXPECT_EQ(credis_setbin(redis, "credis1", "bin\0ary", 7), 0);
+  EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+  EXPECT_EQ(memcmp(val, "bin\0ary", 8), 0);
+  TEST_DONE();
+
+  TEST_BEGIN("getbin and mgetbin");
+  {
+    const char *binkeys[] = {"credis1", "credis2"};
+    int *lenv;
+    EXPECT_EQ(credis_setbin(redis, "credis1", "bin\0ary", 7), 0);
+    EXPECT_EQ(credis_set(redis, "credis2", ""), 0);
+    EXPECT_EQ(credis_getbin(redis, "credis1", &val, &i), 0);
+    EXPECT_EQ(i, 7);
+    EXPECT_EQ(memcmp(val, "bin\0ary", 7), 0);
+    EXPECT_EQ(credis_mgetbin(redis, 2, binkeys, &valv, &lenv), 2);
+    EXPECT_EQ(lenv[0], 7);
+    EXPECT_EQ(memcmp(valv[0], "bin\0ary", 7), 0);
+    EXPECT_EQ(lenv[1], 0);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("large values");
+  {
+    const char *argv[82];
+    int argvlen[82], n = 1024*1024;
+    char *big = malloc(n);
+    for (i = 0; i < n; i++)
+      big[i] = (char)(i * 31);
+    EXPECT_EQ(credis_setbin(redis, "credis1", big, n), 0);
+    EXPECT_EQ(credis_getbin(redis, "credis1", &val, &i), 0);
+    EXPECT_EQ(i, n);
+    EXPECT_EQ(memcmp(val, big, n), 0);
+    /* more large arguments than are sent with a single system call */
+    credis_del(redis, "credis1");
+    argv[0] = "RPUSH";
+    argvlen[0] = 5;
+    argv[1] = "credis1";
+    argvlen[1] = 7;
+    for (i = 2; i < 82; i++) {
+      argv[i] = big + i * 100;
+      argvlen[i] = 20000 + i;
+    }
+    EXPECT_EQ(credis_command(redis, 82, argv, argvlen, &reply), 0);
+    EXPECT_EQ(reply.integer, 80);
+    EXPECT_EQ(credis_lindex(redis, "credis1", 79, &val), 0);
+    EXPECT_EQ(memcmp(val, big + 81 * 100, 20081), 0);
+    credis_del(redis, "credis1");
+    free(big);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("command");
+  {
+    const char *argv[] = {"SET", "credis 1", "value 1"};
+    EXPECT_EQ(credis_command(redis, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_STATUS);
+    argv[0] = "GET";
+    EXPECT_EQ(credis_command(redis, 2, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_BULK);
+    EXPECT_EQ(strcmp(reply.str, "value 1"), 0);
+    argv[0] = "NOSUCHCOMMAND";
+    EXPECT_EQ(credis_command(redis, 2, argv, NULL, &reply), CREDIS_ERR_PROTOCOL);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_ERROR);
+  }
+  {
+    /* message longer than an int can hold is refused before data is read */
+    const char *argv[] = {"SET", "credis 1", "value 1"};
+    const int argvlen[] = {3, 1 << 30, 1 << 30};
+    EXPECT_EQ(credis_command(redis, 3, argv, argvlen, &reply), CREDIS_ERR_NOMEM);
+    EXPECT_EQ(credis_pipeline_begin(redis), 0);
+    EXPECT_EQ(credis_command(redis, 3, argv, argvlen, &reply), CREDIS_ERR_NOMEM);
+    EXPECT_EQ(credis_pipeline_end(redis), 0);
+    EXPECT_EQ(credis_ping(redis), 0);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("command with nested reply");
+  {
+    const char *multiv[] = {"MULTI"};
+    const char *pushv[] = {"RPUSH", "credis1", "element1"};
+    const char *rangev[] = {"LRANGE", "credis1", "0", "-1"};
+    const char *execv[] = {"EXEC"};
+    credis_del(redis, "credis1");
+    EXPECT_EQ(credis_command(redis, 1, multiv, NULL, &reply), 0);
+    EXPECT_EQ(credis_command(redis, 3, pushv, NULL, &reply), 0);
+    EXPECT_EQ(credis_command(redis, 4, rangev, NULL, &reply), 0);
+    EXPECT_EQ(credis_command(redis, 1, execv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_MULTIBULK);
+    EXPECT_EQ(reply.elements, 2);
+    EXPECT_EQ(reply.element[0].type, CREDIS_REPLY_INTEGER);
+    EXPECT_EQ(reply.element[0].integer, 1);
+    EXPECT_TRUE(reply.elementv[1] == NULL);
+    EXPECT_EQ(reply.element[1].type, CREDIS_REPLY_MULTIBULK);
+    EXPECT_EQ(reply.element[1].elements, 1);
+    EXPECT_EQ(strcmp(reply.element[1].element[0].str, "element1"), 0);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("command stream");
+  {
+    const char *rangev[] = {"LRANGE", "credis1", "0", "-1"};
+    const char *getv[] = {"GET", "credis1"};
+    const char *nosuchv[] = {"NOSUCHCOMMAND"};
+    int n = 3*1024*1024;
+    char *big = malloc(n);
+    for (i = 0; i < n; i++)
+      big[i] = (char)(i * 13);
+    credis_del(redis, "credis1");
+    for (i = 0; i < 5000; i++)
+      credis_rpush(redis, "credis1", "element");
+    stream_elements = stream_parts = stream_depth = stream_stop = stream_bytes = 0;
+    EXPECT_EQ(credis_commandstream(redis, 4, rangev, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(stream_elements, 5001);
+    EXPECT_EQ(stream_depth, 1);
+    EXPECT_EQ(stream_bytes, 5000 * 7);
+    /* skipping rest of reply keeps handle in sync */
+    stream_elements = 0;
+    stream_stop = 100;
+    EXPECT_EQ(credis_commandstream(redis, 4, rangev, NULL, stream_callback, NULL), 1);
+    EXPECT_EQ(stream_elements, 100);
+    EXPECT_EQ(credis_ping(redis), 0);
+    /* large bulk is handed over in parts */
+    EXPECT_EQ(credis_setbin(redis, "credis1", big, n), 0);
+    stream_elements = stream_parts = stream_stop = stream_bytes = stream_mismatch = 0;
+    stream_expect = big;
+    EXPECT_EQ(credis_commandstream(redis, 2, getv, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(stream_elements, 1);
+    EXPECT_GT(stream_parts, 1);
+    EXPECT_EQ(stream_bytes, n);
+    EXPECT_EQ(stream_mismatch, 0);
+    stream_expect = NULL;
+    EXPECT_EQ(credis_commandstream(redis, 1, nosuchv, NULL, stream_callback, NULL), 
+              CREDIS_ERR_PROTOCOL);
+    EXPECT_TRUE(credis_errorreply(redis) != NULL);
+    EXPECT_EQ(credis_ping(redis), 0);
+    credis_del(redis, "credis1");
+    free(big);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("RESP3");
+
+  TEST_BEGIN("typed replies");
+  {
+    REDIS resp3;
+    REDIS_REPLY reply;
+    const char *argv[] = {"DEBUG", "PROTOCOL", NULL};
+    const char *hgetall[] = {"HGETALL", "credis1"};
+    double score;
+
+    EXPECT_TRUE((resp3 = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_hello(resp3, 4), CREDIS_ERR);
+    EXPECT_EQ(credis_hello(resp3, 3), 0);
+    argv[2] = "double";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_DOUBLE);
+    EXPECT_TRUE(reply.number > 3.14 && reply.number < 3.15);
+    argv[2] = "null";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_NIL);
+    EXPECT_TRUE(reply.str == NULL);
+    argv[2] = "true";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_BOOLEAN);
+    EXPECT_EQ(reply.integer, 1);
+    argv[2] = "map";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_MAP);
+    EXPECT_EQ(reply.elements, 4);
+    EXPECT_EQ(strcmp(reply.elementv[2], "1"), 0);
+    EXPECT_EQ(reply.element[1].type, CREDIS_REPLY_BOOLEAN);
+    EXPECT_EQ(reply.element[3].integer, 1);
+    argv[2] = "set";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_SET);
+    EXPECT_EQ(reply.elements, 2);
+    /* verbatim strings and big numbers are bulks, without format of verbatim */
+    argv[2] = "verbatim";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_BULK);
+    EXPECT_EQ(strncmp(reply.str, "This is a verbatim", 18), 0);
+    stream_elements = stream_bytes = stream_stop = stream_mismatch = 0;
+    stream_expect = "This is a verbatim\nstring";
+    EXPECT_EQ(credis_commandstream(resp3, 3, argv, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(stream_bytes, 25);
+    EXPECT_EQ(stream_mismatch, 0);
+    stream_expect = NULL;
+    argv[2] = "bignum";
+    EXPECT_EQ(credis_command(resp3, 3, argv, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_BULK);
+    EXPECT_EQ(strcmp(reply.str, "1234567999999999999999999999999999999"), 0);
+    /* INFO is a verbatim string with RESP3 */
+    EXPECT_EQ(credis_info(resp3, &info), 0);
+    EXPECT_TRUE(info.redis_version[0] != '\0');
+    EXPECT_EQ(credis_ping(resp3), 0);
+    /* command functions are unaffected by protocol */
+    credis_del(resp3, "credis1");
+    EXPECT_EQ(credis_get(resp3, "credis1", &val), -1);
+    EXPECT_EQ(credis_zadd(resp3, "credis1", 1.5, "member1"), 0);
+    EXPECT_EQ(credis_zscore(resp3, "credis1", "member1", &score), 0);
+    EXPECT_TRUE(score == 1.5);
+    EXPECT_EQ(credis_zincrby(resp3, "credis1", 2.0, "member1", &score), 0);
+    EXPECT_TRUE(score == 3.5);
+    EXPECT_EQ(credis_zscore(resp3, "credis1", "member2", &score), -1);
+    credis_del(resp3, "credis1");
+    EXPECT_EQ(credis_sadd(resp3, "credis1", "member1"), 0);
+    EXPECT_EQ(credis_smembers(resp3, "credis1", &valv), 1);
+    EXPECT_EQ(strcmp(valv[0], "member1"), 0);
+    credis_del(resp3, "credis1");
+    EXPECT_EQ(credis_hset(resp3, "credis1", "field1", "value1"), 0);
+    EXPECT_EQ(credis_command(resp3, 2, hgetall, NULL, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_MAP);
+    EXPECT_EQ(reply.elements, 2);
+    EXPECT_EQ(strcmp(reply.elementv[1], "value1"), 0);
+    stream_elements = stream_depth = stream_stop = 0;
+    EXPECT_EQ(credis_commandstream(resp3, 2, hgetall, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(stream_elements, 3);
+    EXPECT_EQ(stream_depth, 1);
+    credis_del(resp3, "credis1");
+    credis_close(resp3);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("pushes");
+  {
+    REDIS resp3;
+    const char *tracking[] = {"CLIENT", "TRACKING", "ON"}, *getv[] = {"GET", "credis1"};
+    char *pattern, *channel, *message;
+
+    EXPECT_TRUE((resp3 = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_hello(resp3, 3), 0);
+    /* invalidation pushes arriving in between replies are skipped */
+    EXPECT_EQ(credis_command(resp3, 3, tracking, NULL, NULL), 0);
+    EXPECT_EQ(credis_set(redis, "credis1", "value1"), 0);
+    EXPECT_EQ(credis_get(resp3, "credis1", &val), 0);
+    EXPECT_EQ(credis_set(redis, "credis1", "value2"), 0);
+    usleep(100000);
+    EXPECT_EQ(credis_get(resp3, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value2"), 0);
+    /* also before a streamed reply */
+    EXPECT_EQ(credis_set(redis, "credis1", "value3"), 0);
+    usleep(100000);
+    stream_elements = stream_bytes = stream_depth = stream_stop = stream_mismatch = 0;
+    stream_expect = "value3";
+    EXPECT_EQ(credis_commandstream(resp3, 2, getv, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(stream_elements, 1);
+    EXPECT_EQ(stream_bytes, 6);
+    EXPECT_EQ(stream_depth, 0);
+    EXPECT_EQ(stream_mismatch, 0);
+    stream_expect = NULL;
+    EXPECT_EQ(credis_ping(resp3), 0);
+    /* pub/sub messages are pushes */
+    EXPECT_EQ(credis_subscribe(resp3, "credis1"), 1);
+    EXPECT_EQ(credis_publish(redis, "credis1", "message1"), 1);
+    EXPECT_EQ(credis_listen(resp3, &pattern, &channel, &message), 0);
+    EXPECT_EQ(strcmp(message, "message1"), 0);
+    EXPECT_EQ(credis_unsubscribe(resp3, NULL), 0);
+    credis_del(redis, "credis1");
+    credis_close(resp3);
+  }
+  TEST_DONE();
+
   TEST_GROUP("lists");
 
   TEST_BEGIN("rphush");
@@ -441,6 +906,917 @@ int test_suite2(void)
   EXPECT_EQ(credis_lrem(redis, "credis1", 0, values[1]), 0);
   TEST_DONE();
 
+  TEST_GROUP("incremental iteration");
+
+  TEST_BEGIN("sscan");
+  {
+    REDIS_SCAN shnd;
+    int n, total = 0, batches = 0;
+    credis_del(redis, "credis1");
+    for (i = 0; i < 1000; i++) {
+      sprintf(lstr, "member%d", i);
+      credis_sadd(redis, "credis1", lstr);
+    }
+    EXPECT_TRUE((shnd = credis_sscan(redis, "credis1", NULL, 100)) != NULL);
+    while ((n = credis_scan_next(shnd, &valv, NULL)) > 0) {
+      total += n;
+      batches++;
+    }
+    EXPECT_EQ(n, 0);
+    EXPECT_EQ(total, 1000);
+    EXPECT_GT(batches, 1);
+    EXPECT_EQ(credis_scan_next(shnd, &valv, NULL), 0);
+    credis_scan_close(shnd);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("hscan with other commands between batches");
+  {
+    REDIS_SCAN shnd;
+    int n, *lenv, fields = 0, total = 0;
+    credis_del(redis, "credis1");
+    for (i = 0; i < 50; i++) {
+      sprintf(lstr, "field%d", i);
+      credis_hset(redis, "credis1", lstr, "value");
+    }
+    shnd = credis_hscan(redis, "credis1", NULL, 10);
+    while ((n = credis_scan_next(shnd, &valv, &lenv)) > 0) {
+      for (i = 0; i < n; i += 2)
+        if (strncmp(valv[i], "field", 5) == 0 && lenv[i + 1] == 5)
+          fields++;
+      total += n;
+      EXPECT_EQ(credis_ping(redis), 0);
+    }
+    EXPECT_EQ(total, 100);
+    EXPECT_EQ(fields, 50);
+    credis_scan_close(shnd);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("scan with pattern and close before end");
+  {
+    REDIS_SCAN shnd;
+    int n, total = 0;
+    for (i = 0; i < 30; i++) {
+      sprintf(lstr, "credisscan:%d", i);
+      credis_set(redis, lstr, "value");
+    }
+    shnd = credis_scan(redis, "credisscan:*", 20);
+    while ((n = credis_scan_next(shnd, &valv, NULL)) > 0) {
+      for (i = 0; i < n; i++)
+        EXPECT_EQ(strncmp(valv[i], "credisscan:", 11), 0);
+      total += n;
+    }
+    EXPECT_EQ(total, 30);
+    credis_scan_close(shnd);
+    /* handle used between batches, batches received meanwhile are kept */
+    shnd = credis_scan(redis, "credisscan:*", 5);
+    for (total = 0; (n = credis_scan_next(shnd, &valv, NULL)) > 0; total += n) {
+      for (i = 0; i < n; i++)
+        EXPECT_EQ(strncmp(valv[i], "credisscan:", 11), 0);
+      EXPECT_EQ(credis_ping(redis), 0);
+    }
+    EXPECT_EQ(total, 30);
+    credis_scan_close(shnd);
+    shnd = credis_scan(redis, NULL, 5);
+    EXPECT_GT(credis_scan_next(shnd, &valv, NULL), 0);
+    credis_scan_close(shnd);
+    EXPECT_EQ(credis_ping(redis), 0);
+    for (i = 0; i < 30; i++) {
+      sprintf(lstr, "credisscan:%d", i);
+      credis_del(redis, lstr);
+    }
+  }
+  TEST_DONE();
+
+  TEST_GROUP("variadic writes");
+
+  TEST_BEGIN("batched commands");
+  {
+    static char strs[1000][16];
+    const char *keyv[1000], *vals[1000];
+    double scorev[1000];
+    REDIS_STATS stats;
+
+    for (i = 0; i < 1000; i++) {
+      sprintf(strs[i], "credis%d", i);
+      keyv[i] = vals[i] = strs[i];
+      scorev[i] = i;
+      credis_del(redis, strs[i]);
+    }
+    credis_setbatchsize(redis, 100);
+    /* keys are their own values */
+    EXPECT_EQ(credis_mset(redis, 1000, keyv, vals), 0);
+    EXPECT_EQ(credis_mget(redis, 5, keyv + 995, &valv), 5);
+    EXPECT_EQ(strcmp(valv[4], "credis999"), 0);
+    EXPECT_EQ(credis_msetnx(redis, 2, keyv + 998, vals), -1);
+    credis_del(redis, keyv[998]);
+    credis_del(redis, keyv[999]);
+    EXPECT_EQ(credis_msetnx(redis, 2, keyv + 998, vals + 998), 0);
+    credis_del(redis, "credis1");
+    credis_resetstats(redis);
+    EXPECT_EQ(credis_saddv(redis, "credis1", 1000, vals), 1000);
+    if (credis_getstats(redis, &stats) == 0) {
+      EXPECT_EQ(stats.commands, 10);
+      EXPECT_EQ(stats.send_calls, 1);
+    }
+    EXPECT_EQ(credis_saddv(redis, "credis1", 10, vals), 0);
+    EXPECT_EQ(credis_scard(redis, "credis1"), 1000);
+    credis_del(redis, "credis1");
+    EXPECT_EQ(credis_zaddv(redis, "credis1", 250, scorev, vals), 250);
+    EXPECT_EQ(credis_zcard(redis, "credis1"), 250);
+    credis_del(redis, "credis1");
+    EXPECT_EQ(credis_rpushv(redis, "credis1", 1000, vals), 1000);
+    EXPECT_EQ(credis_lpushv(redis, "credis1", 3, vals), 1003);
+    EXPECT_EQ(credis_lindex(redis, "credis1", 0, &val), 0);
+    EXPECT_EQ(strcmp(val, "credis2"), 0);
+    EXPECT_EQ(credis_lindex(redis, "credis1", -1, &val), 0);
+    EXPECT_EQ(strcmp(val, "credis999"), 0);
+    credis_del(redis, "credis1");
+    EXPECT_EQ(credis_hmset(redis, "credis1", 300, keyv, vals), 0);
+    EXPECT_EQ(credis_hlen(redis, "credis1"), 300);
+    EXPECT_EQ(credis_hget(redis, "credis1", "credis299", &val), 0);
+    EXPECT_EQ(strcmp(val, "credis299"), 0);
+    credis_del(redis, "credis1");
+    /* queued as several commands in pipeline mode */
+    EXPECT_EQ(credis_pipeline_begin(redis), 0);
+    EXPECT_EQ(credis_saddv(redis, "credis1", 250, vals), CREDIS_QUEUED);
+    EXPECT_EQ(credis_pipeline_flush(redis), 3);
+    EXPECT_EQ(credis_pipeline_end(redis), 0);
+    EXPECT_EQ(credis_scard(redis, "credis1"), 250);
+    /* a failing command does not leave handle out of sync */
+    EXPECT_EQ(credis_rpushv(redis, "credis1", 250, vals), CREDIS_ERR_PROTOCOL);
+    EXPECT_EQ(credis_ping(redis), 0);
+    credis_del(redis, "credis1");
+    credis_setbatchsize(redis, 1024);
+    for (i = 0; i < 1000; i++)
+      credis_del(redis, strs[i]);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("pipelining");
+
+  TEST_BEGIN("pipeline set and get");
+  EXPECT_EQ(credis_pipeline_begin(redis), 0);
+  for (i = 0; i < 1000; i++) {
+    sprintf(lstr, "credis-pipe%d", i);
+    EXPECT_EQ(credis_set(redis, lstr, values[i % keyc]), CREDIS_QUEUED);
+  }
+  for (i = 0; i < 1000; i++) {
+    sprintf(lstr, "credis-pipe%d", i);
+    EXPECT_EQ(credis_get(redis, lstr, &val), CREDIS_QUEUED);
+  }
+  EXPECT_EQ(credis_pipeline_flush(redis), 2000);
+  for (i = 0; i < 1000; i++) {
+    EXPECT_EQ(credis_pipeline_next(redis, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_STATUS);
+  }
+  for (i = 0; i < 1000; i++) {
+    EXPECT_EQ(credis_pipeline_next(redis, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_BULK);
+    EXPECT_EQ(strcmp(reply.str, values[i % keyc]), 0);
+  }
+  EXPECT_EQ(credis_pipeline_next(redis, &reply), -1);
+  EXPECT_EQ(credis_pipeline_end(redis), 0);
+  TEST_DONE();
+
+  TEST_BEGIN("pipeline mixed replies");
+  credis_del(redis, "credis1");
+  EXPECT_EQ(credis_pipeline_begin(redis), 0);
+  EXPECT_EQ(credis_rpush(redis, "credis1", "element1"), CREDIS_QUEUED);
+  EXPECT_EQ(credis_lrange(redis, "credis1", 0, -1, &valv), CREDIS_QUEUED);
+  EXPECT_EQ(credis_incr(redis, "credis1", &value), CREDIS_QUEUED);
+  EXPECT_EQ(credis_pipeline_flush(redis), 3);
+  EXPECT_LT(credis_set(redis, "credis2", "value2"), 0);
+  EXPECT_EQ(credis_pipeline_next(redis, &reply), 0);
+  EXPECT_EQ(reply.type, CREDIS_REPLY_INTEGER);
+  EXPECT_EQ(reply.integer, 1);
+  EXPECT_EQ(credis_pipeline_next(redis, &reply), 0);
+  EXPECT_EQ(reply.type, CREDIS_REPLY_MULTIBULK);
+  EXPECT_EQ(reply.elements, 1);
+  EXPECT_EQ(strcmp(reply.elementv[0], "element1"), 0);
+  EXPECT_EQ(credis_pipeline_next(redis, &reply), 0);
+  EXPECT_EQ(reply.type, CREDIS_REPLY_ERROR);
+  EXPECT_EQ(credis_pipeline_end(redis), 0);
+  EXPECT_EQ(credis_ping(redis), 0);
+  TEST_DONE();
+
+  TEST_BEGIN("pipeline end discards replies");
+  EXPECT_EQ(credis_pipeline_begin(redis), 0);
+  EXPECT_EQ(credis_set(redis, "credis1", "value1"), CREDIS_QUEUED);
+  EXPECT_EQ(credis_get(redis, "credis1", &val), CREDIS_QUEUED);
+  EXPECT_EQ(credis_pipeline_flush(redis), 2);
+  EXPECT_EQ(credis_pipeline_end(redis), 0);
+  EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+  EXPECT_EQ(strcmp(val, "value1"), 0);
+  TEST_DONE();
+
+  TEST_GROUP("transactions");
+
+  TEST_BEGIN("multi and exec");
+  credis_del(redis, "credis1");
+  credis_del(redis, "credis2");
+  EXPECT_EQ(credis_multi(redis), 0);
+  EXPECT_EQ(credis_set(redis, "credis1", "value1"), CREDIS_QUEUED);
+  EXPECT_EQ(credis_incr(redis, "credis2", &value), CREDIS_QUEUED);
+  EXPECT_EQ(credis_rpush(redis, "credis3", "element1"), CREDIS_QUEUED);
+  EXPECT_EQ(credis_pipeline_flush(redis), CREDIS_ERR_PIPELINE);
+  EXPECT_EQ(credis_exec(redis, &reply), 3);
+  EXPECT_EQ(reply.type, CREDIS_REPLY_MULTIBULK);
+  EXPECT_EQ(reply.element[0].type, CREDIS_REPLY_STATUS);
+  EXPECT_EQ(reply.element[1].type, CREDIS_REPLY_INTEGER);
+  EXPECT_EQ(reply.element[1].integer, 1);
+  EXPECT_EQ(reply.element[2].type, CREDIS_REPLY_INTEGER);
+  EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+  EXPECT_EQ(strcmp(val, "value1"), 0);
+  EXPECT_EQ(credis_exec(redis, &reply), CREDIS_ERR_PIPELINE);
+  credis_del(redis, "credis3");
+  TEST_DONE();
+
+  TEST_BEGIN("watch aborts exec");
+  {
+    REDIS other = credis_connect(NULL, 0, 10000);
+    const char *keyv[] = {"credis1"};
+    EXPECT_EQ(credis_watch(redis, 1, keyv), 0);
+    EXPECT_EQ(credis_set(other, "credis1", "modified"), 0);
+    EXPECT_EQ(credis_multi(redis), 0);
+    EXPECT_EQ(credis_set(redis, "credis1", "value2"), CREDIS_QUEUED);
+    EXPECT_EQ(credis_exec(redis, &reply), -1);
+    EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "modified"), 0);
+    EXPECT_EQ(credis_watch(redis, 1, keyv), 0);
+    EXPECT_EQ(credis_multi(redis), 0);
+    EXPECT_EQ(credis_set(redis, "credis1", "value2"), CREDIS_QUEUED);
+    EXPECT_EQ(credis_exec(redis, NULL), 1);
+    EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value2"), 0);
+    EXPECT_EQ(credis_unwatch(redis), 0);
+    credis_close(other);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("discard");
+  EXPECT_EQ(credis_multi(redis), 0);
+  EXPECT_EQ(credis_multi(redis), CREDIS_ERR_PIPELINE);
+  EXPECT_EQ(credis_set(redis, "credis1", "discarded"), CREDIS_QUEUED);
+  EXPECT_EQ(credis_discard(redis), 0);
+  EXPECT_EQ(credis_discard(redis), CREDIS_ERR_PIPELINE);
+  EXPECT_EQ(credis_get(redis, "credis1", &val), 0);
+  EXPECT_EQ(strcmp(val, "value2"), 0);
+  EXPECT_EQ(credis_exec(redis, NULL), CREDIS_ERR_PIPELINE);
+  TEST_DONE();
+
+  TEST_GROUP("scripting");
+
+  TEST_BEGIN("script sha");
+  {
+    REDIS_SCRIPT script;
+    script = credis_script_create("");
+    EXPECT_EQ(strcmp(credis_script_sha(script), "da39a3ee5e6b4b0d3255bfef95601890afd80709"), 0);
+    credis_script_destroy(script);
+    script = credis_script_create("abc");
+    EXPECT_EQ(strcmp(credis_script_sha(script), "a9993e364706816aba3e25717850c26c9cd0d89d"), 0);
+    credis_script_destroy(script);
+    /* server verifies digest of a script spanning several blocks */
+    memset(lstr, 'x', 1000);
+    strcpy(lstr + 1000, " return KEYS");
+    script = credis_script_create(lstr);
+    EXPECT_EQ(credis_script_register(redis, script), 0);
+    credis_close(redis);
+    EXPECT_TRUE((redis = credis_connect(NULL, 0, 10000)) != NULL);
+    credis_script_destroy(script);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("evalsha loads script when not cached");
+  {
+    REDIS_SCRIPT script = credis_script_create("return ARGV");
+    const char *flushv[] = {"SCRIPT", "FLUSH"};
+    const char *keyv[] = {"credis1"};
+    const char *argv[] = {"arg1", "bin\0ary"};
+    const int argvlen[] = {4, 7};
+    EXPECT_EQ(credis_command(redis, 2, flushv, NULL, &reply), 0);
+    EXPECT_EQ(credis_evalsha(redis, script, 1, keyv, NULL, 2, argv, argvlen, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_MULTIBULK);
+    EXPECT_EQ(reply.elements, 2);
+    EXPECT_EQ(reply.elementlenv[1], 7);
+    EXPECT_EQ(memcmp(reply.elementv[1], "bin\0ary", 7), 0);
+    EXPECT_EQ(credis_command(redis, 2, flushv, NULL, &reply), 0);
+    EXPECT_EQ(credis_script_register(redis, script), 0);
+    EXPECT_EQ(credis_pipeline_begin(redis), 0);
+    EXPECT_EQ(credis_evalsha(redis, script, 0, NULL, NULL, 1, argv, NULL, NULL), CREDIS_QUEUED);
+    EXPECT_EQ(credis_pipeline_flush(redis), 1);
+    EXPECT_EQ(credis_pipeline_next(redis, &reply), 0);
+    EXPECT_EQ(reply.type, CREDIS_REPLY_MULTIBULK);
+    EXPECT_EQ(credis_pipeline_end(redis), 0);
+    credis_close(redis);
+    EXPECT_TRUE((redis = credis_connect(NULL, 0, 10000)) != NULL);
+    credis_script_destroy(script);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("asynchronous");
+
+  TEST_BEGIN("async commands");
+  {
+    REDIS_ASYNC ahnd;
+    const char *setv[] = {"SET", "credis1", "async value"};
+    const char *getv[] = {"GET", "credis1"};
+    const char *errv[] = {"NOSUCHCOMMAND"};
+
+    EXPECT_TRUE((ahnd = credis_async_connect(NULL, 0, 10000)) != NULL);
+    async_replies = 0;
+    EXPECT_EQ(credis_async_events(ahnd), CREDIS_ASYNC_READ);
+    for (i = 0; i < 100; i++)
+      EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 3, setv, NULL), 0);
+    EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 2, getv, NULL), 0);
+    EXPECT_EQ(credis_async_events(ahnd), CREDIS_ASYNC_READ | CREDIS_ASYNC_WRITE);
+    EXPECT_EQ(credis_async_pending(ahnd), 101);
+    EXPECT_EQ(async_run(ahnd), 0);
+    EXPECT_EQ(async_replies, 101);
+    EXPECT_EQ(async_reply.type, CREDIS_REPLY_BULK);
+    EXPECT_EQ(async_reply.len, 11);
+    EXPECT_EQ(strcmp(async_reply.str, "async value"), 0);
+    EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 1, errv, NULL), 0);
+    EXPECT_EQ(async_run(ahnd), 0);
+    EXPECT_EQ(async_reply.type, CREDIS_REPLY_ERROR);
+    EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 2, getv, NULL), 0);
+    credis_async_close(ahnd);
+    EXPECT_EQ(async_replies, 103);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("reconnect");
+
+  TEST_BEGIN("reconnect and replay");
+  {
+    REDIS rh;
+    REDIS_ASYNC ahnd;
+    const char *idv[] = {"CLIENT", "ID"};
+    const char *getv[] = {"GET", "credis1"}, *incrv[] = {"INCR", "credis2"};
+
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_set(rh, "credis1", "value1"), 0);
+    EXPECT_EQ(credis_command(rh, 2, idv, NULL, &reply), 0);
+    EXPECT_EQ(kill_client(redis, reply.integer), 0);
+    EXPECT_TRUE(credis_get(rh, "credis1", &val) < 0);
+    credis_close(rh);
+
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    credis_setreconnect(rh, 3, 1, 100);
+    /* read-only command is sent again */
+    EXPECT_EQ(credis_command(rh, 2, idv, NULL, &reply), 0);
+    EXPECT_EQ(kill_client(redis, reply.integer), 0);
+    EXPECT_EQ(credis_get(rh, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value1"), 0);
+    /* so is a streamed one */
+    EXPECT_EQ(credis_command(rh, 2, idv, NULL, &reply), 0);
+    EXPECT_EQ(kill_client(redis, reply.integer), 0);
+    stream_elements = stream_stop = stream_bytes = 0;
+    EXPECT_EQ(credis_commandstream(rh, 2, getv, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(stream_elements, 1);
+    EXPECT_EQ(stream_bytes, 6);
+    /* others are not, but handle is usable again */
+    EXPECT_EQ(credis_command(rh, 2, idv, NULL, &reply), 0);
+    EXPECT_EQ(kill_client(redis, reply.integer), 0);
+    EXPECT_TRUE(credis_incr(rh, "credis2", &value) < 0);
+    EXPECT_EQ(credis_ping(rh), 0);
+    /* so are flushed pipelined commands when all are read-only */
+    EXPECT_EQ(credis_command(rh, 2, idv, NULL, &reply), 0);
+    EXPECT_EQ(kill_client(redis, reply.integer), 0);
+    EXPECT_EQ(credis_pipeline_begin(rh), 0);
+    for (i = 0; i < 3; i++)
+      EXPECT_EQ(credis_get(rh, "credis1", &val), CREDIS_QUEUED);
+    EXPECT_EQ(credis_pipeline_flush(rh), 3);
+    for (i = 0; i < 3; i++) {
+      EXPECT_EQ(credis_pipeline_next(rh, &reply), 0);
+      EXPECT_EQ(strcmp(reply.str, "value1"), 0);
+    }
+    EXPECT_EQ(credis_pipeline_end(rh), 0);
+    credis_close(rh);
+
+    /* host name is resolved again and registered scripts are loaded again */
+    {
+      REDIS_SCRIPT script;
+      const char *flushv[] = {"SCRIPT", "FLUSH"}, *existsv[] = {"SCRIPT", "EXISTS", NULL};
+
+      EXPECT_TRUE((rh = credis_connect("localhost", 0, 10000)) != NULL);
+      credis_setreconnect(rh, 3, 1, 100);
+      EXPECT_TRUE((script = credis_script_create("return 1")) != NULL);
+      EXPECT_EQ(credis_script_register(rh, script), 0);
+      EXPECT_EQ(credis_command(redis, 2, flushv, NULL, NULL), 0);
+      EXPECT_EQ(credis_command(rh, 2, idv, NULL, &reply), 0);
+      EXPECT_EQ(kill_client(redis, reply.integer), 0);
+      EXPECT_EQ(credis_get(rh, "credis1", &val), 0);
+      existsv[2] = credis_script_sha(script);
+      EXPECT_EQ(credis_command(redis, 3, existsv, NULL, &reply), 0);
+      EXPECT_EQ(reply.elements, 1);
+      EXPECT_EQ(reply.element[0].integer, 1);
+      credis_close(rh);
+      credis_script_destroy(script);
+    }
+
+    /* callbacks of commands not sent again get no reply */
+    EXPECT_TRUE((ahnd = credis_async_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_async_setreconnect(ahnd, 3, 1, 100), 0);
+    async_replies = 0;
+    EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 2, idv, NULL), 0);
+    EXPECT_EQ(async_run(ahnd), 0);
+    EXPECT_EQ(kill_client(redis, async_reply.integer), 0);
+    EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 2, incrv, NULL), 0);
+    EXPECT_EQ(credis_async_command(ahnd, async_callback, NULL, 2, getv, NULL), 0);
+    EXPECT_EQ(credis_async_setreconnect(ahnd, 3, 1, 100), CREDIS_ERR);
+    EXPECT_EQ(async_run(ahnd), 0);
+    EXPECT_EQ(async_replies, 3);
+    EXPECT_EQ(async_reply.type, CREDIS_REPLY_BULK);
+    EXPECT_EQ(strcmp(async_reply.str, "value1"), 0);
+    credis_async_close(ahnd);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("connection pool");
+
+  TEST_BEGIN("pool checkout and checkin");
+  {
+    REDIS_POOL pool;
+    REDIS rh1, rh2;
+
+    EXPECT_TRUE((pool = credis_pool_create(NULL, 0, 10000, 2)) != NULL);
+    EXPECT_TRUE((rh1 = credis_pool_checkout(pool)) != NULL);
+    EXPECT_TRUE((rh2 = credis_pool_checkout(pool)) != NULL);
+    EXPECT_TRUE(rh1 != rh2);
+    EXPECT_TRUE(credis_pool_checkout(pool) == NULL);
+    EXPECT_EQ(credis_ping(rh1), 0);
+    EXPECT_EQ(credis_ping(rh2), 0);
+    credis_pool_checkin(pool, rh2);
+    EXPECT_TRUE(credis_pool_checkout(pool) == rh2);
+    credis_pool_checkin(pool, rh2);
+    credis_pool_checkin(pool, rh1);
+    credis_pool_sethealthcheck(pool, 0);
+    EXPECT_TRUE(credis_pool_checkout(pool) == rh2);
+    EXPECT_EQ(credis_ping(rh2), 0);
+    credis_pool_checkin(pool, rh2);
+    credis_pool_destroy(pool);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("parallel executor");
+  {
+    REDIS_POOL pool;
+    REDIS_EXECUTOR ex;
+    static char keybuf[1000][16];
+    const char *keyv[1000];
+    int j, ok;
+
+    for (i = 0; i < 1000; i++) {
+      sprintf(keybuf[i], "exec%d", i);
+      keyv[i] = keybuf[i];
+    }
+    EXPECT_EQ(credis_pipeline_begin(redis), 0);
+    for (i = 0; i < 1000; i += 2)
+      credis_set(redis, keyv[i], keyv[i]);
+    EXPECT_EQ(credis_pipeline_flush(redis), 500);
+    EXPECT_EQ(credis_pipeline_end(redis), 0);
+
+    EXPECT_TRUE((pool = credis_pool_create(NULL, 0, 10000, 4)) != NULL);
+    EXPECT_TRUE(credis_executor_create(pool, 0, 0) == NULL);
+    /* more workers than pooled handles, and a single thread */
+    for (j = 0; j < 3; j++) {
+      EXPECT_TRUE((ex = credis_executor_create(pool, j == 0 ? 4 : j == 1 ? 8 : 1, 7)) != NULL);
+      EXPECT_EQ(credis_executor_mget(ex, 1000, keyv, &valv), 1000);
+      for (i = 0, ok = 1; i < 1000; i++)
+        ok &= i % 2 == 0 ? valv[i] != NULL && strcmp(valv[i], keyv[i]) == 0 : valv[i] == NULL;
+      EXPECT_TRUE(ok);
+      EXPECT_EQ(credis_executor_mget(ex, 3, keyv, &valv), 3);
+      EXPECT_EQ(strcmp(valv[2], "exec2"), 0);
+      credis_executor_destroy(ex);
+    }
+    EXPECT_TRUE((ex = credis_executor_create(pool, 4, 0)) != NULL);
+    EXPECT_EQ(credis_executor_del(ex, 1000, keyv), 500);
+    EXPECT_EQ(credis_executor_mget(ex, 1000, keyv, &valv), 1000);
+    for (i = 0, ok = 1; i < 1000; i++)
+      ok &= valv[i] == NULL;
+    EXPECT_TRUE(ok);
+    credis_executor_destroy(ex);
+    /* a single chunk after several does not count deletes of earlier job */
+    EXPECT_TRUE((ex = credis_executor_create(pool, 4, 7)) != NULL);
+    for (i = 0; i < 100; i++)
+      credis_set(redis, keyv[i], keyv[i]);
+    EXPECT_EQ(credis_executor_del(ex, 100, keyv), 100);
+    credis_set(redis, keyv[0], keyv[0]);
+    EXPECT_EQ(credis_executor_del(ex, 3, keyv), 1);
+    credis_executor_destroy(ex);
+    credis_pool_destroy(pool);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("statistics");
+
+  TEST_BEGIN("handle statistics");
+  {
+    REDIS_STATS stats;
+    const char *getv[] = {"GET", "credis1"};
+    unsigned long long n = 0;
+
+    credis_resetstats(redis);
+    if (credis_getstats(redis, &stats) == 0) {
+      EXPECT_EQ(stats.commands, 0);
+      EXPECT_EQ(credis_setcommandhook(redis, stats_hook, NULL), 0);
+      hook_calls = 0;
+      EXPECT_EQ(credis_ping(redis), 0);
+      EXPECT_EQ(credis_set(redis, "credis1", "value1"), 0);
+      stream_elements = stream_stop = 0;
+      EXPECT_EQ(credis_commandstream(redis, 2, getv, NULL, stream_callback, NULL), 0);
+      EXPECT_EQ(credis_setcommandhook(redis, NULL, NULL), 0);
+      EXPECT_EQ(credis_getstats(redis, &stats), 0);
+      EXPECT_EQ(stats.commands, 3);
+      EXPECT_GT(stats.bytes_sent, 0);
+      EXPECT_GT(stats.bytes_received, 0);
+      EXPECT_TRUE(stats.send_calls >= 2);
+      EXPECT_TRUE(stats.recv_calls >= 2);
+      for (i = 0; i < CREDIS_STATS_BUCKETS; i++)
+        n += stats.latency[i];
+      EXPECT_EQ(n, 3);
+      EXPECT_EQ(hook_calls, 3);
+      EXPECT_EQ(strcmp(hook_command, "GET"), 0);
+    }
+    else
+      EXPECT_EQ(credis_setcommandhook(redis, stats_hook, NULL), CREDIS_ERR);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("memory allocation");
+
+  /* counting allocator passes on to malloc() and friends, which makes it
+   * safe to plug in while handles exist */
+  TEST_BEGIN("custom allocator");
+  {
+    REDIS rh;
+
+    allocs = 0;
+    credis_setallocator(count_malloc, count_realloc, count_free);
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_GT(allocs, 0);
+    EXPECT_EQ(credis_ping(rh), 0);
+    credis_close(rh);
+    EXPECT_EQ(allocs, 0);
+    credis_setallocator(NULL, NULL, NULL);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("buffer shrinking");
+  {
+    REDIS rh;
+    REDIS_STATS stats;
+    char *big;
+    unsigned long long reallocs;
+
+    EXPECT_TRUE((big = malloc(1000000)) != NULL);
+    memset(big, 'x', 1000000);
+    EXPECT_EQ(credis_setbin(redis, "credis1", big, 1000000), 0);
+    credis_setbufferpolicy(0, 0, 2);
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    credis_resetstats(rh);
+    /* reallocations are only counted with statistics enabled */
+    if (credis_getstats(rh, &stats) == 0) {
+      EXPECT_EQ(credis_getbin(rh, "credis1", &val, &i), 0);
+      EXPECT_EQ(i, 1000000);
+      EXPECT_EQ(credis_getstats(rh, &stats), 0);
+      EXPECT_GT(reallocs = stats.buffer_reallocs, 0);
+      EXPECT_EQ(credis_ping(rh), 0);
+      EXPECT_EQ(credis_getstats(rh, &stats), 0);
+      EXPECT_EQ(stats.buffer_reallocs, reallocs);
+      /* buffer is shrunk at third small command, and has to grow again */
+      EXPECT_EQ(credis_ping(rh), 0);
+      EXPECT_EQ(credis_ping(rh), 0);
+      EXPECT_EQ(credis_getbin(rh, "credis1", &val, &i), 0);
+      EXPECT_EQ(credis_getstats(rh, &stats), 0);
+      EXPECT_GT(stats.buffer_reallocs, reallocs);
+    }
+    credis_close(rh);
+    credis_setbufferpolicy(4096, 8*1024*1024, 64);
+    free(big);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("detached replies");
+  {
+    REDIS rh;
+    REDIS_DETACHED dh1, dh2;
+    const char *keys[] = {"credis1", "credis2"};
+    char **mvals;
+
+    allocs = 0;
+    credis_setallocator(count_malloc, count_realloc, count_free);
+    EXPECT_TRUE((rh = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_set(rh, "credis1", "first"), 0);
+    EXPECT_EQ(credis_set(rh, "credis2", "second"), 0);
+    EXPECT_EQ(credis_mget(rh, 2, keys, &mvals), 2);
+    EXPECT_TRUE((dh1 = credis_detach(rh)) != NULL);
+    /* values survive further commands */
+    EXPECT_EQ(credis_get(rh, "credis2", &val), 0);
+    EXPECT_TRUE((dh2 = credis_detach(rh)) != NULL);
+    EXPECT_EQ(credis_set(rh, "credis1", "changed"), 0);
+    EXPECT_EQ(credis_get(rh, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "changed"), 0);
+    EXPECT_EQ(strcmp(mvals[0], "first"), 0);
+    EXPECT_EQ(strcmp(mvals[1], "second"), 0);
+    credis_detach_free(rh, dh1);
+    credis_detach_free(NULL, dh2);
+    /* spare buffers are recycled */
+    EXPECT_EQ(credis_ping(rh), 0);
+    EXPECT_TRUE((dh1 = credis_detach(rh)) != NULL);
+    credis_detach_free(rh, dh1);
+    EXPECT_EQ(credis_pipeline_begin(rh), 0);
+    EXPECT_TRUE(credis_detach(rh) == NULL);
+    EXPECT_EQ(credis_pipeline_end(rh), 0);
+    credis_close(rh);
+    EXPECT_EQ(allocs, 0);
+    credis_setallocator(NULL, NULL, NULL);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("publish/subscribe");
+
+  TEST_BEGIN("queued messages");
+  {
+    REDIS sub;
+    char *pattern, *channel, *message;
+    char str[32];
+
+    EXPECT_TRUE((sub = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_subscribe(sub, "credis1"), 1);
+    for (i = 0; i < 100; i++) {
+      sprintf(str, "message%d", i);
+      EXPECT_EQ(credis_publish(redis, "credis1", str), 1);
+    }
+    /* messages received while waiting for reply are queued */
+    EXPECT_EQ(credis_subscribe(sub, "credis2"), 2);
+    for (i = 0; i < 100; i++) {
+      sprintf(str, "message%d", i);
+      EXPECT_EQ(credis_listen(sub, &pattern, &channel, &message), 0);
+      EXPECT_TRUE(pattern == NULL);
+      EXPECT_EQ(strcmp(channel, "credis1"), 0);
+      EXPECT_EQ(strcmp(message, str), 0);
+    }
+    EXPECT_EQ(credis_publish(redis, "credis2", "last"), 1);
+    EXPECT_EQ(credis_listen(sub, &pattern, &channel, &message), 0);
+    EXPECT_EQ(strcmp(message, "last"), 0);
+    credis_close(sub);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("batch listen");
+  {
+    REDIS sub;
+    REDIS_MESSAGE msgv[64];
+    char str[32];
+    int n, total = 0, calls = 0, order = 0;
+
+    EXPECT_TRUE((sub = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_listenbatch(sub, msgv, 64, 0), CREDIS_ERR_PUBSUB);
+    EXPECT_EQ(credis_subscribe(sub, "credis1"), 1);
+    for (i = 0; i < 1000; i++) {
+      sprintf(str, "message%d", i);
+      EXPECT_EQ(credis_publish(redis, "credis1", str), 1);
+    }
+    while (total < 1000 && (n = credis_listenbatch(sub, msgv, 64, 1000)) > 0) {
+      for (i = 0; i < n; i++) {
+        sprintf(str, "message%d", total + i);
+        if (strcmp(msgv[i].message, str) != 0 || msgv[i].len != strlen(str))
+          order++;
+      }
+      total += n;
+      calls++;
+    }
+    EXPECT_EQ(total, 1000);
+    EXPECT_EQ(order, 0);
+    EXPECT_LT(calls, 500);
+    EXPECT_EQ(credis_listenbatch(sub, msgv, 64, 100), 0);
+    /* messages received but not yet listened to survive a new subscription */
+    for (i = 0; i < 10; i++) {
+      sprintf(str, "message%d", i);
+      EXPECT_EQ(credis_publish(redis, "credis1", str), 1);
+    }
+    usleep(100000);
+    EXPECT_EQ(credis_listenbatch(sub, msgv, 3, 1000), 3);
+    EXPECT_EQ(credis_psubscribe(sub, "credis*"), 2);
+    for (total = 3; total < 10; total += n) {
+      EXPECT_GT((n = credis_listenbatch(sub, msgv, 64, 1000)), 0);
+      sprintf(str, "message%d", total);
+      EXPECT_EQ(strcmp(msgv[0].message, str), 0);
+      EXPECT_TRUE(msgv[0].pattern == NULL);
+    }
+    EXPECT_EQ(credis_unsubscribe(sub, NULL), 1);
+    EXPECT_EQ(credis_punsubscribe(sub, NULL), 0);
+    credis_close(sub);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("client-side caching");
+
+  TEST_BEGIN("cached values");
+  {
+    REDIS cached;
+    const char *setv[] = {"SET", "credis1", "value4"};
+
+    EXPECT_TRUE((cached = credis_connect(NULL, 0, 10000)) != NULL);
+    credis_del(redis, "credis1");
+    credis_del(redis, "credis2");
+    credis_del(redis, "credis3");
+    EXPECT_EQ(credis_set(redis, "credis1", "value1"), 0);
+    EXPECT_EQ(credis_hset(redis, "credis2", "field1", "value1"), 0);
+    EXPECT_EQ(credis_cache_enable(cached, 2, 4096), 0);
+    EXPECT_EQ(credis_cache_enable(cached, 2, 4096), CREDIS_ERR);
+    for (i = 0; i < 2; i++) {
+      EXPECT_EQ(credis_get(cached, "credis1", &val), 0);
+      EXPECT_EQ(strcmp(val, "value1"), 0);
+      EXPECT_EQ(credis_hget(cached, "credis2", "field1", &val), 0);
+      EXPECT_EQ(strcmp(val, "value1"), 0);
+    }
+    /* modified by another client, invalidated by server */
+    EXPECT_EQ(credis_set(redis, "credis1", "value2"), 0);
+    EXPECT_EQ(credis_hset(redis, "credis2", "field1", "value2"), -1);
+    usleep(100000);
+    EXPECT_EQ(credis_get(cached, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value2"), 0);
+    EXPECT_EQ(credis_hget(cached, "credis2", "field1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value2"), 0);
+    /* modified through cached handle itself, invalidated right away */
+    EXPECT_EQ(credis_set(cached, "credis1", "value3"), 0);
+    EXPECT_EQ(credis_get(cached, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value3"), 0);
+    /* so is a streamed command */
+    stream_stop = 0;
+    EXPECT_EQ(credis_commandstream(cached, 3, setv, NULL, stream_callback, NULL), 0);
+    EXPECT_EQ(credis_get(cached, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value4"), 0);
+    EXPECT_EQ(credis_set(cached, "credis1", "value3"), 0);
+    /* nil values are cached, evicting the oldest entry */
+    EXPECT_EQ(credis_get(cached, "credis3", &val), -1);
+    EXPECT_EQ(credis_get(cached, "credis3", &val), -1);
+    EXPECT_EQ(credis_set(redis, "credis3", "value1"), 0);
+    usleep(100000);
+    EXPECT_EQ(credis_get(cached, "credis3", &val), 0);
+    EXPECT_EQ(strcmp(val, "value1"), 0);
+    EXPECT_EQ(credis_hget(cached, "credis2", "field1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value2"), 0);
+    EXPECT_EQ(credis_cache_disable(cached), 0);
+    EXPECT_EQ(credis_get(cached, "credis1", &val), 0);
+    EXPECT_EQ(strcmp(val, "value3"), 0);
+    credis_close(cached);
+  }
+  TEST_DONE();
+
+  TEST_BEGIN("cache hit");
+  {
+    REDIS cached;
+    REDIS_STATS stats;
+    unsigned long long sent;
+    int len;
+
+    EXPECT_TRUE((cached = credis_connect(NULL, 0, 10000)) != NULL);
+    EXPECT_EQ(credis_setbin(redis, "credis1", "a\0b", 3), 0);
+    EXPECT_EQ(credis_cache_enable(cached, 100, 65536), 0);
+    EXPECT_EQ(credis_getbin(cached, "credis1", &val, &len), 0);
+    EXPECT_EQ(len, 3);
+    if (credis_getstats(cached, &stats) == 0) {
+      sent = stats.bytes_sent;
+      for (i = 0; i < 1000; i++)
+        credis_getbin(cached, "credis1", &val, &len);
+      EXPECT_EQ(credis_getstats(cached, &stats), 0);
+      EXPECT_EQ(stats.bytes_sent, sent);
+      EXPECT_EQ(stats.cache_hits, 1000);
+      EXPECT_EQ(stats.cache_misses, 1);
+    }
+    EXPECT_EQ(credis_getbin(cached, "credis1", &val, &len), 0);
+    EXPECT_EQ(len, 3);
+    EXPECT_EQ(memcmp(val, "a\0b", 3), 0);
+    /* flushing database clears cache */
+    EXPECT_EQ(credis_flushdb(redis), 0);
+    usleep(100000);
+    EXPECT_EQ(credis_getbin(cached, "credis1", &val, &len), -1);
+    credis_close(cached);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("cluster");
+
+  TEST_BEGIN("cluster key slots");
+  EXPECT_EQ(credis_cluster_keyslot("123456789", 9), 12739);
+  EXPECT_EQ(credis_cluster_keyslot("foo", 3), 12182);
+  EXPECT_EQ(credis_cluster_keyslot("{user1000}.following", 20), 
+            credis_cluster_keyslot("user1000", 8));
+  EXPECT_EQ(credis_cluster_keyslot("{user1000}.followers", 20), 
+            credis_cluster_keyslot("user1000", 8));
+  EXPECT_EQ(credis_cluster_keyslot("foo{}{bar}", 10), 
+            credis_cluster_keyslot("foo{}{bar}", 10));
+  EXPECT_EQ(credis_cluster_keyslot("foo{bar}{zap}", 13), 
+            credis_cluster_keyslot("bar", 3));
+  TEST_DONE();
+
+  TEST_BEGIN("cluster commands");
+  {
+    REDIS_CLUSTER cluster;
+    const char *keys[] = {"credis1", "{credis}2", "credis3"};
+
+    /* only possible if test server is a cluster node */
+    if ((cluster = credis_cluster_connect("127.0.0.1:6379", 10000)) != NULL) {
+      EXPECT_EQ(credis_cluster_set(cluster, "credis1", "value1"), 0);
+      EXPECT_EQ(credis_cluster_set(cluster, "{credis}2", "value2"), 0);
+      EXPECT_EQ(credis_cluster_del(cluster, "credis3"), -1);
+      EXPECT_EQ(credis_cluster_get(cluster, "credis1", &val), 0);
+      EXPECT_EQ(strcmp(val, "value1"), 0);
+      EXPECT_EQ(credis_cluster_mget(cluster, 3, keys, &valv), 3);
+      EXPECT_EQ(strcmp(valv[0], "value1"), 0);
+      EXPECT_EQ(strcmp(valv[1], "value2"), 0);
+      EXPECT_TRUE(valv[2] == NULL);
+      credis_cluster_close(cluster);
+    }
+  }
+  TEST_DONE();
+
+  TEST_GROUP("sharding");
+
+  TEST_BEGIN("sharded commands");
+  {
+    REDIS_SHARDS shards;
+    const char *keys[] = {"credis1", "credis2", "credis3", "credis4"};
+
+    /* same server twice, under different names */
+    EXPECT_TRUE((shards = credis_shards_create(10000)) != NULL);
+    EXPECT_TRUE(credis_shards_handle(shards, "credis1") == NULL);
+    EXPECT_EQ(credis_shards_add(shards, "127.0.0.1", 0, 1), 0);
+    EXPECT_EQ(credis_shards_add(shards, "localhost", 0, 2), 0);
+    EXPECT_EQ(credis_shards_add(shards, "localhost", 0, 1), CREDIS_ERR);
+    EXPECT_TRUE(credis_shards_del(shards, 4, keys) >= 0);
+    for (i = 0; i < 3; i++)
+      EXPECT_EQ(credis_set(credis_shards_handle(shards, keys[i]), keys[i], values[i]), 0);
+    EXPECT_TRUE(credis_shards_handle(shards, "credis1") == credis_shards_handle(shards, "credis1"));
+    EXPECT_EQ(credis_shards_mget(shards, 4, keys, &valv), 4);
+    for (i = 0; i < 3; i++)
+      EXPECT_EQ(strcmp(valv[i], values[i]), 0);
+    EXPECT_TRUE(valv[3] == NULL);
+    EXPECT_EQ(credis_shards_remove(shards, "localhost", 0), 0);
+    EXPECT_EQ(credis_shards_remove(shards, "localhost", 0), -1);
+    EXPECT_EQ(credis_shards_del(shards, 4, keys), 3);
+    credis_shards_destroy(shards);
+  }
+  TEST_DONE();
+
+  TEST_GROUP("sentinel");
+
+  TEST_BEGIN("sentinel failover and replica reads");
+  {
+    REDIS_SENTINEL sentinel;
+    REDIS master, r1, r2;
+    const char *get[] = {"GET", "credis1"}, *set[] = {"SET", "credis1", "value1"};
+    const char *id[] = {"CLIENT", "ID"};
+    const char *flushv[] = {"SCRIPT", "FLUSH"}, *existsv[] = {"SCRIPT", "EXISTS", NULL};
+    REDIS_SCRIPT script;
+    long long id1;
+
+    /* only possible if test server is a sentinel */
+    if ((sentinel = credis_sentinel_connect("127.0.0.1:6379", "mymaster", 10000)) != NULL) {
+      EXPECT_TRUE(credis_sentinel_connect("127.0.0.1:6379", "nomaster", 10000) == NULL);
+      EXPECT_TRUE((master = credis_sentinel_master(sentinel)) != NULL);
+      EXPECT_TRUE(credis_sentinel_replica(sentinel) == master);
+      EXPECT_EQ(credis_sentinel_command(sentinel, 3, set, NULL, &reply), 0);
+      EXPECT_EQ(credis_sentinel_readreplicas(sentinel, 1), 0);
+      EXPECT_TRUE((r1 = credis_sentinel_replica(sentinel)) != NULL);
+      EXPECT_TRUE(r1 != master);
+      EXPECT_EQ(credis_sentinel_command(sentinel, 2, get, NULL, &reply), 0);
+      EXPECT_EQ(strcmp(reply.str, "value1"), 0);
+      /* replica with outstanding replies is passed over, ties round-robin */
+      EXPECT_EQ(credis_pipeline_begin(r1), 0);
+      EXPECT_EQ(credis_ping(r1), CREDIS_QUEUED);
+      EXPECT_TRUE((r2 = credis_sentinel_replica(sentinel)) != r1);
+      EXPECT_TRUE(credis_sentinel_replica(sentinel) == r2);
+      EXPECT_EQ(credis_pipeline_end(r1), 0);
+      EXPECT_TRUE(credis_sentinel_replica(sentinel) != credis_sentinel_replica(sentinel));
+
+      /* switch to an unreachable master makes sentinels be asked again, 
+       * scripts of master are passed on to the handle finally connected */
+      EXPECT_TRUE((script = credis_script_create("return 2")) != NULL);
+      EXPECT_EQ(credis_script_register(master, script), 0);
+      EXPECT_EQ(credis_command(master, 2, id, NULL, &reply), 0);
+      id1 = reply.integer;
+      EXPECT_EQ(credis_publish(redis, "+switch-master", 
+                               "mymaster 127.0.0.1 6379 127.0.0.1 1"), 1);
+      usleep(100000);
+      EXPECT_EQ(credis_command(redis, 2, flushv, NULL, NULL), 0);
+      EXPECT_TRUE((master = credis_sentinel_master(sentinel)) != NULL);
+      EXPECT_EQ(credis_command(master, 2, id, NULL, &reply), 0);
+      EXPECT_TRUE(reply.integer != id1);
+      existsv[2] = credis_script_sha(script);
+      EXPECT_EQ(credis_command(redis, 3, existsv, NULL, &reply), 0);
+      EXPECT_EQ(reply.element[0].integer, 1);
+      credis_sentinel_close(sentinel);
+      credis_script_destroy(script);
+    }
+  }
+  TEST_DONE();
+
 #if 0
 
 
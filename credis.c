@@ -33,6 +33,7 @@
 #define _CRT_SECURE_NO_DEPRECATE
 #define WIN32_LEAN_AND_MEAN
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #else 
 #ifdef __FreeBSD__
 #include <sys/types.h>
@@ -43,16 +44,26 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "credis.h"
 
@@ -69,12 +80,107 @@ void close(int fd) {
 #define CR_BULK '$'
 #define CR_MULTIBULK '*'
 #define CR_INT ':'
+/* RESP3 types, mapped to the RESP2 type above they correspond to */
+#define CR_DOUBLE ','
+#define CR_NULL '_'
+#define CR_BOOLEAN '#'
+#define CR_MAP '%'
+#define CR_SET '~'
+#define CR_PUSH '>'
+#define CR_VERBATIM '='
+#define CR_BIGNUMBER '('
+#define CR_BLOBERROR '!'
 #define CR_ANY '?'
 #define CR_NONE ' '
+#define CR_STREAM '&' /* reply is handed to rhnd->stream.callback */
 
 #define CR_BUFFER_SIZE 4096
 #define CR_BUFFER_WATERMARK ((CR_BUFFER_SIZE)/10+1)
+#define CR_BUFFER_MAXGROWTH (8*1024*1024)
+#define CR_BUFFER_SHRINKAFTER 64
 #define CR_MULTIBULK_SIZE 256
+#define CR_INT_STRING_SIZE 24
+#define CR_DOUBLE_STRING_SIZE 32
+#define CR_PARSER_MAXDEPTH 16
+#define CR_ARENA_CHUNK_SIZE 16384
+#define CR_PUBSUB_QUEUE_SIZE 256
+#define CR_ZEROCOPY_SIZE 16384
+#define CR_IOV_MAX 64
+
+/* a lost connection is reported as a send error rather than by SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define CR_SENDFLAGS MSG_NOSIGNAL
+#else
+#define CR_SENDFLAGS 0
+#endif
+#define CR_STREAM_CHUNK_SIZE 65536
+
+#define CR_PARSE_LINE 0
+#define CR_PARSE_BULK 1
+
+#define CR_CACHELINE_SIZE 64
+#define CR_POOL_HEALTHCHECK 1000
+#define CR_CLUSTER_SLOTS 16384
+#define CR_CLUSTER_MAXREDIRECTS 5
+#define CR_SHARDS_POINTS 160
+#define CR_SENTINEL_PORT 26379
+#define CR_SENTINEL_POLL_INTERVAL 1 /* milliseconds */
+#define CR_SENTINEL_RETRY_INTERVAL 1000 /* milliseconds */
+#define CR_CACHE_POLL_INTERVAL 1 /* milliseconds */
+#define CR_BATCH_SIZE 1024
+#define CR_BATCH_WINDOW 16
+#define CR_DETACH_SPARES 4
+#define CR_RECONNECT_REPLAYS 3
+#define CR_ADDRESS_STRING_SIZE 108 /* fits IPv6 addresses and unix socket paths */
+#define CR_ADDRCACHE_SIZE 16
+#define CR_ADDRCACHE_HOST_SIZE 64
+#define CR_ADDRCACHE_TTL 60000 /* milliseconds */
+#define CR_EXECUTOR_CHUNK 256
+
+#ifdef WIN32
+#define CR_THREAD __declspec(thread)
+#define cr_cas(ptr, old, new) (InterlockedCompareExchange((LONG volatile *)(ptr), (new), (old)) == (old))
+#define cr_release(ptr) InterlockedExchange((LONG volatile *)(ptr), 0)
+#else
+#define CR_THREAD __thread
+#define cr_cas(ptr, old, new) __sync_bool_compare_and_swap((ptr), (old), (new))
+#define cr_release(ptr) __sync_lock_release(ptr)
+#endif
+
+/* threads of the parallel executor, refer to credis_executor_create() */
+#ifdef WIN32
+typedef HANDLE cr_thread;
+typedef CRITICAL_SECTION cr_mutex;
+typedef CONDITION_VARIABLE cr_cond;
+#define CR_THREADFN DWORD WINAPI
+#define cr_threadstart(thread, fn, arg) \
+  ((*(thread) = CreateThread(NULL, 0, (fn), (arg), 0, NULL)) != NULL ? 0 : -1)
+#define cr_threadjoin(thread) \
+  (WaitForSingleObject((thread), INFINITE), CloseHandle(thread))
+#define cr_mutexinit(mutex) InitializeCriticalSection(mutex)
+#define cr_mutexdestroy(mutex) DeleteCriticalSection(mutex)
+#define cr_lock(mutex) EnterCriticalSection(mutex)
+#define cr_unlock(mutex) LeaveCriticalSection(mutex)
+#define cr_condinit(cond) InitializeConditionVariable(cond)
+#define cr_conddestroy(cond)
+#define cr_wait(cond, mutex) SleepConditionVariableCS((cond), (mutex), INFINITE)
+#define cr_broadcast(cond) WakeAllConditionVariable(cond)
+#else
+typedef pthread_t cr_thread;
+typedef pthread_mutex_t cr_mutex;
+typedef pthread_cond_t cr_cond;
+#define CR_THREADFN void *
+#define cr_threadstart(thread, fn, arg) pthread_create((thread), NULL, (fn), (arg))
+#define cr_threadjoin(thread) pthread_join((thread), NULL)
+#define cr_mutexinit(mutex) pthread_mutex_init((mutex), NULL)
+#define cr_mutexdestroy(mutex) pthread_mutex_destroy(mutex)
+#define cr_lock(mutex) pthread_mutex_lock(mutex)
+#define cr_unlock(mutex) pthread_mutex_unlock(mutex)
+#define cr_condinit(cond) pthread_cond_init((cond), NULL)
+#define cr_conddestroy(cond) pthread_cond_destroy(cond)
+#define cr_wait(cond, mutex) pthread_cond_wait((cond), (mutex))
+#define cr_broadcast(cond) pthread_cond_broadcast(cond)
+#endif
 
 #define _STRINGIF(arg) #arg
 #define STRINGIFY(arg) _STRINGIF(arg)
@@ -95,6 +201,180 @@ void close(int fd) {
 #define DEBUG(...)
 #endif
 
+#ifdef CREDIS_STATS
+/* add -DCREDIS_STATS to CPPFLAGS in Makefile to collect handle statistics */
+#define CR_STATS(rhnd, field, n) ((rhnd)->stats.field += (n))
+#define CR_STATS_BUFFER(buf) ((buf)->reallocs++)
+#define CR_COMMAND_NAME_SIZE 32
+#else
+#define CR_STATS(rhnd, field, n)
+#define CR_STATS_BUFFER(buf)
+#endif
+
+/* allocator functions, refer to credis_setallocator() */
+static void *(*cr_mallocfn)(size_t) = malloc;
+static void *(*cr_reallocfn)(void *, size_t) = realloc;
+static void (*cr_freefn)(void *) = free;
+
+/* buffer policy, refer to credis_setbufferpolicy() */
+static int cr_bufferbaseline = CR_BUFFER_SIZE;
+static int cr_buffermaxgrowth = CR_BUFFER_MAXGROWTH;
+static int cr_buffershrinkafter = CR_BUFFER_SHRINKAFTER;
+
+/* major, minor and patch of server version assumed instead of detecting it
+ * at connect, all 0 to detect, refer to credis_setserverversion(). Not 
+ * synchronized, only set before threads connecting handles have started */
+static int cr_serverversion[3];
+
+/* Command table, each entry is: identifier, name, length of name, usual 
+ * number of arguments including the name, expected reply type, flags, 
+ * server version the entry applies from and identifier of entry used with 
+ * older servers. Commands are sent with a prefix prepared from it, and the 
+ * entries for the server version are picked once per handle at connect */
+#define CR_COMMANDS(X)                                                   \
+  X(APPEND,           "APPEND",           6,  3, CR_INT,       0, 0, APPEND) \
+  X(ASKING,           "ASKING",           6,  1, CR_INLINE,    0, 0, ASKING) \
+  X(AUTH,             "AUTH",             4,  2, CR_INLINE,    0, 0, AUTH) \
+  X(BGREWRITEAOF,     "BGREWRITEAOF",     12, 1, CR_INLINE,    0, 0, BGREWRITEAOF) \
+  X(BGSAVE,           "BGSAVE",           6,  1, CR_INLINE,    0, 0, BGSAVE) \
+  X(BITCOUNT,         "BITCOUNT",         8,  2, CR_INT,       CR_READONLY, 0, BITCOUNT) \
+  X(DBSIZE,           "DBSIZE",           6,  1, CR_INT,       CR_READONLY, 0, DBSIZE) \
+  X(DECR,             "DECR",             4,  2, CR_INT,       0, 0, DECR) \
+  X(DECRBY,           "DECRBY",           6,  3, CR_INT,       0, 0, DECRBY) \
+  X(DEL,              "DEL",              3,  2, CR_INT,       0, 0, DEL) \
+  X(ECHO,             "ECHO",             4,  2, CR_BULK,      0, 0, ECHO) \
+  X(EXEC,             "EXEC",             4,  1, CR_ANY,       0, 0, EXEC) \
+  X(EXISTS,           "EXISTS",           6,  2, CR_INT,       CR_READONLY, 0, EXISTS) \
+  X(EXPIRE,           "EXPIRE",           6,  3, CR_INT,       0, 0, EXPIRE) \
+  X(FLUSHALL,         "FLUSHALL",         8,  1, CR_INLINE,    0, 0, FLUSHALL) \
+  X(FLUSHDB,          "FLUSHDB",          7,  1, CR_INLINE,    0, 0, FLUSHDB) \
+  X(GET,              "GET",              3,  2, CR_BULK,      CR_READONLY, 0, GET) \
+  X(GETBIT,           "GETBIT",           6,  3, CR_INT,       CR_READONLY, 0, GETBIT) \
+  X(GETRANGE,         "GETRANGE",         8,  4, CR_BULK,      CR_READONLY, CR_VERSION(2,0,1), SUBSTR) \
+  X(GETSET,           "GETSET",           6,  3, CR_BULK,      0, 0, GETSET) \
+  X(HELLO,            "HELLO",            5,  2, CR_MULTIBULK, 0, 0, HELLO) \
+  X(HEXISTS,          "HEXISTS",          7,  3, CR_INT,       CR_READONLY, 0, HEXISTS) \
+  X(HGET,             "HGET",             4,  3, CR_BULK,      CR_READONLY, 0, HGET) \
+  X(HGETALL,          "HGETALL",          7,  2, CR_MULTIBULK, CR_READONLY, 0, HGETALL) \
+  X(HKEYS,            "HKEYS",            5,  2, CR_MULTIBULK, CR_READONLY, 0, HKEYS) \
+  X(HLEN,             "HLEN",             4,  2, CR_INT,       CR_READONLY, 0, HLEN) \
+  X(HMGET,            "HMGET",            5,  3, CR_MULTIBULK, CR_READONLY, 0, HMGET) \
+  X(HSCAN,            "HSCAN",            5,  3, CR_MULTIBULK, CR_READONLY, 0, HSCAN) \
+  X(HSET,             "HSET",             4,  4, CR_INT,       0, 0, HSET) \
+  X(HVALS,            "HVALS",            5,  2, CR_MULTIBULK, CR_READONLY, 0, HVALS) \
+  X(INCR,             "INCR",             4,  2, CR_INT,       0, 0, INCR) \
+  X(INCRBY,           "INCRBY",           6,  3, CR_INT,       0, 0, INCRBY) \
+  X(INFO,             "INFO",             4,  1, CR_BULK,      0, 0, INFO) \
+  X(KEYS,             "KEYS",             4,  2, CR_MULTIBULK, CR_READONLY, CR_VERSION(2,0,0), KEYS_BULK) \
+  X(KEYS_BULK,        "KEYS",             4,  2, CR_BULK,      CR_READONLY, 0, KEYS_BULK) \
+  X(LASTSAVE,         "LASTSAVE",         8,  1, CR_INT,       0, 0, LASTSAVE) \
+  X(LINDEX,           "LINDEX",           6,  3, CR_BULK,      CR_READONLY, 0, LINDEX) \
+  X(LLEN,             "LLEN",             4,  2, CR_INT,       CR_READONLY, 0, LLEN) \
+  X(LPOP,             "LPOP",             4,  2, CR_BULK,      0, 0, LPOP) \
+  X(LPUSH,            "LPUSH",            5,  3, CR_INT,       0, CR_VERSION(2,0,0), LPUSH_INLINE) \
+  X(LPUSH_INLINE,     "LPUSH",            5,  3, CR_INLINE,    0, 0, LPUSH_INLINE) \
+  X(LRANGE,           "LRANGE",           6,  4, CR_MULTIBULK, CR_READONLY, 0, LRANGE) \
+  X(LREM,             "LREM",             4,  4, CR_INT,       0, 0, LREM) \
+  X(LSET,             "LSET",             4,  4, CR_INLINE,    0, 0, LSET) \
+  X(LTRIM,            "LTRIM",            5,  4, CR_INLINE,    0, 0, LTRIM) \
+  X(MGET,             "MGET",             4,  2, CR_MULTIBULK, CR_READONLY, 0, MGET) \
+  X(MONITOR,          "MONITOR",          7,  1, CR_INLINE,    0, 0, MONITOR) \
+  X(MOVE,             "MOVE",             4,  3, CR_INT,       0, 0, MOVE) \
+  X(MULTI,            "MULTI",            5,  1, CR_ANY,       0, 0, MULTI) \
+  X(PING,             "PING",             4,  1, CR_INLINE,    0, 0, PING) \
+  X(PTTL,             "PTTL",             4,  2, CR_INT,       CR_READONLY, 0, PTTL) \
+  X(PUBLISH,          "PUBLISH",          7,  3, CR_INT,       0, 0, PUBLISH) \
+  X(QUIT,             "QUIT",             4,  1, CR_INLINE,    0, 0, QUIT) \
+  X(RANDOMKEY,        "RANDOMKEY",        9,  1, CR_BULK,      CR_READONLY, CR_VERSION(2,0,0), RANDOMKEY_INLINE) \
+  X(RANDOMKEY_INLINE, "RANDOMKEY",        9,  1, CR_INLINE,    CR_READONLY, 0, RANDOMKEY_INLINE) \
+  X(RENAME,           "RENAME",           6,  3, CR_INLINE,    0, 0, RENAME) \
+  X(RENAMENX,         "RENAMENX",         8,  3, CR_INT,       0, 0, RENAMENX) \
+  X(RPOP,             "RPOP",             4,  2, CR_BULK,      0, 0, RPOP) \
+  X(RPUSH,            "RPUSH",            5,  3, CR_INT,       0, CR_VERSION(2,0,0), RPUSH_INLINE) \
+  X(RPUSH_INLINE,     "RPUSH",            5,  3, CR_INLINE,    0, 0, RPUSH_INLINE) \
+  X(SADD,             "SADD",             4,  3, CR_INT,       0, 0, SADD) \
+  X(SAVE,             "SAVE",             4,  1, CR_INLINE,    0, 0, SAVE) \
+  X(SCAN,             "SCAN",             4,  2, CR_MULTIBULK, CR_READONLY, 0, SCAN) \
+  X(SCARD,            "SCARD",            5,  2, CR_INT,       CR_READONLY, 0, SCARD) \
+  X(SDIFF,            "SDIFF",            5,  2, CR_MULTIBULK, CR_READONLY, 0, SDIFF) \
+  X(SDIFFSTORE,       "SDIFFSTORE",       10, 3, CR_INT,       0, 0, SDIFFSTORE) \
+  X(SELECT,           "SELECT",           6,  2, CR_INLINE,    0, 0, SELECT) \
+  X(SET,              "SET",              3,  3, CR_INLINE,    0, 0, SET) \
+  X(SETEX,            "SETEX",            5,  4, CR_INLINE,    0, 0, SETEX) \
+  X(SETNX,            "SETNX",            5,  3, CR_INT,       0, 0, SETNX) \
+  X(SHUTDOWN,         "SHUTDOWN",         8,  1, CR_INLINE,    0, 0, SHUTDOWN) \
+  X(SINTER,           "SINTER",           6,  2, CR_MULTIBULK, CR_READONLY, 0, SINTER) \
+  X(SINTERSTORE,      "SINTERSTORE",      11, 3, CR_INT,       0, 0, SINTERSTORE) \
+  X(SISMEMBER,        "SISMEMBER",        9,  3, CR_INT,       CR_READONLY, 0, SISMEMBER) \
+  X(SLAVEOF,          "SLAVEOF",          7,  3, CR_INLINE,    0, 0, SLAVEOF) \
+  X(SMEMBERS,         "SMEMBERS",         8,  2, CR_MULTIBULK, CR_READONLY, 0, SMEMBERS) \
+  X(SMOVE,            "SMOVE",            5,  4, CR_INT,       0, 0, SMOVE) \
+  X(SORT,             "SORT",             4,  2, CR_MULTIBULK, 0, 0, SORT) \
+  X(SPOP,             "SPOP",             4,  2, CR_BULK,      0, 0, SPOP) \
+  X(SRANDMEMBER,      "SRANDMEMBER",      11, 2, CR_BULK,      CR_READONLY, 0, SRANDMEMBER) \
+  X(SREM,             "SREM",             4,  3, CR_INT,       0, 0, SREM) \
+  X(SSCAN,            "SSCAN",            5,  3, CR_MULTIBULK, CR_READONLY, 0, SSCAN) \
+  X(STRLEN,           "STRLEN",           6,  2, CR_INT,       CR_READONLY, 0, STRLEN) \
+  X(SUBSTR,           "SUBSTR",           6,  4, CR_BULK,      CR_READONLY, 0, SUBSTR) \
+  X(SUNION,           "SUNION",           6,  2, CR_MULTIBULK, CR_READONLY, 0, SUNION) \
+  X(SUNIONSTORE,      "SUNIONSTORE",      11, 3, CR_INT,       0, 0, SUNIONSTORE) \
+  X(TTL,              "TTL",              3,  2, CR_INT,       CR_READONLY, 0, TTL) \
+  X(TYPE,             "TYPE",             4,  2, CR_INLINE,    CR_READONLY, 0, TYPE) \
+  X(UNWATCH,          "UNWATCH",          7,  1, CR_INLINE,    0, 0, UNWATCH) \
+  X(WATCH,            "WATCH",            5,  2, CR_INLINE,    0, 0, WATCH) \
+  X(ZADD,             "ZADD",             4,  4, CR_INT,       0, 0, ZADD) \
+  X(ZCARD,            "ZCARD",            5,  2, CR_INT,       CR_READONLY, 0, ZCARD) \
+  X(ZCOUNT,           "ZCOUNT",           6,  4, CR_INT,       CR_READONLY, 0, ZCOUNT) \
+  X(ZINCRBY,          "ZINCRBY",          7,  4, CR_BULK,      0, 0, ZINCRBY) \
+  X(ZINTERSTORE,      "ZINTERSTORE",      11, 4, CR_INT,       0, 0, ZINTERSTORE) \
+  X(ZRANGE,           "ZRANGE",           6,  4, CR_MULTIBULK, CR_READONLY, 0, ZRANGE) \
+  X(ZRANGEBYSCORE,    "ZRANGEBYSCORE",    13, 4, CR_MULTIBULK, CR_READONLY, 0, ZRANGEBYSCORE) \
+  X(ZRANK,            "ZRANK",            5,  3, CR_ANY,       CR_READONLY, 0, ZRANK) \
+  X(ZREM,             "ZREM",             4,  3, CR_INT,       0, 0, ZREM) \
+  X(ZREMRANGEBYRANK,  "ZREMRANGEBYRANK",  15, 4, CR_INT,       0, 0, ZREMRANGEBYRANK) \
+  X(ZREMRANGEBYSCORE, "ZREMRANGEBYSCORE", 16, 4, CR_INT,       0, 0, ZREMRANGEBYSCORE) \
+  X(ZREVRANGE,        "ZREVRANGE",        9,  4, CR_MULTIBULK, CR_READONLY, 0, ZREVRANGE) \
+  X(ZREVRANGEBYSCORE, "ZREVRANGEBYSCORE", 16, 4, CR_MULTIBULK, CR_READONLY, 0, ZREVRANGEBYSCORE) \
+  X(ZREVRANK,         "ZREVRANK",         8,  3, CR_ANY,       CR_READONLY, 0, ZREVRANK) \
+  X(ZSCAN,            "ZSCAN",            5,  3, CR_MULTIBULK, CR_READONLY, 0, ZSCAN) \
+  X(ZSCORE,           "ZSCORE",           6,  3, CR_BULK,      CR_READONLY, 0, ZSCORE) \
+  X(ZUNIONSTORE,      "ZUNIONSTORE",      11, 4, CR_INT,       0, 0, ZUNIONSTORE)
+
+/* command never modifies data, may be served by a replica or sent again */
+#define CR_READONLY 1
+
+#define CR_COMMAND_ID(id, name, namelen, argc, type, flags, since, fallback) CR_CMD_##id,
+enum { CR_COMMANDS(CR_COMMAND_ID) CR_CMD_COUNT };
+
+typedef struct _cr_command {
+  const char *name;
+  const char *prefix; /* "*<argc>\r\n$<namelen>\r\n<name>\r\n" */
+  int prefixlen;
+  int nameoff;        /* offset of "$<namelen>" in prefix */
+  int namelen;
+  int argc;
+  char type;
+  int flags;
+  int since;          /* version number created by CR_VERSION() */
+  int fallback;
+} cr_command;
+
+#define CR_COMMAND_ENTRY(id, name, namelen, argc, type, flags, since, fallback) \
+  {name, "*" #argc "\r\n$" #namelen "\r\n" name "\r\n",                 \
+   sizeof("*" #argc "\r\n$" #namelen "\r\n" name "\r\n") - 1,           \
+   sizeof("*" #argc "\r\n") - 1, namelen, argc, type, flags, since,     \
+   CR_CMD_##fallback},
+static const cr_command cr_commands[CR_CMD_COUNT] = { CR_COMMANDS(CR_COMMAND_ENTRY) };
+
+/* fails to compile if a name length in the table is wrong */
+#define CR_COMMAND_CHECK(id, name, namelen, argc, type, flags, since, fallback) \
+  typedef char cr_commandcheck_##id[sizeof(name) - 1 == namelen ? 1 : -1];
+CR_COMMANDS(CR_COMMAND_CHECK)
+
+#define cr_malloc(size) cr_mallocfn(size)
+#define cr_realloc(ptr, size) cr_reallocfn((ptr), (size))
+#define cr_free(ptr) cr_freefn(ptr)
+
 /* format warnings are GNU C specific */
 #if !__GNUC__
 #define __attribute__(x)
@@ -105,30 +385,171 @@ typedef struct _cr_buffer {
   int idx;
   int len;
   int size;
+#ifdef CREDIS_STATS
+  unsigned long long reallocs;
+#endif
 } cr_buffer;
 
 typedef struct _cr_multibulk { 
   char **bulks; 
-  int *idxs;
+  int *lens;
   int size;
   int len; 
+#ifdef CREDIS_STATS
+  unsigned long long reallocs;
+#endif
 } cr_multibulk;
 
 typedef struct _cr_reply {
   char type;
-  int integer;
+  char *base; /* start of reply in buffer */
+  long long integer;
   char *line;
   char *bulk;
+  int bulklen;
   cr_multibulk multibulk;
 } cr_reply;
 
+/* Part of a parsed reply, either a reply of its own or an element of a 
+ * multi-bulk. Offsets are relative to start of reply in buffer */
+typedef struct _cr_node {
+  char type; /* RESP2 type */
+  char resp; /* type as received, differs from `type' for RESP3 types */
+  long long integer;
+  int idx;  /* offset of line or bulk data, -1 if nil */
+  int len;  /* length of line or bulk data, number of elements of multi-bulk */
+  int next; /* index of node following this node and all of its elements */
+} cr_node;
+
+typedef struct _cr_parser {
+  int state;
+  int pos;  /* offset of first byte not yet parsed */
+  int scan; /* offset from which to resume looking for "\r\n" */
+  int need; /* number of bytes at least needed to continue */
+  int depth;
+  struct {
+    int node;
+    int remaining; /* number of elements not yet parsed */
+  } stack[CR_PARSER_MAXDEPTH];
+  cr_node *nodes;      /* nodes of reply in order of appearance */
+  REDIS_REPLY *views;  /* storage for multi-bulk elements of public replies */
+  int len;
+  int size;
+#ifdef CREDIS_STATS
+  unsigned long long reallocs;
+#endif
+} cr_parser;
+
+/* Bump allocator handing out memory from a list of chunks, all of which is
+ * released at once by resetting the arena. Chunks are kept for reuse */
+typedef struct _cr_arenachunk {
+  struct _cr_arenachunk *next;
+  int size;
+  int used;
+  char data[];
+} cr_arenachunk;
+
+typedef struct _cr_arena {
+  cr_arenachunk *head;
+  cr_arenachunk *current; /* chunk allocations are currently made from */
+} cr_arena;
+
+/* Argument of a command that is sent directly from caller's memory rather than
+ * being copied to message buffer. It goes in between buffer offsets `pos' 
+ * and `pos'+1 of the message */
+typedef struct _cr_zerocopyref {
+  const char *data;
+  int len;
+  int pos;
+} cr_zerocopyref;
+
+/* Lua script run with EVALSHA, `sha' is the SHA1 digest of `body' in hex */
+typedef struct _cr_script {
+  char sha[41];
+  char *body;
+  int len;
+} cr_script;
+
+/* Buffers of a handle handed over to caller by credis_detach(), or kept by
+ * handle as spares */
+typedef struct _cr_detached {
+  char *data;
+  int size;
+  char **bulks;
+  int *lens;
+  int bulksize;
+  REDIS_REPLY *views;
+  int viewsize;
+} cr_detached;
+
+/* Elements of a variadic write command, each made up of a score if `scorev' 
+ * is set, an argument of `av' and one of `bv' if set. Lengths of arguments
+ * are given by `alenv' and `blenv', if NULL arguments are zero-terminated */
+typedef struct _cr_batch {
+  const char *cmd;
+  const char *key;      /* NULL if command takes no key */
+  int n;
+  const double *scorev;
+  const char **av;
+  const int *alenv;
+  const char **bv;
+  const int *blenv;
+} cr_batch;
+
+/* Value cached by credis_get() or credis_hget(), `data' holds key, field 
+ * and value, each zero-terminated */
+typedef struct _cr_cacheentry {
+  struct _cr_cacheentry *next; /* next entry in hash bucket */
+  unsigned int hash;  /* of key only, so that fields of a hash share bucket */
+  int keylen;
+  int fieldlen;       /* -1 if cached by credis_get() */
+  int vallen;         /* -1 if value is nil */
+  int slot;           /* index in clock */
+  int referenced;     /* set by hits, cleared as clock hand passes */
+  char data[];
+} cr_cacheentry;
+
+/* Bounded local cache of a handle kept coherent by server assisted 
+ * invalidation, refer to credis_cache_enable() */
+typedef struct _cr_cache {
+  REDIS inv;                /* receives invalidation messages, NULL if lost */
+  cr_cacheentry **buckets;
+  int mask;                 /* number of buckets minus one */
+  cr_cacheentry **clock;    /* all entries, in no particular order */
+  int len;
+  int hand;
+  int maxentries;
+  int maxbytes;
+  int bytes;
+  int maxkeylen;            /* of keys ever cached */
+  int fetching;             /* a value to be cached is being fetched */
+  long polled;              /* time invalidations were last checked for */
+} cr_cache;
+
 typedef struct _cr_message { 
   char *pattern;
   char *channel;
   char *message;
-  struct _cr_message *next; 
+  int len;
 } cr_message;
 
+typedef struct _cr_address {
+  struct sockaddr_storage sa;
+  socklen_t len;
+} cr_address;
+
+/* Address a host name last resolved to and was connected at, so that 
+ * reconnects do not wait for name resolution */
+typedef struct _cr_addrcacheentry {
+  char host[CR_ADDRCACHE_HOST_SIZE];
+  int port;
+  long resolved; /* time stamp in milliseconds, 0 if entry is unused */
+  cr_address addr;
+} cr_addrcacheentry;
+
+static cr_addrcacheentry cr_addrcache[CR_ADDRCACHE_SIZE];
+static volatile int cr_addrcachelock;
+
 typedef struct _cr_redis {
   struct {
     int major;
@@ -136,33 +557,397 @@ typedef struct _cr_redis {
     int patch;
     int number; /* holds a version number created by CR_VERSION() */
   } version;
+  const cr_command *commands[CR_CMD_COUNT]; /* entries for server version */
   struct {
-    cr_message *head;
-    cr_message *tail;
-    cr_message *msg;
+    cr_message *queue; /* ring of messages received while waiting for ack */
+    int head;
+    int len;
+    int size;          /* power of two */
+    cr_arena arena;    /* storage of queued messages */
+    int subscriptions; /* number of channels and patterns subscribed to */
+    int channels;      /* number of those that are channels */
+    cr_buffer out;     /* commands are sent from here to keep pushed messages */
   } pubsub;
+  struct {
+    int active;
+    int queued;  /* number of commands queued but not yet sent */
+    int pending; /* number of replies not yet read */
+    int mark;    /* end of last complete command in buffer */
+    int multi;   /* commands are queued for a transaction, see credis_multi() */
+  } pipeline;
+  struct {
+    cr_zerocopyref *refs; /* ordered by position in message buffer */
+    int len;
+    int size;
+    int bytes; /* total length of referenced arguments */
+  } zerocopy;
   int fd;
+  char *host; /* as given to connect, resolved again on reconnect */
   char *ip;
   int port;
   int timeout;
   cr_buffer buf;
+  cr_parser parser;
   cr_reply reply;
-  int error;
+  int error; /* last send or receive error, handle is out of sync if set */
+  int small; /* number of consecutive commands using little of buffer */
+  int slot;  /* index of pool slot if handle belongs to a pool */
+  int batchsize; /* elements per command of variadic writes before splitting */
+  struct {
+    cr_detached *v[CR_DETACH_SPARES]; /* returned by credis_detach_free() */
+    int len;
+  } spares;
+  struct {
+    int attempts;     /* per lost connection, 0 disables reconnect */
+    int mindelay;     /* backoff in milliseconds */
+    int maxdelay;
+    unsigned int seed;
+    int active;       /* set while reconnecting */
+    char *password;   /* sent with AUTH after reconnect if not NULL */
+    int protover;
+    int db;
+    cr_buffer replay; /* copy of commands that may be sent again */
+    int sent;         /* number of commands in `replay' */
+  } reconnect;
+  struct _cr_scan *scan; /* iterator whose next batch has been requested */
+  struct {
+    credis_streamcallback callback; /* of credis_commandstream() in progress */
+    void *data;
+    int started; /* set once an element has been handed to callback */
+  } stream;
+  cr_cache *cache;       /* NULL unless credis_cache_enable() has been called */
+  struct {
+    cr_script **v; /* scripts loaded on server, not owned by handle */
+    int len;
+    int size;
+  } scripts;
+#ifdef CREDIS_STATS
+  REDIS_STATS stats;
+  credis_commandhook hook;
+  void *hookdata;
+#endif
 } cr_redis;
 
-static void cr_freeallmessages(REDIS rhnd);
+typedef struct _cr_poolslot {
+  REDIS rhnd;
+  volatile int busy;
+  long checkin; /* time stamp of last check-in in milliseconds */
+} __attribute__ ((aligned (CR_CACHELINE_SIZE))) cr_poolslot;
+
+typedef struct _cr_pool {
+  char *host;
+  int port;
+  int timeout;
+  int healthcheck;
+  int size;
+  cr_poolslot *slots;
+} cr_pool;
+
+/* Worker of parallel executor, runs chunks of its own range of the current
+ * job first and then steals chunks from the end of other workers' ranges */
+typedef struct _cr_executorworker {
+  struct _cr_executor *ehnd;
+  cr_thread thread;  /* not used by worker 0, which is the calling thread */
+  volatile int lock; /* guards `next' and `end' */
+  int next;          /* first chunk of range not yet taken */
+  int end;           /* end of range, lowered by stealing workers */
+  long long sum;     /* of integer replies of chunks run */
+  cr_buffer vals;    /* values copied from replies of chunks run */
+} __attribute__ ((aligned (CR_CACHELINE_SIZE))) cr_executorworker;
+
+typedef struct _cr_executor {
+  REDIS_POOL pool;
+  int chunk;          /* keys per command */
+  int threads;        /* number of workers, including calling thread */
+  int started;        /* number of worker threads started */
+  cr_executorworker *workers;
+  cr_mutex mutex;     /* guards `generation', `running' and `stop' */
+  cr_cond start;
+  cr_cond done;
+  unsigned int generation; /* incremented for each job */
+  int running;        /* number of worker threads not done with job */
+  int stop;
+  int cmd;            /* job, command of the command table */
+  int keyc;
+  const char **keyv;
+  volatile int rc;    /* first error of job */
+  int *owners;        /* worker that ran each chunk, -1 if not run */
+  int *offsets;       /* offset of each value in `vals' of worker, -1 if nil */
+  char **valv;
+  int size;           /* number of keys storage is allocated for */
+} cr_executor;
+
+typedef struct _cr_clusternode {
+  char *host;
+  int port;
+  REDIS rhnd; /* NULL until connected */
+} cr_clusternode;
+
+/* Key of a multi-key command fanned out to several servers, refer to
+ * cr_fanoutsort() */
+typedef struct _cr_fanoutkey {
+  int group; /* cluster slot or shard that key belongs to */
+  int idx;   /* index of key in caller's key array */
+  int node;  /* node command of group was pipelined to, -1 if it failed */
+} cr_fanoutkey;
+
+typedef struct _cr_fanout {
+  cr_fanoutkey *keys;  /* keys ordered by group */
+  const char **keyv;   /* keys ordered by group */
+  int *offsets;        /* offset of each value in `vals', -1 if nil */
+  char **valv;
+  int size;
+  cr_buffer vals;      /* values copied from replies of all servers */
+} cr_fanout;
+
+typedef struct _cr_cluster {
+  int timeout;
+  cr_clusternode *nodes;
+  int len;
+  int size;
+  short slots[CR_CLUSTER_SLOTS]; /* index of node serving slot, -1 if unknown */
+  cr_fanout fanout;
+} cr_cluster;
+
+typedef struct _cr_shard {
+  char *host;
+  int port;
+  int weight;
+  REDIS rhnd; /* NULL until connected */
+} cr_shard;
+
+typedef struct _cr_shardpoint {
+  unsigned int hash;
+  int shard;
+} cr_shardpoint;
+
+typedef struct _cr_shards {
+  int timeout;
+  cr_shard *shards;
+  int len;
+  int size;
+  cr_shardpoint *ring; /* points of all shards ordered by hash */
+  int points;
+  cr_fanout fanout;
+} cr_shards;
+
+typedef struct _cr_sentinelnode {
+  char *host;
+  int port;
+  REDIS rhnd; /* NULL until connected, out of sync until replaced */
+  long down;  /* time stamp of last failed connect, 0 if none */
+} cr_sentinelnode;
+
+typedef struct _cr_sentinel {
+  int timeout;
+  char *name;                 /* of master, as monitored by sentinels */
+  cr_sentinelnode *sentinels; /* the one that last answered first */
+  int len;
+  REDIS sub;                  /* subscribed to +switch-master, NULL if lost */
+  long polled;
+  int stale;                  /* sentinels are to be asked again */
+  cr_sentinelnode master;
+  cr_sentinelnode *replicas;
+  int replicalen;
+  int replicasize;
+  int readreplicas;
+  int next;                   /* replica picked first on a tie */
+} cr_sentinel;
+
+/* Iterator over a SCAN family command. The command for the next cursor is 
+ * sent as soon as a batch has been received, so that the server is already
+ * working on it while the caller processes the batch. If the handle is used
+ * for another command in between, the batch is received first and kept in
+ * `held' until the iterator is advanced */
+typedef struct _cr_scan {
+  REDIS rhnd;
+  const char *cmd;
+  char *key;     /* NULL for SCAN */
+  char *pattern; /* NULL matches all */
+  int count;     /* 0 leaves batch size to server */
+  char cursor[CR_INT_STRING_SIZE];
+  int done;      /* cursor 0 has been returned */
+  int helds;     /* number of elements in `held', -1 if no batch is held */
+  cr_buffer held; /* elements of batch received ahead, each an int length,
+                   * -1 for nil, followed by its zero-terminated data */
+  cr_buffer out; /* next command, kept apart from handle's buffer */
+} cr_scan;
+
+typedef struct _cr_asynccallback {
+  credis_async_callback fn;
+  void *privdata;
+  int len;      /* of command in output buffer */
+  int replays;  /* times sent again after a lost connection */
+} cr_asynccallback;
+
+typedef struct _cr_asynccallbacks {
+  cr_asynccallback *fifo; /* circular FIFO of commands waiting for reply */
+  int head;
+  int len;
+  int size;
+} cr_asynccallbacks;
+
+typedef struct _cr_async {
+  REDIS rhnd;
+  cr_buffer out; /* commands to send, `idx' marks first byte not yet sent */
+  int acked;     /* with reconnect enabled sent commands are kept in `out' 
+                  * until answered, this marks first one not answered */
+  cr_asynccallbacks callbacks;
+  int events;
+  credis_async_eventhook hook;
+  void *hookdata;
+} cr_async;
+
+/* Returns pointer to the first occurence of '\r', or NULL if not found. 
+ * Compares 32 or 16 bytes at a time where AVX2, SSE2 or NEON is available 
+ * and leaves the remaining bytes to memchr() */
+static char * cr_findcr(char *buf, int len) {
+#if defined(__AVX2__)
+  const __m256i cr = _mm256_set1_epi8('\r');
+  unsigned int mask;
+
+  for (; len >= 32; buf += 32, len -= 32) {
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)buf), cr));
+    if (mask != 0)
+      return buf + __builtin_ctz(mask);
+  }
+#elif defined(__SSE2__)
+  const __m128i cr = _mm_set1_epi8('\r');
+  unsigned int mask;
+
+  for (; len >= 16; buf += 16, len -= 16) {
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)buf), cr));
+    if (mask != 0)
+      return buf + __builtin_ctz(mask);
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t cr = vdupq_n_u8('\r');
+  uint64_t mask;
+
+  for (; len >= 16; buf += 16, len -= 16) {
+    /* narrow comparison result to one nibble per byte */
+    mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(
+             vceqq_u8(vld1q_u8((const uint8_t *)buf), cr)), 4)), 0);
+    if (mask != 0)
+      return buf + (__builtin_ctzll(mask) >> 2);
+  }
+#endif
+  return len > 0 ? memchr(buf, '\r', len) : NULL;
+}
 
 /* Returns pointer to the '\r' of the first occurence of "\r\n", or NULL
  * if not found */
 static char * cr_findnl(char *buf, int len) {
-  while (--len >= 0) {
-    if (*(buf++) == '\r')
-      if (*buf == '\n')
-        return --buf;
+  char *end = buf + len, *cr;
+
+  while ((cr = cr_findcr(buf, end - buf)) != NULL && cr + 1 < end) {
+    if (cr[1] == '\n')
+      return cr;
+    buf = cr + 1;
   }
   return NULL;
 }
 
+static void * cr_calloc(size_t nmemb, size_t size)
+{
+  void *ptr;
+
+  /* as calloc(), fails if total size does not fit in a size_t */
+  if (nmemb != 0 && size > (size_t)-1 / nmemb)
+    return NULL;
+  if ((ptr = cr_malloc(nmemb * size)) != NULL)
+    memset(ptr, 0, nmemb * size);
+
+  return ptr;
+}
+
+static char * cr_strdup(const char *str)
+{
+  size_t len = strlen(str) + 1;
+  char *copy;
+
+  if ((copy = cr_malloc(len)) != NULL)
+    memcpy(copy, str, len);
+
+  return copy;
+}
+
+/* Returns `size' bytes of arena memory, aligned for any type, or NULL if out
+ * of memory. A new chunk is only allocated if none of the chunks kept are 
+ * free */
+static void * cr_arenaalloc(cr_arena *arena, int size)
+{
+  cr_arenachunk *chunk = arena->current;
+  int chunksize;
+
+  size = (size + sizeof(void *) - 1) & ~((int)sizeof(void *) - 1);
+
+  while (chunk != NULL && chunk->size - chunk->used < size)
+    chunk = chunk->next;
+
+  if (chunk == NULL) {
+    chunksize = size > CR_ARENA_CHUNK_SIZE ? size : CR_ARENA_CHUNK_SIZE;
+    if ((chunk = cr_malloc(sizeof(cr_arenachunk) + chunksize)) == NULL)
+      return NULL;
+    chunk->size = chunksize;
+    chunk->used = 0;
+    /* insert after current chunk, the chunks following it are all in use
+     * or too small */
+    if (arena->current != NULL) {
+      chunk->next = arena->current->next;
+      arena->current->next = chunk;
+    }
+    else {
+      chunk->next = arena->head;
+      arena->head = chunk;
+    }
+  }
+
+  arena->current = chunk;
+  chunk->used += size;
+
+  return chunk->data + chunk->used - size;
+}
+
+/* Copies `len' bytes of `data' to arena and zero-terminates the copy */
+static char * cr_arenamemdup(cr_arena *arena, const char *data, int len)
+{
+  char *copy;
+
+  if ((copy = cr_arenaalloc(arena, len + 1)) != NULL) {
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+  }
+
+  return copy;
+}
+
+static char * cr_arenastrdup(cr_arena *arena, const char *str)
+{
+  return cr_arenamemdup(arena, str, strlen(str));
+}
+
+/* Releases all memory handed out by arena at once */
+static void cr_arenareset(cr_arena *arena)
+{
+  cr_arenachunk *chunk;
+
+  for (chunk = arena->head; chunk != NULL; chunk = chunk->next)
+    chunk->used = 0;
+  arena->current = arena->head;
+}
+
+static void cr_arenafree(cr_arena *arena)
+{
+  cr_arenachunk *chunk;
+
+  while ((chunk = arena->head) != NULL) {
+    arena->head = chunk->next;
+    cr_free(chunk);
+  }
+  arena->current = NULL;
+}
+
 /* Allocate at least `size' bytes more buffer memory, keeping content of
  * previously allocated memory untouched.
  * Returns:
@@ -171,19 +956,33 @@ static char * cr_findnl(char *buf, int len) {
 static int cr_moremem(cr_buffer *buf, int size)
 {
   char *ptr;
-  int total, n;
-
-  n = size / CR_BUFFER_SIZE + 1;
-  total = buf->size + n * CR_BUFFER_SIZE;
+  long long total;
+  int grow;
 
-  DEBUG("allocate %d x CR_BUFFER_SIZE, total %d bytes", n, total);
+  /* size of buffer is an int, growth is limited to what it can hold */
+  if (size > INT_MAX - buf->size)
+    return -1;
 
-  ptr = realloc(buf->data, total);
+  /* grow geometrically, by at most the growth limit unless more is needed,
+   * to keep the number of reallocations of large replies low */
+  grow = buf->size;
+  if (cr_buffermaxgrowth > 0 && grow > cr_buffermaxgrowth)
+    grow = cr_buffermaxgrowth;
+  if (grow < size)
+    grow = size;
+  total = (((long long)buf->size + grow) / CR_BUFFER_SIZE + 1) * CR_BUFFER_SIZE;
+  if (total > INT_MAX)
+    total = INT_MAX;
+
+  DEBUG("allocate %lld bytes more, total %lld bytes", total - buf->size, total);
+  CR_STATS_BUFFER(buf);
+
+  ptr = cr_realloc(buf->data, total);
   if (ptr == NULL)
     return -1;
 
   buf->data = ptr;
-  buf->size = total;
+  buf->size = (int)total;
   return 0;
 }
 
@@ -194,24 +993,35 @@ static int cr_moremem(cr_buffer *buf, int size)
  *  -1  on error, i.e. more memory not available */
 static int cr_morebulk(cr_multibulk *mb, int size) 
 {
+  long long total, max = INT_MAX / sizeof(char *);
   char **cptr;
-  int *iptr;
-  int total, n;
-
-  n = (size / CR_MULTIBULK_SIZE + 1) * CR_MULTIBULK_SIZE;
-  total = mb->size + n;
+  int *lptr;
+  int n;
 
-  DEBUG("allocate %d x CR_MULTIBULK_SIZE, total %d (%lu bytes)", 
-        n, total, total * ((sizeof(char *)+sizeof(int))));
-  cptr = realloc(mb->bulks, total * sizeof(char *));
-  iptr = realloc(mb->idxs, total * sizeof(int));
+  /* number of elements is an int, and so is byte size of their storage */
+  if (size > max - mb->size)
+    return CREDIS_ERR_NOMEM;
 
-  if (cptr == NULL || iptr == NULL)
+  /* at least double size */
+  n = size > mb->size ? size : mb->size; 
+  total = (((long long)mb->size + n) / CR_MULTIBULK_SIZE + 1) * CR_MULTIBULK_SIZE;
+  if (total > max)
+    total = max;
+
+  DEBUG("allocate %lld elements more, total %lld (%lu bytes)", 
+        total - mb->size, total, (unsigned long)(total * (sizeof(char *)+sizeof(int))));
+  CR_STATS_BUFFER(mb);
+  cptr = cr_realloc(mb->bulks, total * sizeof(char *));
+  if (cptr != NULL)
+    mb->bulks = cptr;
+  lptr = cr_realloc(mb->lens, total * sizeof(int));
+  if (lptr != NULL)
+    mb->lens = lptr;
+
+  if (cptr == NULL || lptr == NULL)
     return CREDIS_ERR_NOMEM;
 
-  mb->bulks = cptr;
-  mb->idxs = iptr;
-  mb->size = total;
+  mb->size = (int)total;
   return 0;
 }
 
@@ -228,6 +1038,7 @@ static int cr_splitstrtomultibulk(REDIS rhnd, char *str, const char token)
   if (str != NULL) {
     rhnd->reply.multibulk.bulks[i++] = str;
     while ((str = strchr(str, token))) {
+      rhnd->reply.multibulk.lens[i-1] = str - rhnd->reply.multibulk.bulks[i-1];
       *str++ = '\0';
       if (i >= rhnd->reply.multibulk.size)
         if (cr_morebulk(&(rhnd->reply.multibulk), 1))
@@ -235,122 +1046,382 @@ static int cr_splitstrtomultibulk(REDIS rhnd, char *str, const char token)
       
       rhnd->reply.multibulk.bulks[i++] = str;
     }
+    rhnd->reply.multibulk.lens[i-1] = strlen(rhnd->reply.multibulk.bulks[i-1]);
   }
   rhnd->reply.multibulk.len = i;  
   return 0;
 }
 
-/* Appends a printf style formatted to the end of buffer `buf'. If available
- * memory in buffer is not enough to hold `str' more memory is allocated to 
- * the buffer. 
+static const char cr_digitpairs[] = 
+  "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+  "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Writes the decimal representation of `val' to `str', which must be able
+ * to hold at least CR_INT_STRING_SIZE bytes. The string is zero-terminated.
+ * Digits are produced two at a time, from the end of a temporary string.
+ * Returns number of characters written, excluding the terminating zero. */
+static int cr_itoa(char *str, long long val)
+{
+  char tmp[CR_INT_STRING_SIZE];
+  unsigned long long u = val < 0 ? 0ULL - val : (unsigned long long)val;
+  const char *pair;
+  int i = CR_INT_STRING_SIZE, len;
+
+  while (u >= 100) {
+    pair = cr_digitpairs + (u % 100) * 2;
+    u /= 100;
+    tmp[--i] = pair[1];
+    tmp[--i] = pair[0];
+  }
+  if (u >= 10) {
+    tmp[--i] = cr_digitpairs[u * 2 + 1];
+    tmp[--i] = cr_digitpairs[u * 2];
+  }
+  else
+    tmp[--i] = '0' + u;
+  if (val < 0)
+    tmp[--i] = '-';
+
+  len = CR_INT_STRING_SIZE - i;
+  memcpy(str, tmp + i, len);
+  str[len] = '\0';
+
+  return len;
+}
+
+/* Writes `val' to `str' with full precision, integral values such as most 
+ * scores without going through snprintf(). `str' must be able to hold at 
+ * least CR_DOUBLE_STRING_SIZE bytes.
+ * Returns number of characters written, excluding the terminating zero. */
+static int cr_dtoa(char *str, double val)
+{
+  /* integers up to 2^53 are exact in a double */
+  if (val >= -9007199254740992.0 && val <= 9007199254740992.0 && 
+      val == (double)(long long)val)
+    return cr_itoa(str, (long long)val);
+
+  return snprintf(str, CR_DOUBLE_STRING_SIZE, "%.17g", val);
+}
+
+/* Parses the decimal integer at the start of `str', up to the first 
+ * character that is not a digit. Unlike atoi() white space is not skipped 
+ * and the value is not truncated to an int.
+ * Returns value parsed, 0 if `str' does not start with a number */
+static long long cr_strtoll(const char *str)
+{
+  unsigned long long u = 0;
+  unsigned int digit;
+  int neg = *str == '-';
+
+  str += neg || *str == '+';
+  while ((digit = (unsigned char)*str - '0') < 10) {
+    u = u * 10 + digit;
+    str++;
+  }
+
+  return (long long)(neg ? 0ULL - u : u);
+}
+
+/* Parses zero-terminated decimal number `str' like strtod(). Numbers of at 
+ * most 15 digits written without exponent, as scores usually are, are 
+ * exactly representable with their digits as an integer, and so is the 
+ * power of ten they are divided by, which gives a correctly rounded result. 
+ * Anything else is left to strtod().
+ * Returns value parsed */
+static double cr_strtod(const char *str)
+{
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 
+    1e13, 1e14, 1e15};
+  const char *ptr = str;
+  unsigned long long m = 0;
+  unsigned int digit;
+  int digits = 0, decimals = 0, neg = *ptr == '-';
+
+  ptr += neg;
+  for (; (digit = (unsigned char)*ptr - '0') < 10; ptr++, digits++)
+    m = m * 10 + digit;
+  if (*ptr == '.')
+    for (ptr++; (digit = (unsigned char)*ptr - '0') < 10; ptr++, digits++, decimals++)
+      m = m * 10 + digit;
+
+  if (*ptr != '\0' || digits == 0 || digits > 15)
+    return strtod(str, NULL);
+
+  return neg ? -(m / pow10[decimals]) : m / pow10[decimals];
+}
+
+/* Makes sure that at least `size' bytes are available at the end of buffer
+ * `buf', allocating more memory if needed.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_reserve(cr_buffer *buf, int size)
+{
+  int avail = buf->size - buf->len;
+
+  if (size > avail)
+    if (cr_moremem(buf, size - avail))
+      return CREDIS_ERR_NOMEM;
+
+  return 0;
+}
+
+/* Writes `prefix' followed by the decimal number `num' and "\r\n" to the end 
+ * of buffer `buf'. Caller must make sure there is enough memory available, 
+ * i.e. at least CR_INT_STRING_SIZE + 3 bytes. */
+static void cr_appendcount(cr_buffer *buf, char prefix, int num)
+{
+  buf->data[buf->len++] = prefix;
+  buf->len += cr_itoa(buf->data + buf->len, num);
+  buf->data[buf->len++] = '\r';
+  buf->data[buf->len++] = '\n';
+}
+
+/* Appends the header of a command in the unified request protocol, i.e. 
+ * the number of arguments `argc' that will follow, to the end of buffer 
+ * `buf'. 
  * Returns:
  *   0  on success
  *  <0  on error, i.e. more memory not available */
-__attribute__ ((format(printf,2,3)))
-static int cr_appendstrf(cr_buffer *buf, const char *format, ...)
+static int cr_appendheader(cr_buffer *buf, int argc)
 {
-  int rc, avail;
-  va_list ap;
+  if (cr_reserve(buf, CR_INT_STRING_SIZE + 3))
+    return CREDIS_ERR_NOMEM;
 
-  avail = buf->size - buf->len;
+  cr_appendcount(buf, CR_MULTIBULK, argc);
 
-  va_start(ap, format);
-  rc = vsnprintf(buf->data + buf->len, avail, format, ap);
-  va_end(ap);
+  return 0;
+}
 
-  if (rc < 0) {
-#ifdef WIN32
-    rc = avail * 2;
-#else
-    return -1;
-#endif
+/* Appends the header of a command with `argc' arguments, including the name 
+ * of command `cmd', followed by the name to the end of buffer `buf'. Both 
+ * are copied from the prefix prepared in the command table, the number of 
+ * arguments is only written when it differs from the usual one.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_appendcommand(cr_buffer *buf, const cr_command *cmd, int argc)
+{
+  int off = 0;
+
+  if (cr_reserve(buf, cmd->prefixlen + CR_INT_STRING_SIZE + 3))
+    return CREDIS_ERR_NOMEM;
+
+  if (argc != cmd->argc) {
+    cr_appendcount(buf, CR_MULTIBULK, argc);
+    off = cmd->nameoff;
   }
+  memcpy(buf->data + buf->len, cmd->prefix + off, cmd->prefixlen - off);
+  buf->len += cmd->prefixlen - off;
 
-  while (rc >= avail) {
-    if (cr_moremem(buf, rc - avail + 1))
-      return CREDIS_ERR_NOMEM;
+  return 0;
+}
 
-    va_start(ap, format);
-    rc = vsnprintf(buf->data + buf->len, buf->size - buf->len, format, ap);
-    va_end(ap);
+/* Appends one argument `arg' of `len' bytes, as a bulk in the unified 
+ * request protocol, to the end of buffer `buf'. `arg' is binary safe.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_appendarg(cr_buffer *buf, const char *arg, int len)
+{
+  if (cr_reserve(buf, len + CR_INT_STRING_SIZE + 5))
+    return CREDIS_ERR_NOMEM;
 
-    if (rc < 0) {
-#ifdef WIN32
-      rc = avail * 2;
-#else
-      return -1;
-#endif
-    }
-  }
-  buf->len += rc;
+  cr_appendcount(buf, CR_BULK, len);
+  memcpy(buf->data + buf->len, arg, len);
+  buf->len += len;
+  buf->data[buf->len++] = '\r';
+  buf->data[buf->len++] = '\n';
 
   return 0;
 }
 
-/* Appends a zero-terminated string `str' to the end of buffer `buf'. If 
- * available memory in buffer is not enough to hold `str' more memory is 
- * allocated to the buffer. If `space' is not 0 `str' is padded with a space.
+/* Appends a command with `argc' arguments stored in `argv' to the end of 
+ * buffer `buf' using the unified request protocol. The length of each 
+ * argument is given by `argvlen', if it is NULL all arguments are expected
+ * to be zero-terminated strings. Memory required for the complete command
+ * is calculated and allocated upfront.
  * Returns:
  *   0  on success
  *  <0  on error, i.e. more memory not available */
-static int cr_appendstr(cr_buffer *buf, const char *str, int space)
+static int cr_appendargv(cr_buffer *buf, int argc, const char **argv, const int *argvlen)
 {
-  int avail, len, reqd;
+  long long total = CR_INT_STRING_SIZE + 3;
+  int i, len;
 
-  len = strlen(str);
-  avail = buf->size - buf->len;
+  for (i = 0; i < argc; i++)
+    total += (long long)(argvlen ? argvlen[i] : strlen(argv[i])) + CR_INT_STRING_SIZE + 5;
+
+  /* a message must fit in the buffer, whose size is an int */
+  if (total > INT_MAX - buf->len || cr_reserve(buf, (int)total))
+    return CREDIS_ERR_NOMEM;
+
+  cr_appendcount(buf, CR_MULTIBULK, argc);
+  for (i = 0; i < argc; i++) {
+    len = argvlen ? argvlen[i] : strlen(argv[i]);
+    cr_appendcount(buf, CR_BULK, len);
+    memcpy(buf->data + buf->len, argv[i], len);
+    buf->len += len;
+    buf->data[buf->len++] = '\r';
+    buf->data[buf->len++] = '\n';
+  }
+
+  return 0;
+}
+
+/* Like cr_appendargv() but appends the command to handle's message buffer 
+ * with arguments of at least CR_ZEROCOPY_SIZE bytes left in caller's memory, 
+ * only their headers are staged in buffer. The message is then sent with 
+ * cr_sendmessage(). Caller's memory is only guaranteed to be valid for the 
+ * duration of the call, so in pipeline mode all arguments are copied.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_appendargvzerocopy(REDIS rhnd, int argc, const char **argv, 
+                                 const int *argvlen)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  cr_zerocopyref *ref;
+  long long total = CR_INT_STRING_SIZE + 3, bytes = 0, size;
+  int i, len, refs = 0;
+  void *ptr;
+
+  if (rhnd->pipeline.active)
+    return cr_appendargv(buf, argc, argv, argvlen);
+
+  for (i = 0; i < argc; i++) {
+    size = argvlen ? argvlen[i] : strlen(argv[i]);
+    if (size >= CR_ZEROCOPY_SIZE) {
+      refs++;
+      bytes += size;
+    }
+    else
+      total += size;
+    total += CR_INT_STRING_SIZE + 5;
+  }
 
-  /* required memory: len, terminating zero and possibly a space */
-  reqd = len + 1;
-  if (space)
-    reqd++;
+  /* lengths of staged and referenced data are kept as int */
+  if (total > INT_MAX - buf->len || bytes > INT_MAX - rhnd->zerocopy.bytes ||
+      cr_reserve(buf, (int)total))
+    return CREDIS_ERR_NOMEM;
 
-  if (reqd > avail)
-    if (cr_moremem(buf, reqd - avail + 1))
+  if (rhnd->zerocopy.len + refs > rhnd->zerocopy.size) {
+    if ((ptr = cr_realloc(rhnd->zerocopy.refs, sizeof(cr_zerocopyref) * 
+                          (rhnd->zerocopy.len + refs))) == NULL)
       return CREDIS_ERR_NOMEM;
+    rhnd->zerocopy.refs = (cr_zerocopyref *)ptr;
+    rhnd->zerocopy.size = rhnd->zerocopy.len + refs;
+  }
+
+  cr_appendcount(buf, CR_MULTIBULK, argc);
+  for (i = 0; i < argc; i++) {
+    len = argvlen ? argvlen[i] : strlen(argv[i]);
+    cr_appendcount(buf, CR_BULK, len);
+    if (len >= CR_ZEROCOPY_SIZE) {
+      ref = &(rhnd->zerocopy.refs[rhnd->zerocopy.len++]);
+      ref->data = argv[i];
+      ref->len = len;
+      ref->pos = buf->len;
+      rhnd->zerocopy.bytes += len;
+    }
+    else {
+      memcpy(buf->data + buf->len, argv[i], len);
+      buf->len += len;
+    }
+    buf->data[buf->len++] = '\r';
+    buf->data[buf->len++] = '\n';
+  }
 
-  if (space)
-    buf->data[buf->len++] = ' ';
+  return 0;
+}
 
-  memcpy(buf->data + buf->len, str, len);
-  buf->len += len;
+/* Appends argument `arg' of `len' bytes to handle's message buffer, leaving 
+ * it in caller's memory if large. Refer to cr_appendargvzerocopy().
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_appendargzerocopy(REDIS rhnd, const char *arg, int len)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  cr_zerocopyref *ref;
+  void *ptr;
+
+  if (rhnd->pipeline.active || len < CR_ZEROCOPY_SIZE)
+    return cr_appendarg(buf, arg, len);
+
+  if (cr_reserve(buf, CR_INT_STRING_SIZE + 5))
+    return CREDIS_ERR_NOMEM;
+
+  if (rhnd->zerocopy.len == rhnd->zerocopy.size) {
+    if ((ptr = cr_realloc(rhnd->zerocopy.refs, sizeof(cr_zerocopyref) * 
+                          (rhnd->zerocopy.size + 1))) == NULL)
+      return CREDIS_ERR_NOMEM;
+    rhnd->zerocopy.refs = (cr_zerocopyref *)ptr;
+    rhnd->zerocopy.size++;
+  }
 
-  buf->data[buf->len] = '\0';
+  cr_appendcount(buf, CR_BULK, len);
+  ref = &(rhnd->zerocopy.refs[rhnd->zerocopy.len++]);
+  ref->data = arg;
+  ref->len = len;
+  ref->pos = buf->len;
+  rhnd->zerocopy.bytes += len;
+  buf->data[buf->len++] = '\r';
+  buf->data[buf->len++] = '\n';
 
   return 0;
 }
 
-/* Appends an array of strings `strv' to the end of buffer `buf', each 
- * separated with a space. If `newline' is not 0 "\r\n" is added last 
- * to buffer.
+/* Appends an array of zero-terminated strings `strv' as arguments to the end
+ * of buffer `buf'. Refer to cr_appendarg().
  * Returns:
  *   0  on success
  *  <0  on error, i.e. more memory not available */
-static int cr_appendstrarray(cr_buffer *buf, int strc, const char **strv, int newline)
+static int cr_appendstrarray(cr_buffer *buf, int strc, const char **strv)
 {
   int rc, i;
 
   for (i = 0; i < strc; i++) {
-    if ((rc = cr_appendstr(buf, strv[i], 1)) != 0)
-      return rc;
-  }
-
-  if (newline) {
-    if ((rc = cr_appendstr(buf, "\r\n", 0)) != 0)
+    if ((rc = cr_appendarg(buf, strv[i], strlen(strv[i]))) != 0)
       return rc;
   }
 
   return 0;
 }
 
-/* Helper function for select that waits for `timeout' milliseconds 
- * for `fd' to become readable (`readable' == 1) or writable.
+#ifdef WIN32
+#define cr_wouldblock() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define cr_interrupted() (WSAGetLastError() == WSAEINTR)
+#else
+#define cr_wouldblock() (errno == EAGAIN || errno == EWOULDBLOCK)
+#define cr_interrupted() (errno == EINTR)
+#endif
+
+/* Returns current time in milliseconds, from an arbitrary starting point */
+static long cr_msecs(void)
+{
+#ifdef WIN32
+  return (long)GetTickCount();
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((long)tv.tv_sec)*1000 + tv.tv_usec/1000;
+#endif
+}
+
+/* Helper function that waits for `timeout' milliseconds for `fd' to become 
+ * readable (`readable' == 1) or writable. Uses poll() which, unlike select(),
+ * is not limited to file descriptors below FD_SETSIZE.
  * Returns:
  *  >0  `fd' became readable or writable
  *   0  timeout 
  *  -1  on error */
 int cr_select(int fd, int timeout, int readable)
 {
+#ifdef WIN32
   struct timeval tv;
   fd_set fds;
 
@@ -364,1731 +1435,6496 @@ int cr_select(int fd, int timeout, int readable)
     return select(fd+1, &fds, NULL, NULL, &tv);    
 
   return select(fd+1, NULL, &fds, NULL, &tv);
+#else
+  struct pollfd pfd;
+  long start = cr_msecs();
+  int rc, remaining = timeout;
+
+  pfd.fd = fd;
+  pfd.events = (readable == 1) ? POLLIN : POLLOUT;
+  pfd.revents = 0;
+
+  /* an interrupted wait is resumed for the time left */
+  while ((rc = poll(&pfd, 1, remaining)) < 0 && cr_interrupted())
+    if (timeout >= 0 && (remaining = timeout - (cr_msecs() - start)) <= 0)
+      return 0;
+
+  return rc;
+#endif
 }
 #define cr_selectreadable(fd, timeout) cr_select(fd, timeout, 1)
 #define cr_selectwritable(fd, timeout) cr_select(fd, timeout, 0)
 
-/* Receives at most `size' bytes from socket `fd' to `buf'. Times out after 
- * `msecs' milliseconds if no data has yet arrived.
+/* Receives at most `size' bytes from handle's socket to `buf'. Times out 
+ * after handle's timeout if no data has yet arrived. The socket is 
+ * non-blocking, so receiving is tried first and only if no data is available
+ * is there a wait for it to arrive.
  * Returns:
  *  >0  number of read bytes on success
  *   0  server closed connection
  *  -1  on error
  *  -2  on timeout */
-static int cr_receivedata(int fd, unsigned int msecs, char *buf, int size)
+static int cr_receivedata(REDIS rhnd, char *buf, int size)
 {
-  int rc = cr_selectreadable(fd, msecs);
+  long start = 0;
+  int rc, waited = 0, remaining = rhnd->timeout;
 
-  if (rc > 0)
-    return recv(fd, buf, size, 0);
-  else if (rc == 0)
-    return -2;
-  else
-    return -1;  
+  while (1) {
+#ifndef WIN32
+    CR_STATS(rhnd, recv_calls, 1);
+    if ((rc = recv(rhnd->fd, buf, size, 0)) >= 0) {
+      CR_STATS(rhnd, bytes_received, rc);
+      return rc;
+    }
+    if (!cr_wouldblock() && !cr_interrupted())
+      return -1;
+#endif
+
+    /* socket may turn out not to be readable after all, the wait is then 
+     * resumed for the time left */
+    if (!waited) {
+      start = cr_msecs();
+      waited = 1;
+    }
+    else if ((remaining = rhnd->timeout - (cr_msecs() - start)) <= 0) {
+      CR_STATS(rhnd, timeouts, 1);
+      return -2;
+    }
+
+    rc = cr_selectreadable(rhnd->fd, remaining);
+
+    if (rc == 0) {
+      CR_STATS(rhnd, timeouts, 1);
+      return -2;
+    }
+    else if (rc < 0)
+      return -1;
+
+#ifdef WIN32
+    CR_STATS(rhnd, recv_calls, 1);
+    if ((rc = recv(rhnd->fd, buf, size, 0)) >= 0) {
+      CR_STATS(rhnd, bytes_received, rc);
+      return rc;
+    }
+    if (!cr_wouldblock() && !cr_interrupted())
+      return -1;
+#endif
+  }
 }
 
-/* Sends `size' bytes from `buf' to socket `fd' and times out after `msecs' 
- * milliseconds if not all data has been sent. 
+/* Sends `size' bytes from `buf' to handle's socket and times out after 
+ * handle's timeout if not all data has been sent. Sending is tried first and 
+ * only when the socket's send buffer is full is there a wait for it to 
+ * become writable.
  * Returns:
  *  >0  number of bytes sent; if less than `size' it means that timeout occurred
  *  -1  on error */
-static int cr_senddata(int fd, unsigned int msecs, char *buf, int size)
+static int cr_senddata(REDIS rhnd, char *buf, int size)
 {
-  fd_set fds;
-  struct timeval tv;
-  int rc, sent=0;
-  
-  /* NOTE: On Linux, select() modifies timeout to reflect the amount 
-   * of time not slept, on other systems it is likely not the same */
-  tv.tv_sec = msecs/1000;
-  tv.tv_usec = (msecs%1000)*1000;
+  long start = 0;
+  int rc, sent = 0, waited = 0, remaining = rhnd->timeout;
 
   while (sent < size) {
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
+#ifndef WIN32
+    CR_STATS(rhnd, send_calls, 1);
+    if ((rc = send(rhnd->fd, buf+sent, size-sent, CR_SENDFLAGS)) >= 0) {
+      CR_STATS(rhnd, bytes_sent, rc);
+      sent += rc;
+      continue;
+    }
+    if (!cr_wouldblock())
+      return -1;
+#endif
+
+    /* time left is only kept track of when waiting is needed at all */
+    if (!waited) {
+      start = cr_msecs();
+      waited = 1;
+    }
+    else if ((remaining = rhnd->timeout - (cr_msecs() - start)) <= 0) {
+      CR_STATS(rhnd, timeouts, 1);
+      break;
+    }
 
-    rc = select(fd+1, NULL, &fds, NULL, &tv);
+    rc = cr_selectwritable(rhnd->fd, remaining);
 
-    if (rc > 0) {
-      rc = send(fd, buf+sent, size-sent, 0);
-      if (rc < 0)
-        return -1;
+    if (rc == 0) { /* timeout */
+      CR_STATS(rhnd, timeouts, 1);
+      break;
+    }
+    else if (rc < 0)
+      return -1;
+
+#ifdef WIN32
+    CR_STATS(rhnd, send_calls, 1);
+    if ((rc = send(rhnd->fd, buf+sent, size-sent, CR_SENDFLAGS)) < 0)
+      return -1;
+    CR_STATS(rhnd, bytes_sent, rc);
+    sent += rc;
+#endif
+  }
+
+  return sent;
+}
+
+#ifdef WIN32
+typedef WSABUF cr_iovec;
+#define cr_setiovec(iov, ptr, n) ((iov)->buf = (CHAR *)(ptr), (iov)->len = (ULONG)(n))
+#else
+typedef struct iovec cr_iovec;
+#define cr_setiovec(iov, ptr, n) ((iov)->iov_base = (void *)(ptr), (iov)->iov_len = (n))
+#endif
+
+/* Looks up segment `k' of message, even segments are parts of message buffer
+ * and odd segments are arguments referenced by cr_appendargvzerocopy().
+ * Returns:
+ *   length of segment, its start is stored in `ptr' */
+static int cr_messagesegment(REDIS rhnd, int k, const char **ptr)
+{
+  cr_zerocopyref *refs = rhnd->zerocopy.refs;
+  int start, end;
+
+  if (k % 2) {
+    *ptr = refs[k/2].data;
+    return refs[k/2].len;
+  }
+
+  start = (k == 0) ? 0 : refs[k/2-1].pos;
+  end = (k/2 < rhnd->zerocopy.len) ? refs[k/2].pos : rhnd->buf.len;
+  *ptr = rhnd->buf.data + start;
+  return end - start;
+}
+
+/* Sends up to CR_IOV_MAX segments of message with a single system call, 
+ * starting at offset `*off' of segment `*k'. Position is advanced by the 
+ * number of bytes sent.
+ * Returns:
+ *  >=0  number of bytes sent
+ *   -1  on error */
+static int cr_sendsegments(REDIS rhnd, int *k, int *off)
+{
+  cr_iovec iov[CR_IOV_MAX];
+  const char *ptr;
+  int i, len, rc, segments = 2 * rhnd->zerocopy.len + 1;
+#ifdef WIN32
+  DWORD sent;
+#endif
+
+  for (i = 0; i < CR_IOV_MAX && *k + i < segments; i++) {
+    len = cr_messagesegment(rhnd, *k + i, &ptr);
+    if (i == 0)
+      cr_setiovec(&iov[i], ptr + *off, len - *off);
+    else
+      cr_setiovec(&iov[i], ptr, len);
+  }
+
+  CR_STATS(rhnd, send_calls, 1);
+#ifdef WIN32
+  if (WSASend(rhnd->fd, iov, i, &sent, 0, NULL, NULL) != 0)
+    return -1;
+  rc = (int)sent;
+#else
+  struct msghdr msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = i;
+  if ((rc = sendmsg(rhnd->fd, &msg, CR_SENDFLAGS)) < 0)
+    return -1;
+#endif
+  CR_STATS(rhnd, bytes_sent, rc);
+
+  for (i = rc; i > 0; ) {
+    len = cr_messagesegment(rhnd, *k, &ptr) - *off;
+    if (i < len) {
+      *off += i;
+      break;
+    }
+    i -= len;
+    (*k)++;
+    *off = 0;
+  }
+
+  return rc;
+}
+
+/* Sends message in handle's message buffer together with arguments it 
+ * references, a total of `size' bytes, using scatter-gather I/O. Times out
+ * like cr_senddata().
+ * Returns:
+ *  >0  number of bytes sent; if less than `size' it means that timeout occurred
+ *  -1  on error */
+static int cr_sendmessage(REDIS rhnd, int size)
+{
+  long start = 0;
+  int rc, k = 0, off = 0, sent = 0, waited = 0, remaining = rhnd->timeout;
+
+  if (rhnd->zerocopy.len == 0)
+    return cr_senddata(rhnd, rhnd->buf.data, size);
+
+  while (sent < size) {
+#ifndef WIN32
+    if ((rc = cr_sendsegments(rhnd, &k, &off)) >= 0) {
       sent += rc;
+      continue;
+    }
+    if (!cr_wouldblock())
+      return -1;
+#endif
+
+    if (!waited) {
+      start = cr_msecs();
+      waited = 1;
     }
-    else if (rc == 0) /* timeout */
+    else if ((remaining = rhnd->timeout - (cr_msecs() - start)) <= 0) {
+      CR_STATS(rhnd, timeouts, 1);
       break;
-    else
-      return -1;  
+    }
+
+    rc = cr_selectwritable(rhnd->fd, remaining);
+
+    if (rc == 0) { /* timeout */
+      CR_STATS(rhnd, timeouts, 1);
+      break;
+    }
+    else if (rc < 0)
+      return -1;
+
+#ifdef WIN32
+    if ((rc = cr_sendsegments(rhnd, &k, &off)) < 0)
+      return -1;
+    sent += rc;
+#endif
   }
 
   return sent;
 }
 
-/* Buffered read line, returns pointer to zero-terminated string 
- * and length of that string. `start' specifies from which byte
- * to start looking for "\r\n".
+/* Receives more data to buffer, first making sure there is room for at 
+ * least `more' bytes.
  * Returns:
- *  >0  length of string to which pointer `line' refers. `idx' is
- *      an optional pointer for returning start index of line with
- *      respect to buffer.
+ *  >0  number of received bytes
  *   0  connection to Redis server was closed
- *  -1  on error, i.e. a string is not available */
-static int cr_readln(REDIS rhnd, int start, char **line, int *idx)
+ *  <0  on error or timeout */
+static int cr_receivemore(REDIS rhnd, int more)
 {
   cr_buffer *buf = &(rhnd->buf);
-  char *nl;
-  int rc, len, avail, more;
+  int rc, avail;
+
+  avail = buf->size - buf->len;
+  if (avail < CR_BUFFER_WATERMARK || avail < more) {
+    DEBUG("available buffer memory is low, get more memory");
+    if (cr_moremem(buf, more>0?more:1))
+      return CREDIS_ERR_NOMEM;
 
-  /* do we need more data before we expect to find "\r\n"? */
-  if ((more = buf->idx + start + 2 - buf->len) < 0)
-    more = 0;
-  
-  while (more > 0 || 
-         (nl = cr_findnl(buf->data + buf->idx + start, buf->len - (buf->idx + start))) == NULL) {
     avail = buf->size - buf->len;
-    if (avail < CR_BUFFER_WATERMARK || avail < more) {
-      DEBUG("available buffer memory is low, get more memory");
-      if (cr_moremem(buf, more>0?more:1))
-        return CREDIS_ERR_NOMEM;
+  }
 
-      avail = buf->size - buf->len;
-    }
+  rc = cr_receivedata(rhnd, buf->data + buf->len, avail);
+  if (rc > 0) {
+    DEBUG("received %d bytes: %s", rc, buf->data + buf->len);
+    buf->len += rc;
+  }
 
-    rc = cr_receivedata(rhnd->fd, rhnd->timeout, buf->data + buf->len, avail);
-    if (rc > 0) {
-      DEBUG("received %d bytes: %s", rc, buf->data + buf->len);
-      buf->len += rc;
-    }
-    else if (rc == 0)
-      return 0; /* EOF reached, connection terminated */
-    else 
-      return -1; /* error */
+  return rc;
+}
 
-    /* do we need more data before we expect to find "\r\n"? */
-    if ((more = buf->idx + start + 2 - buf->len) < 0)
-      more = 0;
-  }
+static void cr_parsereset(cr_parser *p)
+{
+  p->state = CR_PARSE_LINE;
+  p->pos = 0;
+  p->scan = 0;
+  p->need = 0;
+  p->depth = 0;
+}
 
-  *nl = '\0'; /* zero terminate */
+/* Returns index of a new node or CREDIS_ERR_NOMEM */
+static int cr_parsenewnode(cr_parser *p)
+{
+  cr_node *nptr;
+  REDIS_REPLY *vptr;
+  int total;
 
-  *line = buf->data + buf->idx;
-  if (idx)
-    *idx = buf->idx;
-  len = nl - *line;
-  buf->idx = (nl - buf->data) + 2; /* skip "\r\n" */
+  if (p->len == p->size) {
+    total = p->size > 0 ? p->size * 2 : CR_MULTIBULK_SIZE;
 
-  DEBUG("size=%d, len=%d, idx=%d, start=%d, line=%s", 
-        buf->size, buf->len, buf->idx, start, *line);
+    DEBUG("allocate %d nodes", total);
+    CR_STATS_BUFFER(p);
+    nptr = cr_realloc(p->nodes, total * sizeof(cr_node));
+    if (nptr != NULL)
+      p->nodes = nptr;
+    vptr = cr_realloc(p->views, total * sizeof(REDIS_REPLY));
+    if (vptr != NULL)
+      p->views = vptr;
 
-  return len;
+    if (nptr == NULL || vptr == NULL)
+      return CREDIS_ERR_NOMEM;
+
+    p->size = total;
+  }
+
+  return p->len++;
 }
 
-static int cr_receivemultibulk(REDIS rhnd, char *line) 
+/* Parses a reply held in `data' of `len' bytes. Parsing stops when all 
+ * available bytes have been consumed and is resumed, where it stopped, by 
+ * a new call as more data has been received. Lines are zero terminated in 
+ * place and bulk data is skipped, using its known length, rather than 
+ * scanned. Multi-bulk replies may be nested.
+ * Returns:
+ *   1  a complete reply has been parsed, see cr_setreply()
+ *   0  more data is needed, at least `need' bytes
+ *  <0  on error, i.e. protocol error or more memory not available */
+static int cr_parse(cr_parser *p, char *data, int len)
 {
-  int bnum, blen, i, rc=0, idx;
-  char type;
+  cr_node *node;
+  char *nl;
+  int n, scan;
+
+  /* nodes of previous reply are discarded first when starting over */
+  if (p->pos == 0)
+    p->len = 0;
+
+  while (1) {
+    if (p->state == CR_PARSE_BULK) {
+      node = &(p->nodes[p->len - 1]);
+      if (len - p->pos < node->len + 2) {
+        p->need = node->len + 2 - (len - p->pos);
+        return 0;
+      }
+      if (data[p->pos + node->len] != '\r' || data[p->pos + node->len + 1] != '\n')
+        return CREDIS_ERR_PROTOCOL;
+
+      data[p->pos + node->len] = '\0'; /* zero terminate */
+      node->idx = p->pos;
+      p->pos += node->len + 2;
+      /* verbatim string starts with its format, e.g. "txt:", skipped */
+      if (node->resp == CR_VERBATIM && node->len >= 4) {
+        node->idx += 4;
+        node->len -= 4;
+      }
+      p->state = CR_PARSE_LINE;
+    }
+    else {
+      /* continue where previous look-up stopped instead of starting over */
+      scan = p->scan > p->pos ? p->scan : p->pos;
+      if ((nl = cr_findnl(data + scan, len - scan)) == NULL) {
+        /* last byte might be the '\r' of a "\r\n" not completely received */
+        p->scan = len > p->pos ? len - 1 : p->pos;
+        p->need = 1;
+        return 0;
+      }
+      *nl = '\0'; /* zero terminate */
+
+      if ((n = cr_parsenewnode(p)) < 0)
+        return n;
+      node = &(p->nodes[n]);
+      node->type = node->resp = data[p->pos];
+      node->integer = 0;
+      node->idx = p->pos + 1;
+      node->len = nl - (data + node->idx);
+      node->next = n + 1;
+      p->pos = (nl - data) + 2; /* skip "\r\n" */
+
+      switch (node->resp) {
+      case CR_ERROR:
+      case CR_INLINE:
+        break;
+      case CR_INT:
+        node->integer = cr_strtoll(data + node->idx);
+        break;
+      case CR_BOOLEAN:
+        node->type = CR_INT;
+        node->integer = data[node->idx] == 't';
+        break;
+      case CR_DOUBLE:
+      case CR_BIGNUMBER:
+        node->type = CR_BULK; /* text of number is kept as bulk data */
+        break;
+      case CR_NULL:
+        node->type = CR_BULK;
+        node->idx = -1;
+        node->len = 0;
+        break;
+      case CR_VERBATIM:
+      case CR_BLOBERROR:
+        /* framed as bulk, a blob error is kept as an error line */
+        node->type = node->resp == CR_BLOBERROR ? CR_ERROR : CR_BULK;
+        /* fall through */
+      case CR_BULK:
+        if ((node->len = cr_strtoll(data + node->idx)) >= 0) {
+          p->state = CR_PARSE_BULK;
+          continue;
+        }
+        if (node->type != CR_BULK)
+          return CREDIS_ERR_PROTOCOL;
+        node->idx = -1; /* key didn't exist */
+        node->len = 0;
+        break;
+      case CR_MAP:
+      case CR_SET:
+      case CR_PUSH:
+        node->type = CR_MULTIBULK;
+        /* fall through */
+      case CR_MULTIBULK:
+        /* a map is a multi-bulk of alternating keys and values */
+        if ((node->len = cr_strtoll(data + node->idx) * (node->resp == CR_MAP ? 2 : 1)) > 0) {
+          if (p->depth == CR_PARSER_MAXDEPTH)
+            return CREDIS_ERR_PROTOCOL;
+          p->stack[p->depth].node = n;
+          p->stack[p->depth].remaining = node->len;
+          p->depth++;
+          continue;
+        }
+        node->idx = -1; /* no data or key didn't exist */
+        node->len = 0;
+        break;
+      default:
+        return CREDIS_ERR_PROTOCOL;
+      }
+    }
 
-  bnum = atoi(line);
+    /* an element is complete, which may in turn complete multi-bulks */
+    while (p->depth > 0 && --(p->stack[p->depth - 1].remaining) == 0) {
+      p->depth--;
+      p->nodes[p->stack[p->depth].node].next = p->len;
+    }
 
-  if (bnum == -1) {
-    rhnd->reply.multibulk.len = 0; /* no data or key didn't exist */
-    return 0;
-  }
-  else if (bnum > rhnd->reply.multibulk.size) {
-    DEBUG("available multibulk storage is low, get more memory");
-    if (cr_morebulk(&(rhnd->reply.multibulk), bnum - rhnd->reply.multibulk.size))
-      return CREDIS_ERR_NOMEM;
+    if (p->depth == 0)
+      return 1;
   }
+}
+
+/* Makes the reply parsed by cr_parse(), starting at current index of buffer, 
+ * available in the handle's reply structure and advances index past it. The
+ * parser is reset, but nodes are kept until parsing of next reply starts.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_setreply(REDIS rhnd)
+{
+  cr_parser *p = &(rhnd->parser);
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  char *base = rhnd->buf.data + rhnd->buf.idx;
+  cr_node *node = p->nodes;
+  int i, n;
 
-  for (i = 0; bnum > 0 && (rc = cr_readln(rhnd, 0, &line, &idx)) > 0; i++, bnum--) {
-    type = *(line++);
-    if (type == CR_BULK) {
-      blen = atoi(line);
-      if (blen == -1)
-        rhnd->reply.multibulk.idxs[i] = -1;
+  rhnd->reply.type = node->type;
+  rhnd->reply.base = base;
+
+  switch (node->type) {
+  case CR_ERROR:
+  case CR_INLINE:
+    rhnd->reply.line = base + node->idx;
+    break;
+  case CR_INT:
+    rhnd->reply.integer = node->integer;
+    break;
+  case CR_BULK:
+    rhnd->reply.bulk = node->idx < 0 ? NULL : base + node->idx;
+    rhnd->reply.bulklen = node->len;
+    break;
+  case CR_MULTIBULK:
+    if (node->len > mb->size) {
+      DEBUG("available multibulk storage is low, get more memory");
+      if (cr_morebulk(mb, node->len - mb->size))
+        return CREDIS_ERR_NOMEM;
+    }
+    /* nested multi-bulks are only available through cr_fillreply() */
+    for (i = 0, n = 1; i < node->len; i++, n = p->nodes[n].next) {
+      if (p->nodes[n].type == CR_MULTIBULK || p->nodes[n].idx < 0) {
+        mb->bulks[i] = NULL;
+        mb->lens[i] = 0;
+      }
       else {
-        if ((rc = cr_readln(rhnd, blen, &line, &idx)) != blen)
-          return CREDIS_ERR_PROTOCOL;
-        
-        rhnd->reply.multibulk.idxs[i] = idx;
+        mb->bulks[i] = base + p->nodes[n].idx;
+        mb->lens[i] = p->nodes[n].len;
       }
     }
-    else if (type == CR_INT) {
-      rhnd->reply.multibulk.idxs[i] = idx + 1;
+    mb->len = node->len;
+    break;
+  }
+
+  rhnd->buf.idx += p->pos;
+  cr_parsereset(p);
+
+  return 0;
+}
+
+static int cr_receivereply(REDIS rhnd, char recvtype) 
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc;
+
+  /* reset common send/receive buffer, unless it holds replies to pipelined
+   * commands or pushed pub/sub messages in which case already consumed data 
+   * is discarded */
+  if (rhnd->pipeline.pending > 0 || rhnd->pubsub.subscriptions > 0) {
+    buf->len -= buf->idx;
+    memmove(buf->data, buf->data + buf->idx, buf->len);
+  }
+  else {
+    buf->len = 0;
+    cr_parsereset(&(rhnd->parser));
+  }
+  buf->idx = 0;
+
+  /* parser state of a partially received reply is relative to index and 
+   * parsing of it resumes */
+  while (1) {
+    while ((rc = cr_parse(&(rhnd->parser), buf->data + buf->idx, buf->len - buf->idx)) == 0) {
+      if (cr_receivemore(rhnd, rhnd->parser.need) <= 0)
+        return rhnd->error = CREDIS_ERR_RECV;
     }
-    else
-      return CREDIS_ERR_PROTOCOL;
+
+    if (rc < 0 || (rc = cr_setreply(rhnd)) != 0)
+      return rhnd->error = rc;
+
+    /* RESP3 pushes, e.g. invalidation messages, may arrive between replies 
+     * and are skipped unless asked for, pub/sub messages and acks are pushes */
+    if (rhnd->parser.nodes[0].resp != CR_PUSH || recvtype == CR_PUSH ||
+        rhnd->pubsub.subscriptions > 0)
+      break;
+    DEBUG("skip pushed reply");
   }
-  
-  if (bnum != 0) {
-    DEBUG("bnum != 0, bnum=%d, rc=%d", bnum, rc);
+  if (recvtype == CR_PUSH)
+    recvtype = CR_MULTIBULK;
+
+  /* RESP3 has a single null type for both nil bulk and nil multi-bulk */
+  if (rhnd->parser.nodes[0].resp == CR_NULL && recvtype == CR_MULTIBULK) {
+    rhnd->reply.type = CR_MULTIBULK;
+    rhnd->reply.multibulk.len = 0;
+  }
+
+  if (rhnd->reply.type == CR_ERROR || 
+      (recvtype != CR_ANY && rhnd->reply.type != recvtype))
     return CREDIS_ERR_PROTOCOL;
+
+  return 0;
+}
+
+/* Returns CREDIS_REPLY_* type of reply received as type `resp' */
+static int cr_replytype(char resp)
+{
+  switch (resp) {
+  case CR_ERROR:
+  case CR_BLOBERROR:
+    return CREDIS_REPLY_ERROR;
+  case CR_INLINE:
+    return CREDIS_REPLY_STATUS;
+  case CR_INT:
+    return CREDIS_REPLY_INTEGER;
+  case CR_BULK:
+  case CR_VERBATIM:
+  case CR_BIGNUMBER:
+    return CREDIS_REPLY_BULK;
+  case CR_DOUBLE:
+    return CREDIS_REPLY_DOUBLE;
+  case CR_NULL:
+    return CREDIS_REPLY_NIL;
+  case CR_BOOLEAN:
+    return CREDIS_REPLY_BOOLEAN;
+  case CR_MAP:
+    return CREDIS_REPLY_MAP;
+  case CR_SET:
+    return CREDIS_REPLY_SET;
+  case CR_PUSH:
+    return CREDIS_REPLY_PUSH;
   }
+  return CREDIS_REPLY_MULTIBULK;
+}
 
-  rhnd->reply.multibulk.len = i;
-  for (i = 0; i < rhnd->reply.multibulk.len; i++) {
-    if (rhnd->reply.multibulk.idxs[i] > 0)
-      rhnd->reply.multibulk.bulks[i] = rhnd->buf.data + rhnd->reply.multibulk.idxs[i];
-    else
-      rhnd->reply.multibulk.bulks[i] = NULL;
+/* Fills `reply' with node `n' of the last received reply. Elements of a
+ * multi-bulk are stored in consecutive reply views, starting at `*next' */
+static void cr_fillnode(REDIS rhnd, REDIS_REPLY *reply, int n, int *next)
+{
+  cr_parser *p = &(rhnd->parser);
+  cr_node *node = &(p->nodes[n]);
+  int i;
+
+  memset(reply, 0, sizeof(REDIS_REPLY));
+  reply->type = cr_replytype(node->resp);
+
+  switch (node->type) {
+  case CR_ERROR:
+  case CR_INLINE:
+    reply->str = rhnd->reply.base + node->idx;
+    reply->len = node->len;
+    break;
+  case CR_INT:
+    reply->integer = reply->integer64 = node->integer;
+    break;
+  case CR_BULK:
+    reply->str = node->idx < 0 ? NULL : rhnd->reply.base + node->idx;
+    reply->len = node->len;
+    if (node->resp == CR_DOUBLE)
+      reply->number = cr_strtod(reply->str);
+    break;
+  case CR_MULTIBULK:
+    reply->elements = node->len;
+    if (node->len > 0) {
+      reply->element = p->views + *next;
+      *next += node->len;
+      for (i = 0, n++; i < node->len; i++, n = p->nodes[n].next)
+        cr_fillnode(rhnd, &(reply->element[i]), n, next);
+    }
+    break;
   }
+}
 
-  return 0;
+/* Fills public `reply' with the last received reply */
+static void cr_fillreply(REDIS rhnd, REDIS_REPLY *reply)
+{
+  int next = 0;
+
+  cr_fillnode(rhnd, reply, 0, &next);
+  if (rhnd->parser.nodes[0].type == CR_MULTIBULK) {
+    reply->elementv = rhnd->reply.multibulk.bulks;
+    reply->elementlenv = rhnd->reply.multibulk.lens;
+  }
+}
+
+static void cr_cachefree(cr_cache *cache);
+static void cr_detachedfree(cr_detached *dhnd);
+
+static void cr_delete(REDIS rhnd) 
+{
+  if (rhnd == NULL)
+    return;
+
+  cr_cachefree(rhnd->cache);
+  while (rhnd->spares.len > 0)
+    cr_detachedfree(rhnd->spares.v[--rhnd->spares.len]);
+  cr_arenafree(&(rhnd->pubsub.arena));
+  if (rhnd->pubsub.queue != NULL)
+    cr_free(rhnd->pubsub.queue);
+  if (rhnd->pubsub.out.data != NULL)
+    cr_free(rhnd->pubsub.out.data);
+  if (rhnd->zerocopy.refs != NULL)
+    cr_free(rhnd->zerocopy.refs);
+  if (rhnd->scripts.v != NULL)
+    cr_free(rhnd->scripts.v);
+  if (rhnd->reply.multibulk.bulks != NULL)
+    cr_free(rhnd->reply.multibulk.bulks);
+  if (rhnd->parser.nodes != NULL)
+    cr_free(rhnd->parser.nodes);
+  if (rhnd->parser.views != NULL)
+    cr_free(rhnd->parser.views);
+  if (rhnd->reply.multibulk.lens != NULL)
+    cr_free(rhnd->reply.multibulk.lens);
+  if (rhnd->buf.data != NULL)
+    cr_free(rhnd->buf.data);
+  if (rhnd->host != NULL)
+    cr_free(rhnd->host);
+  if (rhnd->ip != NULL)
+    cr_free(rhnd->ip);
+  if (rhnd->reconnect.password != NULL)
+    cr_free(rhnd->reconnect.password);
+  if (rhnd->reconnect.replay.data != NULL)
+    cr_free(rhnd->reconnect.replay.data);
+  cr_free(rhnd);
 }
 
-static int cr_receivebulk(REDIS rhnd, char *line) 
+/* Picks the entry of the command table to use for each command with the 
+ * server version of handle, once instead of for every command sent */
+static void cr_resolvecommands(REDIS rhnd)
 {
-  int blen;
+  int i;
 
-  blen = atoi(line);
-  if (blen == -1) {
-    rhnd->reply.bulk = NULL; /* key didn't exist */
-    return 0;
+  for (i = 0; i < CR_CMD_COUNT; i++)
+    rhnd->commands[i] = &cr_commands[rhnd->version.number >= cr_commands[i].since ? 
+                                     i : cr_commands[i].fallback];
+}
+
+REDIS cr_new(void) 
+{
+  REDIS rhnd;
+
+  if ((rhnd = cr_calloc(sizeof(cr_redis), 1)) == NULL ||
+      (rhnd->ip = cr_malloc(CR_ADDRESS_STRING_SIZE)) == NULL ||
+      (rhnd->buf.data = cr_malloc(cr_bufferbaseline)) == NULL ||
+      (rhnd->reply.multibulk.bulks = cr_malloc(sizeof(char *)*CR_MULTIBULK_SIZE)) == NULL ||
+      (rhnd->reply.multibulk.lens = cr_malloc(sizeof(int)*CR_MULTIBULK_SIZE)) == NULL) {
+    cr_delete(rhnd);
+    return NULL;   
   }
-  if (cr_readln(rhnd, blen, &line, NULL) >= 0) {
-    rhnd->reply.bulk = line;
-    return 0;
+
+  rhnd->buf.size = cr_bufferbaseline;
+  rhnd->reply.multibulk.size = CR_MULTIBULK_SIZE;
+  rhnd->batchsize = CR_BATCH_SIZE;
+  cr_resolvecommands(rhnd);
+
+  return rhnd;
+}
+
+/* Drops buffers back to their baseline sizes once a number of consecutive 
+ * commands have used less than a quarter of the message buffer, so that a 
+ * single large reply does not pin memory for the lifetime of the handle. 
+ * Message buffer holds last command and reply when called */
+static void cr_shrink(REDIS rhnd)
+{
+  cr_parser *p = &(rhnd->parser);
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  void *ptr;
+
+  if (cr_buffershrinkafter == 0 || rhnd->buf.size <= cr_bufferbaseline ||
+      rhnd->buf.len >= rhnd->buf.size / 4) {
+    rhnd->small = 0;
+    return;
+  }
+  if (++rhnd->small < cr_buffershrinkafter)
+    return;
+
+  DEBUG("shrinking buffer of %d bytes to %d bytes", rhnd->buf.size, cr_bufferbaseline);
+  rhnd->small = 0;
+  if ((ptr = cr_realloc(rhnd->buf.data, cr_bufferbaseline)) != NULL) {
+    rhnd->buf.data = (char *)ptr;
+    rhnd->buf.size = cr_bufferbaseline;
   }
 
-  return CREDIS_ERR_PROTOCOL;
+  /* failing to shrink an array leaves it larger than its size says */
+  if (mb->size > CR_MULTIBULK_SIZE) {
+    if ((ptr = cr_realloc(mb->bulks, sizeof(char *) * CR_MULTIBULK_SIZE)) != NULL)
+      mb->bulks = (char **)ptr;
+    if ((ptr = cr_realloc(mb->lens, sizeof(int) * CR_MULTIBULK_SIZE)) != NULL)
+      mb->lens = (int *)ptr;
+    mb->size = CR_MULTIBULK_SIZE;
+    mb->len = 0;
+  }
+
+  /* parser nodes are allocated again when needed */
+  if (p->size > CR_MULTIBULK_SIZE) {
+    cr_free(p->nodes);
+    cr_free(p->views);
+    p->nodes = NULL;
+    p->views = NULL;
+    p->size = 0;
+    p->len = 0;
+  }
 }
 
-static int cr_receiveinline(REDIS rhnd, char *line) 
+static void cr_detachedfree(cr_detached *dhnd)
 {
-  rhnd->reply.line = line;
-  return 0;
+  if (dhnd->data != NULL)
+    cr_free(dhnd->data);
+  if (dhnd->bulks != NULL)
+    cr_free(dhnd->bulks);
+  if (dhnd->lens != NULL)
+    cr_free(dhnd->lens);
+  if (dhnd->views != NULL)
+    cr_free(dhnd->views);
+  cr_free(dhnd);
 }
 
-static int cr_receiveint(REDIS rhnd, char *line) 
+/* Returns spare buffers for a handle to continue with, recycled if there are
+ * any or else newly allocated at baseline sizes. Reply views are made to 
+ * match the handle's parser nodes. Returns NULL if out of memory */
+static cr_detached * cr_detachedspare(REDIS rhnd)
 {
-  rhnd->reply.integer = atoi(line);
-  return 0;
+  cr_detached *dhnd;
+  void *ptr;
+
+  if (rhnd->spares.len > 0)
+    dhnd = rhnd->spares.v[--rhnd->spares.len];
+  else if ((dhnd = cr_calloc(sizeof(cr_detached), 1)) == NULL ||
+           (dhnd->data = cr_malloc(cr_bufferbaseline)) == NULL ||
+           (dhnd->bulks = cr_malloc(sizeof(char *) * CR_MULTIBULK_SIZE)) == NULL ||
+           (dhnd->lens = cr_malloc(sizeof(int) * CR_MULTIBULK_SIZE)) == NULL) {
+    if (dhnd != NULL)
+      cr_detachedfree(dhnd);
+    return NULL;
+  }
+  else {
+    dhnd->size = cr_bufferbaseline;
+    dhnd->bulksize = CR_MULTIBULK_SIZE;
+  }
+
+  if (dhnd->viewsize < rhnd->parser.size) {
+    if ((ptr = cr_realloc(dhnd->views, sizeof(REDIS_REPLY) * rhnd->parser.size)) == NULL) {
+      cr_detachedfree(dhnd);
+      return NULL;
+    }
+    dhnd->views = (REDIS_REPLY *)ptr;
+    dhnd->viewsize = rhnd->parser.size;
+  }
+
+  return dhnd;
 }
 
-static int cr_receiveerror(REDIS rhnd, char *line) 
+REDIS_DETACHED credis_detach(REDIS rhnd)
 {
-  rhnd->reply.line = line;
-  return CREDIS_ERR_PROTOCOL;
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  cr_detached *dhnd, spare;
+
+  /* buffer holds more than the last reply */
+  if (rhnd->pipeline.active || rhnd->pubsub.subscriptions > 0)
+    return NULL;
+
+  if ((dhnd = cr_detachedspare(rhnd)) == NULL)
+    return NULL;
+  spare = *dhnd;
+
+  dhnd->data = rhnd->buf.data;
+  dhnd->size = rhnd->buf.size;
+  dhnd->bulks = mb->bulks;
+  dhnd->lens = mb->lens;
+  dhnd->bulksize = mb->size;
+  dhnd->views = rhnd->parser.views;
+  dhnd->viewsize = rhnd->parser.size;
+
+  rhnd->buf.data = spare.data;
+  rhnd->buf.size = spare.size;
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
+  mb->bulks = spare.bulks;
+  mb->lens = spare.lens;
+  mb->size = spare.bulksize;
+  mb->len = 0;
+  /* views are never smaller than nodes, but may be larger */
+  rhnd->parser.views = spare.views;
+  rhnd->small = 0;
+
+  return dhnd;
 }
 
-static int cr_receivereply(REDIS rhnd, char recvtype) 
+void credis_detach_free(REDIS rhnd, REDIS_DETACHED dhnd)
+{
+  if (dhnd == NULL)
+    return;
+
+  if (rhnd != NULL && rhnd->spares.len < CR_DETACH_SPARES)
+    rhnd->spares.v[rhnd->spares.len++] = dhnd;
+  else
+    cr_detachedfree(dhnd);
+}
+
+static void cr_scandrain(REDIS rhnd);
+static void cr_cachewrite(REDIS rhnd, int start);
+static int cr_cacheget(REDIS rhnd, const char *key, const char *field, char **val);
+static int cr_receivestream(REDIS rhnd, credis_streamcallback callback, void *data);
+
+/* Prepare message buffer for a new command. In pipeline mode the command is
+ * appended to already queued commands, any partially prepared command is 
+ * discarded.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. replies to a flushed pipeline have not been read */
+static int cr_newcommand(REDIS rhnd)
+{
+  cr_scandrain(rhnd);
+
+  if (rhnd->pipeline.active) {
+    if (rhnd->pipeline.pending > 0)
+      return CREDIS_ERR_PIPELINE;
+    rhnd->buf.len = rhnd->pipeline.mark;
+  }
+  else {
+    cr_shrink(rhnd);
+    rhnd->buf.len = 0;
+  }
+  rhnd->zerocopy.len = 0;
+  rhnd->zerocopy.bytes = 0;
+
+  return 0;
+}
+
+/* Send message that has been prepared in message buffer prior to the call
+ * to this function. Wait and receive reply. */
+static int cr_sendandreceivemessage(REDIS rhnd, char recvtype)
+{
+  int rc, size = rhnd->buf.len + rhnd->zerocopy.bytes;
+
+  DEBUG("Sending message: len=%d, data=%s", size, rhnd->buf.data);
+
+  rc = cr_sendmessage(rhnd, size);
+  rhnd->zerocopy.len = 0;
+  rhnd->zerocopy.bytes = 0;
+
+  if (rc != size) {
+    if (rc < 0)
+      return rhnd->error = CREDIS_ERR_SEND;
+    return rhnd->error = CREDIS_ERR_TIMEOUT;
+  }
+
+  /* message has been consumed if no reply is to be received into buffer */
+  if (recvtype == CR_NONE) {
+    rhnd->buf.len = 0;
+    rhnd->buf.idx = 0;
+    return 0;
+  }
+  if (recvtype == CR_STREAM) {
+    rhnd->buf.len = 0;
+    rhnd->buf.idx = 0;
+    rhnd->stream.started = 0;
+    return cr_receivestream(rhnd, rhnd->stream.callback, rhnd->stream.data);
+  }
+
+  return cr_receivereply(rhnd, recvtype);
+}
+
+#ifdef CREDIS_STATS
+/* Returns time in microseconds, from an arbitrary starting point */
+static long long cr_usecs(void)
+{
+#ifdef WIN32
+  LARGE_INTEGER count, freq;
+
+  QueryPerformanceCounter(&count);
+  QueryPerformanceFrequency(&freq);
+  return count.QuadPart * 1000000 / freq.QuadPart;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return ((long long)tv.tv_sec)*1000000 + tv.tv_usec;
+#endif
+}
+
+/* Copies name of command in message buffer to `name', truncated to fit */
+static void cr_commandname(REDIS rhnd, char *name)
+{
+  char *ptr = rhnd->buf.data, *end = rhnd->buf.data + rhnd->buf.len;
+  int len = 0;
+
+  /* skip "*<argc>\r\n$<len>\r\n" */
+  while (ptr < end && *ptr++ != '\n')
+    ;
+  if (ptr < end && *ptr == '$')
+    len = cr_strtoll(ptr + 1);
+  while (ptr < end && *ptr++ != '\n')
+    ;
+
+  if (len > end - ptr)
+    len = end - ptr;
+  if (len > CR_COMMAND_NAME_SIZE - 1)
+    len = CR_COMMAND_NAME_SIZE - 1;
+  memcpy(name, ptr, len);
+  name[len] = '\0';
+}
+
+static void cr_statslatency(REDIS rhnd, long long usecs)
+{
+  int i = 0;
+
+  while (i < CREDIS_STATS_BUCKETS - 1 && (usecs >> (i + 1)) > 0)
+    i++;
+  rhnd->stats.latency[i]++;
+}
+#endif
+
+/* Returns 1 if `cmd' of length `len' never modifies data, so that it may be
+ * served by a replica or sent again after a lost connection */
+static int cr_readonlycommand(const char *cmd, int len)
+{
+  const cr_command *entry;
+  int i;
+
+  for (i = 0; i < CR_CMD_COUNT; i++) {
+    entry = &cr_commands[i];
+    if ((entry->flags & CR_READONLY) && entry->namelen == len &&
+        strncasecmp(entry->name, cmd, len) == 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+/* Returns offset in `data' of the command following the first `skip' ones,
+ * if all commands from there on are read-only and can be sent again, or -1.
+ * Commands are always sent as multi-bulk */
+static int cr_replayoffset(const char *data, int len, int skip)
+{
+  const char *ptr = data, *end = data + len, *start = NULL;
+  int i, n, argc, arglen;
+
+  for (n = 0; ptr < end; n++) {
+    if (n == skip)
+      start = ptr;
+    if (*ptr != '*')
+      return -1;
+    argc = cr_strtoll(ptr + 1);
+    while (ptr < end && *ptr++ != '\n')
+      ;
+    for (i = 0; i < argc && ptr < end; i++) {
+      arglen = cr_strtoll(ptr + 1);
+      while (ptr < end && *ptr++ != '\n')
+        ;
+      if (i == 0 && n >= skip && !cr_readonlycommand(ptr, arglen))
+        return -1;
+      ptr += arglen + 2;
+    }
+  }
+
+  return start != NULL ? start - data : -1;
+}
+
+static void cr_sleep(int msecs)
+{
+#ifdef WIN32
+  Sleep(msecs);
+#else
+  usleep(msecs * 1000);
+#endif
+}
+
+static int cr_connectsocket(REDIS rhnd, const char *host, int port, int timeout);
+static int cr_sendcommandandreceive(REDIS rhnd, int id, int argc, 
+                                    const char **argv, const int *argvlen);
+static int cr_scriptload(REDIS rhnd, cr_script *script);
+
+/* Reconnects handle after its connection was lost, resolving its host name
+ * again, and restores what the session depends on: authentication, protocol
+ * version and selected database. Registered scripts are then loaded again,
+ * those that fail to load are loaded when first run. Attempts are spaced by
+ * exponential backoff, each delay picked at random between half and all of
+ * it so that many clients losing the same server do not come back all at
+ * once. Subscriptions are not restored, and neither is client-side cache
+ * tracking, the cache is bypassed from then on.
+ * Returns:
+ *   0  on success
+ *  <0  CREDIS_ERR_CONNECT if reconnect is disabled or all attempts failed */
+static int cr_reconnect(REDIS rhnd)
+{
+  char db[CR_INT_STRING_SIZE];
+  const char *password = rhnd->reconnect.password, *dbstr = db;
+  int i, delay, active = rhnd->pipeline.active, rc = CREDIS_ERR_CONNECT;
+
+  if (rhnd->reconnect.attempts == 0 || rhnd->reconnect.active || 
+      rhnd->pubsub.subscriptions > 0)
+    return CREDIS_ERR_CONNECT;
+
+  rhnd->reconnect.active = 1;
+  /* session is restored with commands sent right away */
+  rhnd->pipeline.active = 0;
+
+  for (i = 0, delay = rhnd->reconnect.mindelay; i < rhnd->reconnect.attempts && rc != 0; i++) {
+    if (rhnd->fd > 0)
+      close(rhnd->fd);
+    rhnd->fd = -1;
+    rhnd->buf.len = 0;
+    rhnd->buf.idx = 0;
+    rhnd->zerocopy.len = 0;
+    rhnd->zerocopy.bytes = 0;
+    cr_parsereset(&(rhnd->parser));
+    rhnd->error = 0;
+
+    rhnd->reconnect.seed = rhnd->reconnect.seed * 1103515245 + 12345;
+    if (delay > 0)
+      cr_sleep(delay / 2 + (rhnd->reconnect.seed >> 16) % (delay / 2 + 1));
+    if (delay < rhnd->reconnect.maxdelay / 2)
+      delay *= 2;
+    else
+      delay = rhnd->reconnect.maxdelay;
+
+    DEBUG("reconnecting to %s:%d, attempt %d", rhnd->host, rhnd->port, i + 1);
+    if (cr_connectsocket(rhnd, rhnd->host, rhnd->port, rhnd->timeout) != 0)
+      continue;
+    cr_itoa(db, rhnd->reconnect.db);
+    if ((password == NULL || cr_sendcommandandreceive(rhnd, CR_CMD_AUTH, 1, &password, NULL) == 0) &&
+        (rhnd->reconnect.protover != 3 || credis_hello(rhnd, 3) == 0) &&
+        (rhnd->reconnect.db == 0 || cr_sendcommandandreceive(rhnd, CR_CMD_SELECT, 1, &dbstr, NULL) == 0))
+      rc = 0;
+  }
+
+  for (i = 0; rc == 0 && i < rhnd->scripts.len; i++)
+    cr_scriptload(rhnd, rhnd->scripts.v[i]);
+  if (rc == 0 && rhnd->cache != NULL) {
+    DEBUG("tracking lost with connection, bypass cache");
+    cr_cachefree(rhnd->cache);
+    rhnd->cache = NULL;
+  }
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
+  rhnd->pipeline.active = active;
+  rhnd->reconnect.active = 0;
+  if (rc != 0)
+    rhnd->error = CREDIS_ERR_CONNECT;
+
+  return rc;
+}
+
+/* Sends message and receives reply, see cr_sendandreceivemessage(). With 
+ * reconnect enabled a lost connection is reconnected and a read-only 
+ * command sent again, a bounded number of times, unless part of its reply
+ * has already been streamed */
+static int cr_sendandreceiveretry(REDIS rhnd, char recvtype)
+{
+  cr_buffer *replay = &(rhnd->reconnect.replay);
+  int rc, replays = 0;
+
+  if (rhnd->reconnect.attempts == 0 || rhnd->reconnect.active)
+    return cr_sendandreceivemessage(rhnd, recvtype);
+
+  /* message buffer is reused for the reply, keep a copy to send again */
+  replay->len = 0;
+  if (rhnd->zerocopy.len == 0 && cr_replayoffset(rhnd->buf.data, rhnd->buf.len, 0) == 0 &&
+      cr_reserve(replay, rhnd->buf.len) == 0) {
+    memcpy(replay->data, rhnd->buf.data, rhnd->buf.len);
+    replay->len = rhnd->buf.len;
+  }
+
+  while ((rc = cr_sendandreceivemessage(rhnd, recvtype)) == CREDIS_ERR_SEND ||
+         rc == CREDIS_ERR_RECV) {
+    if (cr_reconnect(rhnd) != 0 || replay->len == 0 || replays++ == CR_RECONNECT_REPLAYS ||
+        (recvtype == CR_STREAM && rhnd->stream.started))
+      break;
+    if (cr_reserve(&(rhnd->buf), replay->len))
+      return CREDIS_ERR_NOMEM;
+    memcpy(rhnd->buf.data, replay->data, replay->len);
+    rhnd->buf.len = replay->len;
+  }
+
+  return rc;
+}
+
+/* Send message that has been prepared in message buffer prior to the call
+ * to this function. Wait and receive reply. In pipeline mode the message is
+ * queued and nothing is sent. */
+static int cr_sendandreceive(REDIS rhnd, char recvtype)
+{
+#ifdef CREDIS_STATS
+  char name[CR_COMMAND_NAME_SIZE];
+  long long usecs;
+  int rc;
+#endif
+
+  CR_STATS(rhnd, commands, 1);
+
+  if (rhnd->cache != NULL)
+    cr_cachewrite(rhnd, rhnd->pipeline.active ? rhnd->pipeline.mark : 0);
+
+  if (rhnd->pipeline.active) {
+    rhnd->pipeline.queued++;
+    rhnd->pipeline.mark = rhnd->buf.len;
+    return CREDIS_QUEUED;
+  }
+
+#ifdef CREDIS_STATS
+  /* message buffer is reused for the reply, get command name first */
+  if (rhnd->hook != NULL)
+    cr_commandname(rhnd, name);
+
+  usecs = cr_usecs();
+  rc = cr_sendandreceiveretry(rhnd, recvtype);
+  usecs = cr_usecs() - usecs;
+
+  cr_statslatency(rhnd, usecs);
+  if (rhnd->hook != NULL)
+    rhnd->hook(rhnd, name, rc, usecs, rhnd->hookdata);
+
+  return rc;
+#else
+  return cr_sendandreceiveretry(rhnd, recvtype);
+#endif
+}
+
+/* Prepare message buffer with a command of `argc' arguments stored in `argv', 
+ * refer to cr_appendargvzerocopy(). Send it and receive reply. */
+static int cr_sendargvandreceive(REDIS rhnd, char recvtype, int argc, 
+                                 const char **argv, const int *argvlen)
+{
+  int rc;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+  if ((rc = cr_appendargvzerocopy(rhnd, argc, argv, argvlen)) != 0)
+    return rc;
+
+  return cr_sendandreceive(rhnd, recvtype);
+}
+
+/* Convenience macro for commands with arguments that are all zero-terminated
+ * strings, e.g. cr_sendstrandreceive(rhnd, CR_INT, "DEL", key) */
+#define cr_sendstrandreceive(rhnd, recvtype, ...)                         \
+  cr_sendargvandreceive(rhnd, recvtype,                                \
+                        sizeof((const char *[]){__VA_ARGS__})/sizeof(char *), \
+                        (const char *[]){__VA_ARGS__}, NULL)
+
+/* Like cr_sendargvandreceive() but for command `id' of the command table in 
+ * the variant for handle's server version, whose prefix is copied as is. 
+ * `argv' holds only the `argc' arguments following the name, and the reply 
+ * type expected is taken from the table. */
+static int cr_sendcommandandreceive(REDIS rhnd, int id, int argc, 
+                                    const char **argv, const int *argvlen)
+{
+  const cr_command *cmd = rhnd->commands[id];
+  int rc, i;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+  if ((rc = cr_appendcommand(&(rhnd->buf), cmd, argc + 1)) != 0)
+    return rc;
+  for (i = 0; i < argc; i++)
+    if ((rc = cr_appendargzerocopy(rhnd, argv[i], argvlen ? argvlen[i] : strlen(argv[i]))) != 0)
+      return rc;
+
+  return cr_sendandreceive(rhnd, cmd->type);
+}
+
+/* Convenience macro as cr_sendstrandreceive() for commands of the command 
+ * table, e.g. cr_sendcmdandreceive(rhnd, CR_CMD_DEL, key) */
+#define cr_sendcmdandreceive(rhnd, id, ...)                                 \
+  cr_sendcommandandreceive(rhnd, id,                                     \
+                           sizeof((const char *[]){NULL, __VA_ARGS__})/sizeof(char *) - 1, \
+                           (const char *[]){NULL, __VA_ARGS__} + 1, NULL)
+
+char * credis_errorreply(REDIS rhnd)
+{
+  return rhnd->reply.line;
+}
+
+long long credis_integerreply(REDIS rhnd)
+{
+  return rhnd->reply.integer;
+}
+
+void credis_close(REDIS rhnd)
+{
+  if (rhnd) {
+    if (rhnd->fd > 0)
+      close(rhnd->fd);
+#ifdef WIN32
+    WSACleanup();
+#endif
+    cr_delete(rhnd);
+  }
+}
+
+/* Requests Redis server information and tries to fill handle with server version 
+ * information */ 
+static int cr_getredisversion(REDIS rhnd)
+{
+  if (cr_serverversion[0] > 0) {
+    rhnd->version.major = cr_serverversion[0];
+    rhnd->version.minor = cr_serverversion[1];
+    rhnd->version.patch = cr_serverversion[2];
+    rhnd->version.number = CR_VERSION(rhnd->version.major, rhnd->version.minor, rhnd->version.patch);
+    cr_resolvecommands(rhnd);
+    return 0;
+  }
+
+  /* We can receive 2 version formats: x.yz and x.y.z, where x.yz was only used prior 
+   * first 1.1.0 release(?), e.g. stable releases 1.02 and 1.2.6 */
+  /* TODO check returned error string, "-ERR operation not permitted", to detect if 
+   * server require password? */
+  if (cr_sendcmdandreceive(rhnd, CR_CMD_INFO) == 0) {
+    int items = sscanf(rhnd->reply.bulk,
+                       "redis_version:%d.%d.%d\r\n",
+                       &(rhnd->version.major),
+                       &(rhnd->version.minor),
+                       &(rhnd->version.patch));
+    if (items == 2) {
+      rhnd->version.patch = rhnd->version.minor;
+      rhnd->version.minor = 0;
+    }
+    DEBUG("Connected to Redis version: %d.%d.%d\n", 
+          rhnd->version.major, rhnd->version.minor, rhnd->version.patch);
+
+    rhnd->version.number = CR_VERSION(rhnd->version.major, rhnd->version.minor, rhnd->version.patch);
+    cr_resolvecommands(rhnd);
+  }
+
+  return 0;
+}
+
+/* Looks up address `host':`port' was last connected at. Returns 0 if found
+ * and not yet expired, else -1 */
+static int cr_addrcacheget(const char *host, int port, cr_address *addr)
+{
+  long now = cr_msecs();
+  int i, rc = -1;
+
+  while (!cr_cas(&cr_addrcachelock, 0, 1))
+    ;
+  for (i = 0; i < CR_ADDRCACHE_SIZE; i++) {
+    if (cr_addrcache[i].resolved != 0 && cr_addrcache[i].port == port &&
+        strcmp(cr_addrcache[i].host, host) == 0) {
+      if (now - cr_addrcache[i].resolved < CR_ADDRCACHE_TTL) {
+        *addr = cr_addrcache[i].addr;
+        rc = 0;
+      }
+      else
+        cr_addrcache[i].resolved = 0;
+      break;
+    }
+  }
+  cr_release(&cr_addrcachelock);
+
+  return rc;
+}
+
+/* Stores address, or removes entry if `addr' is NULL, replacing the oldest
+ * entry when the cache is full */
+static void cr_addrcacheput(const char *host, int port, const cr_address *addr)
+{
+  int i, oldest = 0;
+
+  if (strlen(host) >= CR_ADDRCACHE_HOST_SIZE)
+    return;
+
+  while (!cr_cas(&cr_addrcachelock, 0, 1))
+    ;
+  for (i = 0; i < CR_ADDRCACHE_SIZE; i++) {
+    if (cr_addrcache[i].resolved != 0 && cr_addrcache[i].port == port &&
+        strcmp(cr_addrcache[i].host, host) == 0)
+      break;
+    if (cr_addrcache[i].resolved < cr_addrcache[oldest].resolved)
+      oldest = i;
+  }
+  if (i == CR_ADDRCACHE_SIZE)
+    i = oldest;
+
+  if (addr == NULL)
+    cr_addrcache[i].resolved = 0;
+  else {
+    strcpy(cr_addrcache[i].host, host);
+    cr_addrcache[i].port = port;
+    cr_addrcache[i].addr = *addr;
+    cr_addrcache[i].resolved = cr_msecs();
+  }
+  cr_release(&cr_addrcachelock);
+}
+
+/* Connects a new non-blocking socket to `addr' with user specified timeout.
+ * Returns socket or -1 on failure */
+static int cr_connectaddress(const cr_address *addr, int timeout)
+{
+  int fd, family = addr->sa.ss_family, yes = 1;
+
+  if ((fd = socket(family, SOCK_STREAM, 0)) == -1)
+    return -1;
+
+#ifdef WIN32
+  unsigned long nonblocking = 1;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *)&yes, sizeof(yes)) == -1 ||
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&yes, sizeof(yes)) == -1 ||
+      ioctlsocket(fd, FIONBIO, &nonblocking) != 0)
+    goto error;
+#else
+  int rc, flags;
+
+  /* unix domain sockets have neither keepalive nor Nagle's algorithm */
+  if (family != AF_UNIX &&
+      (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&yes, sizeof(yes)) == -1 ||
+       setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&yes, sizeof(yes)) == -1))
+    goto error;
+
+  flags = fcntl(fd, F_GETFL);
+  if ((rc = fcntl(fd, F_SETFL, flags | O_NONBLOCK)) < 0) {
+    DEBUG("Setting socket non-blocking failed with: %d\n", rc);
+  }
+#endif
+
+  if (connect(fd, (const struct sockaddr *)&(addr->sa), addr->len) != 0) {
+#ifdef WIN32
+    if (WSAGetLastError() != WSAEWOULDBLOCK)
+#else
+    if (errno != EINPROGRESS && errno != EAGAIN)
+#endif
+      goto error;
+
+    if (cr_selectwritable(fd, timeout) > 0) {
+      int err;
+      socklen_t len = sizeof(err);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) == -1 || err)
+        goto error;
+    }
+    else /* timeout or select error */
+      goto error;
+  }
+  /* else connect completed immediately */
+
+  return fd;
+
+error:
+  close(fd);
+  return -1;
+}
+
+/* Connects handle's socket to `host':`port', a unix domain socket if `host'
+ * is a path, and stores the address connected to in handle. `host' must not
+ * be handle's own address string.
+ * Returns:
+ *   0  on success
+ *  <0  CREDIS_ERR_CONNECT on failure */
+static int cr_connectsocket(REDIS rhnd, const char *host, int port, int timeout)
+{
+  int fd = -1, err;
+  char service[CR_INT_STRING_SIZE];
+  struct addrinfo hints, *info, *ai;
+  cr_address addr;
+
+#ifndef WIN32
+  if (host[0] == '/') {
+    struct sockaddr_un *un = (struct sockaddr_un *)&(addr.sa);
+
+    if (strlen(host) >= sizeof(un->sun_path))
+      return CREDIS_ERR_CONNECT;
+    memset(un, 0, sizeof(struct sockaddr_un));
+    un->sun_family = AF_UNIX;
+    strcpy(un->sun_path, host);
+    addr.len = sizeof(struct sockaddr_un);
+    if ((fd = cr_connectaddress(&addr, timeout)) == -1)
+      return CREDIS_ERR_CONNECT;
+    strcpy(rhnd->ip, host);
+    port = 0;
+  }
+  else
+#endif
+  {
+    /* an address that has stopped working is resolved again */
+    if (cr_addrcacheget(host, port, &addr) == 0 &&
+        (fd = cr_connectaddress(&addr, timeout)) == -1)
+      cr_addrcacheput(host, port, NULL);
+
+    if (fd == -1) {
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      cr_itoa(service, port);
+      if ((err = getaddrinfo(host, service, &hints, &info)) != 0) {
+        DEBUG("getaddrinfo error: %s\n", gai_strerror(err));
+        return CREDIS_ERR_CONNECT;
+      }
+      /* addresses are tried in the order resolver prefers them */
+      for (ai = info; ai != NULL && fd == -1; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(addr.sa))
+          continue;
+        memcpy(&(addr.sa), ai->ai_addr, ai->ai_addrlen);
+        addr.len = ai->ai_addrlen;
+        fd = cr_connectaddress(&addr, timeout);
+      }
+      freeaddrinfo(info);
+      if (fd == -1)
+        return CREDIS_ERR_CONNECT;
+      cr_addrcacheput(host, port, &addr);
+    }
+
+    if (addr.sa.ss_family == AF_INET6)
+      inet_ntop(AF_INET6, &(((struct sockaddr_in6 *)&(addr.sa))->sin6_addr), 
+                rhnd->ip, CR_ADDRESS_STRING_SIZE);
+    else
+      inet_ntop(AF_INET, &(((struct sockaddr_in *)&(addr.sa))->sin_addr), 
+                rhnd->ip, CR_ADDRESS_STRING_SIZE);
+  }
+
+  rhnd->port = port;
+  rhnd->fd = fd;
+
+  return 0;
+}
+
+REDIS credis_connect(const char *host, int port, int timeout)
+{
+  REDIS rhnd;
+
+#ifdef WIN32
+  WSADATA data;
+  
+  if (WSAStartup(MAKEWORD(2,2), &data) != 0) {
+    DEBUG("Failed to init Windows Sockets DLL\n");
+    return NULL;
+  }
+#endif
+
+  if ((rhnd = cr_new()) == NULL)
+    return NULL;
+
+  if (host == NULL)
+    host = "127.0.0.1";
+  if (port == 0)
+    port = 6379;
+
+  rhnd->timeout = timeout;
+  if ((rhnd->host = cr_strdup(host)) == NULL ||
+      cr_connectsocket(rhnd, host, port, timeout) != 0 ||
+      cr_getredisversion(rhnd) != 0)
+    goto error;
+
+  return rhnd;
+
+error:
+  credis_close(rhnd);
+  return NULL;
+}
+
+int credis_setserverversion(const char *version)
+{
+  int v[3] = {0, 0, 0};
+
+  if (version != NULL && 
+      (sscanf(version, "%d.%d.%d", &v[0], &v[1], &v[2]) < 2 || v[0] <= 0))
+    return CREDIS_ERR;
+
+  cr_serverversion[0] = v[0];
+  cr_serverversion[1] = v[1];
+  cr_serverversion[2] = v[2];
+
+  return 0;
+}
+
+void credis_settimeout(REDIS rhnd, int timeout)
+{
+  rhnd->timeout = timeout;
+}
+
+int credis_set(REDIS rhnd, const char *key, const char *val)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_SET, key, val);
+}
+
+int credis_setbin(REDIS rhnd, const char *key, const char *val, int vallen)
+{
+  const char *argv[] = {key, val};
+  const int argvlen[] = {strlen(key), vallen};
+
+  return cr_sendcommandandreceive(rhnd, CR_CMD_SET, 2, argv, argvlen);
+}
+
+int credis_setex(REDIS rhnd, const char *key, const char *val, int seconds)
+{
+  char secs[CR_INT_STRING_SIZE];
+
+  cr_itoa(secs, seconds);
+  return cr_sendcmdandreceive(rhnd, CR_CMD_SETEX, key, secs, val);
+}
+
+int credis_get(REDIS rhnd, const char *key, char **val)
+{
+  return cr_cacheget(rhnd, key, NULL, val);
+}
+
+int credis_getbin(REDIS rhnd, const char *key, char **val, int *vallen)
+{
+  int rc = credis_get(rhnd, key, val);
+
+  if (rc == 0)
+    *vallen = rhnd->reply.bulklen;
+
+  return rc;
+}
+
+int credis_getset(REDIS rhnd, const char *key, const char *set_val, char **get_val)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_GETSET, key, set_val);
+  
+  if (rc == 0 && (*get_val = rhnd->reply.bulk) == NULL)
+    return -1;
+
+  return rc;
+}
+
+int credis_ping(REDIS rhnd) 
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_PING);
+}
+
+int credis_echo(REDIS rhnd, const char *message, char **reply)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_ECHO, message);
+  
+  if (rc == 0 && (*reply = rhnd->reply.bulk) == NULL)
+    return -1;
+
+  return rc;
+}
+
+int credis_quit(REDIS rhnd) 
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_QUIT);
+}
+
+int credis_auth(REDIS rhnd, const char *password)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_AUTH, password);
+  char *copy;
+
+  /* Request Redis server version once we have been authenticated */
+  if (rc == 0) {
+    /* kept to authenticate again after reconnect */
+    if ((copy = cr_strdup(password)) == NULL)
+      return CREDIS_ERR_NOMEM;
+    if (rhnd->reconnect.password != NULL)
+      cr_free(rhnd->reconnect.password);
+    rhnd->reconnect.password = copy;
+    return cr_getredisversion(rhnd);
+  }
+
+  return rc;
+}
+
+int credis_hello(REDIS rhnd, int protover)
+{
+  char ver[CR_INT_STRING_SIZE];
+  int rc;
+
+  if (protover != 2 && protover != 3)
+    return CREDIS_ERR;
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+
+  /* HELLO is not known to servers prior to 6.0, which only speak RESP2 */
+  if (rhnd->version.number > 0 && rhnd->version.number < CR_VERSION(6,0,0))
+    return protover == 2 ? 0 : CREDIS_ERR_PROTOCOL;
+
+  cr_itoa(ver, protover);
+  if ((rc = cr_sendcmdandreceive(rhnd, CR_CMD_HELLO, ver)) == 0)
+    rhnd->reconnect.protover = protover;
+
+  return rc;
+}
+
+void credis_setreconnect(REDIS rhnd, int attempts, int mindelay, int maxdelay)
+{
+  rhnd->reconnect.attempts = attempts > 0 ? attempts : 0;
+  rhnd->reconnect.mindelay = mindelay > 0 ? mindelay : 0;
+  rhnd->reconnect.maxdelay = maxdelay > rhnd->reconnect.mindelay ? maxdelay : rhnd->reconnect.mindelay;
+  rhnd->reconnect.seed = (unsigned int)cr_msecs() ^ (unsigned int)(size_t)rhnd;
+}
+
+int credis_command(REDIS rhnd, int argc, const char **argv, const int *argvlen, 
+                   REDIS_REPLY *reply)
+{
+  int rc = cr_sendargvandreceive(rhnd, CR_ANY, argc, argv, argvlen);
+
+  if ((rc == 0 || (rc == CREDIS_ERR_PROTOCOL && rhnd->reply.type == CR_ERROR)) &&
+      reply != NULL)
+    cr_fillreply(rhnd, reply);
+
+  return rc;
+}
+
+/* Hands element `el' of a streamed reply to the callback, unless an earlier
+ * call has asked for the rest of the reply to be skipped or the element is 
+ * part of a push */
+#define cr_streamelement(el, depth, offset, remaining)                   \
+  do {                                                                  \
+    if (ret == 0 && !push) {                                            \
+      rhnd->stream.started = 1;                                         \
+      ret = callback(el, depth, offset, remaining, data);               \
+    }                                                                   \
+  } while (0)
+
+/* Receives a reply piece by piece, handing each element to `callback' as soon
+ * as it has been parsed and reusing its buffer space for what follows. Bulks
+ * that do not fit in CR_STREAM_CHUNK_SIZE bytes are passed on in several 
+ * parts. The reply is always read to its end to keep the handle in sync.
+ * RESP3 pushes arriving before the reply are skipped, as by cr_receivereply()
+ * Returns:
+ *   0  on success
+ *  !0  value returned by callback when it asked for the rest to be skipped
+ *  <0  on error, CREDIS_ERR_PROTOCOL if the reply is an error */
+static int cr_receivestream(REDIS rhnd, credis_streamcallback callback, void *data)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  REDIS_REPLY el;
+  int stack[CR_PARSER_MAXDEPTH];
+  int depth = 0, bulk = -1, offset = 0, scan = 0, need, avail, n, ret = 0, push = 0;
+  char *line, *nl, bulkresp = CR_BULK;
+
+  while (1) {
+    avail = buf->len - buf->idx;
+    need = 1;
+
+    if (bulk >= 4 && bulkresp == CR_VERBATIM) {
+      /* format of verbatim string, e.g. "txt:", is skipped */
+      if (avail >= 4) {
+        buf->idx += 4;
+        bulk -= 4;
+        bulkresp = CR_BULK;
+        continue;
+      }
+      need = 4 - avail;
+    }
+    else if (bulk >= 0) {
+      memset(&el, 0, sizeof(REDIS_REPLY));
+      el.type = cr_replytype(bulkresp);
+      el.str = buf->data + buf->idx;
+
+      if (avail >= bulk + 2) {
+        if (el.str[bulk] != '\r' || el.str[bulk + 1] != '\n')
+          return rhnd->error = CREDIS_ERR_PROTOCOL;
+        el.str[bulk] = '\0'; /* zero terminate */
+        el.len = bulk;
+        cr_streamelement(&el, depth, offset, 0);
+        buf->idx += bulk + 2;
+        bulk = -1;
+        goto complete;
+      }
+      /* a blob error is only passed on as a whole */
+      if (bulkresp != CR_BLOBERROR && avail >= CR_STREAM_CHUNK_SIZE && avail < bulk) {
+        el.len = avail;
+        cr_streamelement(&el, depth, offset, bulk - avail);
+        buf->idx += avail;
+        offset += avail;
+        bulk -= avail;
+        continue;
+      }
+      need = (bulk + 2 < CR_STREAM_CHUNK_SIZE ? bulk + 2 : CR_STREAM_CHUNK_SIZE) - avail;
+      if (need < 1)
+        need = bulk + 2 - avail;
+    }
+    else if ((nl = cr_findnl(buf->data + (scan > buf->idx ? scan : buf->idx), 
+                             buf->len - (scan > buf->idx ? scan : buf->idx))) != NULL) {
+      *nl = '\0'; /* zero terminate */
+      line = buf->data + buf->idx;
+      buf->idx = (nl - buf->data) + 2; /* skip "\r\n" */
+      scan = 0;
+
+      memset(&el, 0, sizeof(REDIS_REPLY));
+      el.type = cr_replytype(*line);
+      el.str = line + 1;
+      el.len = nl - el.str;
+
+      switch (*line) {
+      case CR_ERROR:
+      case CR_INLINE:
+      case CR_BIGNUMBER:
+        break;
+      case CR_DOUBLE:
+        el.number = cr_strtod(el.str);
+        break;
+      case CR_INT:
+      case CR_BOOLEAN:
+        el.integer = el.integer64 = *line == CR_INT ? cr_strtoll(el.str) : *el.str == 't';
+        el.str = NULL;
+        el.len = 0;
+        break;
+      case CR_VERBATIM:
+      case CR_BLOBERROR:
+      case CR_BULK:
+        if ((bulk = cr_strtoll(el.str)) >= 0) {
+          bulkresp = *line;
+          offset = 0;
+          continue;
+        }
+        if (*line != CR_BULK)
+          return rhnd->error = CREDIS_ERR_PROTOCOL;
+        /* key didn't exist */
+        /* fall through */
+      case CR_NULL:
+        el.str = NULL;
+        el.len = 0;
+        break;
+      case CR_MULTIBULK:
+      case CR_MAP:
+      case CR_SET:
+      case CR_PUSH:
+        n = cr_strtoll(el.str) * (*line == CR_MAP ? 2 : 1);
+        if (depth == 0 && *line == CR_PUSH)
+          push = 1;
+        el.elements = n > 0 ? n : 0;
+        el.str = NULL;
+        el.len = 0;
+        cr_streamelement(&el, depth, 0, 0);
+        if (n > 0) {
+          if (depth == CR_PARSER_MAXDEPTH)
+            return rhnd->error = CREDIS_ERR_PROTOCOL;
+          stack[depth++] = n;
+          continue;
+        }
+        goto complete;
+      default:
+        return rhnd->error = CREDIS_ERR_PROTOCOL;
+      }
+
+      cr_streamelement(&el, depth, 0, 0);
+      goto complete;
+    }
+    else /* last byte might be the '\r' of a "\r\n" not completely received */
+      scan = buf->len > buf->idx ? buf->len - 1 : buf->idx;
+
+    /* consumed data is discarded before receiving more */
+    if (buf->idx > 0) {
+      buf->len -= buf->idx;
+      memmove(buf->data, buf->data + buf->idx, buf->len);
+      scan = scan > buf->idx ? scan - buf->idx : 0;
+      buf->idx = 0;
+    }
+    if (cr_receivemore(rhnd, need) <= 0)
+      return rhnd->error = CREDIS_ERR_RECV;
+    continue;
+
+  complete:
+    if (depth == 0 && el.type == CREDIS_REPLY_ERROR) {
+      rhnd->reply.type = CR_ERROR;
+      rhnd->reply.line = el.str;
+      return ret ? ret : CREDIS_ERR_PROTOCOL;
+    }
+    /* an element is complete, which may in turn complete multi-bulks */
+    while (depth > 0 && --stack[depth - 1] == 0)
+      depth--;
+    if (depth == 0) {
+      if (!push)
+        break;
+      DEBUG("skip pushed reply");
+      push = 0;
+    }
+  }
+
+  rhnd->reply.type = CR_NONE;
+  rhnd->reply.multibulk.len = 0;
+
+  return ret;
+}
+
+int credis_commandstream(REDIS rhnd, int argc, const char **argv, const int *argvlen,
+                         credis_streamcallback callback, void *data)
+{
+  int rc;
+
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+  if (rhnd->pubsub.subscriptions > 0)
+    return CREDIS_ERR_PUBSUB;
+
+  if ((rc = cr_newcommand(rhnd)) != 0 ||
+      (rc = cr_appendargvzerocopy(rhnd, argc, argv, argvlen)) != 0)
+    return rc;
+
+  rhnd->stream.callback = callback;
+  rhnd->stream.data = data;
+
+  return cr_sendandreceive(rhnd, CR_STREAM);
+}
+
+static int cr_multikeycommand(REDIS rhnd, int cmd, int keyc, const char **keyv)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+  if ((rc = cr_appendcommand(buf, rhnd->commands[cmd], keyc + 1)) != 0)
+    return rc;
+  if ((rc = cr_appendstrarray(buf, keyc, keyv)) != 0)
+    return rc;
+
+  return cr_sendandreceive(rhnd, rhnd->commands[cmd]->type);
+}
+
+static int cr_multikeybulkcommand(REDIS rhnd, int cmd, int keyc, 
+                                  const char **keyv, char ***valv)
+{
+  int rc;
+
+  if ((rc = cr_multikeycommand(rhnd, cmd, keyc, keyv)) == 0) {
+    *valv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+static int cr_multikeystorecommand(REDIS rhnd, int cmd, const char *destkey, 
+                                   int keyc, const char **keyv)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+  if ((rc = cr_appendcommand(buf, rhnd->commands[cmd], keyc + 2)) != 0)
+    return rc;
+  if ((rc = cr_appendarg(buf, destkey, strlen(destkey))) != 0)
+    return rc;
+  if ((rc = cr_appendstrarray(buf, keyc, keyv)) != 0)
+    return rc;
+
+  /* integer reply and not inline as documentation specifies */
+  if ((rc = cr_sendandreceive(rhnd, CR_INT)) == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_mget(REDIS rhnd, int keyc, const char **keyv, char ***valv)
+{
+  return cr_multikeybulkcommand(rhnd, CR_CMD_MGET, keyc, keyv, valv);
+}
+
+int credis_mgetbin(REDIS rhnd, int keyc, const char **keyv, char ***valv, int **vallenv)
+{
+  int rc = cr_multikeybulkcommand(rhnd, CR_CMD_MGET, keyc, keyv, valv);
+
+  if (rc >= 0)
+    *vallenv = rhnd->reply.multibulk.lens;
+
+  return rc;
+}
+
+int credis_setnx(REDIS rhnd, const char *key, const char *val)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_SETNX, key, val);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+static int cr_incr(REDIS rhnd, int incr, int decr, const char *key, int *new_val)
+{
+  char val[CR_INT_STRING_SIZE];
+  int rc = 0;
+
+  if (incr == 1 || decr == 1)
+    rc = cr_sendcmdandreceive(rhnd, incr>0?CR_CMD_INCR:CR_CMD_DECR, key);
+  else if (incr > 1 || decr > 1) {
+    cr_itoa(val, incr>0?incr:decr);
+    rc = cr_sendcmdandreceive(rhnd, incr>0?CR_CMD_INCRBY:CR_CMD_DECRBY, key, val);
+  }
+
+  if (rc == 0 && new_val != NULL)
+    *new_val = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_incr(REDIS rhnd, const char *key, int *new_val)
+{
+  return cr_incr(rhnd, 1, 0, key, new_val);
+}
+
+int credis_decr(REDIS rhnd, const char *key, int *new_val)
+{
+  return cr_incr(rhnd, 0, 1, key, new_val);
+}
+
+int credis_incrby(REDIS rhnd, const char *key, int incr_val, int *new_val)
+{
+  return cr_incr(rhnd, incr_val, 0, key, new_val);
+}
+
+int credis_decrby(REDIS rhnd, const char *key, int decr_val, int *new_val)
+{
+  return cr_incr(rhnd, 0, decr_val, key, new_val);
+}
+
+int credis_append(REDIS rhnd, const char *key, const char *val)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_APPEND, key, val);
+                            
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;                            
+}
+
+int credis_substr(REDIS rhnd, const char *key, int start, int end, char **substr)
+{
+  char startstr[CR_INT_STRING_SIZE], endstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(startstr, start);
+  cr_itoa(endstr, end);
+
+  /* sent as SUBSTR up to Redis 2.0.0 */
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_GETRANGE, key, startstr, endstr);
+
+  if (rc == 0 && substr) 
+    *substr = rhnd->reply.bulk;
+
+  return rc;                            
+}
+
+int credis_getrange(REDIS rhnd, const char *key, int start, int end, char **substr)
+{
+  return credis_substr(rhnd, key, start, end, substr);
+}
+
+int credis_exists(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_EXISTS, key);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_del(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_DEL, key);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_type(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_TYPE, key);
+
+  if (rc == 0) {
+    char *t = rhnd->reply.line;
+    if (!strcmp("string", t))
+      rc = CREDIS_TYPE_STRING;
+    else if (!strcmp("list", t))
+      rc = CREDIS_TYPE_LIST;
+    else if (!strcmp("set", t))
+      rc = CREDIS_TYPE_SET;
+    else
+      rc = CREDIS_TYPE_NONE;
+  }
+
+  return rc;
+}
+
+int credis_keys(REDIS rhnd, const char *pattern, char ***keyv)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_KEYS, pattern);
+
+  /* with Redis 2.0.0 keys-command returns a multibulk instead of bulk */
+  if (rc == 0 && rhnd->commands[CR_CMD_KEYS]->type == CR_BULK) {
+    /* server returns keys as space-separated strings, use multi-bulk 
+     * storage to store keys */
+    rc = cr_splitstrtomultibulk(rhnd, rhnd->reply.bulk, ' ');
+  }
+
+  if (rc == 0) {
+    *keyv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_randomkey(REDIS rhnd, char **key)
+{
+  /* with Redis 2.0.0 randomkey-command returns a bulk instead of inline */
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_RANDOMKEY);
+
+  if (rc == 0 && key) 
+    *key = rhnd->commands[CR_CMD_RANDOMKEY]->type == CR_BULK ? 
+      rhnd->reply.bulk : rhnd->reply.line;
+
+  return rc;
+}
+
+int credis_rename(REDIS rhnd, const char *key, const char *new_key_name)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_RENAME, key, new_key_name);
+}
+
+int credis_renamenx(REDIS rhnd, const char *key, const char *new_key_name)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_RENAMENX, key, new_key_name);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_dbsize(REDIS rhnd)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_DBSIZE);
+
+  if (rc == 0) 
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_expire(REDIS rhnd, const char *key, int secs)
+{ 
+  char secsstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(secsstr, secs);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_EXPIRE, key, secsstr);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_ttl(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_TTL, key);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+static int cr_push(REDIS rhnd, int left, const char *key, const char *val, int vallen)
+{
+  const char *argv[] = {key, val};
+  const int argvlen[] = {strlen(key), vallen};
+  int id = left==1 ? CR_CMD_LPUSH : CR_CMD_RPUSH;
+  int rc = cr_sendcommandandreceive(rhnd, id, 2, argv, argvlen);
+
+  /* with Redis 2.0.0 push-commands return the length of list */
+  if (rc == 0 && rhnd->commands[id]->type == CR_INT)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_rpush(REDIS rhnd, const char *key, const char *val)
+{
+  return cr_push(rhnd, 0, key, val, strlen(val));
+}
+
+int credis_rpushbin(REDIS rhnd, const char *key, const char *val, int vallen)
+{
+  return cr_push(rhnd, 0, key, val, vallen);
+}
+
+int credis_lpush(REDIS rhnd, const char *key, const char *val)
+{
+  return cr_push(rhnd, 1, key, val, strlen(val));
+}
+
+int credis_lpushbin(REDIS rhnd, const char *key, const char *val, int vallen)
+{
+  return cr_push(rhnd, 1, key, val, vallen);
+}
+
+int credis_llen(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_LLEN, key);
+
+  if (rc == 0) 
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_lrange(REDIS rhnd, const char *key, int start, int end, char ***valv)
+{
+  char startstr[CR_INT_STRING_SIZE], endstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(startstr, start);
+  cr_itoa(endstr, end);
+
+  if ((rc = cr_sendcmdandreceive(rhnd, CR_CMD_LRANGE, key, startstr, endstr)) == 0) {
+    *valv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_lrangebin(REDIS rhnd, const char *key, int start, int end, char ***valv, 
+                     int **vallenv)
+{
+  int rc = credis_lrange(rhnd, key, start, end, valv);
+
+  if (rc >= 0)
+    *vallenv = rhnd->reply.multibulk.lens;
+
+  return rc;
+}
+
+int credis_ltrim(REDIS rhnd, const char *key, int start, int end)
+{
+  char startstr[CR_INT_STRING_SIZE], endstr[CR_INT_STRING_SIZE];
+
+  cr_itoa(startstr, start);
+  cr_itoa(endstr, end);
+
+  return cr_sendcmdandreceive(rhnd, CR_CMD_LTRIM, key, startstr, endstr);
+}
+
+int credis_lindex(REDIS rhnd, const char *key, int index, char **val)
+{
+  char indexstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(indexstr, index);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_LINDEX, key, indexstr);
+
+  if (rc == 0 && (*val = rhnd->reply.bulk) == NULL)
+    return -1;
+
+  return rc;
+}
+
+int credis_lset(REDIS rhnd, const char *key, int index, const char *val)
+{
+  char indexstr[CR_INT_STRING_SIZE];
+
+  cr_itoa(indexstr, index);
+  return cr_sendcmdandreceive(rhnd, CR_CMD_LSET, key, indexstr, val);
+}
+
+int credis_lrem(REDIS rhnd, const char *key, int count, const char *val)
+{
+  char countstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(countstr, count);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_LREM, key, countstr, val);
+
+  if (rc == 0) 
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+static int cr_pop(REDIS rhnd, int left, const char *key, char **val)
+{
+  int rc = cr_sendcmdandreceive(rhnd, left==1?CR_CMD_LPOP:CR_CMD_RPOP, key);
+
+  if (rc == 0 && (*val = rhnd->reply.bulk) == NULL)
+    return -1;
+
+  return rc;
+}
+
+int credis_lpop(REDIS rhnd, const char *key, char **val)
+{
+  return cr_pop(rhnd, 1, key, val);
+}
+
+int credis_rpop(REDIS rhnd, const char *key, char **val)
+{
+  return cr_pop(rhnd, 0, key, val);
+}
+
+int credis_select(REDIS rhnd, int index)
+{
+  char indexstr[CR_INT_STRING_SIZE];
+
+  int rc;
+
+  cr_itoa(indexstr, index);
+  if ((rc = cr_sendcmdandreceive(rhnd, CR_CMD_SELECT, indexstr)) == 0)
+    rhnd->reconnect.db = index;
+
+  return rc;
+}
+
+int credis_move(REDIS rhnd, const char *key, int index)
+{
+  char indexstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(indexstr, index);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_MOVE, key, indexstr);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_flushdb(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_FLUSHDB);
+}
+
+int credis_flushall(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_FLUSHALL);
+}
+
+int credis_sort(REDIS rhnd, const char *query, char ***elementv)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  const char *arg;
+  int rc, argc, len;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+
+  /* count space separated arguments of query */
+  for (argc = 1, arg = query; *arg != '\0'; argc++) {
+    while (*arg == ' ')
+      arg++;
+    if (*arg == '\0')
+      break;
+    arg += strcspn(arg, " ");
+  }
+
+  if ((rc = cr_appendcommand(buf, rhnd->commands[CR_CMD_SORT], argc)) != 0)
+    return rc;
+
+  for (arg = query; *arg != '\0'; arg += len) {
+    while (*arg == ' ')
+      arg++;
+    if ((len = strcspn(arg, " ")) > 0)
+      if ((rc = cr_appendarg(buf, arg, len)) != 0)
+        return rc;
+  }
+
+  if ((rc = cr_sendandreceive(rhnd, CR_MULTIBULK)) == 0) {
+    *elementv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+static int cr_scanreply(cr_scan *shnd);
+
+/* Receives a batch requested ahead by a SCAN iterator so that the handle can
+ * be used for another command, and copies its elements aside for the 
+ * iterator to return when it is next advanced. If the batch cannot be kept
+ * it is requested again, using the same cursor */
+static void cr_scandrain(REDIS rhnd)
+{
+  cr_scan *shnd = rhnd->scan;
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  char cursor[CR_INT_STRING_SIZE];
+  int i, n, len, done;
+
+  if (shnd == NULL)
+    return;
+
+  rhnd->scan = NULL;
+  memcpy(cursor, shnd->cursor, CR_INT_STRING_SIZE);
+  done = shnd->done;
+
+  if (cr_receivereply(rhnd, CR_MULTIBULK) != 0 || (n = cr_scanreply(shnd)) < 0)
+    goto restore;
+
+  shnd->held.len = 0;
+  for (i = 0; i < n; i++) {
+    len = mb->bulks[i] != NULL ? mb->lens[i] : -1;
+    if (cr_reserve(&(shnd->held), sizeof(int) + (len > 0 ? len : 0) + 1))
+      goto restore;
+    memcpy(shnd->held.data + shnd->held.len, &len, sizeof(int));
+    shnd->held.len += sizeof(int);
+    if (len > 0)
+      memcpy(shnd->held.data + shnd->held.len, mb->bulks[i], len);
+    shnd->held.len += (len > 0 ? len : 0);
+    shnd->held.data[shnd->held.len++] = '\0';
+  }
+  shnd->helds = n;
+  return;
+
+ restore:
+  memcpy(shnd->cursor, cursor, CR_INT_STRING_SIZE);
+  shnd->done = done;
+}
+
+/* Makes the elements of a batch kept by cr_scandrain() available in the 
+ * handle's multi-bulk storage.
+ * Returns:
+ *  >=0  number of elements
+ *   <0  on error */
+static int cr_scanheld(cr_scan *shnd)
+{
+  cr_multibulk *mb = &(shnd->rhnd->reply.multibulk);
+  char *ptr = shnd->held.data;
+  int i, len, n = shnd->helds;
+
+  if (n > mb->size && cr_morebulk(mb, n - mb->size))
+    return CREDIS_ERR_NOMEM;
+
+  for (i = 0; i < n; i++) {
+    memcpy(&len, ptr, sizeof(int));
+    ptr += sizeof(int);
+    mb->bulks[i] = len >= 0 ? ptr : NULL;
+    mb->lens[i] = len > 0 ? len : 0;
+    ptr += (len > 0 ? len : 0) + 1;
+  }
+  mb->len = n;
+  shnd->helds = -1;
+
+  return n;
+}
+
+/* Sends command for next batch of an iterator. 
+ * Returns:
+ *   0  on success
+ *  <0  on error */
+static int cr_scansend(cr_scan *shnd)
+{
+  REDIS rhnd = shnd->rhnd;
+  const char *argv[7];
+  char count[CR_INT_STRING_SIZE];
+  int rc, argc = 0;
+
+  argv[argc++] = shnd->cmd;
+  if (shnd->key != NULL)
+    argv[argc++] = shnd->key;
+  argv[argc++] = shnd->cursor;
+  if (shnd->pattern != NULL) {
+    argv[argc++] = "MATCH";
+    argv[argc++] = shnd->pattern;
+  }
+  if (shnd->count > 0) {
+    cr_itoa(count, shnd->count);
+    argv[argc++] = "COUNT";
+    argv[argc++] = count;
+  }
+
+  shnd->out.len = 0;
+  if ((rc = cr_appendargv(&(shnd->out), argc, argv, NULL)) != 0)
+    return rc;
+
+  CR_STATS(rhnd, commands, 1);
+  rc = cr_senddata(rhnd, shnd->out.data, shnd->out.len);
+  if (rc != shnd->out.len) {
+    if (rc < 0)
+      return rhnd->error = CREDIS_ERR_SEND;
+    return rhnd->error = CREDIS_ERR_TIMEOUT;
+  }
+
+  rhnd->scan = shnd;
+  return 0;
+}
+
+/* Makes the elements of a received [cursor, [elements]] reply available in 
+ * the handle's multi-bulk storage and keeps the cursor for the next batch.
+ * Returns:
+ *  >=0  number of elements
+ *   <0  on error */
+static int cr_scanreply(cr_scan *shnd)
+{
+  REDIS rhnd = shnd->rhnd;
+  cr_node *nodes = rhnd->parser.nodes;
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  char *base = rhnd->reply.base;
+  int i, n;
+
+  if (nodes[0].len != 2 || nodes[1].type != CR_BULK || nodes[1].idx < 0 || 
+      nodes[1].len >= CR_INT_STRING_SIZE || nodes[2].type != CR_MULTIBULK)
+    return CREDIS_ERR_PROTOCOL;
+
+  memcpy(shnd->cursor, base + nodes[1].idx, nodes[1].len + 1);
+  shnd->done = (strcmp(shnd->cursor, "0") == 0);
+
+  if (nodes[2].len > mb->size && cr_morebulk(mb, nodes[2].len - mb->size))
+    return CREDIS_ERR_NOMEM;
+
+  for (i = 0, n = 3; i < nodes[2].len; i++, n = nodes[n].next) {
+    if (nodes[n].type == CR_MULTIBULK || nodes[n].idx < 0) {
+      mb->bulks[i] = NULL;
+      mb->lens[i] = 0;
+    }
+    else {
+      mb->bulks[i] = base + nodes[n].idx;
+      mb->lens[i] = nodes[n].len;
+    }
+  }
+  mb->len = nodes[2].len;
+
+  return mb->len;
+}
+
+static REDIS_SCAN cr_scannew(REDIS rhnd, const char *cmd, const char *key, 
+                             const char *pattern, int count)
+{
+  cr_scan *shnd;
+
+  if ((shnd = cr_calloc(sizeof(cr_scan), 1)) == NULL)
+    return NULL;
+
+  shnd->rhnd = rhnd;
+  shnd->cmd = cmd;
+  shnd->count = count;
+  shnd->helds = -1;
+  strcpy(shnd->cursor, "0");
+
+  if ((key != NULL && (shnd->key = cr_strdup(key)) == NULL) ||
+      (pattern != NULL && (shnd->pattern = cr_strdup(pattern)) == NULL)) {
+    credis_scan_close(shnd);
+    return NULL;
+  }
+
+  return shnd;
+}
+
+REDIS_SCAN credis_scan(REDIS rhnd, const char *pattern, int count)
+{
+  return cr_scannew(rhnd, "SCAN", NULL, pattern, count);
+}
+
+REDIS_SCAN credis_sscan(REDIS rhnd, const char *key, const char *pattern, int count)
+{
+  return cr_scannew(rhnd, "SSCAN", key, pattern, count);
+}
+
+REDIS_SCAN credis_hscan(REDIS rhnd, const char *key, const char *pattern, int count)
+{
+  return cr_scannew(rhnd, "HSCAN", key, pattern, count);
+}
+
+REDIS_SCAN credis_zscan(REDIS rhnd, const char *key, const char *pattern, int count)
+{
+  return cr_scannew(rhnd, "ZSCAN", key, pattern, count);
+}
+
+int credis_scan_next(REDIS_SCAN shnd, char ***elementv, int **elementlenv)
+{
+  REDIS rhnd = shnd->rhnd;
+  int rc, n;
+
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+  if (rhnd->pubsub.subscriptions > 0)
+    return CREDIS_ERR_PUBSUB;
+
+  /* the server may return empty batches before the iteration is complete */
+  do {
+    if (shnd->helds >= 0) {
+      /* batch kept aside, the next one is requested ahead again */
+      if (rhnd->scan != NULL)
+        cr_scandrain(rhnd);
+      if ((rc = cr_scanheld(shnd)) < 0)
+        return rc;
+    }
+    else {
+      if (shnd->done)
+        return 0;
+
+      if (rhnd->scan != shnd) {
+        cr_scandrain(rhnd);
+        if ((rc = cr_scansend(shnd)) != 0)
+          return rc;
+      }
+      rhnd->scan = NULL;
+
+      if ((rc = cr_receivereply(rhnd, CR_MULTIBULK)) != 0 ||
+          (rc = cr_scanreply(shnd)) < 0)
+        return rc;
+    }
+
+    /* batch stays in handle's buffer while next one is on its way */
+    if (!shnd->done && (n = cr_scansend(shnd)) != 0)
+      return n;
+  } while (rc == 0);
+
+  *elementv = rhnd->reply.multibulk.bulks;
+  if (elementlenv != NULL)
+    *elementlenv = rhnd->reply.multibulk.lens;
+
+  return rc;
+}
+
+void credis_scan_close(REDIS_SCAN shnd)
+{
+  if (shnd == NULL)
+    return;
+
+  /* batch requested ahead is read and no longer needed */
+  if (shnd->rhnd->scan == shnd) {
+    shnd->rhnd->scan = NULL;
+    cr_receivereply(shnd->rhnd, CR_ANY);
+  }
+  if (shnd->key != NULL)
+    cr_free(shnd->key);
+  if (shnd->pattern != NULL)
+    cr_free(shnd->pattern);
+  if (shnd->held.data != NULL)
+    cr_free(shnd->held.data);
+  if (shnd->out.data != NULL)
+    cr_free(shnd->out.data);
+  cr_free(shnd);
+}
+
+int credis_save(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_SAVE);
+}
+
+int credis_bgsave(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_BGSAVE);
+}
+
+int credis_lastsave(REDIS rhnd)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_LASTSAVE);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_shutdown(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_SHUTDOWN);
+}
+
+int credis_bgrewriteaof(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_BGREWRITEAOF);
+}
+
+#define CR_INFO_INT 0
+#define CR_INFO_UINT 1
+#define CR_INFO_LONG 2
+#define CR_INFO_ULONG 3
+#define CR_INFO_LONGLONG 4
+#define CR_INFO_STRING 5
+#define CR_INFO_ROLE 6
+
+#define CR_INFO_FIELD(name, type) \
+  {#name, sizeof(#name) - 1, type, offsetof(REDIS_INFO, name), sizeof(((REDIS_INFO *)0)->name)}
+
+/* fields of REDIS_INFO, filled in from INFO lines "<name>:<value>" */
+static const struct {
+  const char *name;
+  int namelen;
+  int type;
+  size_t offset;
+  size_t size;
+} cr_infofields[] = {
+  CR_INFO_FIELD(redis_version, CR_INFO_STRING),
+  CR_INFO_FIELD(arch_bits, CR_INFO_INT),
+  CR_INFO_FIELD(multiplexing_api, CR_INFO_STRING),
+  CR_INFO_FIELD(process_id, CR_INFO_LONG),
+  CR_INFO_FIELD(uptime_in_seconds, CR_INFO_LONG),
+  CR_INFO_FIELD(uptime_in_days, CR_INFO_LONG),
+  CR_INFO_FIELD(connected_clients, CR_INFO_INT),
+  CR_INFO_FIELD(connected_slaves, CR_INFO_INT),
+  CR_INFO_FIELD(blocked_clients, CR_INFO_INT),
+  CR_INFO_FIELD(used_memory, CR_INFO_ULONG),
+  CR_INFO_FIELD(used_memory_human, CR_INFO_STRING),
+  CR_INFO_FIELD(changes_since_last_save, CR_INFO_LONGLONG),
+  CR_INFO_FIELD(bgsave_in_progress, CR_INFO_INT),
+  CR_INFO_FIELD(last_save_time, CR_INFO_LONG),
+  CR_INFO_FIELD(bgrewriteaof_in_progress, CR_INFO_INT),
+  CR_INFO_FIELD(total_connections_received, CR_INFO_LONGLONG),
+  CR_INFO_FIELD(total_commands_processed, CR_INFO_LONGLONG),
+  CR_INFO_FIELD(expired_keys, CR_INFO_LONGLONG),
+  CR_INFO_FIELD(hash_max_zipmap_entries, CR_INFO_ULONG),
+  CR_INFO_FIELD(hash_max_zipmap_value, CR_INFO_ULONG),
+  CR_INFO_FIELD(pubsub_channels, CR_INFO_LONG),
+  CR_INFO_FIELD(pubsub_patterns, CR_INFO_UINT),
+  CR_INFO_FIELD(keyspace_hits, CR_INFO_LONGLONG),
+  CR_INFO_FIELD(keyspace_misses, CR_INFO_LONGLONG),
+  CR_INFO_FIELD(vm_enabled, CR_INFO_INT),
+  CR_INFO_FIELD(role, CR_INFO_ROLE)
+};
+
+/* Fills `info' from Redis `text' in a single pass, looking up the name of 
+ * each line among cr_infofields[] instead of searching all of `text' for 
+ * each field. Lines of other fields and section headers are skipped. */
+static void cr_parseinfo(const char *text, REDIS_INFO *info)
+{
+  const char *line, *value, *end;
+  char *field;
+  int i, len;
+  size_t n;
+
+  for (line = text; *line != '\0'; line = *end == '\0' ? end : end + 1) {
+    end = line + strcspn(line, ":\n");
+    if (*end != ':') 
+      continue;
+    len = end - line;
+    value = end + 1;
+    end = value + strcspn(value, "\n");
+
+    for (i = 0; i < sizeof(cr_infofields) / sizeof(cr_infofields[0]); i++) {
+      if (cr_infofields[i].namelen != len || memcmp(cr_infofields[i].name, line, len) != 0)
+        continue;
+      field = (char *)info + cr_infofields[i].offset;
+      switch (cr_infofields[i].type) {
+      case CR_INFO_INT:
+        *(int *)field = cr_strtoll(value);
+        break;
+      case CR_INFO_UINT:
+        *(unsigned int *)field = cr_strtoll(value);
+        break;
+      case CR_INFO_LONG:
+        *(long *)field = cr_strtoll(value);
+        break;
+      case CR_INFO_ULONG:
+        *(unsigned long *)field = cr_strtoll(value);
+        break;
+      case CR_INFO_LONGLONG:
+        *(long long *)field = cr_strtoll(value);
+        break;
+      case CR_INFO_STRING:
+        if ((n = strcspn(value, " \r\n")) > cr_infofields[i].size - 1)
+          n = cr_infofields[i].size - 1;
+        memcpy(field, value, n);
+        field[n] = '\0';
+        break;
+      case CR_INFO_ROLE:
+        *(int *)field = *value == 'm' ? CREDIS_SERVER_MASTER : CREDIS_SERVER_SLAVE;
+        break;
+      }
+      break;
+    }
+  }
+}
+
+int credis_info(REDIS rhnd, REDIS_INFO *info)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_INFO);
+
+  if (rc == 0) {
+    memset(info, 0, sizeof(REDIS_INFO));
+    cr_parseinfo(rhnd->reply.bulk, info);
+  }
+  
+  return rc;
+}
+
+int credis_monitor(REDIS rhnd)
+{
+  return cr_sendcmdandreceive(rhnd, CR_CMD_MONITOR);
+}
+
+int credis_slaveof(REDIS rhnd, const char *host, int port)
+{
+  char portstr[CR_INT_STRING_SIZE];
+
+  if (host == NULL || port == 0)
+    return cr_sendcmdandreceive(rhnd, CR_CMD_SLAVEOF, "no", "one");
+
+  cr_itoa(portstr, port);
+  return cr_sendcmdandreceive(rhnd, CR_CMD_SLAVEOF, host, portstr);
+}
+
+static int cr_setaddrem(REDIS rhnd, int cmd, const char *key, const char *member)
+{
+  int rc = cr_sendcmdandreceive(rhnd, cmd, key, member);
+  
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_sadd(REDIS rhnd, const char *key, const char *member)
+{
+  return cr_setaddrem(rhnd, CR_CMD_SADD, key, member);
+}
+
+int credis_srem(REDIS rhnd, const char *key, const char *member)
+{
+  return cr_setaddrem(rhnd, CR_CMD_SREM, key, member);
+}
+
+int credis_spop(REDIS rhnd, const char *key, char **member)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_SPOP, key);
+
+  if (rc == 0 && (*member = rhnd->reply.bulk) == NULL)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_smove(REDIS rhnd, const char *sourcekey, const char *destkey, 
+                 const char *member)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_SMOVE, sourcekey, destkey, member);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_scard(REDIS rhnd, const char *key) 
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_SCARD, key);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_sinter(REDIS rhnd, int keyc, const char **keyv, char ***members)
+{
+  return cr_multikeybulkcommand(rhnd, CR_CMD_SINTER, keyc, keyv, members);
+}
+
+int credis_sunion(REDIS rhnd, int keyc, const char **keyv, char ***members)
+{
+  return cr_multikeybulkcommand(rhnd, CR_CMD_SUNION, keyc, keyv, members);
+}
+
+int credis_sdiff(REDIS rhnd, int keyc, const char **keyv, char ***members)
+{
+  return cr_multikeybulkcommand(rhnd, CR_CMD_SDIFF, keyc, keyv, members);
+}
+
+int credis_sinterstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv)
+{
+  return cr_multikeystorecommand(rhnd, CR_CMD_SINTERSTORE, destkey, keyc, keyv);
+}
+
+int credis_sunionstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv)
+{
+  return cr_multikeystorecommand(rhnd, CR_CMD_SUNIONSTORE, destkey, keyc, keyv);
+}
+
+int credis_sdiffstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv)
+{
+  return cr_multikeystorecommand(rhnd, CR_CMD_SDIFFSTORE, destkey, keyc, keyv);
+}
+
+int credis_sismember(REDIS rhnd, const char *key, const char *member)
+{
+  return cr_setaddrem(rhnd, CR_CMD_SISMEMBER, key, member);
+}
+
+int credis_smembers(REDIS rhnd, const char *key, char ***members)
+{
+  return cr_multikeybulkcommand(rhnd, CR_CMD_SMEMBERS, 1, &key, members);
+}
+
+int credis_smembersbin(REDIS rhnd, const char *key, char ***members, int **memberlenv)
+{
+  int rc = cr_multikeybulkcommand(rhnd, CR_CMD_SMEMBERS, 1, &key, members);
+
+  if (rc >= 0)
+    *memberlenv = rhnd->reply.multibulk.lens;
+
+  return rc;
+}
+
+int credis_zadd(REDIS rhnd, const char *key, double score, const char *member)
+{
+  char scorestr[CR_DOUBLE_STRING_SIZE];
+  int rc;
+
+  cr_dtoa(scorestr, score);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZADD, key, scorestr, member);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_zrem(REDIS rhnd, const char *key, const char *member)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZREM, key, member);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+/* TODO what does Redis return if member is not member of set? */
+int credis_zincrby(REDIS rhnd, const char *key, double incr_score, const char *member, double *new_score)
+{
+  char scorestr[CR_DOUBLE_STRING_SIZE];
+  int rc;
+
+  cr_dtoa(scorestr, incr_score);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZINCRBY, key, scorestr, member);
+
+  if (rc == 0 && new_score)
+    *new_score = cr_strtod(rhnd->reply.bulk);
+
+  return rc;
+}
+
+static int cr_zrank(REDIS rhnd, int reverse, const char *key, const char *member)
+{
+  int rc = cr_sendcmdandreceive(rhnd, reverse==1?CR_CMD_ZREVRANK:CR_CMD_ZRANK, key, member);
+
+  if (rc == 0) {
+    if (rhnd->reply.type == CR_INT)
+      rc = rhnd->reply.integer;
+    else
+      rc = -1;
+  }
+
+  return rc;
+}
+
+int credis_zrank(REDIS rhnd, const char *key, const char *member)
+{
+  return cr_zrank(rhnd, 0, key, member);
+}
+
+int credis_zrevrank(REDIS rhnd, const char *key, const char *member)
+{
+  return cr_zrank(rhnd, 1, key, member);
+}
+
+int cr_zrange(REDIS rhnd, int reverse, const char *key, int start, int end, char ***elementv)
+{
+  char startstr[CR_INT_STRING_SIZE], endstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(startstr, start);
+  cr_itoa(endstr, end);
+  rc = cr_sendcmdandreceive(rhnd, reverse==1?CR_CMD_ZREVRANGE:CR_CMD_ZRANGE, 
+                            key, startstr, endstr);
+
+  if (rc == 0) {
+    *elementv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_zrange(REDIS rhnd, const char *key, int start, int end, char ***elementv)
+{
+  return cr_zrange(rhnd, 0, key, start, end, elementv);
+}
+
+int credis_zrevrange(REDIS rhnd, const char *key, int start, int end, char ***elementv)
+{
+  return cr_zrange(rhnd, 1, key, start, end, elementv);
+}
+
+int cr_zrangebyscore(REDIS rhnd, int reverse, const char *key, double a, double b, char ***elementv)
+{
+  char astr[CR_DOUBLE_STRING_SIZE], bstr[CR_DOUBLE_STRING_SIZE];
+  int rc;
+
+  cr_dtoa(astr, a);
+  cr_dtoa(bstr, b);
+  rc = cr_sendcmdandreceive(rhnd, reverse==1?CR_CMD_ZREVRANGEBYSCORE:CR_CMD_ZRANGEBYSCORE, 
+                            key, astr, bstr);
+
+  if (rc == 0) {
+    *elementv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_zrangebyscore(REDIS rhnd, const char *key, double min, double max, char ***elementv)
+{
+  return cr_zrangebyscore(rhnd, 0, key, min, max, elementv);
+}
+
+int credis_zrevrangebyscore(REDIS rhnd, const char *key, double max, double min, char ***elementv)
+{
+  return cr_zrangebyscore(rhnd, 1, key, max, min, elementv);
+}
+
+int credis_zcard(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZCARD, key);
+
+  if (rc == 0) {
+    if (rhnd->reply.integer == 0)
+      rc = -1;
+    else
+      rc = rhnd->reply.integer;
+  }
+
+  return rc;
+}
+
+int credis_zscore(REDIS rhnd, const char *key, const char *member, double *score)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZSCORE, key, member);
+
+  if (rc == 0) {
+    if (!rhnd->reply.bulk)
+      rc = -1;
+    else if (score)
+      *score = cr_strtod(rhnd->reply.bulk);
+  }
+
+  return rc;
+}
+
+int credis_zremrangebyscore(REDIS rhnd, const char *key, double min, double max)
+{
+  char minstr[CR_DOUBLE_STRING_SIZE], maxstr[CR_DOUBLE_STRING_SIZE];
+  int rc;
+
+  cr_dtoa(minstr, min);
+  cr_dtoa(maxstr, max);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZREMRANGEBYSCORE, key, minstr, maxstr);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_zremrangebyrank(REDIS rhnd, const char *key, int start, int end)
+{
+  char startstr[CR_INT_STRING_SIZE], endstr[CR_INT_STRING_SIZE];
+  int rc;
+
+  cr_itoa(startstr, start);
+  cr_itoa(endstr, end);
+  rc = cr_sendcmdandreceive(rhnd, CR_CMD_ZREMRANGEBYRANK, key, startstr, endstr);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+static int cr_zstore(REDIS rhnd, int inter, const char *destkey, int keyc, const char **keyv, 
+                     const int *weightv, REDIS_AGGREGATE aggregate)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  char str[CR_INT_STRING_SIZE];
+  int rc, i, argc;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+
+  argc = 3 + keyc;
+  if (weightv != NULL)
+    argc += 1 + keyc;
+  if (aggregate != NONE)
+    argc += 2;
+
+  if ((rc = cr_appendcommand(buf, rhnd->commands[inter?CR_CMD_ZINTERSTORE:CR_CMD_ZUNIONSTORE], argc)) != 0)
+    return rc;
+  if ((rc = cr_appendarg(buf, destkey, strlen(destkey))) != 0)
+    return rc;
+  if ((rc = cr_appendarg(buf, str, cr_itoa(str, keyc))) != 0)
+    return rc;
+  if ((rc = cr_appendstrarray(buf, keyc, keyv)) != 0)
+    return rc;
+
+  if (weightv != NULL) {
+    if ((rc = cr_appendarg(buf, "WEIGHTS", 7)) != 0)
+      return rc;
+    for (i = 0; i < keyc; i++)
+      if ((rc = cr_appendarg(buf, str, cr_itoa(str, weightv[i]))) != 0)
+        return rc;
+  }
+
+  switch (aggregate) {
+  case SUM: 
+    rc = cr_appendstrarray(buf, 2, (const char *[]){"AGGREGATE", "SUM"});
+    break;
+  case MIN:
+    rc = cr_appendstrarray(buf, 2, (const char *[]){"AGGREGATE", "MIN"});
+    break;
+  case MAX:
+    rc = cr_appendstrarray(buf, 2, (const char *[]){"AGGREGATE", "MAX"});
+    break;
+  case NONE:
+    ; /* avoiding compiler warning */
+  }
+  if (rc != 0)
+    return rc;
+
+  if ((rc = cr_sendandreceive(rhnd, CR_INT)) == 0) 
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_zinterstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv, 
+                       const int *weightv, REDIS_AGGREGATE aggregate)
+{
+  return cr_zstore(rhnd, 1, destkey, keyc, keyv, weightv, aggregate);
+}
+
+int credis_zunionstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv, 
+                       const int *weightv, REDIS_AGGREGATE aggregate)
+{
+  return cr_zstore(rhnd, 0, destkey, keyc, keyv, weightv, aggregate);
+}
+
+int credis_hset(REDIS rhnd, const char *key, const char *field, const char *value)
+{
+  return credis_hsetbin(rhnd, key, field, value, strlen(value));
+}
+
+int credis_hsetbin(REDIS rhnd, const char *key, const char *field, const char *value, 
+                   int valuelen)
+{
+  const char *argv[] = {key, field, value};
+  const int argvlen[] = {strlen(key), strlen(field), valuelen};
+  int rc = cr_sendcommandandreceive(rhnd, CR_CMD_HSET, 3, argv, argvlen);
+
+  if (rc == 0 && rhnd->reply.integer == 0)
+    rc = -1;
+
+  return rc;
+}
+
+int credis_hget(REDIS rhnd, const char *key, const char *field, char **value)
+{
+  return cr_cacheget(rhnd, key, field, value);
+}
+
+int credis_hgetbin(REDIS rhnd, const char *key, const char *field, char **value, 
+                   int *valuelen)
+{
+  int rc = credis_hget(rhnd, key, field, value);
+
+  if (rc == 0)
+    *valuelen = rhnd->reply.bulklen;
+
+  return rc;
+}
+
+int credis_hkeys(REDIS rhnd, const char *key, char ***fieldv)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_HKEYS, key);
+
+  if (rc == 0) {
+    rc = rhnd->reply.multibulk.len;
+    *fieldv = rhnd->reply.multibulk.bulks;
+  }
+
+  return rc;
+}
+
+int credis_hlen(REDIS rhnd, const char *key)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_HLEN, key);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;
+}
+
+int credis_hmget(REDIS rhnd, const char *key, int fieldc, const char **fieldv, char ***valv)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc;
+
+  if ((rc = cr_newcommand(rhnd)) != 0)
+    return rc;
+  if ((rc = cr_appendcommand(buf, rhnd->commands[CR_CMD_HMGET], fieldc + 2)) != 0)
+    return rc;
+  if ((rc = cr_appendarg(buf, key, strlen(key))) != 0)
+    return rc;
+  if ((rc = cr_appendstrarray(buf, fieldc, fieldv)) != 0)
+    return rc;
+
+  if ((rc = cr_sendandreceive(rhnd, CR_MULTIBULK)) == 0) {
+    *valv = rhnd->reply.multibulk.bulks;
+    rc = rhnd->reply.multibulk.len;
+  }
+
+  return rc;
+}
+
+int credis_hmgetbin(REDIS rhnd, const char *key, int fieldc, const char **fieldv, 
+                    char ***valv, int **vallenv)
+{
+  int rc = credis_hmget(rhnd, key, fieldc, fieldv, valv);
+
+  if (rc >= 0)
+    *vallenv = rhnd->reply.multibulk.lens;
+
+  return rc;
+}
+
+
+/* returns first message in FIFO and removes it from queue. returns NULL if 
+ * the queue is empty */
+static cr_message * cr_getmessage(REDIS rhnd)
+{
+  cr_message *msg;
+
+  if (rhnd->pubsub.len == 0)
+    return NULL;
+
+  msg = &(rhnd->pubsub.queue[rhnd->pubsub.head]);
+  rhnd->pubsub.head = (rhnd->pubsub.head + 1) & (rhnd->pubsub.size - 1);
+  rhnd->pubsub.len--;
+
+  return msg;
+}
+
+/* messages are stored in an arena, they are all released at once */
+static void cr_freeallmessages(REDIS rhnd)
+{
+  rhnd->pubsub.head = 0;
+  rhnd->pubsub.len = 0;
+  cr_arenareset(&(rhnd->pubsub.arena));
+}
+
+/* Makes room for at least one more message in FIFO, the ring is allocated 
+ * upfront and doubled when full.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_reservemessage(REDIS rhnd)
+{
+  cr_message *queue;
+  int i, size;
+
+  if (rhnd->pubsub.len < rhnd->pubsub.size)
+    return 0;
+
+  size = rhnd->pubsub.size > 0 ? rhnd->pubsub.size * 2 : CR_PUBSUB_QUEUE_SIZE;
+  DEBUG("grow message queue to %d messages", size);
+  if ((queue = cr_malloc(sizeof(cr_message) * size)) == NULL)
+    return CREDIS_ERR_NOMEM;
+
+  for (i = 0; i < rhnd->pubsub.len; i++)
+    queue[i] = rhnd->pubsub.queue[(rhnd->pubsub.head + i) & (rhnd->pubsub.size - 1)];
+  if (rhnd->pubsub.queue != NULL)
+    cr_free(rhnd->pubsub.queue);
+
+  rhnd->pubsub.queue = queue;
+  rhnd->pubsub.head = 0;
+  rhnd->pubsub.size = size;
+
+  return 0;
+}
+
+/* adds copy of message last in FIFO. if successful a pointer to the queued 
+ * message is returned else NULL is returned. */
+static cr_message * cr_storemessage(REDIS rhnd, const cr_message *message)
+{
+  cr_arena *arena = &(rhnd->pubsub.arena);
+  cr_message *msg;
+
+  if (cr_reservemessage(rhnd) != 0)
+    return NULL;
+  msg = &(rhnd->pubsub.queue[(rhnd->pubsub.head + rhnd->pubsub.len) & 
+                             (rhnd->pubsub.size - 1)]);
+  msg->pattern = NULL;
+  msg->len = message->len;
+
+  if ((message->pattern != NULL && 
+       (msg->pattern = cr_arenastrdup(arena, message->pattern)) == NULL) ||
+      (msg->channel = cr_arenastrdup(arena, message->channel)) == NULL ||
+      (msg->message = cr_arenamemdup(arena, message->message, message->len)) == NULL) {
+    DEBUG("out of memory\n");
+    return NULL;
+  }
+  rhnd->pubsub.len++;
+  
+  return msg;
+}
+
+static int cr_parsepubsubmessage(REDIS rhnd, cr_message *msg)
+{
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+
+  if (mb->len >= 4 && mb->bulks[0] != NULL && !strcmp("pmessage", mb->bulks[0]) &&
+      mb->bulks[2] != NULL && mb->bulks[3] != NULL) {
+    msg->pattern = mb->bulks[1];
+    msg->channel = mb->bulks[2];
+    msg->message = mb->bulks[3];
+    msg->len = mb->lens[3];
+  }
+  else if (mb->len >= 3 && mb->bulks[0] != NULL && !strcmp("message", mb->bulks[0]) &&
+           mb->bulks[1] != NULL && mb->bulks[2] != NULL) {
+    msg->pattern = NULL;
+    msg->channel = mb->bulks[1];
+    msg->message = mb->bulks[2];
+    msg->len = mb->lens[2];
+  }
+  else
+    return CREDIS_ERR_PROTOCOL;
+
+  return 0;
+}
+
+/* Parses next pushed reply in buffer, receiving more data only if `wait' is
+ * set. Parsing of a partially received reply is resumed by the next call.
+ * Returns:
+ *   1  a reply has been parsed
+ *   0  no complete reply in buffer
+ *  <0  on error */
+static int cr_receivepushed(REDIS rhnd, int wait)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  int rc;
+
+  while ((rc = cr_parse(&(rhnd->parser), buf->data + buf->idx, buf->len - buf->idx)) == 0) {
+    if (!wait)
+      return 0;
+    if (cr_receivemore(rhnd, rhnd->parser.need) <= 0)
+      return rhnd->error = CREDIS_ERR_RECV;
+  }
+
+  if (rc < 0 || (rc = cr_setreply(rhnd)) != 0)
+    return rhnd->error = rc;
+
+  return 1;
+}
+
+/* wait for a specific pub/sub message, for instance the reply to an
+ * subscription request, and store (p)messages received during wait to
+ * message queue. When `data' is NULL, i.e. unsubscribing from all, the ack
+ * that leaves no channels, or patterns, is waited for. Gives up after the handle's 
+ * timeout even if messages keep arriving. Returns number of channels/patterns
+ * subscribed to. */
+static int cr_sendandwaitforpubsub(REDIS rhnd, const char *command, const char *data)
+{
+  cr_buffer *out = &(rhnd->pubsub.out);
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  cr_message msg;
+  long start;
+  int rc, count, patterns = (command[0] == 'P');
+
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+
+  /* messages last returned by credis_listen() are no longer referenced */
+  if (rhnd->pubsub.len == 0)
+    cr_freeallmessages(rhnd);
+  if ((rc = cr_reservemessage(rhnd)) != 0)
+    return rc;
+
+  /* pushed messages not yet read are kept in handle's buffer */
+  if (rhnd->pubsub.subscriptions == 0) {
+    cr_scandrain(rhnd);
+    rhnd->buf.len = 0;
+    rhnd->buf.idx = 0;
+  }
+
+  out->len = 0;
+  if (data != NULL)
+    rc = cr_appendargv(out, 2, (const char *[]){command, data}, NULL);
+  else
+    rc = cr_appendargv(out, 1, &command, NULL);
+  if (rc != 0)
+    return rc;
+
+  CR_STATS(rhnd, commands, 1);
+  if ((rc = cr_senddata(rhnd, out->data, out->len)) != out->len) {
+    if (rc < 0)
+      return rhnd->error = CREDIS_ERR_SEND;
+    return rhnd->error = CREDIS_ERR_TIMEOUT;
+  }
+
+  /* wait for pushed messages */
+  start = cr_msecs();
+  while (1) {
+    if ((rc = cr_receivereply(rhnd, CR_PUSH)) != 0)
+      return rc;
+
+    if (mb->len >= 3 && mb->bulks[0] != NULL && mb->bulks[2] != NULL &&
+        !strcasecmp(command, mb->bulks[0])) {
+      /* acks only tell the total number of subscriptions */
+      count = cr_strtoll(mb->bulks[2]);
+      if (!patterns)
+        rhnd->pubsub.channels += count - rhnd->pubsub.subscriptions;
+      rhnd->pubsub.subscriptions = count;
+
+      if (data != NULL ? (mb->bulks[1] != NULL && !strcasecmp(data, mb->bulks[1]))
+                       : (patterns ? count == rhnd->pubsub.channels : rhnd->pubsub.channels == 0))
+        return count;
+    }
+    else if (cr_parsepubsubmessage(rhnd, &msg) == 0) {
+      if (cr_storemessage(rhnd, &msg) == NULL)
+        return CREDIS_ERR_NOMEM;
+    }
+    /* acks of other channels when unsubscribing from all are skipped */
+
+    if (cr_msecs() - start >= rhnd->timeout) {
+      CR_STATS(rhnd, timeouts, 1);
+      return CREDIS_ERR_TIMEOUT;
+    }
+  }
+}
+
+int credis_subscribe(REDIS rhnd, const char *channel)
+{
+  return cr_sendandwaitforpubsub(rhnd, "SUBSCRIBE", channel);
+}
+
+int credis_unsubscribe(REDIS rhnd, const char *channel)
+{
+  return cr_sendandwaitforpubsub(rhnd, "UNSUBSCRIBE", channel);
+}
+
+int credis_psubscribe(REDIS rhnd, const char *pattern)
+{
+  return cr_sendandwaitforpubsub(rhnd, "PSUBSCRIBE", pattern);
+}
+
+int credis_punsubscribe(REDIS rhnd, const char *pattern)
+{
+  return cr_sendandwaitforpubsub(rhnd, "PUNSUBSCRIBE", pattern);
+}
+
+int credis_publish(REDIS rhnd, const char *channel, const char *message)
+{
+  int rc = cr_sendcmdandreceive(rhnd, CR_CMD_PUBLISH, channel, message);
+
+  if (rc == 0)
+    rc = rhnd->reply.integer;
+
+  return rc;                            
+}
+
+int credis_listen(REDIS rhnd, char **pattern, char **channel, char **message)
+{
+  cr_message *msg, m;
+  int rc;
+
+  /* check message queue first */
+  if ((msg = cr_getmessage(rhnd)) == NULL) {
+    /* no queued messages are referenced anymore */
+    cr_freeallmessages(rhnd);
+
+    /* wait for message */
+    if ((rc = cr_receivereply(rhnd, CR_MULTIBULK)) != 0 ||
+        (rc = cr_parsepubsubmessage(rhnd, &m)) != 0)
+      return rc;
+    msg = &m;
+  }
+
+  *pattern = msg->pattern;
+  *channel = msg->channel;
+  *message = msg->message;
+
+  return 0;
+}
+
+int credis_listenbatch(REDIS rhnd, REDIS_MESSAGE *msgv, int max, int timeout)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  cr_message *msg, m;
+  int rc, n = 0;
+
+  if (rhnd->pubsub.subscriptions == 0)
+    return CREDIS_ERR_PUBSUB;
+
+  /* messages returned by previous call are no longer referenced */
+  if (rhnd->pubsub.len == 0)
+    cr_freeallmessages(rhnd);
+  buf->len -= buf->idx;
+  memmove(buf->data, buf->data + buf->idx, buf->len);
+  buf->idx = 0;
+
+  for (; n < max && (msg = cr_getmessage(rhnd)) != NULL; n++) {
+    msgv[n].pattern = msg->pattern;
+    msgv[n].channel = msg->channel;
+    msgv[n].message = msg->message;
+    msgv[n].len = msg->len;
+  }
+
+  /* only the first message is waited for, the rest is what is already 
+   * received since buffer must not move once messages refer to it */
+  while (n < max) {
+    if ((rc = cr_receivepushed(rhnd, 0)) == 0) {
+      if (n > 0)
+        break;
+      if ((rc = cr_selectreadable(rhnd->fd, timeout)) == 0)
+        return 0;
+      if (rc < 0)
+        return rhnd->error = CREDIS_ERR_RECV;
+      rc = cr_receivepushed(rhnd, 1);
+    }
+    if (rc < 0)
+      return rc;
+
+    if (cr_parsepubsubmessage(rhnd, &m) == 0) {
+      msgv[n].pattern = m.pattern;
+      msgv[n].channel = m.channel;
+      msgv[n].message = m.message;
+      msgv[n].len = m.len;
+      n++;
+    }
+  }
+
+  return n;
+}
+
+/* 32-bit FNV-1a, continuing from `hash' so that a hash can be computed in
+ * parts. Start with CR_FNV_OFFSET and finish with cr_fmix32() */
+#define CR_FNV_OFFSET 2166136261U
+
+static unsigned int cr_fnv1a(unsigned int hash, const char *buf, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (unsigned char)buf[i]) * 16777619U;
+
+  return hash;
+}
+
+/* MurmurHash3 finalizer, spreads FNV-1a hashes of similar strings evenly
+ * over the ring */
+static unsigned int cr_fmix32(unsigned int hash)
+{
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bU;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35U;
+  hash ^= hash >> 16;
+
+  return hash;
+}
+
+static unsigned int cr_cachehash(const char *key, int keylen)
+{
+  return cr_fmix32(cr_fnv1a(CR_FNV_OFFSET, key, keylen));
+}
+
+static int cr_cacheentrysize(int keylen, int fieldlen, int vallen)
+{
+  return sizeof(cr_cacheentry) + keylen + 1 + 
+    (fieldlen < 0 ? 0 : fieldlen + 1) + (vallen < 0 ? 0 : vallen + 1);
+}
+
+/* Returns entry of `key', and `field' unless it is NULL, or NULL if not 
+ * cached */
+static cr_cacheentry * cr_cachefind(cr_cache *cache, const char *key, 
+                                    const char *field)
+{
+  int keylen = strlen(key), fieldlen = field != NULL ? (int)strlen(field) : -1;
+  unsigned int hash = cr_cachehash(key, keylen);
+  cr_cacheentry *e;
+
+  for (e = cache->buckets[hash & cache->mask]; e != NULL; e = e->next) {
+    if (e->hash == hash && e->keylen == keylen && e->fieldlen == fieldlen &&
+        !memcmp(e->data, key, keylen) &&
+        (field == NULL || !memcmp(e->data + keylen + 1, field, fieldlen)))
+      return e;
+  }
+
+  return NULL;
+}
+
+/* Removes entry from its hash bucket and the clock, the last entry of the
+ * clock takes its place */
+static void cr_cacheunlink(cr_cache *cache, cr_cacheentry *e)
+{
+  cr_cacheentry **pe = &(cache->buckets[e->hash & cache->mask]), *last;
+
+  while (*pe != e)
+    pe = &((*pe)->next);
+  *pe = e->next;
+
+  last = cache->clock[--cache->len];
+  cache->clock[e->slot] = last;
+  last->slot = e->slot;
+  if (cache->hand >= cache->len)
+    cache->hand = 0;
+
+  cache->bytes -= cr_cacheentrysize(e->keylen, e->fieldlen, e->vallen);
+  cr_free(e);
+}
+
+/* Removes entries of `key', including those of all fields if key is a hash */
+static void cr_cacheremove(cr_cache *cache, const char *key, int keylen)
+{
+  unsigned int hash;
+  cr_cacheentry *e, *next;
+
+  if (cache->len == 0 || keylen > cache->maxkeylen)
+    return;
+
+  hash = cr_cachehash(key, keylen);
+  for (e = cache->buckets[hash & cache->mask]; e != NULL; e = next) {
+    next = e->next;
+    if (e->hash == hash && e->keylen == keylen && !memcmp(e->data, key, keylen))
+      cr_cacheunlink(cache, e);
+  }
+}
+
+static void cr_cacheclear(cr_cache *cache)
+{
+  int i;
+
+  for (i = 0; i < cache->len; i++)
+    cr_free(cache->clock[i]);
+  memset(cache->buckets, 0, sizeof(cr_cacheentry *) * (cache->mask + 1));
+  cache->len = 0;
+  cache->hand = 0;
+  cache->bytes = 0;
+}
+
+static void cr_cachefree(cr_cache *cache)
+{
+  if (cache == NULL)
+    return;
+
+  if (cache->buckets != NULL) {
+    cr_cacheclear(cache);
+    cr_free(cache->buckets);
+  }
+  if (cache->clock != NULL)
+    cr_free(cache->clock);
+  credis_close(cache->inv);
+  cr_free(cache);
+}
+
+/* Evicts an entry that has not been hit since the clock hand last passed it, 
+ * passing clears the reference bit of entries */
+static void cr_cacheevict(cr_cache *cache)
+{
+  while (cache->clock[cache->hand]->referenced) {
+    cache->clock[cache->hand]->referenced = 0;
+    cache->hand = (cache->hand + 1) % cache->len;
+  }
+  cr_cacheunlink(cache, cache->clock[cache->hand]);
+}
+
+/* Adds copy of value, NULL if nil, of `key' and `field' unless it is NULL. 
+ * Values that do not fit are not cached, which is not an error */
+static void cr_cacheput(cr_cache *cache, const char *key, const char *field, 
+                        const char *val, int vallen)
+{
+  int keylen = strlen(key), fieldlen = field != NULL ? (int)strlen(field) : -1;
+  int size;
+  cr_cacheentry *e;
+  char *ptr;
+
+  if (val == NULL)
+    vallen = -1;
+  size = cr_cacheentrysize(keylen, fieldlen, vallen);
+  if (keylen >= CR_ZEROCOPY_SIZE || size > cache->maxbytes)
+    return;
+
+  while (cache->len > 0 && 
+         (cache->len == cache->maxentries || cache->bytes + size > cache->maxbytes))
+    cr_cacheevict(cache);
+
+  if ((e = cr_malloc(size)) == NULL)
+    return;
+
+  e->hash = cr_cachehash(key, keylen);
+  e->keylen = keylen;
+  e->fieldlen = fieldlen;
+  e->vallen = vallen;
+  e->referenced = 0;
+  ptr = e->data;
+  memcpy(ptr, key, keylen + 1);
+  ptr += keylen + 1;
+  if (field != NULL) {
+    memcpy(ptr, field, fieldlen + 1);
+    ptr += fieldlen + 1;
+  }
+  if (val != NULL) {
+    memcpy(ptr, val, vallen);
+    ptr[vallen] = '\0';
+  }
+
+  e->next = cache->buckets[e->hash & cache->mask];
+  cache->buckets[e->hash & cache->mask] = e;
+  e->slot = cache->len;
+  cache->clock[cache->len++] = e;
+  cache->bytes += size;
+  if (keylen > cache->maxkeylen)
+    cache->maxkeylen = keylen;
+}
+
+/* Removes the keys of an invalidation message just parsed by the
+ * invalidation connection, a nil message means the database was flushed */
+static void cr_cacheinvalidate(cr_cache *cache)
+{
+  REDIS inv = cache->inv;
+  cr_multibulk *mb = &(inv->reply.multibulk);
+  cr_node *nodes = inv->parser.nodes;
+  int i, n, len;
+
+  if (inv->reply.type != CR_MULTIBULK || mb->len < 3 || mb->bulks[0] == NULL ||
+      strcmp("message", mb->bulks[0]))
+    return;
+
+  /* node of third element, the message */
+  n = nodes[nodes[1].next].next;
+  if (nodes[n].type == CR_MULTIBULK) {
+    len = nodes[n].len;
+    for (i = 0, n++; i < len; i++, n = nodes[n].next) {
+      if (nodes[n].type == CR_BULK && nodes[n].idx >= 0)
+        cr_cacheremove(cache, inv->reply.base + nodes[n].idx, nodes[n].len);
+    }
+  }
+  else if (nodes[n].idx < 0) {
+    DEBUG("database flushed, clear cache");
+    cr_cacheclear(cache);
+  }
+  else
+    cr_cacheremove(cache, mb->bulks[2], mb->lens[2]);
+}
+
+/* Applies invalidation messages received so far without waiting for more. If 
+ * invalidation connection is lost coherence can not be maintained and the
+ * cache is cleared and bypassed from then on */
+static void cr_cachepoll(cr_cache *cache)
+{
+  cr_buffer *buf = &(cache->inv->buf);
+  int rc;
+
+  cache->polled = cr_msecs();
+  while ((rc = cr_selectreadable(cache->inv->fd, 0)) > 0) {
+    buf->len -= buf->idx;
+    memmove(buf->data, buf->data + buf->idx, buf->len);
+    buf->idx = 0;
+
+    if (cr_receivemore(cache->inv, cache->inv->parser.need) <= 0) {
+      rc = CREDIS_ERR_RECV;
+      break;
+    }
+    while ((rc = cr_receivepushed(cache->inv, 0)) == 1)
+      cr_cacheinvalidate(cache);
+    if (rc < 0)
+      break;
+  }
+
+  if (rc < 0) {
+    DEBUG("invalidation connection lost, bypass cache");
+    cr_cacheclear(cache);
+    credis_close(cache->inv);
+    cache->inv = NULL;
+  }
+}
+
+/* Called for each command about to be sent with cache enabled, starting at
+ * offset `start' of message buffer. Arguments other than the command name 
+ * are taken to be keys the command may modify and entries of them are 
+ * removed, the server's invalidation message may arrive well after the 
+ * reply */
+static void cr_cachewrite(REDIS rhnd, int start)
+{
+  cr_cache *cache = rhnd->cache;
+  char *ptr = rhnd->buf.data + start, *end = rhnd->buf.data + rhnd->buf.len;
+  int i, argc, len, ref = 0;
+
+  if (cache->len == 0 || cache->fetching)
+    return;
+
+  argc = cr_strtoll(ptr + 1);
+  while (ptr < end && *ptr++ != '\n')
+    ;
+
+  for (i = 0; i < argc && ptr < end; i++) {
+    len = cr_strtoll(ptr + 1);
+    while (ptr < end && *ptr++ != '\n')
+      ;
+    /* argument sent from caller's memory is too large to be a cached key */
+    if (ref < rhnd->zerocopy.len && 
+        rhnd->zerocopy.refs[ref].pos == ptr - rhnd->buf.data) {
+      ref++;
+      ptr += 2;
+      continue;
+    }
+    if (i > 0)
+      cr_cacheremove(cache, ptr, len);
+    ptr += len + 2;
+  }
+}
+
+/* Sends GET, or HGET if `field' is not NULL, unless value is cached. A 
+ * cached value is made available in handle's reply just like a received 
+ * one */
+static int cr_cacheget(REDIS rhnd, const char *key, const char *field, char **val)
+{
+  cr_cache *cache = rhnd->cache;
+  cr_cacheentry *e;
+  int rc, cached = cache != NULL && cache->inv != NULL && !rhnd->pipeline.active;
+
+  if (cached) {
+    if (cr_msecs() - cache->polled >= CR_CACHE_POLL_INTERVAL)
+      cr_cachepoll(cache);
+
+    if (cache->inv == NULL)
+      cached = 0;
+    else if ((e = cr_cachefind(cache, key, field)) != NULL) {
+      CR_STATS(rhnd, cache_hits, 1);
+      e->referenced = 1;
+      rhnd->reply.type = CR_BULK;
+      rhnd->reply.bulk = NULL;
+      rhnd->reply.bulklen = 0;
+      /* value is copied to message buffer, where returned data always is, 
+       * since entry may be evicted, and for credis_detach() to cover it */
+      if (e->vallen >= 0) {
+        rhnd->buf.len = 0;
+        rhnd->buf.idx = 0;
+        if (cr_reserve(&(rhnd->buf), e->vallen + 1))
+          return CREDIS_ERR_NOMEM;
+        memcpy(rhnd->buf.data, e->data + e->keylen + 1 + 
+               (e->fieldlen < 0 ? 0 : e->fieldlen + 1), e->vallen + 1);
+        rhnd->reply.bulk = rhnd->buf.data;
+        rhnd->reply.bulklen = e->vallen;
+      }
+      return (*val = rhnd->reply.bulk) == NULL ? -1 : 0;
+    }
+    else {
+      CR_STATS(rhnd, cache_misses, 1);
+      cache->fetching = 1;
+    }
+  }
+
+  if (field == NULL)
+    rc = cr_sendcmdandreceive(rhnd, CR_CMD_GET, key);
+  else
+    rc = cr_sendcmdandreceive(rhnd, CR_CMD_HGET, key, field);
+
+  if (cached) {
+    cache->fetching = 0;
+    if (rc == 0)
+      cr_cacheput(cache, key, field, rhnd->reply.bulk, rhnd->reply.bulklen);
+  }
+
+  if (rc == 0 && (*val = rhnd->reply.bulk) == NULL)
+    return -1;
+
+  return rc;
+}
+
+int credis_cache_enable(REDIS rhnd, int maxentries, int maxbytes)
+{
+  cr_cache *cache;
+  char id[CR_INT_STRING_SIZE];
+  int rc, size = 1;
+
+  if (rhnd->cache != NULL || maxentries <= 0 || maxbytes <= 0)
+    return CREDIS_ERR;
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+
+  while (size < maxentries)
+    size *= 2;
+
+  if ((cache = cr_calloc(sizeof(cr_cache), 1)) == NULL ||
+      (cache->buckets = cr_calloc(sizeof(cr_cacheentry *), size)) == NULL ||
+      (cache->clock = cr_malloc(sizeof(cr_cacheentry *) * maxentries)) == NULL) {
+    cr_cachefree(cache);
+    return CREDIS_ERR_NOMEM;
+  }
+  cache->mask = size - 1;
+  cache->maxentries = maxentries;
+  cache->maxbytes = maxbytes;
+
+  /* invalidation messages are pushed to a connection of its own, subscribed
+   * to the channel the server redirects them to. It is authenticated as the
+   * handle is, while protocol version and database do not matter to it */
+  if ((cache->inv = credis_connect(rhnd->host, rhnd->port, rhnd->timeout)) == NULL) {
+    cr_cachefree(cache);
+    return CREDIS_ERR_CONNECT;
+  }
+  if ((rhnd->reconnect.password != NULL && 
+       (rc = credis_auth(cache->inv, rhnd->reconnect.password)) != 0) ||
+      (rc = cr_sendstrandreceive(cache->inv, CR_INT, "CLIENT", "ID")) != 0)
+    goto error;
+  cr_itoa(id, cache->inv->reply.integer);
+  if ((rc = credis_subscribe(cache->inv, "__redis__:invalidate")) < 0 ||
+      (rc = cr_sendstrandreceive(rhnd, CR_INLINE, "CLIENT", "TRACKING", "ON", 
+                                 "REDIRECT", id)) != 0)
+    goto error;
+
+  cache->polled = cr_msecs();
+  rhnd->cache = cache;
+
+  return 0;
+
+error:
+  cr_cachefree(cache);
+  return rc;
+}
+
+int credis_cache_disable(REDIS rhnd)
 {
-  char *line, prefix=0;
+  if (rhnd->cache == NULL)
+    return 0;
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
 
-  /* reset common send/receive buffer */
-  rhnd->buf.len = 0;
-  rhnd->buf.idx = 0;
+  cr_cachefree(rhnd->cache);
+  rhnd->cache = NULL;
 
-  if (cr_readln(rhnd, 0, &line, NULL) > 0) {
-    prefix = *(line++);
- 
-    if (recvtype != CR_ANY && prefix != recvtype && prefix != CR_ERROR)
-      return CREDIS_ERR_PROTOCOL;
+  return cr_sendstrandreceive(rhnd, CR_INLINE, "CLIENT", "TRACKING", "OFF");
+}
 
-    rhnd->reply.type = prefix;
 
-    switch(prefix) {
-    case CR_ERROR:
-      return cr_receiveerror(rhnd, line);
-    case CR_INLINE:
-      return cr_receiveinline(rhnd, line);
-    case CR_INT:
-      return cr_receiveint(rhnd, line);
-    case CR_BULK:
-      return cr_receivebulk(rhnd, line);
-    case CR_MULTIBULK:
-      return cr_receivemultibulk(rhnd, line);
-    }   
-  }
+int credis_pipeline_begin(REDIS rhnd)
+{
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
 
-  return CREDIS_ERR_RECV;
-}
+  rhnd->pipeline.active = 1;
+  rhnd->pipeline.queued = 0;
+  rhnd->pipeline.pending = 0;
+  rhnd->pipeline.mark = 0;
+  rhnd->buf.len = 0;
 
-static void cr_delete(REDIS rhnd) 
-{
-  cr_freeallmessages(rhnd);
-  if (rhnd->reply.multibulk.bulks != NULL)
-    free(rhnd->reply.multibulk.bulks);
-  if (rhnd->reply.multibulk.idxs != NULL)
-    free(rhnd->reply.multibulk.idxs);
-  if (rhnd->buf.data != NULL)
-    free(rhnd->buf.data);
-  if (rhnd->ip != NULL)
-    free(rhnd->ip);
-  if (rhnd != NULL)
-    free(rhnd);
+  return 0;
 }
 
-REDIS cr_new(void) 
+/* With reconnect enabled, flushed commands are copied and kept until all 
+ * replies have been read, to be sent again if the connection is lost */
+static void cr_pipelinekeep(REDIS rhnd)
 {
-  REDIS rhnd;
+  cr_buffer *replay = &(rhnd->reconnect.replay);
 
-  if ((rhnd = calloc(sizeof(cr_redis), 1)) == NULL ||
-      (rhnd->ip = malloc(32)) == NULL ||
-      (rhnd->buf.data = malloc(CR_BUFFER_SIZE)) == NULL ||
-      (rhnd->reply.multibulk.bulks = malloc(sizeof(char *)*CR_MULTIBULK_SIZE)) == NULL ||
-      (rhnd->reply.multibulk.idxs = malloc(sizeof(int)*CR_MULTIBULK_SIZE)) == NULL) {
-    cr_delete(rhnd);
-    return NULL;   
+  if (rhnd->pipeline.pending == 0) {
+    replay->len = 0;
+    rhnd->reconnect.sent = 0;
   }
+  if (rhnd->reconnect.sent < 0)
+    return;
 
-  rhnd->buf.size = CR_BUFFER_SIZE;
-  rhnd->reply.multibulk.size = CR_MULTIBULK_SIZE;
-
-  return rhnd;
+  if (cr_reserve(replay, rhnd->pipeline.mark)) {
+    rhnd->reconnect.sent = -1;
+    return;
+  }
+  memcpy(replay->data + replay->len, rhnd->buf.data, rhnd->pipeline.mark);
+  replay->len += rhnd->pipeline.mark;
+  rhnd->reconnect.sent += rhnd->pipeline.queued;
 }
 
-/* Send message that has been prepared in message buffer prior to the call
- * to this function. Wait and receive reply. */
-static int cr_sendandreceive(REDIS rhnd, char recvtype)
+/* Reconnects after connection was lost with `unanswered' replies of flushed
+ * commands outstanding, and sends those commands again if all of them are 
+ * read-only. Otherwise the replies are dropped, since some commands may have
+ * been carried out and some not.
+ * Returns:
+ *   0  on success, replies are pending again
+ *  <0  on error */
+static int cr_pipelinerecover(REDIS rhnd, int unanswered)
 {
-  int rc;
+  cr_buffer *replay = &(rhnd->reconnect.replay);
+  int rc, off;
 
-  DEBUG("Sending message: len=%d, data=%s", rhnd->buf.len, rhnd->buf.data);
-
-  rc = cr_senddata(rhnd->fd, rhnd->timeout, rhnd->buf.data, rhnd->buf.len);
+  if ((rc = cr_reconnect(rhnd)) != 0)
+    return rc;
 
-  if (rc != rhnd->buf.len) {
-    if (rc < 0)
-      return CREDIS_ERR_SEND;
-    return CREDIS_ERR_TIMEOUT;
-  }
+  rhnd->pipeline.pending = 0;
+  if (rhnd->reconnect.sent < unanswered ||
+      (off = cr_replayoffset(replay->data, replay->len, rhnd->reconnect.sent - unanswered)) < 0)
+    return CREDIS_ERR_RECV;
 
-  if (recvtype != CR_NONE)
-    rc = cr_receivereply(rhnd, recvtype);
+  DEBUG("sending %d pipelined commands again", unanswered);
+  if (cr_senddata(rhnd, replay->data + off, replay->len - off) != replay->len - off)
+    return rhnd->error = CREDIS_ERR_SEND;
+  rhnd->pipeline.pending = unanswered;
 
-  return rc;
+  return 0;
 }
 
-/* Prepare message buffer for sending using a printf()-style formatting. */
-__attribute__ ((format(printf,3,4)))
-static int cr_sendfandreceive(REDIS rhnd, char recvtype, const char *format, ...)
+static int cr_pipelineflush(REDIS rhnd)
 {
-  int rc;
-  va_list ap;
-  cr_buffer *buf = &(rhnd->buf);
-
-  va_start(ap, format);
-  rc = vsnprintf(buf->data, buf->size, format, ap);
-  va_end(ap);
+  int rc, unanswered;
 
-  if (rc < 0) {
-#ifdef WIN32
-    /* handle the fact that vnsprintf() returns -1 if the buffer is too small */
-    rc = buf->size * 2;
-#else
-    return -1;
-#endif
-  }
+  if (rhnd->pipeline.queued > 0) {
+    DEBUG("Sending %d pipelined commands: len=%d", 
+          rhnd->pipeline.queued, rhnd->pipeline.mark);
 
-  while (rc >= buf->size) {
-    DEBUG("truncated, get more memory and try again");
-    if (cr_moremem(buf, rc - buf->size + 1))
-      return CREDIS_ERR_NOMEM;
+    if (rhnd->reconnect.attempts > 0)
+      cr_pipelinekeep(rhnd);
 
-    va_start(ap, format);
-    rc = vsnprintf(buf->data, buf->size, format, ap);
-    va_end(ap);
+    rc = cr_senddata(rhnd, rhnd->buf.data, rhnd->pipeline.mark);
 
-    if (rc < 0) {
-#ifdef WIN32
-      rc = buf->size * 2;
-#else
-      return -1;
-#endif
+    if (rc != rhnd->pipeline.mark) {
+      unanswered = rhnd->pipeline.pending + rhnd->pipeline.queued;
+      rhnd->pipeline.queued = 0;
+      rhnd->pipeline.mark = 0;
+      if (rc < 0 && rhnd->reconnect.attempts > 0 &&
+          cr_pipelinerecover(rhnd, unanswered) == 0)
+        return rhnd->pipeline.pending;
+      if (rc < 0)
+        return rhnd->error = CREDIS_ERR_SEND;
+      return rhnd->error = CREDIS_ERR_TIMEOUT;
     }
-  }
 
-  buf->len = rc;
+    /* buffer is from now on used for receiving replies */
+    rhnd->pipeline.pending = rhnd->pipeline.queued;
+    rhnd->pipeline.queued = 0;
+    rhnd->pipeline.mark = 0;
+    rhnd->buf.len = 0;
+    rhnd->buf.idx = 0;
+  }
 
-  return cr_sendandreceive(rhnd, recvtype);
+  return rhnd->pipeline.pending;
 }
 
-char * credis_errorreply(REDIS rhnd)
+int credis_pipeline_flush(REDIS rhnd)
 {
-  return rhnd->reply.line;
-}
+  if (!rhnd->pipeline.active || rhnd->pipeline.multi)
+    return CREDIS_ERR_PIPELINE;
 
-void credis_close(REDIS rhnd)
-{
-  if (rhnd) {
-    if (rhnd->fd > 0)
-      close(rhnd->fd);
-#ifdef WIN32
-    WSACleanup();
-#endif
-    cr_delete(rhnd);
-  }
+  return cr_pipelineflush(rhnd);
 }
 
-/* Requests Redis server information and tries to fill handle with server version 
- * information */ 
-static int cr_getredisversion(REDIS rhnd)
+int credis_pipeline_next(REDIS rhnd, REDIS_REPLY *reply)
 {
-  /* We can receive 2 version formats: x.yz and x.y.z, where x.yz was only used prior 
-   * first 1.1.0 release(?), e.g. stable releases 1.02 and 1.2.6 */
-  /* TODO check returned error string, "-ERR operation not permitted", to detect if 
-   * server require password? */
-  if (cr_sendfandreceive(rhnd, CR_BULK, "INFO\r\n") == 0) {
-    int items = sscanf(rhnd->reply.bulk,
-                       "redis_version:%d.%d.%d\r\n",
-                       &(rhnd->version.major),
-                       &(rhnd->version.minor),
-                       &(rhnd->version.patch));
-    if (items == 2) {
-      rhnd->version.patch = rhnd->version.minor;
-      rhnd->version.minor = 0;
-    }
-    DEBUG("Connected to Redis version: %d.%d.%d\n", 
-          rhnd->version.major, rhnd->version.minor, rhnd->version.patch);
+  int rc, replays = 0;
 
-    rhnd->version.number = CR_VERSION(rhnd->version.major, rhnd->version.minor, rhnd->version.patch);
+  if (rhnd->pipeline.pending == 0)
+    return -1;
+
+  while ((rc = cr_receivereply(rhnd, CR_ANY)) == CREDIS_ERR_RECV && 
+         rhnd->reconnect.attempts > 0 && replays++ < CR_RECONNECT_REPLAYS &&
+         cr_pipelinerecover(rhnd, rhnd->pipeline.pending) == 0)
+    ;
+
+  /* an error reply is a valid reply in this context */
+  if (rc == CREDIS_ERR_PROTOCOL && rhnd->reply.type == CR_ERROR)
+    rc = 0;
+
+  if (rc != 0) {
+    /* connection is out of sync, drop remaining replies */
+    rhnd->pipeline.pending = 0;
+    return rc;
   }
 
+  rhnd->pipeline.pending--;
+
+  cr_fillreply(rhnd, reply);
+
   return 0;
 }
 
-REDIS credis_connect(const char *host, int port, int timeout)
+int credis_pipeline_end(REDIS rhnd)
 {
-  int fd, rc, flags, yes = 1;
-  struct sockaddr_in sa;  
-  REDIS rhnd;
+  REDIS_REPLY reply;
+  int rc = 0;
 
-#ifdef WIN32
-  unsigned long addr;
-  WSADATA data;
-  
-  if (WSAStartup(MAKEWORD(2,2), &data) != 0) {
-    DEBUG("Failed to init Windows Sockets DLL\n");
-    return NULL;
-  }
-#endif
+  if (!rhnd->pipeline.active || rhnd->pipeline.multi)
+    return CREDIS_ERR_PIPELINE;
 
-  if ((rhnd = cr_new()) == NULL)
-    return NULL;
+  /* discard commands not flushed and replies not read */
+  rhnd->pipeline.queued = 0;
+  rhnd->pipeline.mark = 0;
+  while (rhnd->pipeline.pending > 0 && (rc = credis_pipeline_next(rhnd, &reply)) == 0)
+    ;
 
-  if (host == NULL)
-    host = "127.0.0.1";
-  if (port == 0)
-    port = 6379;
+  rhnd->pipeline.active = 0;
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
 
-#ifdef WIN32
-  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
-      setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const char *)&yes, sizeof(yes)) == -1 ||
-      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const char *)&yes, sizeof(yes)) == -1)
-    goto error;
-#else
-  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
-      setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void *)&yes, sizeof(yes)) == -1 ||
-      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&yes, sizeof(yes)) == -1)
-    goto error;
-#endif
+  return rc;
+}
 
-  sa.sin_family = AF_INET;
-  sa.sin_port = htons(port);
+/* Appends command of elements `first' to `first' + `count' - 1 of `batch' to
+ * handle's message buffer
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_batchappend(REDIS rhnd, const cr_batch *batch, int first, int count)
+{
+  cr_buffer *buf = &(rhnd->buf);
+  char score[CR_DOUBLE_STRING_SIZE];
+  int rc, i, per = 1 + (batch->scorev != NULL) + (batch->bv != NULL);
+
+  if ((rc = cr_newcommand(rhnd)) != 0 ||
+      (rc = cr_appendheader(buf, 1 + (batch->key != NULL) + count * per)) != 0 ||
+      (rc = cr_appendarg(buf, batch->cmd, strlen(batch->cmd))) != 0 ||
+      (batch->key != NULL && 
+       (rc = cr_appendarg(buf, batch->key, strlen(batch->key))) != 0))
+    return rc;
 
-#ifdef WIN32
-  struct hostent *he;
+  for (i = first; i < first + count; i++) {
+    if (batch->scorev != NULL &&
+        (rc = cr_appendarg(buf, score, cr_dtoa(score, batch->scorev[i]))) != 0)
+      return rc;
+    if ((rc = cr_appendarg(buf, batch->av[i], batch->alenv ? batch->alenv[i] : 
+                           strlen(batch->av[i]))) != 0)
+      return rc;
+    if (batch->bv != NULL &&
+        (rc = cr_appendarg(buf, batch->bv[i], batch->blenv ? batch->blenv[i] : 
+                           strlen(batch->bv[i]))) != 0)
+      return rc;
+  }
 
-  /* TODO use getaddrinfo() instead! */
-  addr = inet_addr(host);
-  if (addr == INADDR_NONE)
-    he = gethostbyname(host);
-  else
-    he = gethostbyaddr((char *)&addr, sizeof(addr), AF_INET);
+  return 0;
+}
 
-  if (he == NULL)
-    goto error;
+/* Sends `batch' as one command, or if it has more elements than `size' as 
+ * several commands of at most `size' elements that are pipelined 
+ * CR_BATCH_WINDOW commands at a time. In pipeline mode all commands are just
+ * queued.
+ * Returns:
+ *  >=0 on success, sum of integer replies or the last one if `last' is set
+ *   1  CREDIS_QUEUED in pipeline mode
+ *  <0  on error, CREDIS_ERR_PROTOCOL if any of the commands failed */
+static int cr_batchcommand(REDIS rhnd, char recvtype, const cr_batch *batch, 
+                           int size, int last)
+{
+  REDIS_REPLY reply;
+  int rc = 0, i = 0, j, count, total = 0, failed = 0;
 
-  memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
-#else
-  int err;
-  struct addrinfo hints, *info;
- 
-  if (inet_aton(host, &sa.sin_addr) == 0) {
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    err = getaddrinfo(host, NULL, &hints, &info);
-    if (err)
-      DEBUG("getaddrinfo error: %s\n", gai_strerror(err));
-    memcpy(&sa.sin_addr.s_addr, &(info->ai_addr->sa_data[2]), sizeof(in_addr_t));
-    freeaddrinfo(info);
+  if (batch->n <= 0)
+    return 0;
+  if (size < 1)
+    size = 1;
+
+  if (rhnd->pipeline.active) {
+    for (; i < batch->n; i += count) {
+      count = batch->n - i < size ? batch->n - i : size;
+      if ((rc = cr_batchappend(rhnd, batch, i, count)) != 0 ||
+          (rc = cr_sendandreceive(rhnd, recvtype)) != CREDIS_QUEUED)
+        return rc;
+    }
+    return CREDIS_QUEUED;
   }
-#endif
 
-  /* connect with user specified timeout */
-
-  flags = fcntl(fd, F_GETFL);
-  if ((rc = fcntl(fd, F_SETFL, flags | O_NONBLOCK)) < 0) {
-    DEBUG("Setting socket non-blocking failed with: %d\n", rc);
+  if (batch->n <= size) {
+    if ((rc = cr_batchappend(rhnd, batch, 0, batch->n)) != 0 ||
+        (rc = cr_sendandreceive(rhnd, recvtype)) != 0)
+      return rc;
+    return recvtype == CR_INT ? rhnd->reply.integer : 0;
   }
 
-  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
-    if (errno != EINPROGRESS)
-      goto error;
-
-    if (cr_selectwritable(fd, timeout) > 0) {
-      int err;
-      unsigned int len = sizeof(err);
-      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err)
-        goto error;
+  DEBUG("split batch of %d elements in commands of %d", batch->n, size);
+  credis_pipeline_begin(rhnd);
+  while (i < batch->n && rc >= 0) {
+    for (j = 0; j < CR_BATCH_WINDOW && i < batch->n; j++, i += count) {
+      count = batch->n - i < size ? batch->n - i : size;
+      if ((rc = cr_batchappend(rhnd, batch, i, count)) != 0 ||
+          (rc = cr_sendandreceive(rhnd, recvtype)) != CREDIS_QUEUED)
+        break;
+    }
+    if (rc == CREDIS_QUEUED)
+      rc = cr_pipelineflush(rhnd);
+
+    /* all replies are read to keep handle in sync even if a command failed */
+    while (rc >= 0 && rhnd->pipeline.pending > 0 && 
+           (rc = credis_pipeline_next(rhnd, &reply)) == 0) {
+      if (reply.type == CREDIS_REPLY_ERROR)
+        failed = 1;
+      else if (reply.type == CREDIS_REPLY_INTEGER)
+        total = last ? reply.integer : total + reply.integer;
     }
-    else /* timeout or select error */
-      goto error;
   }
-  /* else connect completed immediately */
-
-  strcpy(rhnd->ip, inet_ntoa(sa.sin_addr));
-  rhnd->port = port;
-  rhnd->fd = fd;
-  rhnd->timeout = timeout;
+  if (rc >= 0)
+    rc = credis_pipeline_end(rhnd);
+  else
+    credis_pipeline_end(rhnd);
 
-  if (cr_getredisversion(rhnd) != 0)
-    goto error;
+  if (rc < 0)
+    return rc;
+  if (failed)
+    return CREDIS_ERR_PROTOCOL;
 
-  return rhnd;
+  return total;
+}
 
-error:
-  if (fd > 0)
-    close(fd);
-  cr_delete(rhnd);
-  return NULL;
+/* Variadic SADD, ZADD, LPUSH and RPUSH require Redis 2.4, on older servers 
+ * elements are added one command each */
+static int cr_variadicsize(REDIS rhnd)
+{
+  return rhnd->version.number >= CR_VERSION(2,4,0) ? rhnd->batchsize : 1;
 }
 
-void credis_settimeout(REDIS rhnd, int timeout)
+void credis_setbatchsize(REDIS rhnd, int size)
 {
-  rhnd->timeout = timeout;
+  rhnd->batchsize = size > 0 ? size : 1;
 }
 
-int credis_set(REDIS rhnd, const char *key, const char *val)
+int credis_msetbin(REDIS rhnd, int keyc, const char **keyv, const char **valv, 
+                   const int *vallenv)
 {
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SET %s %s\r\n", 
-			      key, val);
-  else
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SET %s %zu\r\n%s\r\n", 
-			      key, strlen(val), val);
+  cr_batch batch = {"MSET", NULL, keyc, NULL, keyv, NULL, valv, vallenv};
+
+  return cr_batchcommand(rhnd, CR_INLINE, &batch, rhnd->batchsize, 0);
 }
 
-int credis_setex(REDIS rhnd, const char *key, const char *val, int seconds)
+int credis_mset(REDIS rhnd, int keyc, const char **keyv, const char **valv)
 {
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SETEX %s %d %s\r\n",
-			      key, seconds, val);
-  else
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SETEX %s %d %zu\r\n%s\r\n",
-			      key, seconds, strlen(val), val);
+  return credis_msetbin(rhnd, keyc, keyv, valv, NULL);
 }
 
-int credis_get(REDIS rhnd, const char *key, char **val)
+int credis_msetnx(REDIS rhnd, int keyc, const char **keyv, const char **valv)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "GET %s\r\n", key);
+  cr_batch batch = {"MSETNX", NULL, keyc, NULL, keyv, NULL, valv, NULL};
+  int rc;
 
-  if (rc == 0 && (*val = rhnd->reply.bulk) == NULL)
-    return -1;
+  if (keyc <= 0)
+    return 0;
 
-  return rc;
+  /* all or nothing, so never split */
+  if ((rc = cr_batchcommand(rhnd, CR_INT, &batch, keyc, 0)) < 0 || 
+      rhnd->pipeline.active)
+    return rc;
+
+  return rc == 1 ? 0 : -1;
 }
 
-int credis_getset(REDIS rhnd, const char *key, const char *set_val, char **get_val)
+int credis_hmsetbin(REDIS rhnd, const char *key, int fieldc, const char **fieldv, 
+                    const char **valv, const int *vallenv)
 {
-  int rc;
+  cr_batch batch = {"HMSET", key, fieldc, NULL, fieldv, NULL, valv, vallenv};
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "GETSET %s %s\r\n", 
-			    key, set_val);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "GETSET %s %zu\r\n%s\r\n", 
-			    key, strlen(set_val), set_val);
-  
-  if (rc == 0 && (*get_val = rhnd->reply.bulk) == NULL)
-    return -1;
+  return cr_batchcommand(rhnd, CR_INLINE, &batch, rhnd->batchsize, 0);
+}
 
-  return rc;
+int credis_hmset(REDIS rhnd, const char *key, int fieldc, const char **fieldv, 
+                 const char **valv)
+{
+  return credis_hmsetbin(rhnd, key, fieldc, fieldv, valv, NULL);
 }
 
-int credis_ping(REDIS rhnd) 
+int credis_saddv(REDIS rhnd, const char *key, int memberc, const char **memberv)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "PING\r\n");
+  cr_batch batch = {"SADD", key, memberc, NULL, memberv, NULL, NULL, NULL};
+
+  return cr_batchcommand(rhnd, CR_INT, &batch, cr_variadicsize(rhnd), 0);
 }
 
-int credis_echo(REDIS rhnd, const char *message, char **reply)
+int credis_zaddv(REDIS rhnd, const char *key, int memberc, const double *scorev, 
+                 const char **memberv)
 {
-  int rc;
+  cr_batch batch = {"ZADD", key, memberc, scorev, memberv, NULL, NULL, NULL};
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "ECHO %s\r\n", 
-			    message);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "ECHO %zu\r\n%s\r\n", 
-			    strlen(message), message);
-  
-  if (rc == 0 && (*reply = rhnd->reply.bulk) == NULL)
-    return -1;
+  return cr_batchcommand(rhnd, CR_INT, &batch, cr_variadicsize(rhnd), 0);
+}
 
-  return rc;
+int credis_rpushvbin(REDIS rhnd, const char *key, int valc, const char **valv, 
+                     const int *vallenv)
+{
+  cr_batch batch = {"RPUSH", key, valc, NULL, valv, vallenv, NULL, NULL};
+
+  return cr_batchcommand(rhnd, CR_INT, &batch, cr_variadicsize(rhnd), 1);
 }
 
-int credis_quit(REDIS rhnd) 
+int credis_rpushv(REDIS rhnd, const char *key, int valc, const char **valv)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "QUIT\r\n");
+  return credis_rpushvbin(rhnd, key, valc, valv, NULL);
 }
 
-int credis_auth(REDIS rhnd, const char *password)
+int credis_lpushvbin(REDIS rhnd, const char *key, int valc, const char **valv, 
+                     const int *vallenv)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INLINE, "AUTH %s\r\n", password);
+  cr_batch batch = {"LPUSH", key, valc, NULL, valv, vallenv, NULL, NULL};
 
-  /* Request Redis server version once we have been authenticated */
-  if (rc == 0)
-    return cr_getredisversion(rhnd);
+  return cr_batchcommand(rhnd, CR_INT, &batch, cr_variadicsize(rhnd), 1);
+}
 
-  return rc;
+int credis_lpushv(REDIS rhnd, const char *key, int valc, const char **valv)
+{
+  return credis_lpushvbin(rhnd, key, valc, valv, NULL);
 }
 
-static int cr_multikeybulkcommand(REDIS rhnd, const char *cmd, int keyc, 
-                                  const char **keyv, char ***valv)
+
+int credis_multi(REDIS rhnd)
 {
-  cr_buffer *buf = &(rhnd->buf);
   int rc;
 
-  buf->len = 0;
-  if ((rc = cr_appendstr(buf, cmd, 0)) != 0)
+  if ((rc = credis_pipeline_begin(rhnd)) != 0)
     return rc;
-  if ((rc = cr_appendstrarray(buf, keyc, keyv, 1)) != 0)
+  rhnd->pipeline.multi = 1;
+
+  if ((rc = cr_sendcmdandreceive(rhnd, CR_CMD_MULTI)) != CREDIS_QUEUED) {
+    credis_discard(rhnd);
     return rc;
-  if ((rc = cr_sendandreceive(rhnd, CR_MULTIBULK)) == 0) {
-    *valv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
   }
 
-  return rc;
+  return 0;
 }
 
-static int cr_multikeystorecommand(REDIS rhnd, const char *cmd, const char *destkey, 
-                                   int keyc, const char **keyv)
+int credis_exec(REDIS rhnd, REDIS_REPLY *reply)
 {
-  cr_buffer *buf = &(rhnd->buf);
-  int rc;
+  REDIS_REPLY ack, exec;
+  int rc, commands;
 
-  buf->len = 0;
-  if ((rc = cr_appendstr(buf, cmd, 0)) != 0)
-    return rc;
-  if ((rc = cr_appendstr(buf, destkey, 1)) != 0)
-    return rc;
-  if ((rc = cr_appendstrarray(buf, keyc, keyv, 1)) != 0)
-    return rc;
+  if (!rhnd->pipeline.multi)
+    return CREDIS_ERR_PIPELINE;
 
-  /* integer reply and not inline as documentation specifies */
-  if ((rc = cr_sendandreceive(rhnd, CR_INT)) == 0)
-    rc = rhnd->reply.integer;
+  /* commands queued in between MULTI and EXEC */
+  commands = rhnd->pipeline.queued - 1;
 
-  return rc;
-}
+  if ((rc = cr_sendcmdandreceive(rhnd, CR_CMD_EXEC)) != CREDIS_QUEUED ||
+      (rc = cr_pipelineflush(rhnd)) < 0) {
+    credis_discard(rhnd);
+    return rc;
+  }
 
-int credis_mget(REDIS rhnd, int keyc, const char **keyv, char ***valv)
-{
-  return cr_multikeybulkcommand(rhnd, "MGET", keyc, keyv, valv);
-}
+  /* acknowledgements of MULTI and queued commands are of no interest, a 
+   * command refused when queued makes EXEC fail as a whole */
+  while (rhnd->pipeline.pending > 1 && (rc = credis_pipeline_next(rhnd, &ack)) == 0)
+    ;
+  if (rc == 0)
+    rc = credis_pipeline_next(rhnd, &exec);
 
-int credis_setnx(REDIS rhnd, const char *key, const char *val)
-{
-  int rc;
+  rhnd->pipeline.active = 0;
+  rhnd->pipeline.multi = 0;
+  rhnd->pipeline.pending = 0;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "SETNX %s %s\r\n", 
-			    key, val);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "SETNX %s %zu\r\n%s\r\n", 
-			    key, strlen(val), val);
+  if (rc != 0)
+    return rc;
+  if (reply != NULL)
+    *reply = exec;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if (exec.type == CREDIS_REPLY_ERROR)
+    return CREDIS_ERR_PROTOCOL;
+  /* EXEC replies nil if a watched key was modified, a null in RESP3 */
+  if (exec.type == CREDIS_REPLY_NIL)
+    return -1;
+  if (exec.type != CREDIS_REPLY_MULTIBULK)
+    return rhnd->error = CREDIS_ERR_PROTOCOL;
+  if (exec.elements == 0 && commands > 0)
+    return -1;
 
-  return rc;
+  return exec.elements;
 }
 
-static int cr_incr(REDIS rhnd, int incr, int decr, const char *key, int *new_val)
+int credis_discard(REDIS rhnd)
 {
-  int rc = 0;
-
-  if (incr == 1 || decr == 1)
-    rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s\r\n", 
-                            incr>0?"INCR":"DECR", key);
-  else if (incr > 1 || decr > 1)
-    rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %d\r\n", 
-                            incr>0?"INCRBY":"DECRBY", key, incr>0?incr:decr);
-
-  if (rc == 0 && new_val != NULL)
-    *new_val = rhnd->reply.integer;
+  if (!rhnd->pipeline.multi)
+    return CREDIS_ERR_PIPELINE;
 
-  return rc;
+  /* nothing has been sent to server */
+  rhnd->pipeline.active = 0;
+  rhnd->pipeline.multi = 0;
+  rhnd->pipeline.queued = 0;
+  rhnd->pipeline.mark = 0;
+  rhnd->buf.len = 0;
+  rhnd->buf.idx = 0;
+
+  return 0;
 }
 
-int credis_incr(REDIS rhnd, const char *key, int *new_val)
+int credis_watch(REDIS rhnd, int keyc, const char **keyv)
 {
-  return cr_incr(rhnd, 1, 0, key, new_val);
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+
+  return cr_multikeycommand(rhnd, CR_CMD_WATCH, keyc, keyv);
 }
 
-int credis_decr(REDIS rhnd, const char *key, int *new_val)
+int credis_unwatch(REDIS rhnd)
 {
-  return cr_incr(rhnd, 0, 1, key, new_val);
+  if (rhnd->pipeline.active)
+    return CREDIS_ERR_PIPELINE;
+
+  return cr_sendcmdandreceive(rhnd, CR_CMD_UNWATCH);
 }
 
-int credis_incrby(REDIS rhnd, const char *key, int incr_val, int *new_val)
+#define cr_rol32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void cr_sha1block(unsigned int *h, const unsigned char *p)
 {
-  return cr_incr(rhnd, incr_val, 0, key, new_val);
+  unsigned int w[80], a, b, c, d, e, f, k, t;
+  int i;
+
+  for (i = 0; i < 16; i++)
+    w[i] = (unsigned int)p[4*i] << 24 | (unsigned int)p[4*i+1] << 16 | 
+      (unsigned int)p[4*i+2] << 8 | p[4*i+3];
+  for (i = 16; i < 80; i++)
+    w[i] = cr_rol32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+  a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+  for (i = 0; i < 80; i++) {
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5A827999;
+    }
+    else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ED9EBA1;
+    }
+    else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8F1BBCDC;
+    }
+    else {
+      f = b ^ c ^ d;
+      k = 0xCA62C1D6;
+    }
+    t = cr_rol32(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = cr_rol32(b, 30);
+    b = a;
+    a = t;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
 }
 
-int credis_decrby(REDIS rhnd, const char *key, int decr_val, int *new_val)
+/* Computes SHA1 digest of `len' bytes of `data', as Redis identifies 
+ * scripts, and stores it in `hex' as 40 hex digits and a terminating zero */
+static void cr_sha1(const char *data, int len, char *hex)
 {
-  return cr_incr(rhnd, 0, decr_val, key, new_val);
+  unsigned int h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+  unsigned long long bits = (unsigned long long)len * 8;
+  unsigned char block[64];
+  int i, n;
+
+  for (i = 0; i + 64 <= len; i += 64)
+    cr_sha1block(h, (const unsigned char *)data + i);
+
+  /* pad with a 1 bit, zeros and length in bits */
+  n = len - i;
+  memcpy(block, data + i, n);
+  block[n++] = 0x80;
+  if (n > 56) {
+    memset(block + n, 0, 64 - n);
+    cr_sha1block(h, block);
+    n = 0;
+  }
+  memset(block + n, 0, 56 - n);
+  for (i = 0; i < 8; i++)
+    block[56 + i] = (unsigned char)(bits >> (56 - 8*i));
+  cr_sha1block(h, block);
+
+  for (i = 0; i < 40; i++)
+    hex[i] = "0123456789abcdef"[(h[i/8] >> (28 - 4*(i%8))) & 0xf];
+  hex[40] = '\0';
 }
 
-int credis_append(REDIS rhnd, const char *key, const char *val)
+/* Loads script on server of handle.
+ * Returns:
+ *   0  on success
+ *  <0  on error */
+static int cr_scriptload(REDIS rhnd, cr_script *script)
 {
+  const char *argv[] = {"SCRIPT", "LOAD", script->body};
+  const int argvlen[] = {6, 4, script->len};
   int rc;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "APPEND %s %s\r\n", 
-			    key, val);
-  else 
-    rc = cr_sendfandreceive(rhnd, CR_INT, "APPEND %s %zu\r\n%s\r\n", 
-			    key, strlen(val), val);
-                            
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  if ((rc = cr_sendargvandreceive(rhnd, CR_BULK, 3, argv, argvlen)) != 0)
+    return rc;
+  if (rhnd->reply.bulklen != 40 || memcmp(rhnd->reply.bulk, script->sha, 40) != 0)
+    return CREDIS_ERR_PROTOCOL;
 
-  return rc;                            
+  return 0;
 }
 
-int credis_substr(REDIS rhnd, const char *key, int start, int end, char **substr)
+/* Moves scripts registered with handle `from' to handle `to', replacing it
+ * after a reconnect, and loads them on its server. Scripts that fail to load
+ * are loaded when first run */
+static void cr_scriptsmove(REDIS from, REDIS to)
 {
-  int rc;
+  int i;
 
-  if (rhnd->version.number <= CR_VERSION(2,0,0))
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "SUBSTR %s %d %d\r\n", 
-			    key, start, end);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "GETRANGE %s %d %d\r\n", 
-			    key, start, end);
+  if (from == NULL)
+    return;
 
-  if (rc == 0 && substr) 
-    *substr = rhnd->reply.bulk;
+  to->scripts = from->scripts;
+  memset(&(from->scripts), 0, sizeof(from->scripts));
 
-  return rc;                            
+  for (i = 0; i < to->scripts.len; i++)
+    cr_scriptload(to, to->scripts.v[i]);
 }
 
-int credis_getrange(REDIS rhnd, const char *key, int start, int end, char **substr)
+static int cr_evalsha(REDIS rhnd, cr_script *script, int keyc, const char **keyv, 
+                      const int *keylenv, int argc, const char **argv, const int *argvlen)
 {
-  return credis_substr(rhnd, key, start, end, substr);
+  cr_buffer *buf = &(rhnd->buf);
+  char numkeys[CR_INT_STRING_SIZE];
+  int i, rc;
+
+  if ((rc = cr_newcommand(rhnd)) != 0 ||
+      (rc = cr_appendheader(buf, 3 + keyc + argc)) != 0 ||
+      (rc = cr_appendarg(buf, "EVALSHA", 7)) != 0 ||
+      (rc = cr_appendarg(buf, script->sha, 40)) != 0 ||
+      (rc = cr_appendarg(buf, numkeys, cr_itoa(numkeys, keyc))) != 0)
+    return rc;
+
+  for (i = 0; i < keyc; i++)
+    if ((rc = cr_appendargzerocopy(rhnd, keyv[i], keylenv ? keylenv[i] : strlen(keyv[i]))) != 0)
+      return rc;
+  for (i = 0; i < argc; i++)
+    if ((rc = cr_appendargzerocopy(rhnd, argv[i], argvlen ? argvlen[i] : strlen(argv[i]))) != 0)
+      return rc;
+
+  return cr_sendandreceive(rhnd, CR_ANY);
 }
 
-int credis_exists(REDIS rhnd, const char *key)
+REDIS_SCRIPT credis_script_create(const char *body)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "EXISTS %s\r\n", key);
+  cr_script *script;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if ((script = cr_calloc(sizeof(cr_script), 1)) == NULL)
+    return NULL;
+  if ((script->body = cr_strdup(body)) == NULL) {
+    cr_free(script);
+    return NULL;
+  }
 
-  return rc;
+  script->len = strlen(body);
+  cr_sha1(script->body, script->len, script->sha);
+
+  return script;
 }
 
-int credis_del(REDIS rhnd, const char *key)
+void credis_script_destroy(REDIS_SCRIPT script)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "DEL %s\r\n", key);
+  if (script == NULL)
+    return;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  cr_free(script->body);
+  cr_free(script);
+}
 
-  return rc;
+const char *credis_script_sha(REDIS_SCRIPT script)
+{
+  return script->sha;
 }
 
-int credis_type(REDIS rhnd, const char *key)
+int credis_script_register(REDIS rhnd, REDIS_SCRIPT script)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INLINE, "TYPE %s\r\n", key);
+  void *ptr;
+  int i;
 
-  if (rc == 0) {
-    char *t = rhnd->reply.line;
-    if (!strcmp("string", t))
-      rc = CREDIS_TYPE_STRING;
-    else if (!strcmp("list", t))
-      rc = CREDIS_TYPE_LIST;
-    else if (!strcmp("set", t))
-      rc = CREDIS_TYPE_SET;
-    else
-      rc = CREDIS_TYPE_NONE;
+  for (i = 0; i < rhnd->scripts.len && rhnd->scripts.v[i] != script; i++)
+    ;
+  if (i == rhnd->scripts.len) {
+    if (rhnd->scripts.len == rhnd->scripts.size) {
+      if ((ptr = cr_realloc(rhnd->scripts.v, sizeof(cr_script *) * 
+                            (rhnd->scripts.size + 8))) == NULL)
+        return CREDIS_ERR_NOMEM;
+      rhnd->scripts.v = (cr_script **)ptr;
+      rhnd->scripts.size += 8;
+    }
+    rhnd->scripts.v[rhnd->scripts.len++] = script;
   }
 
-  return rc;
+  return cr_scriptload(rhnd, script);
 }
 
-int credis_keys(REDIS rhnd, const char *pattern, char ***keyv)
+int credis_evalsha(REDIS rhnd, REDIS_SCRIPT script, int keyc, const char **keyv, 
+                   const int *keylenv, int argc, const char **argv, const int *argvlen,
+                   REDIS_REPLY *reply)
 {
-  int rc;
+  int rc = cr_evalsha(rhnd, script, keyc, keyv, keylenv, argc, argv, argvlen);
 
-  /* with Redis 2.0.0 keys-command returns a multibulk instead of bulk */
-  if (rhnd->version.number >= CR_VERSION(2,0,0)) {
-    rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "KEYS %s\r\n", pattern);
-  }
-  else {
-    if ((rc = cr_sendfandreceive(rhnd, CR_BULK, "KEYS %s\r\n", pattern)) == 0) {
-      /* server returns keys as space-separated strings, use multi-bulk 
-       * storage to store keys */
-      rc = cr_splitstrtomultibulk(rhnd, rhnd->reply.bulk, ' ');
-    }
+  /* script is not cached by server, e.g. after a restart or SCRIPT FLUSH */
+  if (rc == CREDIS_ERR_PROTOCOL && rhnd->reply.type == CR_ERROR &&
+      strncmp(rhnd->reply.line, "NOSCRIPT", 8) == 0) {
+    DEBUG("script %s not loaded, loading and retrying", script->sha);
+    if ((rc = cr_scriptload(rhnd, script)) == 0)
+      rc = cr_evalsha(rhnd, script, keyc, keyv, keylenv, argc, argv, argvlen);
   }
 
-  if (rc == 0) {
-    *keyv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
-  }
+  if ((rc == 0 || (rc == CREDIS_ERR_PROTOCOL && rhnd->reply.type == CR_ERROR)) &&
+      reply != NULL)
+    cr_fillreply(rhnd, reply);
 
   return rc;
 }
 
-int credis_randomkey(REDIS rhnd, char **key)
+static void cr_asyncupdateevents(REDIS_ASYNC ahnd)
 {
-  int rc;
+  int events = CREDIS_ASYNC_READ;
 
-  /* with Redis 2.0.0 randomkey-command returns a bulk instead of inline */
-  if (rhnd->version.number >= CR_VERSION(2,0,0)) {
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "RANDOMKEY\r\n");
+  if (ahnd->out.idx < ahnd->out.len)
+    events |= CREDIS_ASYNC_WRITE;
 
-    if (rc == 0 && key) 
-      *key = rhnd->reply.bulk;
+  if (events != ahnd->events) {
+    ahnd->events = events;
+    if (ahnd->hook != NULL)
+      ahnd->hook(ahnd, events, ahnd->hookdata);
   }
-  else {
-    rc = cr_sendfandreceive(rhnd, CR_INLINE, "RANDOMKEY\r\n");
+}
+
+/* Appends callback to FIFO of commands waiting for a reply.
+ * Returns:
+ *   0  on success
+ *  <0  on error, i.e. more memory not available */
+static int cr_asyncpushcallback(REDIS_ASYNC ahnd, credis_async_callback fn, void *privdata,
+                                int len)
+{
+  cr_asynccallbacks *cbs = &(ahnd->callbacks);
+  cr_asynccallback *ptr;
+  int i;
 
-    if (rc == 0 && key) 
-      *key = rhnd->reply.line;
+  if (cbs->len == cbs->size) {
+    if ((ptr = cr_malloc(2 * cbs->size * sizeof(cr_asynccallback))) == NULL)
+      return CREDIS_ERR_NOMEM;
+    for (i = 0; i < cbs->len; i++)
+      ptr[i] = cbs->fifo[(cbs->head + i) % cbs->size];
+    cr_free(cbs->fifo);
+    cbs->fifo = ptr;
+    cbs->head = 0;
+    cbs->size *= 2;
   }
 
-  return rc;
-}
+  i = (cbs->head + cbs->len) % cbs->size;
+  cbs->fifo[i].fn = fn;
+  cbs->fifo[i].privdata = privdata;
+  cbs->fifo[i].len = len;
+  cbs->fifo[i].replays = 0;
+  cbs->len++;
 
-int credis_rename(REDIS rhnd, const char *key, const char *new_key_name)
-{
-  return cr_sendfandreceive(rhnd, CR_INLINE, "RENAME %s %s\r\n", 
-                            key, new_key_name);
+  return 0;
 }
 
-int credis_renamenx(REDIS rhnd, const char *key, const char *new_key_name)
+static cr_asynccallback cr_asyncpopcallback(REDIS_ASYNC ahnd)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "RENAMENX %s %s\r\n", 
-                              key, new_key_name);
+  cr_asynccallbacks *cbs = &(ahnd->callbacks);
+  cr_asynccallback cb = cbs->fifo[cbs->head];
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  cbs->head = (cbs->head + 1) % cbs->size;
+  cbs->len--;
 
-  return rc;
+  return cb;
 }
 
-int credis_dbsize(REDIS rhnd)
+static void cr_asyncdelete(REDIS_ASYNC ahnd)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "DBSIZE\r\n");
-
-  if (rc == 0) 
-    rc = rhnd->reply.integer;
-
-  return rc;
+  if (ahnd->callbacks.fifo != NULL)
+    cr_free(ahnd->callbacks.fifo);
+  if (ahnd->out.data != NULL)
+    cr_free(ahnd->out.data);
+  cr_free(ahnd);
 }
 
-int credis_expire(REDIS rhnd, const char *key, int secs)
-{ 
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "EXPIRE %s %d\r\n", key, secs);
+REDIS_ASYNC credis_async_connect(const char *host, int port, int timeout)
+{
+  REDIS_ASYNC ahnd;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if ((ahnd = cr_calloc(sizeof(cr_async), 1)) == NULL)
+    return NULL;
 
-  return rc;
-}
+  if ((ahnd->out.data = cr_malloc(CR_BUFFER_SIZE)) == NULL ||
+      (ahnd->callbacks.fifo = cr_malloc(CR_MULTIBULK_SIZE * sizeof(cr_asynccallback))) == NULL ||
+      (ahnd->rhnd = credis_connect(host, port, timeout)) == NULL) {
+    cr_asyncdelete(ahnd);
+    return NULL;
+  }
 
-int credis_ttl(REDIS rhnd, const char *key)
-{
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "TTL %s\r\n", key);
+  ahnd->out.size = CR_BUFFER_SIZE;
+  ahnd->callbacks.size = CR_MULTIBULK_SIZE;
+  ahnd->events = CREDIS_ASYNC_READ;
 
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  /* receive buffer is from now on only used to hold incoming replies */
+  ahnd->rhnd->buf.len = 0;
+  ahnd->rhnd->buf.idx = 0;
+  cr_parsereset(&(ahnd->rhnd->parser));
 
-  return rc;
+  return ahnd;
 }
 
-static int cr_push(REDIS rhnd, int left, const char *key, const char *val)
+void credis_async_close(REDIS_ASYNC ahnd)
 {
-  int rc;
+  cr_asynccallback cb;
 
-  if (rhnd->version.number >= CR_VERSION(2,0,0)) {
-    if (rhnd->version.number >= CR_VERSION(2,2,2)) {
-      rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %s\r\n", 
-			      left==1?"LPUSH":"RPUSH", key, val);
+  if (ahnd) {
+    while (ahnd->callbacks.len > 0) {
+      cb = cr_asyncpopcallback(ahnd);
+      if (cb.fn != NULL)
+        cb.fn(ahnd, NULL, cb.privdata);
     }
-    else {
-      rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %zu\r\n%s\r\n", 
-			      left==1?"LPUSH":"RPUSH", key, strlen(val), val);
-    }
-
-    if (rc == 0)
-      rc = rhnd->reply.integer;
-  }
-  else {
-    rc = cr_sendfandreceive(rhnd, CR_INLINE, "%s %s %zu\r\n%s\r\n", 
-                            left==1?"LPUSH":"RPUSH", key, strlen(val), val);
+    credis_close(ahnd->rhnd);
+    cr_asyncdelete(ahnd);
   }
-
-  return rc;
 }
 
-int credis_rpush(REDIS rhnd, const char *key, const char *val)
+int credis_async_fd(REDIS_ASYNC ahnd)
 {
-  return cr_push(rhnd, 0, key, val);
+  return ahnd->rhnd->fd;
 }
 
-int credis_lpush(REDIS rhnd, const char *key, const char *val)
+int credis_async_events(REDIS_ASYNC ahnd)
 {
-  return cr_push(rhnd, 1, key, val);
+  return ahnd->events;
 }
 
-int credis_llen(REDIS rhnd, const char *key)
+int credis_async_pending(REDIS_ASYNC ahnd)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "LLEN %s\r\n", key);
-
-  if (rc == 0) 
-    rc = rhnd->reply.integer;
-
-  return rc;
+  return ahnd->callbacks.len;
 }
 
-int credis_lrange(REDIS rhnd, const char *key, int start, int end, char ***valv)
+void credis_async_seteventhook(REDIS_ASYNC ahnd, credis_async_eventhook hook, void *data)
 {
-  int rc;
-
-  if ((rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "LRANGE %s %d %d\r\n", 
-                               key, start, end)) == 0) {
-    *valv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
-  }
-
-  return rc;
+  ahnd->hook = hook;
+  ahnd->hookdata = data;
 }
 
-int credis_ltrim(REDIS rhnd, const char *key, int start, int end)
+int credis_async_command(REDIS_ASYNC ahnd, credis_async_callback fn, void *privdata,
+                         int argc, const char **argv, const int *argvlen)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "LTRIM %s %d %d\r\n", 
-                            key, start, end);
-}
+  cr_buffer *out = &(ahnd->out);
+  int len, rc;
 
-int credis_lindex(REDIS rhnd, const char *key, int index, char **val)
-{
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "LINDEX %s %d\r\n", key, index);
+  /* all previous commands sent, and answered if they are kept, reuse buffer 
+   * from the beginning */
+  if (out->idx == out->len && 
+      (ahnd->rhnd->reconnect.attempts == 0 || ahnd->acked == out->len))
+    out->idx = out->len = ahnd->acked = 0;
+  else if (ahnd->rhnd->reconnect.attempts > 0 && ahnd->acked > out->size / 2) {
+    out->len -= ahnd->acked;
+    out->idx -= ahnd->acked;
+    memmove(out->data, out->data + ahnd->acked, out->len);
+    ahnd->acked = 0;
+  }
 
-  if (rc == 0 && (*val = rhnd->reply.bulk) == NULL)
-    return -1;
+  len = out->len;
+  if ((rc = cr_appendargv(out, argc, argv, argvlen)) != 0 ||
+      (rc = cr_asyncpushcallback(ahnd, fn, privdata, out->len - len)) != 0) {
+    out->len = len;
+    return rc;
+  }
 
-  return rc;
-}
+  CR_STATS(ahnd->rhnd, commands, 1);
+  cr_asyncupdateevents(ahnd);
 
-int credis_lset(REDIS rhnd, const char *key, int index, const char *val)
-{
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    return cr_sendfandreceive(rhnd, CR_INLINE, "LSET %s %d %s\r\n", 
-			      key, index, val);
-  else
-    return cr_sendfandreceive(rhnd, CR_INLINE, "LSET %s %d %zu\r\n%s\r\n", 
-			      key, index, strlen(val), val);
+  return 0;
 }
 
-int credis_lrem(REDIS rhnd, const char *key, int count, const char *val)
+/* Reconnects, if enabled, after connection of `ahnd' was lost. Commands not
+ * yet completely written to the socket were not carried out and are all kept
+ * to be sent. Of those written but not answered, read-only commands are kept
+ * to be sent again, a bounded number of times, while callbacks of the others
+ * are called with a NULL reply since they may or may not have been carried
+ * out. The event hook is called with CREDIS_ASYNC_RECONNECTED set as the
+ * socket has changed.
+ * Returns:
+ *   0  on success
+ *  <0  on error, the handle should be closed */
+static int cr_asyncrecover(REDIS_ASYNC ahnd)
 {
-  int rc;
+  cr_asynccallbacks *cbs = &(ahnd->callbacks);
+  cr_asynccallback *dropped, cb;
+  char *data = ahnd->out.data;
+  int i, rc, sent, len = cbs->len, n = 0, r = ahnd->acked, w = 0;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "LREM %s %d %s\r\n", 
-			    key, count, val);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "LREM %s %d %zu\r\n%s\r\n", 
-			    key, count, strlen(val), val);
+  if ((dropped = cr_malloc(sizeof(cr_asynccallback) * (len + 1))) == NULL)
+    return CREDIS_ERR_NOMEM;
+  if ((rc = cr_reconnect(ahnd->rhnd)) != 0) {
+    cr_free(dropped);
+    return rc;
+  }
+  cr_parsereset(&(ahnd->rhnd->parser));
+
+  /* commands are moved to the beginning of the buffer, in order */
+  for (i = 0; i < len; i++) {
+    cb = cr_asyncpopcallback(ahnd);
+    sent = r + cb.len <= ahnd->out.idx;
+    if (!sent ||
+        (cb.replays < CR_RECONNECT_REPLAYS && cr_replayoffset(data + r, cb.len, 0) == 0)) {
+      memmove(data + w, data + r, cb.len);
+      w += cb.len;
+      cr_asyncpushcallback(ahnd, cb.fn, cb.privdata, cb.len);
+      cbs->fifo[(cbs->head + cbs->len - 1) % cbs->size].replays = cb.replays + sent;
+    }
+    else
+      dropped[n++] = cb;
+    r += cb.len;
+  }
+  ahnd->out.len = w;
+  ahnd->out.idx = 0;
+  ahnd->acked = 0;
+  DEBUG("%d commands to send again, %d dropped", len - n, n);
 
-  if (rc == 0) 
-    rc = rhnd->reply.integer;
+  ahnd->events = CREDIS_ASYNC_READ | (w > 0 ? CREDIS_ASYNC_WRITE : 0);
+  if (ahnd->hook != NULL)
+    ahnd->hook(ahnd, ahnd->events | CREDIS_ASYNC_RECONNECTED, ahnd->hookdata);
 
-  return rc;
+  for (i = 0; i < n; i++)
+    if (dropped[i].fn != NULL)
+      dropped[i].fn(ahnd, NULL, dropped[i].privdata);
+  cr_free(dropped);
+
+  return 0;
 }
 
-static int cr_pop(REDIS rhnd, int left, const char *key, char **val)
+int credis_async_setreconnect(REDIS_ASYNC ahnd, int attempts, int mindelay, int maxdelay)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "%s %s\r\n", 
-                              left==1?"LPOP":"RPOP", key);
-
-  if (rc == 0 && (*val = rhnd->reply.bulk) == NULL)
-    return -1;
+  /* sent commands are only kept from now on */
+  if (ahnd->callbacks.len > 0)
+    return CREDIS_ERR;
 
-  return rc;
-}
+  credis_setreconnect(ahnd->rhnd, attempts, mindelay, maxdelay);
+  ahnd->out.idx = ahnd->out.len = ahnd->acked = 0;
 
-int credis_lpop(REDIS rhnd, const char *key, char **val)
-{
-  return cr_pop(rhnd, 1, key, val);
+  return 0;
 }
 
-int credis_rpop(REDIS rhnd, const char *key, char **val)
+int credis_async_onreadable(REDIS_ASYNC ahnd)
 {
-  return cr_pop(rhnd, 0, key, val);
-}
+  REDIS rhnd = ahnd->rhnd;
+  cr_buffer *buf = &(rhnd->buf);
+  cr_asynccallback cb;
+  REDIS_REPLY reply;
+  int rc, replies = 0, lost = 0;
+
+  /* discard replies already dispatched */
+  if (buf->idx > 0) {
+    buf->len -= buf->idx;
+    memmove(buf->data, buf->data + buf->idx, buf->len);
+    buf->idx = 0;
+  }
 
-int credis_select(REDIS rhnd, int index)
-{
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SELECT %d\r\n", index);
-}
+  /* read all data available without blocking */
+  while (1) {
+    if (buf->size - buf->len < CR_BUFFER_WATERMARK && cr_moremem(buf, 1))
+      return CREDIS_ERR_NOMEM;
 
-int credis_move(REDIS rhnd, const char *key, int index)
-{
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "MOVE %s %d\r\n", key, index);
+    CR_STATS(rhnd, recv_calls, 1);
+    rc = recv(rhnd->fd, buf->data + buf->len, buf->size - buf->len, 0);
+    if (rc > 0) {
+      CR_STATS(rhnd, bytes_received, rc);
+      buf->len += rc;
+    }
+    else if (rc == 0 || (!cr_wouldblock() && !cr_interrupted())) {
+      /* connection terminated, replies received before are dispatched */
+      lost = CREDIS_ERR_RECV; 
+      break;
+    }
+    else if (cr_wouldblock())
+      break;
+  }
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  /* dispatch all completely received replies, a partially received reply
+   * is parsed as far as possible */
+  while (buf->idx < buf->len) {
+    if ((rc = cr_parse(&(rhnd->parser), buf->data + buf->idx, buf->len - buf->idx)) == 0)
+      break;
+    if (rc < 0)
+      return CREDIS_ERR_PROTOCOL;
+    if ((rc = cr_setreply(rhnd)) != 0)
+      return rc;
+    /* RESP3 pushes are not replies to any command */
+    if (rhnd->parser.nodes[0].resp == CR_PUSH)
+      continue;
+    if (ahnd->callbacks.len == 0)
+      return CREDIS_ERR_PROTOCOL;
 
-  return rc;
-}
+    cb = cr_asyncpopcallback(ahnd);
+    if (rhnd->reconnect.attempts > 0)
+      ahnd->acked += cb.len;
+    replies++;
+    if (cb.fn != NULL) {
+      cr_fillreply(rhnd, &reply);
+      cb.fn(ahnd, &reply, cb.privdata);
+    }
+  }
 
-int credis_flushdb(REDIS rhnd)
-{
-  return cr_sendfandreceive(rhnd, CR_INLINE, "FLUSHDB\r\n");
-}
+  if (lost && cr_asyncrecover(ahnd) != 0)
+    return lost;
 
-int credis_flushall(REDIS rhnd)
-{
-  return cr_sendfandreceive(rhnd, CR_INLINE, "FLUSHALL\r\n");
+  return replies;
 }
 
-int credis_sort(REDIS rhnd, const char *query, char ***elementv)
+int credis_async_onwritable(REDIS_ASYNC ahnd)
 {
+  cr_buffer *out = &(ahnd->out);
   int rc;
 
-  if ((rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "SORT %s\r\n", query)) == 0) {
-    *elementv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
+  while (out->idx < out->len) {
+    CR_STATS(ahnd->rhnd, send_calls, 1);
+    rc = send(ahnd->rhnd->fd, out->data + out->idx, out->len - out->idx, CR_SENDFLAGS);
+    if (rc > 0) {
+      CR_STATS(ahnd->rhnd, bytes_sent, rc);
+      out->idx += rc;
+    }
+    else if (rc < 0 && cr_wouldblock())
+      break;
+    else if (rc < 0 && !cr_interrupted() && (rc = cr_asyncrecover(ahnd)) != 0)
+      return CREDIS_ERR_SEND;
   }
 
-  return rc;
-}
+  if (out->idx == out->len && 
+      (ahnd->rhnd->reconnect.attempts == 0 || ahnd->acked == out->len))
+    out->idx = out->len = ahnd->acked = 0;
 
-int credis_save(REDIS rhnd)
-{
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SAVE\r\n");
-}
+  cr_asyncupdateevents(ahnd);
 
-int credis_bgsave(REDIS rhnd)
-{
-  return cr_sendfandreceive(rhnd, CR_INLINE, "BGSAVE\r\n");
+  return 0;
 }
 
-int credis_lastsave(REDIS rhnd)
+/* index of pool slot last checked out by calling thread */
+static CR_THREAD int cr_poolhint = -1;
+
+REDIS_POOL credis_pool_create(const char *host, int port, int timeout, int size)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "LASTSAVE\r\n");
+  REDIS_POOL pool;
 
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  if (size <= 0 || (pool = cr_calloc(sizeof(cr_pool), 1)) == NULL)
+    return NULL;
+
+  if ((host != NULL && (pool->host = cr_strdup(host)) == NULL) ||
+      (pool->slots = cr_calloc(sizeof(cr_poolslot), size)) == NULL) {
+    credis_pool_destroy(pool);
+    return NULL;
+  }
+
+  pool->port = port;
+  pool->timeout = timeout;
+  pool->healthcheck = CR_POOL_HEALTHCHECK;
+  pool->size = size;
 
-  return rc;
+  return pool;
 }
 
-int credis_shutdown(REDIS rhnd)
+void credis_pool_destroy(REDIS_POOL pool)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "SHUTDOWN\r\n");
+  int i;
+
+  if (pool) {
+    for (i = 0; pool->slots != NULL && i < pool->size; i++)
+      credis_close(pool->slots[i].rhnd);
+    if (pool->slots != NULL)
+      cr_free(pool->slots);
+    if (pool->host != NULL)
+      cr_free(pool->host);
+    cr_free(pool);
+  }
 }
 
-int credis_bgrewriteaof(REDIS rhnd)
+void credis_pool_sethealthcheck(REDIS_POOL pool, int msecs)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "BGREWRITEAOF\r\n");
+  pool->healthcheck = msecs;
 }
 
-/* Parse Redis `info' string for a particular `field', storing its value to 
- * `storage' according to `format'.
- */
-void cr_parseinfo(const char *info, const char *field, const char *format, void *storage)
+/* Makes sure handle of an already reserved slot is connected, connecting
+ * lazily and replacing the handle if it fails the health check */
+static REDIS cr_poolconnect(REDIS_POOL pool, int i)
 {
-  char *str = strstr(info, field);
-  if (str) {
-    str += strlen(field) + 1; /* also skip the ':' */
-    sscanf(str, format, storage); 
+  cr_poolslot *slot = &(pool->slots[i]);
+  REDIS old = NULL;
+
+  if (slot->rhnd != NULL && pool->healthcheck >= 0 &&
+      cr_msecs() - slot->checkin >= pool->healthcheck &&
+      credis_ping(slot->rhnd) != 0) {
+    DEBUG("pooled handle %d failed health check, reconnecting", i);
+    old = slot->rhnd;
+    slot->rhnd = NULL;
+  }
+
+  if (slot->rhnd == NULL && 
+      (slot->rhnd = credis_connect(pool->host, pool->port, pool->timeout)) != NULL) {
+    slot->rhnd->slot = i;
+    cr_scriptsmove(old, slot->rhnd);
   }
+  credis_close(old);
+
+  return slot->rhnd;
 }
 
-int credis_info(REDIS rhnd, REDIS_INFO *info)
+REDIS credis_pool_checkout(REDIS_POOL pool)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "INFO\r\n");
+  REDIS rhnd;
+  int i, n, start;
 
-  if (rc == 0) {
-    char role;
-    memset(info, 0, sizeof(REDIS_INFO));
-    cr_parseinfo(rhnd->reply.bulk, "redis_version", "%"CR_VERSION_STRING_SIZE_STR"s\r\n", &(info->redis_version));
-    cr_parseinfo(rhnd->reply.bulk, "arch_bits", "%d", &(info->arch_bits));
-    cr_parseinfo(rhnd->reply.bulk, "multiplexing_api", "%"CR_MULTIPLEXING_API_SIZE_STR"s\r\n", &(info->multiplexing_api));
-    cr_parseinfo(rhnd->reply.bulk, "process_id", "%ld", &(info->process_id));
-    cr_parseinfo(rhnd->reply.bulk, "uptime_in_seconds", "%ld", &(info->uptime_in_seconds));
-    cr_parseinfo(rhnd->reply.bulk, "uptime_in_days", "%ld", &(info->uptime_in_days));
-    cr_parseinfo(rhnd->reply.bulk, "connected_clients", "%d", &(info->connected_clients));
-    cr_parseinfo(rhnd->reply.bulk, "connected_slaves", "%d", &(info->connected_slaves));
-    cr_parseinfo(rhnd->reply.bulk, "blocked_clients", "%d", &(info->blocked_clients));
-    cr_parseinfo(rhnd->reply.bulk, "used_memory", "%zu", &(info->used_memory));
-    cr_parseinfo(rhnd->reply.bulk, "used_memory_human", "%"CR_USED_MEMORY_HUMAN_SIZE_STR"s", &(info->used_memory_human));
-    cr_parseinfo(rhnd->reply.bulk, "changes_since_last_save", "%lld", &(info->changes_since_last_save));
-    cr_parseinfo(rhnd->reply.bulk, "bgsave_in_progress", "%d", &(info->bgsave_in_progress));
-    cr_parseinfo(rhnd->reply.bulk, "last_save_time", "%ld", &(info->last_save_time));
-    cr_parseinfo(rhnd->reply.bulk, "bgrewriteaof_in_progress", "%d", &(info->bgrewriteaof_in_progress));
-    cr_parseinfo(rhnd->reply.bulk, "total_connections_received", "%lld", &(info->total_connections_received));
-    cr_parseinfo(rhnd->reply.bulk, "total_commands_processed", "%lld", &(info->total_commands_processed));
-    cr_parseinfo(rhnd->reply.bulk, "expired_keys", "%lld", &(info->expired_keys));
-    cr_parseinfo(rhnd->reply.bulk, "hash_max_zipmap_entries", "%zu", &(info->hash_max_zipmap_entries));
-    cr_parseinfo(rhnd->reply.bulk, "hash_max_zipmap_value", "%zu", &(info->hash_max_zipmap_value));
-    cr_parseinfo(rhnd->reply.bulk, "pubsub_channels", "%ld", &(info->pubsub_channels));
-    cr_parseinfo(rhnd->reply.bulk, "pubsub_patterns", "%u", &(info->pubsub_patterns));
-    cr_parseinfo(rhnd->reply.bulk, "keyspace_hits", "%lld", &(info->keyspace_hits));
-    cr_parseinfo(rhnd->reply.bulk, "keyspace_misses", "%lld", &(info->keyspace_misses));
-    cr_parseinfo(rhnd->reply.bulk, "vm_enabled", "%d", &(info->vm_enabled));
-    cr_parseinfo(rhnd->reply.bulk, "role", "%c", &role);
-
-    info->role = ((role=='m')?CREDIS_SERVER_MASTER:CREDIS_SERVER_SLAVE);
+  /* start looking at the slot this thread used last time, or at a slot
+   * depending on thread to spread threads over the pool */
+  if (cr_poolhint >= 0)
+    start = cr_poolhint;
+  else
+    start = (int)(((unsigned long)&cr_poolhint / CR_CACHELINE_SIZE) % pool->size);
+
+  for (n = 0; n < pool->size; n++) {
+    i = (start + n) % pool->size;
+    if (!pool->slots[i].busy && cr_cas(&(pool->slots[i].busy), 0, 1)) {
+      if ((rhnd = cr_poolconnect(pool, i)) == NULL) {
+        cr_release(&(pool->slots[i].busy));
+        return NULL;
+      }
+      cr_poolhint = i;
+      return rhnd;
+    }
   }
-  
-  return rc;
+
+  return NULL;
 }
 
-int credis_monitor(REDIS rhnd)
+void credis_pool_checkin(REDIS_POOL pool, REDIS rhnd)
 {
-  return cr_sendfandreceive(rhnd, CR_INLINE, "MONITOR\r\n");
+  cr_poolslot *slot = &(pool->slots[rhnd->slot]);
+
+  if (rhnd->pipeline.active)
+    credis_pipeline_end(rhnd);
+
+  /* a handle that is out of sync is replaced at next check-out */
+  if (rhnd->error != 0) {
+    credis_close(rhnd);
+    slot->rhnd = NULL;
+  }
+  else if (pool->healthcheck > 0)
+    slot->checkin = cr_msecs();
+
+  cr_release(&(slot->busy));
 }
 
-int credis_slaveof(REDIS rhnd, const char *host, int port)
+/* Takes next chunk of worker `w', or steals the last one of another worker 
+ * once its own range is done.
+ * Returns chunk, -1 if none is left */
+static int cr_executortake(cr_executor *ehnd, int w)
 {
-  if (host == NULL || port == 0)
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SLAVEOF no one\r\n");
-  else
-    return cr_sendfandreceive(rhnd, CR_INLINE, "SLAVEOF %s %d\r\n", host, port);
+  cr_executorworker *worker;
+  int i, chunk = -1;
+
+  for (i = 0; i < ehnd->threads && chunk < 0; i++) {
+    worker = &(ehnd->workers[(w + i) % ehnd->threads]);
+    while (!cr_cas(&(worker->lock), 0, 1))
+      ;
+    if (worker->next < worker->end)
+      chunk = i == 0 ? worker->next++ : --worker->end;
+    cr_release(&(worker->lock));
+  }
+
+  return chunk;
 }
 
-static int cr_setaddrem(REDIS rhnd, const char *cmd, const char *key, const char *member)
+/* Keeps reply to command of `count' keys starting at key `first', values 
+ * are copied to buffer of worker as handle is used for the next chunk */
+static int cr_executorkeep(cr_executor *ehnd, cr_executorworker *worker, 
+                           REDIS rhnd, int first, int count)
 {
-  int rc;
+  cr_multibulk *mb = &(rhnd->reply.multibulk);
+  cr_buffer *vals = &(worker->vals);
+  int i;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %s\r\n", 
-			    cmd, key, member);
-  else      
-    rc = cr_sendfandreceive(rhnd, CR_INT, "%s %s %zu\r\n%s\r\n", 
-			    cmd, key, strlen(member), member);
-  
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if (rhnd->reply.type == CR_INT) {
+    worker->sum += rhnd->reply.integer;
+    return 0;
+  }
+  if (mb->len != count)
+    return CREDIS_ERR_PROTOCOL;
 
-  return rc;
+  for (i = 0; i < count; i++) {
+    if (mb->bulks[i] == NULL) {
+      ehnd->offsets[first + i] = -1;
+      continue;
+    }
+    if (cr_reserve(vals, mb->lens[i] + 1) != 0)
+      return CREDIS_ERR_NOMEM;
+    memcpy(vals->data + vals->len, mb->bulks[i], mb->lens[i] + 1);
+    ehnd->offsets[first + i] = vals->len;
+    vals->len += mb->lens[i] + 1;
+  }
+
+  return 0;
 }
 
-int credis_sadd(REDIS rhnd, const char *key, const char *member)
+/* Runs chunks of current job with a handle checked out of the pool until 
+ * none is left. A worker that gets no handle leaves its chunks to others */
+static void cr_executorrun(cr_executor *ehnd, int w)
 {
-  return cr_setaddrem(rhnd, "SADD", key, member);
+  cr_executorworker *worker = &(ehnd->workers[w]);
+  REDIS rhnd;
+  int chunk, first, count, rc;
+
+  if ((rhnd = credis_pool_checkout(ehnd->pool)) == NULL)
+    return;
+
+  while (ehnd->rc == 0 && (chunk = cr_executortake(ehnd, w)) >= 0) {
+    first = chunk * ehnd->chunk;
+    count = ehnd->keyc - first < ehnd->chunk ? ehnd->keyc - first : ehnd->chunk;
+    if ((rc = cr_multikeycommand(rhnd, ehnd->cmd, count, ehnd->keyv + first)) == 0)
+      rc = cr_executorkeep(ehnd, worker, rhnd, first, count);
+    if (rc != 0) {
+      cr_cas(&(ehnd->rc), 0, rc);
+      break;
+    }
+    ehnd->owners[chunk] = w;
+  }
+
+  credis_pool_checkin(ehnd->pool, rhnd);
 }
 
-int credis_srem(REDIS rhnd, const char *key, const char *member)
+static CR_THREADFN cr_executorthread(void *arg)
 {
-  return cr_setaddrem(rhnd, "SREM", key, member);
+  cr_executorworker *worker = arg;
+  cr_executor *ehnd = worker->ehnd;
+  unsigned int generation = 0;
+
+  cr_lock(&(ehnd->mutex));
+  for (;;) {
+    while (ehnd->generation == generation && !ehnd->stop)
+      cr_wait(&(ehnd->start), &(ehnd->mutex));
+    if (ehnd->stop)
+      break;
+    generation = ehnd->generation;
+    cr_unlock(&(ehnd->mutex));
+
+    cr_executorrun(ehnd, worker - ehnd->workers);
+
+    cr_lock(&(ehnd->mutex));
+    if (--ehnd->running == 0)
+      cr_broadcast(&(ehnd->done));
+  }
+  cr_unlock(&(ehnd->mutex));
+
+  return 0;
 }
 
-int credis_spop(REDIS rhnd, const char *key, char **member)
+/* Makes sure there is storage for a job of `keyc' keys */
+static int cr_executorreserve(cr_executor *ehnd, int keyc)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_BULK, "SPOP %s\r\n", key);
+  void *owners, *offsets, *valv;
 
-  if (rc == 0 && (*member = rhnd->reply.bulk) == NULL)
-    rc = -1;
+  if (keyc <= ehnd->size)
+    return 0;
 
-  return rc;
+  if ((owners = cr_realloc(ehnd->owners, sizeof(int) * keyc)) != NULL)
+    ehnd->owners = owners;
+  if ((offsets = cr_realloc(ehnd->offsets, sizeof(int) * keyc)) != NULL)
+    ehnd->offsets = offsets;
+  if ((valv = cr_realloc(ehnd->valv, sizeof(char *) * keyc)) != NULL)
+    ehnd->valv = valv;
+
+  if (owners == NULL || offsets == NULL || valv == NULL)
+    return CREDIS_ERR_NOMEM;
+
+  ehnd->size = keyc;
+  return 0;
 }
 
-int credis_smove(REDIS rhnd, const char *sourcekey, const char *destkey, 
-                 const char *member)
+/* Sends command `cmd' of the command table for `keyc' keys in `keyv', in 
+ * chunks spread over the ranges of all workers, and waits for all workers 
+ * to be done. Worker threads are only woken when there is more than one 
+ * chunk. 
+ * Returns:
+ *   0  on success
+ *  <0  on error */
+static int cr_executorjob(cr_executor *ehnd, int cmd, int keyc, const char **keyv)
 {
+  int i, chunks = (keyc + ehnd->chunk - 1) / ehnd->chunk;
   int rc;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "SMOVE %s %s %s\r\n",  
-			    sourcekey, destkey, member);
+  if ((rc = cr_executorreserve(ehnd, keyc)) != 0)
+    return rc;
+
+  /* results of all workers are reset, also of those a job of a single chunk
+   * leaves idle, since their results are summed up or looked up later */
+  for (i = 0; i < ehnd->threads; i++) {
+    ehnd->workers[i].next = (long long)chunks * i / ehnd->threads;
+    ehnd->workers[i].end = (long long)chunks * (i + 1) / ehnd->threads;
+    ehnd->workers[i].sum = 0;
+    ehnd->workers[i].vals.len = 0;
+  }
+  for (i = 0; i < chunks; i++)
+    ehnd->owners[i] = -1;
+  ehnd->cmd = cmd;
+  ehnd->keyc = keyc;
+  ehnd->keyv = keyv;
+  ehnd->rc = 0;
+
+  if (chunks > 1 && ehnd->started > 0) {
+    cr_lock(&(ehnd->mutex));
+    ehnd->running = ehnd->started;
+    ehnd->generation++;
+    cr_broadcast(&(ehnd->start));
+    cr_unlock(&(ehnd->mutex));
+
+    cr_executorrun(ehnd, 0);
+
+    cr_lock(&(ehnd->mutex));
+    while (ehnd->running > 0)
+      cr_wait(&(ehnd->done), &(ehnd->mutex));
+    cr_unlock(&(ehnd->mutex));
+  }
   else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "SMOVE %s %s %zu\r\n%s\r\n",  
-			    sourcekey, destkey, strlen(member), member);
+    cr_executorrun(ehnd, 0);
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if (ehnd->rc != 0)
+    return ehnd->rc;
+  /* chunks are left if no worker got a handle of the pool */
+  for (i = 0; i < chunks; i++)
+    if (ehnd->owners[i] < 0)
+      return CREDIS_ERR_CONNECT;
 
-  return rc;
+  return 0;
 }
 
-int credis_scard(REDIS rhnd, const char *key) 
+REDIS_EXECUTOR credis_executor_create(REDIS_POOL pool, int threads, int chunk)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "SCARD %s\r\n", key);
+  REDIS_EXECUTOR ehnd;
+  int i;
 
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  if (pool == NULL || threads <= 0 || chunk < 0 || 
+      (ehnd = cr_calloc(sizeof(cr_executor), 1)) == NULL)
+    return NULL;
 
-  return rc;
+  ehnd->pool = pool;
+  ehnd->chunk = chunk > 0 ? chunk : CR_EXECUTOR_CHUNK;
+  ehnd->threads = threads;
+  cr_mutexinit(&(ehnd->mutex));
+  cr_condinit(&(ehnd->start));
+  cr_condinit(&(ehnd->done));
+
+  if ((ehnd->workers = cr_calloc(sizeof(cr_executorworker), threads)) == NULL) {
+    credis_executor_destroy(ehnd);
+    return NULL;
+  }
+  for (i = 0; i < threads; i++)
+    ehnd->workers[i].ehnd = ehnd;
+  for (i = 1; i < threads; i++, ehnd->started++) {
+    if (cr_threadstart(&(ehnd->workers[i].thread), cr_executorthread, &(ehnd->workers[i])) != 0) {
+      credis_executor_destroy(ehnd);
+      return NULL;
+    }
+  }
+
+  return ehnd;
 }
 
-int credis_sinter(REDIS rhnd, int keyc, const char **keyv, char ***members)
+void credis_executor_destroy(REDIS_EXECUTOR ehnd)
 {
-  return cr_multikeybulkcommand(rhnd, "SINTER", keyc, keyv, members);
+  int i;
+
+  if (ehnd == NULL)
+    return;
+
+  cr_lock(&(ehnd->mutex));
+  ehnd->stop = 1;
+  cr_broadcast(&(ehnd->start));
+  cr_unlock(&(ehnd->mutex));
+  for (i = 1; i <= ehnd->started; i++)
+    cr_threadjoin(ehnd->workers[i].thread);
+
+  for (i = 0; ehnd->workers != NULL && i < ehnd->threads; i++)
+    cr_free(ehnd->workers[i].vals.data);
+  cr_free(ehnd->workers);
+  cr_free(ehnd->owners);
+  cr_free(ehnd->offsets);
+  cr_free(ehnd->valv);
+  cr_conddestroy(&(ehnd->done));
+  cr_conddestroy(&(ehnd->start));
+  cr_mutexdestroy(&(ehnd->mutex));
+  cr_free(ehnd);
 }
 
-int credis_sunion(REDIS rhnd, int keyc, const char **keyv, char ***members)
+int credis_executor_mget(REDIS_EXECUTOR ehnd, int keyc, const char **keyv, char ***valv)
 {
-  return cr_multikeybulkcommand(rhnd, "SUNION", keyc, keyv, members);
+  int i, rc;
+
+  if (keyc <= 0)
+    return 0;
+  if ((rc = cr_executorjob(ehnd, CR_CMD_MGET, keyc, keyv)) != 0)
+    return rc;
+
+  /* values buffers may have moved while growing, so pointers are set last */
+  for (i = 0; i < keyc; i++)
+    ehnd->valv[i] = ehnd->offsets[i] < 0 ? NULL : 
+      ehnd->workers[ehnd->owners[i / ehnd->chunk]].vals.data + ehnd->offsets[i];
+  *valv = ehnd->valv;
+
+  return keyc;
 }
 
-int credis_sdiff(REDIS rhnd, int keyc, const char **keyv, char ***members)
+int credis_executor_del(REDIS_EXECUTOR ehnd, int keyc, const char **keyv)
 {
-  return cr_multikeybulkcommand(rhnd, "SDIFF", keyc, keyv, members);
+  long long sum = 0;
+  int i, rc;
+
+  if (keyc <= 0)
+    return 0;
+  if ((rc = cr_executorjob(ehnd, CR_CMD_DEL, keyc, keyv)) != 0)
+    return rc;
+
+  for (i = 0; i < ehnd->threads; i++)
+    sum += ehnd->workers[i].sum;
+
+  return (int)sum;
 }
 
-int credis_sinterstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv)
+/* Multi-key commands are fanned out to several servers by grouping keys, by
+ * cluster slot or by shard, and sending one command per group to the server 
+ * holding the group. Values of all replies are copied to the fan-out buffer
+ * and returned in the order the keys were given. */
+
+static void cr_fanoutfree(cr_fanout *fanout)
 {
-  return cr_multikeystorecommand(rhnd, "SINTERSTORE", destkey, keyc, keyv);
+  cr_free(fanout->keys);
+  cr_free(fanout->keyv);
+  cr_free(fanout->offsets);
+  cr_free(fanout->valv);
+  cr_free(fanout->vals.data);
 }
 
-int credis_sunionstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv)
+/* Makes sure there is storage for a fan-out of `keyc' keys */
+static int cr_fanoutreserve(cr_fanout *fanout, int keyc)
 {
-  return cr_multikeystorecommand(rhnd, "SUNIONSTORE", destkey, keyc, keyv);
+  void *keys, *keyv, *offsets, *valv;
+
+  if (keyc <= fanout->size)
+    return 0;
+
+  if ((keys = cr_realloc(fanout->keys, sizeof(cr_fanoutkey) * keyc)) != NULL)
+    fanout->keys = keys;
+  if ((keyv = cr_realloc(fanout->keyv, sizeof(char *) * keyc)) != NULL)
+    fanout->keyv = keyv;
+  if ((offsets = cr_realloc(fanout->offsets, sizeof(int) * keyc)) != NULL)
+    fanout->offsets = offsets;
+  if ((valv = cr_realloc(fanout->valv, sizeof(char *) * keyc)) != NULL)
+    fanout->valv = valv;
+
+  if (keys == NULL || keyv == NULL || offsets == NULL || valv == NULL)
+    return CREDIS_ERR_NOMEM;
+
+  fanout->size = keyc;
+  return 0;
 }
 
-int credis_sdiffstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv)
+static int cr_fanoutkeycmp(const void *a, const void *b)
 {
-  return cr_multikeystorecommand(rhnd, "SDIFFSTORE", destkey, keyc, keyv);
+  const cr_fanoutkey *ka = a, *kb = b;
+
+  if (ka->group != kb->group)
+    return ka->group - kb->group;
+  return ka->idx - kb->idx;
 }
 
-int credis_sismember(REDIS rhnd, const char *key, const char *member)
+/* Orders keys by group, `group' of each of the `keyc' keys must have been
+ * set before the call */
+static void cr_fanoutsort(cr_fanout *fanout, int keyc, const char **keyv)
 {
-  return cr_setaddrem(rhnd, "SISMEMBER", key, member);
+  int i;
+
+  for (i = 0; i < keyc; i++)
+    fanout->keys[i].idx = i;
+  qsort(fanout->keys, keyc, sizeof(cr_fanoutkey), cr_fanoutkeycmp);
+  for (i = 0; i < keyc; i++)
+    fanout->keyv[i] = keyv[fanout->keys[i].idx];
+  fanout->vals.len = 0;
 }
 
-int credis_smembers(REDIS rhnd, const char *key, char ***members)
+/* Returns index of first key following group starting at key `first' */
+static int cr_fanoutgroupend(cr_fanout *fanout, int keyc, int first)
 {
-  return cr_multikeybulkcommand(rhnd, "SMEMBERS", 1, &key, members);
+  int i = first + 1;
+
+  while (i < keyc && fanout->keys[i].group == fanout->keys[first].group)
+    i++;
+
+  return i;
 }
 
-int credis_zadd(REDIS rhnd, const char *key, double score, const char *member)
+/* Copies values of multi-bulk `reply' to keys `first' to `first' + `count' 
+ * - 1 in group order */
+static int cr_fanoutcopy(cr_fanout *fanout, REDIS_REPLY *reply, int first, int count)
 {
-  int rc;
+  cr_buffer *vals = &(fanout->vals);
+  int i, idx;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "ZADD %s %f %s\r\n", 
-			    key, score, member);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "ZADD %s %f %zu\r\n%s\r\n", 
-			    key, score, strlen(member), member);
+  if (reply->type != CREDIS_REPLY_MULTIBULK || reply->elements != count)
+    return CREDIS_ERR_PROTOCOL;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  for (i = 0; i < count; i++) {
+    idx = fanout->keys[first + i].idx;
+    if (reply->elementv[i] == NULL) {
+      fanout->offsets[idx] = -1;
+      continue;
+    }
+    if (cr_reserve(vals, reply->elementlenv[i] + 1) != 0)
+      return CREDIS_ERR_NOMEM;
+    memcpy(vals->data + vals->len, reply->elementv[i], reply->elementlenv[i] + 1);
+    fanout->offsets[idx] = vals->len;
+    vals->len += reply->elementlenv[i] + 1;
+  }
 
-  return rc;
+  return 0;
 }
 
-int credis_zrem(REDIS rhnd, const char *key, const char *member)
+/* Returns values in the order keys were given. Values buffer may have moved
+ * while growing, so pointers are set last */
+static char ** cr_fanoutvalues(cr_fanout *fanout, int keyc)
+{
+  int i;
+
+  for (i = 0; i < keyc; i++)
+    fanout->valv[i] = fanout->offsets[i] < 0 ? NULL : fanout->vals.data + fanout->offsets[i];
+
+  return fanout->valv;
+}
+
+/* CRC16 as used by Redis Cluster, i.e. the XMODEM variant with polynomial
+ * 0x1021 */
+static const unsigned short cr_crc16tab[256] = {
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+  0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+  0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+  0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+  0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+  0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+  0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+  0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+  0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+  0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+  0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+  0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+  0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+  0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+  0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+  0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+  0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+  0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+  0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+  0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+  0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+  0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+  0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+static unsigned short cr_crc16(const char *buf, int len)
+{
+  unsigned short crc = 0;
+  int i;
+
+  for (i = 0; i < len; i++)
+    crc = (crc << 8) ^ cr_crc16tab[((crc >> 8) ^ (unsigned char)buf[i]) & 0xff];
+
+  return crc;
+}
+
+int credis_cluster_keyslot(const char *key, int keylen)
+{
+  const char *lbrace, *rbrace;
+
+  /* only hash tag is hashed if there is a non-empty one */
+  if ((lbrace = memchr(key, '{', keylen)) != NULL &&
+      (rbrace = memchr(lbrace + 1, '}', key + keylen - lbrace - 1)) != NULL &&
+      rbrace - lbrace > 1) {
+    key = lbrace + 1;
+    keylen = rbrace - key;
+  }
+
+  return cr_crc16(key, keylen) & (CR_CLUSTER_SLOTS - 1);
+}
+
+/* Returns index of node `host':`port', which is added if not already known,
+ * or CREDIS_ERR_NOMEM */
+static int cr_clusteraddnode(REDIS_CLUSTER chnd, const char *host, int hostlen, int port)
 {
-  int rc;
+  cr_clusternode *nodes;
+  char *copy;
+  int i;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "ZREM %s %s\r\n", 
-			    key, member);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "ZREM %s %zu\r\n%s\r\n", 
-			    key, strlen(member), member);
+  for (i = 0; i < chnd->len; i++)
+    if (chnd->nodes[i].port == port && 
+        strncmp(chnd->nodes[i].host, host, hostlen) == 0 &&
+        chnd->nodes[i].host[hostlen] == '\0')
+      return i;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if (chnd->len == chnd->size) {
+    if ((nodes = cr_realloc(chnd->nodes, sizeof(cr_clusternode) * (chnd->size + 8))) == NULL)
+      return CREDIS_ERR_NOMEM;
+    chnd->nodes = nodes;
+    chnd->size += 8;
+  }
+  if ((copy = cr_malloc(hostlen + 1)) == NULL)
+    return CREDIS_ERR_NOMEM;
+  memcpy(copy, host, hostlen);
+  copy[hostlen] = '\0';
 
-  return rc;
+  chnd->nodes[i].host = copy;
+  chnd->nodes[i].port = port;
+  chnd->nodes[i].rhnd = NULL;
+  chnd->len++;
+
+  return i;
 }
 
-/* TODO what does Redis return if member is not member of set? */
-int credis_zincrby(REDIS rhnd, const char *key, double incr_score, const char *member, double *new_score)
+/* Returns handle of node `n', connecting lazily and replacing a handle that 
+ * is out of sync, or NULL if connecting failed */
+static REDIS cr_clusterhandle(REDIS_CLUSTER chnd, int n)
 {
-  int rc;
+  cr_clusternode *node = &(chnd->nodes[n]);
+  REDIS old = NULL;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "ZINCRBY %s %f %s\r\n", 
-			    key, incr_score, member);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "ZINCRBY %s %f %zu\r\n%s\r\n", 
-			    key, incr_score, strlen(member), member);
+  if (node->rhnd != NULL && node->rhnd->error != 0) {
+    DEBUG("handle of cluster node %s:%d out of sync, reconnecting", node->host, node->port);
+    old = node->rhnd;
+    node->rhnd = NULL;
+  }
+  if (node->rhnd == NULL &&
+      (node->rhnd = credis_connect(node->host, node->port, chnd->timeout)) != NULL)
+    cr_scriptsmove(old, node->rhnd);
+  credis_close(old);
 
-  if (rc == 0 && new_score)
-    *new_score = strtod(rhnd->reply.bulk, NULL);
+  return node->rhnd;
+}
 
-  return rc;
+/* Returns index of node serving `slot', node 0 if not known since it will
+ * redirect us */
+static int cr_clusterslotnode(REDIS_CLUSTER chnd, int slot)
+{
+  return chnd->slots[slot] >= 0 ? chnd->slots[slot] : 0;
 }
 
-static int cr_zrank(REDIS rhnd, int reverse, const char *key, const char *member)
+/* Fetches slot map from node `n'. Each element of the reply to CLUSTER SLOTS
+ * holds first and last slot of a range followed by the master serving it, 
+ * as host and port, and its replicas */
+static int cr_clusterloadslots(REDIS_CLUSTER chnd, int n)
 {
-  int rc;
+  const char *argv[] = {"CLUSTER", "SLOTS"};
+  REDIS_REPLY reply, *range, *master;
+  REDIS rhnd;
+  int i, m, slot, last, rc;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_ANY, "%s %s %s\r\n", 
-			    reverse==1?"ZREVRANK":"ZRANK", key, member);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_ANY, "%s %s %zu\r\n%s\r\n", 
-			    reverse==1?"ZREVRANK":"ZRANK", key, strlen(member), member);
+  if ((rhnd = cr_clusterhandle(chnd, n)) == NULL)
+    return CREDIS_ERR_CONNECT;
+  if ((rc = credis_command(rhnd, 2, argv, NULL, &reply)) != 0)
+    return rc;
+  if (reply.type != CREDIS_REPLY_MULTIBULK)
+    return CREDIS_ERR_PROTOCOL;
 
-  if (rc == 0) {
-    if (rhnd->reply.type == CR_INT)
-      rc = rhnd->reply.integer;
+  memset(chnd->slots, 0xff, sizeof(chnd->slots));
+
+  for (i = 0; i < reply.elements; i++) {
+    range = &(reply.element[i]);
+    if (range->type != CREDIS_REPLY_MULTIBULK || range->elements < 3)
+      continue;
+    master = &(range->element[2]);
+    if (master->type != CREDIS_REPLY_MULTIBULK || master->elements < 2 ||
+        master->element[0].str == NULL)
+      continue;
+
+    /* an empty host means the node we asked */
+    if (master->element[0].len == 0)
+      m = cr_clusteraddnode(chnd, chnd->nodes[n].host, strlen(chnd->nodes[n].host), 
+                            master->element[1].integer);
     else
-      rc = -1;
+      m = cr_clusteraddnode(chnd, master->element[0].str, master->element[0].len, 
+                            master->element[1].integer);
+    if (m < 0)
+      return m;
+
+    last = range->element[1].integer;
+    for (slot = range->element[0].integer; slot <= last; slot++)
+      if (slot >= 0 && slot < CR_CLUSTER_SLOTS)
+        chnd->slots[slot] = m;
   }
 
-  return rc;
+  return 0;
 }
 
-int credis_zrank(REDIS rhnd, const char *key, const char *member)
+int credis_cluster_refresh(REDIS_CLUSTER chnd)
 {
-  return cr_zrank(rhnd, 0, key, member);
+  int n;
+
+  for (n = 0; n < chnd->len; n++)
+    if (cr_clusterloadslots(chnd, n) == 0)
+      return 0;
+
+  return CREDIS_ERR;
 }
 
-int credis_zrevrank(REDIS rhnd, const char *key, const char *member)
+void credis_cluster_close(REDIS_CLUSTER chnd)
 {
-  return cr_zrank(rhnd, 1, key, member);
+  int i;
+
+  if (chnd == NULL)
+    return;
+
+  for (i = 0; i < chnd->len; i++) {
+    if (chnd->nodes[i].rhnd != NULL)
+      credis_close(chnd->nodes[i].rhnd);
+    cr_free(chnd->nodes[i].host);
+  }
+  cr_free(chnd->nodes);
+  cr_fanoutfree(&(chnd->fanout));
+  cr_free(chnd);
 }
 
-int cr_zrange(REDIS rhnd, int reverse, const char *key, int start, int end, char ***elementv)
+REDIS_CLUSTER credis_cluster_connect(const char *seeds, int timeout)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "%s %s %d %d\r\n",
-                              reverse==1?"ZREVRANGE":"ZRANGE", key, start, end);
+  REDIS_CLUSTER chnd;
+  const char *seed, *end, *colon;
+  int port;
 
-  if (rc == 0) {
-    *elementv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
+  if ((chnd = cr_calloc(sizeof(cr_cluster), 1)) == NULL)
+    return NULL;
+  chnd->timeout = timeout;
+  memset(chnd->slots, 0xff, sizeof(chnd->slots));
+
+  for (seed = seeds; *seed != '\0'; seed = *end == ',' ? end + 1 : end) {
+    if ((end = strchr(seed, ',')) == NULL)
+      end = seed + strlen(seed);
+    /* last colon separates port, host may be an IPv6 address */
+    for (colon = end - 1; colon > seed && *colon != ':'; colon--)
+      ;
+    if (colon > seed) 
+      port = atoi(colon + 1);
+    else {
+      colon = end;
+      port = 6379;
+    }
+    if (colon > seed && cr_clusteraddnode(chnd, seed, colon - seed, port) < 0)
+      goto error;
   }
 
-  return rc;
+  if (credis_cluster_refresh(chnd) != 0)
+    goto error;
+
+  return chnd;
+
+error:
+  credis_cluster_close(chnd);
+  return NULL;
 }
 
-int credis_zrange(REDIS rhnd, const char *key, int start, int end, char ***elementv)
+REDIS credis_cluster_handle(REDIS_CLUSTER chnd, const char *key)
 {
-  return cr_zrange(rhnd, 0, key, start, end, elementv);
+  return cr_clusterhandle(chnd, cr_clusterslotnode(chnd, 
+                          credis_cluster_keyslot(key, strlen(key))));
 }
 
-int credis_zrevrange(REDIS rhnd, const char *key, int start, int end, char ***elementv)
+/* Checks if error reply `err' is a redirection, "MOVED <slot> <host>:<port>"
+ * or "ASK <slot> <host>:<port>". The slot map is updated for MOVED while ASK
+ * only concerns the next command, `ask' is set accordingly. 
+ * Returns:
+ *  >=0 index of node to redirect to
+ *   <0 if not a redirection */
+static int cr_clusterredirect(REDIS_CLUSTER chnd, const char *err, int *ask)
 {
-  return cr_zrange(rhnd, 1, key, start, end, elementv);
+  const char *host, *colon;
+  int slot, n;
+
+  if (strncmp(err, "MOVED ", 6) == 0)
+    *ask = 0;
+  else if (strncmp(err, "ASK ", 4) == 0)
+    *ask = 1;
+  else
+    return -1;
+
+  host = strchr(err, ' ') + 1;
+  slot = atoi(host);
+  if ((host = strchr(host, ' ')) == NULL || (colon = strrchr(++host, ':')) == NULL)
+    return -1;
+  if ((n = cr_clusteraddnode(chnd, host, colon - host, atoi(colon + 1))) < 0)
+    return -1;
+
+  DEBUG("slot %d %s to %s", slot, *ask ? "asked" : "moved", host);
+  if (!*ask && slot >= 0 && slot < CR_CLUSTER_SLOTS)
+    chnd->slots[slot] = n;
+
+  return n;
 }
 
-int cr_zrangebyscore(REDIS rhnd, int reverse, const char *key, double a, double b, char ***elementv)
+/* Sends command to node serving `slot', following redirections. If the node 
+ * can not be reached the slot map is refreshed once, it may have failed 
+ * over. Refer to credis_command() */
+static int cr_clustercommand(REDIS_CLUSTER chnd, int slot, int argc, const char **argv, 
+                             const int *argvlen, REDIS_REPLY *reply)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "%s %s %f %f\r\n",
-                              reverse==1?"ZREVRANGEBYSCORE":"ZRANGEBYSCORE", key, a, b);
+  int n = cr_clusterslotnode(chnd, slot), ask = 0, refreshed = 0, redirects, rc;
+  REDIS rhnd;
 
-  if (rc == 0) {
-    *elementv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
+  for (redirects = 0; redirects <= CR_CLUSTER_MAXREDIRECTS; redirects++) {
+    if ((rhnd = cr_clusterhandle(chnd, n)) == NULL) {
+      if (refreshed++ || credis_cluster_refresh(chnd) != 0)
+        return CREDIS_ERR_CONNECT;
+      n = cr_clusterslotnode(chnd, slot);
+      continue;
+    }
+    if (ask && (rc = cr_sendcmdandreceive(rhnd, CR_CMD_ASKING)) != 0)
+      return rc;
+
+    rc = credis_command(rhnd, argc, argv, argvlen, reply);
+    if (rc != CREDIS_ERR_PROTOCOL || rhnd->reply.type != CR_ERROR ||
+        (n = cr_clusterredirect(chnd, rhnd->reply.line, &ask)) < 0)
+      return rc;
   }
 
-  return rc;
+  DEBUG("too many redirections");
+  return CREDIS_ERR_PROTOCOL;
 }
 
-int credis_zrangebyscore(REDIS rhnd, const char *key, double min, double max, char ***elementv)
+int credis_cluster_command(REDIS_CLUSTER chnd, int argc, const char **argv, 
+                           const int *argvlen, REDIS_REPLY *reply)
 {
-  return cr_zrangebyscore(rhnd, 0, key, min, max, elementv);
+  int slot = 0;
+
+  if (argc > 1)
+    slot = credis_cluster_keyslot(argv[1], argvlen != NULL ? argvlen[1] : strlen(argv[1]));
+
+  return cr_clustercommand(chnd, slot, argc, argv, argvlen, reply);
 }
 
-int credis_zrevrangebyscore(REDIS rhnd, const char *key, double max, double min, char ***elementv)
+int credis_cluster_set(REDIS_CLUSTER chnd, const char *key, const char *val)
 {
-  return cr_zrangebyscore(rhnd, 1, key, max, min, elementv);
+  const char *argv[] = {"SET", key, val};
+  REDIS_REPLY reply;
+
+  return credis_cluster_command(chnd, 3, argv, NULL, &reply);
 }
 
-int credis_zcard(REDIS rhnd, const char *key)
+int credis_cluster_get(REDIS_CLUSTER chnd, const char *key, char **val)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "ZCARD %s\r\n", key);
+  const char *argv[] = {"GET", key};
+  REDIS_REPLY reply;
+  int rc = credis_cluster_command(chnd, 2, argv, NULL, &reply);
 
-  if (rc == 0) {
-    if (rhnd->reply.integer == 0)
-      rc = -1;
-    else
-      rc = rhnd->reply.integer;
-  }
+  if (rc == 0 && reply.type != CREDIS_REPLY_BULK)
+    return CREDIS_ERR_PROTOCOL;
+  if (rc == 0 && (*val = reply.str) == NULL)
+    return -1;
 
   return rc;
 }
 
-int credis_zscore(REDIS rhnd, const char *key, const char *member, double *score)
+int credis_cluster_del(REDIS_CLUSTER chnd, const char *key)
 {
-  int rc;
+  const char *argv[] = {"DEL", key};
+  REDIS_REPLY reply;
+  int rc = credis_cluster_command(chnd, 2, argv, NULL, &reply);
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "ZSCORE %s %s\r\n", 
-			    key, member);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "ZSCORE %s %zu\r\n%s\r\n", 
-			    key, strlen(member), member);
+  if (rc == 0 && reply.type != CREDIS_REPLY_INTEGER)
+    return CREDIS_ERR_PROTOCOL;
+  if (rc == 0 && reply.integer == 0)
+    return -1;
 
-  if (rc == 0) {
-    if (!rhnd->reply.bulk)
-      rc = -1;
-    else if (score)
-      *score = strtod(rhnd->reply.bulk, NULL);
+  return rc;
+}
+
+int credis_cluster_mget(REDIS_CLUSTER chnd, int keyc, const char **keyv, char ***valv)
+{
+  cr_fanout *fanout = &(chnd->fanout);
+  cr_fanoutkey *keys;
+  const char **argv;
+  REDIS_REPLY reply;
+  REDIS rhnd;
+  char **vals;
+  int i, j, n, rc;
+
+  if ((rc = cr_fanoutreserve(fanout, keyc)) != 0)
+    return rc;
+
+  keys = fanout->keys;
+  for (i = 0; i < keyc; i++)
+    keys[i].group = credis_cluster_keyslot(keyv[i], strlen(keyv[i]));
+  cr_fanoutsort(fanout, keyc, keyv);
+
+  /* queue one MGET per slot, in pipeline of node serving slot */
+  for (i = 0; i < keyc; i = j) {
+    j = cr_fanoutgroupend(fanout, keyc, i);
+    keys[i].node = -1;
+    n = cr_clusterslotnode(chnd, keys[i].group);
+    if ((rhnd = cr_clusterhandle(chnd, n)) == NULL)
+      continue;
+    if (!rhnd->pipeline.active)
+      credis_pipeline_begin(rhnd);
+    if (credis_mget(rhnd, j - i, fanout->keyv + i, &vals) == CREDIS_QUEUED)
+      keys[i].node = n;
+  }
+
+  /* have all nodes work at the same time */
+  for (n = 0; n < chnd->len; n++)
+    if ((rhnd = chnd->nodes[n].rhnd) != NULL && rhnd->pipeline.active)
+      credis_pipeline_flush(rhnd);
+
+  /* replies of each node arrive in the order MGETs were queued */
+  for (i = 0; i < keyc; i = j) {
+    j = cr_fanoutgroupend(fanout, keyc, i);
+    if (keys[i].node < 0)
+      continue;
+    rhnd = chnd->nodes[keys[i].node].rhnd;
+    if (credis_pipeline_next(rhnd, &reply) != 0 || 
+        cr_fanoutcopy(fanout, &reply, i, j - i) != 0)
+      keys[i].node = -1;
+  }
+
+  for (n = 0; n < chnd->len; n++)
+    if ((rhnd = chnd->nodes[n].rhnd) != NULL && rhnd->pipeline.active)
+      credis_pipeline_end(rhnd);
+
+  /* slots that failed, e.g. by being redirected, are retried one by one */
+  for (i = 0; i < keyc; i = j) {
+    j = cr_fanoutgroupend(fanout, keyc, i);
+    if (keys[i].node >= 0)
+      continue;
+    if ((argv = cr_malloc(sizeof(char *) * (j - i + 1))) == NULL)
+      return CREDIS_ERR_NOMEM;
+    argv[0] = "MGET";
+    memcpy(argv + 1, fanout->keyv + i, sizeof(char *) * (j - i));
+    rc = cr_clustercommand(chnd, keys[i].group, j - i + 1, argv, NULL, &reply);
+    cr_free(argv);
+    if (rc != 0 || (rc = cr_fanoutcopy(fanout, &reply, i, j - i)) != 0)
+      return rc;
   }
 
-  return rc;
+  *valv = cr_fanoutvalues(fanout, keyc);
+
+  return keyc;
 }
 
-int credis_zremrangebyscore(REDIS rhnd, const char *key, double min, double max)
+static int cr_shardpointcmp(const void *a, const void *b)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "ZREMRANGEBYSCORE %s %f %f\r\n", 
-                              key, min, max);
-
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  const cr_shardpoint *pa = a, *pb = b;
 
-  return rc;
+  if (pa->hash != pb->hash)
+    return pa->hash < pb->hash ? -1 : 1;
+  return pa->shard - pb->shard;
 }
 
-int credis_zremrangebyrank(REDIS rhnd, const char *key, int start, int end)
+/* Places CR_SHARDS_POINTS points per unit of weight of each shard on the 
+ * ring. The points of a shard only depend on its host and port, so adding
+ * or removing a shard leaves all other points where they were */
+static int cr_shardsbuildring(REDIS_SHARDS shnd)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "ZREMRANGEBYRANK %s %d %d\r\n", 
-                              key, start, end);
+  char suffix[2 * CR_INT_STRING_SIZE + 2];
+  cr_shardpoint *ring;
+  unsigned int hash;
+  int i, j, n, points = 0;
 
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  for (i = 0; i < shnd->len; i++)
+    points += shnd->shards[i].weight * CR_SHARDS_POINTS;
 
-  return rc;
+  if (points > shnd->points || shnd->ring == NULL) {
+    if ((ring = cr_realloc(shnd->ring, sizeof(cr_shardpoint) * (points + 1))) == NULL)
+      return CREDIS_ERR_NOMEM;
+    shnd->ring = ring;
+  }
+
+  for (i = 0, n = 0; i < shnd->len; i++) {
+    hash = cr_fnv1a(CR_FNV_OFFSET, shnd->shards[i].host, strlen(shnd->shards[i].host));
+    for (j = 0; j < shnd->shards[i].weight * CR_SHARDS_POINTS; j++, n++) {
+      /* point `j' is hash of "<host>:<port>-<j>" */
+      sprintf(suffix, ":%d-%d", shnd->shards[i].port, j);
+      shnd->ring[n].hash = cr_fmix32(cr_fnv1a(hash, suffix, strlen(suffix)));
+      shnd->ring[n].shard = i;
+    }
+  }
+  qsort(shnd->ring, points, sizeof(cr_shardpoint), cr_shardpointcmp);
+  shnd->points = points;
+
+  return 0;
 }
 
-/* TODO add writev() support instead and push strings to send onto a vector of
- * strings to send instead... */
-static int cr_zstore(REDIS rhnd, int inter, const char *destkey, int keyc, const char **keyv, 
-                     const int *weightv, REDIS_AGGREGATE aggregate)
+/* Returns index of shard of `key', i.e. of first point at or after hash of 
+ * key on the ring, or -1 if there are no shards */
+static int cr_shardskeyshard(REDIS_SHARDS shnd, const char *key, int keylen)
 {
-  cr_buffer *buf = &(rhnd->buf);
-  int rc, i;
+  unsigned int hash = cr_fmix32(cr_fnv1a(CR_FNV_OFFSET, key, keylen));
+  int lo = 0, hi = shnd->points, mid;
 
-  buf->len = 0;
-  
-  if ((rc = cr_appendstrf(buf, "%s %s %d", inter?"ZINTERSTORE":"ZUNIONSTORE", destkey, keyc)) != 0)
-    return rc;
-  if ((rc = cr_appendstrarray(buf, keyc, keyv, 0)) != 0)
-    return rc;
-  if (weightv != NULL)
-    for (i = 0; i < keyc; i++)
-      if ((rc = cr_appendstrf(buf, " %d", weightv[i])) != 0)
-        return rc;
+  if (shnd->points == 0)
+    return -1;
 
-  switch (aggregate) {
-  case SUM: 
-    rc = cr_appendstr(buf, " AGGREGATE SUM", 0);
-    break;
-  case MIN:
-    rc = cr_appendstr(buf, " AGGREGATE MIN", 0);
-    break;
-  case MAX:
-    rc = cr_appendstr(buf, " AGGREGATE MAX", 0);
-    break;
-  case NONE:
-    ; /* avoiding compiler warning */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (shnd->ring[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  if (rc != 0)
-    return rc;
 
-  if ((rc = cr_appendstr(buf, "\r\n", 0)) != 0)
-    return rc;
+  return shnd->ring[lo == shnd->points ? 0 : lo].shard;
+}
 
-  if ((rc = cr_sendandreceive(rhnd, CR_INT)) == 0) 
-    rc = rhnd->reply.integer;
+REDIS_SHARDS credis_shards_create(int timeout)
+{
+  REDIS_SHARDS shnd;
 
-  return rc;
+  if ((shnd = cr_calloc(sizeof(cr_shards), 1)) == NULL)
+    return NULL;
+  shnd->timeout = timeout;
+
+  return shnd;
 }
 
-int credis_zinterstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv, 
-                       const int *weightv, REDIS_AGGREGATE aggregate)
+void credis_shards_destroy(REDIS_SHARDS shnd)
 {
-  return cr_zstore(rhnd, 1, destkey, keyc, keyv, weightv, aggregate);
+  int i;
+
+  if (shnd == NULL)
+    return;
+
+  for (i = 0; i < shnd->len; i++) {
+    if (shnd->shards[i].rhnd != NULL)
+      credis_close(shnd->shards[i].rhnd);
+    cr_free(shnd->shards[i].host);
+  }
+  cr_free(shnd->shards);
+  cr_free(shnd->ring);
+  cr_fanoutfree(&(shnd->fanout));
+  cr_free(shnd);
 }
 
-int credis_zunionstore(REDIS rhnd, const char *destkey, int keyc, const char **keyv, 
-                       const int *weightv, REDIS_AGGREGATE aggregate)
+static int cr_shardsfind(REDIS_SHARDS shnd, const char *host, int port)
 {
-  return cr_zstore(rhnd, 0, destkey, keyc, keyv, weightv, aggregate);
+  int i;
+
+  for (i = 0; i < shnd->len; i++)
+    if (shnd->shards[i].port == port && strcmp(shnd->shards[i].host, host) == 0)
+      return i;
+
+  return -1;
 }
 
-int credis_hset(REDIS rhnd, const char *key, const char *field, const char *value)
+int credis_shards_add(REDIS_SHARDS shnd, const char *host, int port, int weight)
 {
-  int rc;
+  cr_shard *shards;
+  char *copy;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "HSET %s %s %s\r\n",
-			    key, field, value);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "HSET %s %s %zu\r\n%s\r\n", 
-			    key, field, strlen(value), value);
+  if (host == NULL)
+    host = "127.0.0.1";
+  if (port == 0)
+    port = 6379;
+  if (weight <= 0 || cr_shardsfind(shnd, host, port) >= 0)
+    return CREDIS_ERR;
 
-  if (rc == 0 && rhnd->reply.integer == 0)
-    rc = -1;
+  if (shnd->len == shnd->size) {
+    if ((shards = cr_realloc(shnd->shards, sizeof(cr_shard) * (shnd->size + 8))) == NULL)
+      return CREDIS_ERR_NOMEM;
+    shnd->shards = shards;
+    shnd->size += 8;
+  }
+  if ((copy = cr_strdup(host)) == NULL)
+    return CREDIS_ERR_NOMEM;
 
-  return rc;
+  shnd->shards[shnd->len].host = copy;
+  shnd->shards[shnd->len].port = port;
+  shnd->shards[shnd->len].weight = weight;
+  shnd->shards[shnd->len].rhnd = NULL;
+  shnd->len++;
+
+  return cr_shardsbuildring(shnd);
 }
 
-int credis_hget(REDIS rhnd, const char *key, const char *field, char **value)
+int credis_shards_remove(REDIS_SHARDS shnd, const char *host, int port)
 {
-  int rc;
-
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "HGET %s %s\r\n",
-			    key, field);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_BULK, "HGET %s %zu\r\n%s\r\n", 
-			    key, strlen(field), field);
+  int i;
 
-  if (rc == 0 && (*value = rhnd->reply.bulk) == NULL)
+  if (host == NULL)
+    host = "127.0.0.1";
+  if (port == 0)
+    port = 6379;
+  if ((i = cr_shardsfind(shnd, host, port)) < 0)
     return -1;
 
-  return rc;
+  if (shnd->shards[i].rhnd != NULL)
+    credis_close(shnd->shards[i].rhnd);
+  cr_free(shnd->shards[i].host);
+  shnd->len--;
+  memmove(shnd->shards + i, shnd->shards + i + 1, sizeof(cr_shard) * (shnd->len - i));
+
+  return cr_shardsbuildring(shnd);
 }
 
-int credis_hkeys(REDIS rhnd, const char *key, char ***fieldv)
+/* Returns handle of shard `n', connecting lazily and replacing a handle that
+ * is out of sync, or NULL if connecting failed */
+static REDIS cr_shardshandle(REDIS_SHARDS shnd, int n)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_MULTIBULK, "HKEYS %s\r\n", key);
+  cr_shard *shard = &(shnd->shards[n]);
+  REDIS old = NULL;
 
-  if (rc == 0) {
-    rc = rhnd->reply.multibulk.len;
-    *fieldv = rhnd->reply.multibulk.bulks;
+  if (shard->rhnd != NULL && shard->rhnd->error != 0) {
+    DEBUG("handle of shard %s:%d out of sync, reconnecting", shard->host, shard->port);
+    old = shard->rhnd;
+    shard->rhnd = NULL;
   }
+  if (shard->rhnd == NULL &&
+      (shard->rhnd = credis_connect(shard->host, shard->port, shnd->timeout)) != NULL)
+    cr_scriptsmove(old, shard->rhnd);
+  credis_close(old);
 
-  return rc;
+  return shard->rhnd;
 }
 
-int credis_hlen(REDIS rhnd, const char *key)
+REDIS credis_shards_handle(REDIS_SHARDS shnd, const char *key)
 {
-  int rc = cr_sendfandreceive(rhnd, CR_INT, "HLEN %s\r\n", key);
+  int n = cr_shardskeyshard(shnd, key, strlen(key));
 
-  if (rc == 0)
-    rc = rhnd->reply.integer;
-
-  return rc;
+  return n < 0 ? NULL : cr_shardshandle(shnd, n);
 }
 
-int credis_hmget(REDIS rhnd, const char *key, int fieldc, const char **fieldv, char ***valv)
+int credis_shards_command(REDIS_SHARDS shnd, int argc, const char **argv, 
+                          const int *argvlen, REDIS_REPLY *reply)
 {
-  cr_buffer *buf = &(rhnd->buf);
-  int rc, i;
+  REDIS rhnd;
+  int n = 0;
 
-  buf->len = 0;
+  if (argc > 1)
+    n = cr_shardskeyshard(shnd, argv[1], argvlen != NULL ? argvlen[1] : strlen(argv[1]));
+  else if (shnd->len == 0)
+    n = -1;
 
-  /* using the new unified request protocol */
-  rc = cr_appendstrf(buf, "*%i\r\n$5\r\nHMGET\r\n$%zu\r\n%s\r\n", fieldc + 2, strlen(key), key);
-  if (rc != 0)
+  if (n < 0)
+    return CREDIS_ERR;
+  if ((rhnd = cr_shardshandle(shnd, n)) == NULL)
+    return CREDIS_ERR_CONNECT;
+
+  return credis_command(rhnd, argc, argv, argvlen, reply);
+}
+
+/* Sends `cmd' with the keys of each shard to all shards concerned at the 
+ * same time, by pipelining it to each shard and flushing all pipelines 
+ * before reading any reply. Replies are passed to cr_fanoutcopy() for 
+ * multi-bulk commands and summed up for integer commands.
+ * Returns:
+ *  >=0 sum of integer replies of all shards
+ *   <0 on error */
+static int cr_shardsfanout(REDIS_SHARDS shnd, int cmd, int keyc, const char **keyv)
+{
+  char recvtype = cr_commands[cmd].type;
+  cr_fanout *fanout = &(shnd->fanout);
+  cr_fanoutkey *keys;
+  REDIS_REPLY reply;
+  REDIS rhnd;
+  int i, j, n, rc, sum = 0;
+
+  if (shnd->len == 0)
+    return CREDIS_ERR;
+  if ((rc = cr_fanoutreserve(fanout, keyc)) != 0)
     return rc;
-  
-  /* add fields */
-  for (i = 0; i < fieldc; i++) {
-    if ((rc = cr_appendstrf(buf, "$%zu\r\n%s\r\n", strlen(fieldv[i]), fieldv[i])) != 0)
-      return rc;
+
+  keys = fanout->keys;
+  for (i = 0; i < keyc; i++)
+    keys[i].group = cr_shardskeyshard(shnd, keyv[i], strlen(keyv[i]));
+  cr_fanoutsort(fanout, keyc, keyv);
+
+  /* connect first so that handles are not replaced while pipelining */
+  for (i = 0; i < keyc; i = cr_fanoutgroupend(fanout, keyc, i))
+    if (cr_shardshandle(shnd, keys[i].group) == NULL)
+      return CREDIS_ERR_CONNECT;
+
+  for (i = 0; i < keyc; i = j) {
+    j = cr_fanoutgroupend(fanout, keyc, i);
+    rhnd = shnd->shards[keys[i].group].rhnd;
+    if (!rhnd->pipeline.active)
+      credis_pipeline_begin(rhnd);
+    if ((rc = cr_multikeycommand(rhnd, cmd, j - i, fanout->keyv + i)) != CREDIS_QUEUED)
+      break;
+    rc = 0;
   }
 
-  if ((rc = cr_sendandreceive(rhnd, CR_MULTIBULK)) == 0) {
-    *valv = rhnd->reply.multibulk.bulks;
-    rc = rhnd->reply.multibulk.len;
+  for (n = 0; n < shnd->len && rc == 0; n++)
+    if ((rhnd = shnd->shards[n].rhnd) != NULL && rhnd->pipeline.active)
+      credis_pipeline_flush(rhnd);
+
+  for (i = 0; i < keyc && rc == 0; i = j) {
+    j = cr_fanoutgroupend(fanout, keyc, i);
+    rhnd = shnd->shards[keys[i].group].rhnd;
+    if ((rc = credis_pipeline_next(rhnd, &reply)) != 0)
+      break;
+    if (recvtype == CR_MULTIBULK)
+      rc = cr_fanoutcopy(fanout, &reply, i, j - i);
+    else if (reply.type == CREDIS_REPLY_INTEGER)
+      sum += reply.integer;
+    else
+      rc = CREDIS_ERR_PROTOCOL;
   }
 
-  return rc;
+  for (n = 0; n < shnd->len; n++)
+    if ((rhnd = shnd->shards[n].rhnd) != NULL && rhnd->pipeline.active)
+      credis_pipeline_end(rhnd);
+
+  return rc != 0 ? rc : sum;
 }
 
+int credis_shards_mget(REDIS_SHARDS shnd, int keyc, const char **keyv, char ***valv)
+{
+  int rc = cr_shardsfanout(shnd, CR_CMD_MGET, keyc, keyv);
+
+  if (rc < 0)
+    return rc;
+  *valv = cr_fanoutvalues(&(shnd->fanout), keyc);
+
+  return keyc;
+}
 
-static void cr_freemessage(cr_message *msg)
+int credis_shards_del(REDIS_SHARDS shnd, int keyc, const char **keyv)
 {
-  if (msg != NULL) {
-    if (msg->message != NULL)
-      free(msg->message);
-    if (msg->channel != NULL)
-      free(msg->channel);
-    if (msg->pattern != NULL)
-      free(msg->pattern);
-    free(msg);
-  }
+  return cr_shardsfanout(shnd, CR_CMD_DEL, keyc, keyv);
 }
 
-/* returns first message in FIFO and removes it from queue but
- * does not free memory. returns NULL if the queue is empty */
-static cr_message * cr_getmessage(REDIS rhnd)
+/* Sets address of `node', closing its connection if the address changed. 
+ * Returns 1 if changed, 0 if not or CREDIS_ERR_NOMEM */
+static int cr_sentinelsetnode(cr_sentinelnode *node, const char *host, int hostlen, int port)
 {
-  cr_message *msg = rhnd->pubsub.head;
+  char *copy;
 
-  if (rhnd->pubsub.head != NULL) {
-    if (rhnd->pubsub.head == rhnd->pubsub.tail) {
-      rhnd->pubsub.head = NULL;
-      rhnd->pubsub.tail = NULL;
-    }
-    else
-      rhnd->pubsub.head = rhnd->pubsub.head->next;
+  if (node->host != NULL && node->port == port && 
+      strncmp(node->host, host, hostlen) == 0 && node->host[hostlen] == '\0')
+    return 0;
+
+  if ((copy = cr_malloc(hostlen + 1)) == NULL)
+    return CREDIS_ERR_NOMEM;
+  memcpy(copy, host, hostlen);
+  copy[hostlen] = '\0';
+
+  /* handle of old address is disconnected but kept, with its scripts, until
+   * cr_sentinelhandle() has connected its replacement */
+  if (node->rhnd != NULL) {
+    if (node->rhnd->fd > 0)
+      close(node->rhnd->fd);
+    node->rhnd->fd = -1;
+    node->rhnd->error = CREDIS_ERR_CONNECT;
   }
+  cr_free(node->host);
+  node->host = copy;
+  node->port = port;
+  node->down = 0;
 
-  return msg;
+  return 1;
 }
 
-static void cr_freeallmessages(REDIS rhnd)
+static void cr_sentinelfreenode(cr_sentinelnode *node)
 {
-  cr_message *msg;
-
-  if (rhnd->pubsub.msg != NULL) {
-    cr_freemessage(rhnd->pubsub.msg);
-    rhnd->pubsub.msg = NULL;
-  }
-
-  while ((msg = cr_getmessage(rhnd)) != NULL)
-    cr_freemessage(rhnd->pubsub.msg);
+  credis_close(node->rhnd);
+  cr_free(node->host);
 }
 
-/* allocates and adds new message last in FIFO. if successful a 
- * pointer to newly created message struct is returned else NULL 
- * is returned. */
-static cr_message * cr_storemessage(REDIS rhnd, char *pattern, char *channel, char *message)
+/* Returns handle of `node', connecting lazily and replacing a handle that is
+ * out of sync, or NULL if connecting failed. A handle being replaced is kept
+ * until its replacement has connected, to pass on its scripts. A node that 
+ * could not be reached is not tried again for a while */
+static REDIS cr_sentinelhandle(REDIS_SENTINEL snhnd, cr_sentinelnode *node)
 {
-  cr_message *msg;
+  REDIS rhnd;
 
-  if ((msg = calloc(sizeof(cr_message), 1)) == NULL ||
-      (pattern != NULL && (msg->pattern = strdup(pattern)) == NULL) ||
-      (msg->channel = strdup(channel)) == NULL ||
-      (msg->message = strdup(message)) == NULL) {
-    DEBUG("out of memory\n");
-    cr_freemessage(msg);
+  if (node->rhnd != NULL && node->rhnd->error == 0)
+    return node->rhnd;
+  if (node->host == NULL ||
+      (node->down != 0 && cr_msecs() - node->down < CR_SENTINEL_RETRY_INTERVAL))
     return NULL;
-  }
-
-  if (rhnd->pubsub.tail != NULL)
-    rhnd->pubsub.tail->next = msg;
 
-  rhnd->pubsub.tail = msg;
+  if (node->rhnd != NULL)
+    DEBUG("handle of %s:%d out of sync, reconnecting", node->host, node->port);
+  if ((rhnd = credis_connect(node->host, node->port, snhnd->timeout)) == NULL) {
+    node->down = cr_msecs();
+    return NULL;
+  }
+  cr_scriptsmove(node->rhnd, rhnd);
+  credis_close(node->rhnd);
+  node->rhnd = rhnd;
+  node->down = 0;
 
-  if (rhnd->pubsub.head == NULL)
-    rhnd->pubsub.head = msg;
-  
-  return msg;
+  return rhnd;
 }
 
-static int cr_parsepubsubmessage(REDIS rhnd, char **pattern, char **channel, char **message)
+/* Reads replicas of master from sentinel `rhnd'. Each element of the reply 
+ * to SENTINEL SLAVES, understood by all Sentinel versions, is a list of 
+ * field names and values. Replicas flagged as down or disconnected are left
+ * out */
+static int cr_sentinelloadreplicas(REDIS_SENTINEL snhnd, REDIS rhnd)
 {
-  if (rhnd->reply.multibulk.len >= 4 && 
-      !strcmp("pmessage", rhnd->reply.multibulk.bulks[0])) {
-    *pattern = rhnd->reply.multibulk.bulks[1];
-    *channel = rhnd->reply.multibulk.bulks[2];
-    *message = rhnd->reply.multibulk.bulks[3];
+  const char *argv[] = {"SENTINEL", "SLAVES", snhnd->name};
+  REDIS_REPLY reply, *fields;
+  cr_sentinelnode *replicas;
+  const char *ip, *flags;
+  int i, j, n = 0, rc, iplen = 0, port;
+
+  if ((rc = credis_command(rhnd, 3, argv, NULL, &reply)) != 0)
+    return rc;
+  if (reply.type != CREDIS_REPLY_MULTIBULK)
+    return CREDIS_ERR_PROTOCOL;
+
+  /* replicas are kept, connected, if still listed at the same position */
+  if (reply.elements > snhnd->replicasize) {
+    if ((replicas = cr_realloc(snhnd->replicas, sizeof(cr_sentinelnode) * reply.elements)) == NULL)
+      return CREDIS_ERR_NOMEM;
+    memset(replicas + snhnd->replicasize, 0, 
+           sizeof(cr_sentinelnode) * (reply.elements - snhnd->replicasize));
+    snhnd->replicas = replicas;
+    snhnd->replicasize = reply.elements;
   }
-  else if (rhnd->reply.multibulk.len >= 3 && 
-           !strcmp("message", rhnd->reply.multibulk.bulks[0])) {
-    *pattern = NULL;
-    *channel = rhnd->reply.multibulk.bulks[1];
-    *message = rhnd->reply.multibulk.bulks[2];
+
+  for (i = 0; i < reply.elements; i++) {
+    fields = &(reply.element[i]);
+    if (fields->type != CREDIS_REPLY_MULTIBULK)
+      continue;
+    ip = flags = NULL;
+    port = 0;
+    for (j = 0; j + 1 < fields->elements; j += 2) {
+      if (fields->element[j].str == NULL || fields->element[j + 1].str == NULL)
+        continue;
+      if (strcmp(fields->element[j].str, "ip") == 0) {
+        ip = fields->element[j + 1].str;
+        iplen = fields->element[j + 1].len;
+      }
+      else if (strcmp(fields->element[j].str, "port") == 0)
+        port = atoi(fields->element[j + 1].str);
+      else if (strcmp(fields->element[j].str, "flags") == 0)
+        flags = fields->element[j + 1].str;
+    }
+    if (ip == NULL || port <= 0 || (flags != NULL && 
+        (strstr(flags, "s_down") || strstr(flags, "o_down") || strstr(flags, "disconnected"))))
+      continue;
+    if ((rc = cr_sentinelsetnode(&(snhnd->replicas[n]), ip, iplen, port)) < 0)
+      return rc;
+    n++;
   }
-  else
-    return CREDIS_ERR_PROTOCOL;
+
+  for (i = n; i < snhnd->replicalen; i++) {
+    cr_sentinelfreenode(&(snhnd->replicas[i]));
+    memset(&(snhnd->replicas[i]), 0, sizeof(cr_sentinelnode));
+  }
+  snhnd->replicalen = n;
 
   return 0;
 }
 
-/* wait for a specific pub/sub message, for instance the reply to an
- * subscription request, and store (p)messages received during wait to
- * message queue. returns number of channels/patterns subscribed to. */
-static int cr_sendandwaitforpubsub(REDIS rhnd, const char *command, const char *data)
+/* Asks sentinels, in order, for the address of the master until one knows 
+ * it. The sentinel that answered is moved first, to be asked first next 
+ * time, and is the one subscribed to for +switch-master. The subscription
+ * is made before asking so that no switch can go unnoticed in between */
+static int cr_sentinelresolve(REDIS_SENTINEL snhnd)
 {
-  cr_buffer *buf = &(rhnd->buf);
-  char *pattern, *channel, *message;
-  int rc;
-
-  buf->len = 0;
-  
-  if (data != NULL)
-    rc = cr_appendstrf(buf, "%s %s\r\n", command, data);
-  else
-    rc = cr_appendstrf(buf, "%s\r\n", command);
-
-  /* send without receiving reply */
-  if (rc == 0)
-    rc = cr_sendandreceive(rhnd, CR_NONE);
+  const char *argv[] = {"SENTINEL", "get-master-addr-by-name", snhnd->name};
+  cr_sentinelnode *sentinel, tmp;
+  REDIS_REPLY reply;
+  REDIS rhnd;
+  int i, rc;
+
+  for (i = 0; i < snhnd->len; i++) {
+    sentinel = &(snhnd->sentinels[i]);
+    if ((rhnd = cr_sentinelhandle(snhnd, sentinel)) == NULL)
+      continue;
+
+    if (snhnd->sub == NULL) {
+      if ((snhnd->sub = credis_connect(sentinel->host, sentinel->port, snhnd->timeout)) != NULL &&
+          credis_subscribe(snhnd->sub, "+switch-master") < 0) {
+        credis_close(snhnd->sub);
+        snhnd->sub = NULL;
+      }
+    }
 
-  /* wait for pushed messages */
-  /* TODO introduce a timeout */ 
-  while (rc == 0) {
-    if ((rc = cr_receivereply(rhnd, CR_MULTIBULK)) != 0)
+    if (credis_command(rhnd, 3, argv, NULL, &reply) != 0 ||
+        reply.type != CREDIS_REPLY_MULTIBULK || reply.elements != 2 ||
+        reply.element[0].str == NULL || reply.element[1].str == NULL) {
+      DEBUG("sentinel %s:%d does not know master %s", sentinel->host, sentinel->port, snhnd->name);
+      continue;
+    }
+    if ((rc = cr_sentinelsetnode(&(snhnd->master), reply.element[0].str, 
+                                 reply.element[0].len, atoi(reply.element[1].str))) < 0)
       return rc;
+    if (snhnd->readreplicas)
+      cr_sentinelloadreplicas(snhnd, rhnd);
 
-    if (rhnd->reply.multibulk.len >= 3 && 
-        !strcasecmp(command, rhnd->reply.multibulk.bulks[0]) &&
-        !strcasecmp(data, rhnd->reply.multibulk.bulks[1])) {
-      return atoi(rhnd->reply.multibulk.bulks[2]);
+    if (i > 0) {
+      tmp = snhnd->sentinels[0];
+      snhnd->sentinels[0] = *sentinel;
+      *sentinel = tmp;
     }
-    else if (cr_parsepubsubmessage(rhnd, &pattern, &channel, &message) == 0) {
-      if (cr_storemessage(rhnd, pattern, channel, message) == NULL)
-        return CREDIS_ERR_NOMEM;
+    snhnd->stale = 0;
+    return 0;
+  }
+
+  return CREDIS_ERR_CONNECT;
+}
+
+/* Applies +switch-master messages received so far, "<name> <old ip> <old 
+ * port> <new ip> <new port>", without waiting for more. If the subscription
+ * is lost sentinels are asked again */
+static void cr_sentinelpoll(REDIS_SENTINEL snhnd)
+{
+  REDIS_MESSAGE msgv[8];
+  const char *ip, *port;
+  int i, n, namelen = strlen(snhnd->name);
+
+  if (snhnd->sub == NULL || cr_msecs() - snhnd->polled < CR_SENTINEL_POLL_INTERVAL)
+    return;
+
+  snhnd->polled = cr_msecs();
+  while ((n = credis_listenbatch(snhnd->sub, msgv, 8, 0)) > 0) {
+    for (i = 0; i < n; i++) {
+      if (strncmp(msgv[i].message, snhnd->name, namelen) != 0 || 
+          msgv[i].message[namelen] != ' ' ||
+          (ip = strchr(msgv[i].message + namelen + 1, ' ')) == NULL ||
+          (ip = strchr(ip + 1, ' ')) == NULL ||
+          (port = strchr(++ip, ' ')) == NULL)
+        continue;
+      DEBUG("master %s switched to %s", snhnd->name, ip);
+      if (cr_sentinelsetnode(&(snhnd->master), ip, port - ip, atoi(port + 1)) < 0)
+        snhnd->stale = 1;
+      /* replicas are reconfigured as well */
+      else if (snhnd->readreplicas)
+        snhnd->stale = 1;
     }
-    else
-      ; /* TODO out of order pub/sub message, return error or silently ignore? */
+    if (n < 8)
+      break;
   }
 
-  return rc;
+  if (n < 0) {
+    DEBUG("sentinel subscription lost");
+    credis_close(snhnd->sub);
+    snhnd->sub = NULL;
+    snhnd->stale = 1;
+  }
 }
 
-int credis_subscribe(REDIS rhnd, const char *channel)
+REDIS_SENTINEL credis_sentinel_connect(const char *sentinels, const char *name, int timeout)
 {
-  return cr_sendandwaitforpubsub(rhnd, "SUBSCRIBE", channel);
+  REDIS_SENTINEL snhnd;
+  cr_sentinelnode *nodes;
+  const char *sentinel, *end, *colon;
+  int port;
+
+  if ((snhnd = cr_calloc(sizeof(cr_sentinel), 1)) == NULL)
+    return NULL;
+  snhnd->timeout = timeout;
+  if ((snhnd->name = cr_strdup(name)) == NULL)
+    goto error;
+
+  for (sentinel = sentinels; *sentinel != '\0'; sentinel = *end == ',' ? end + 1 : end) {
+    if ((end = strchr(sentinel, ',')) == NULL)
+      end = sentinel + strlen(sentinel);
+    /* last colon separates port, host may be an IPv6 address */
+    for (colon = end - 1; colon > sentinel && *colon != ':'; colon--)
+      ;
+    if (colon > sentinel) 
+      port = atoi(colon + 1);
+    else {
+      colon = end;
+      port = CR_SENTINEL_PORT;
+    }
+    if (colon == sentinel)
+      continue;
+    if ((nodes = cr_realloc(snhnd->sentinels, sizeof(cr_sentinelnode) * (snhnd->len + 1))) == NULL)
+      goto error;
+    snhnd->sentinels = nodes;
+    memset(&(nodes[snhnd->len]), 0, sizeof(cr_sentinelnode));
+    if (cr_sentinelsetnode(&(nodes[snhnd->len++]), sentinel, colon - sentinel, port) < 0)
+      goto error;
+  }
+
+  if (cr_sentinelresolve(snhnd) != 0)
+    goto error;
+
+  return snhnd;
+
+error:
+  credis_sentinel_close(snhnd);
+  return NULL;
 }
 
-int credis_unsubscribe(REDIS rhnd, const char *channel)
+void credis_sentinel_close(REDIS_SENTINEL snhnd)
 {
-  return cr_sendandwaitforpubsub(rhnd, "UNSUBSCRIBE", channel);
+  int i;
+
+  if (snhnd == NULL)
+    return;
+
+  for (i = 0; i < snhnd->len; i++)
+    cr_sentinelfreenode(&(snhnd->sentinels[i]));
+  for (i = 0; i < snhnd->replicalen; i++)
+    cr_sentinelfreenode(&(snhnd->replicas[i]));
+  cr_sentinelfreenode(&(snhnd->master));
+  credis_close(snhnd->sub);
+  cr_free(snhnd->sentinels);
+  cr_free(snhnd->replicas);
+  cr_free(snhnd->name);
+  cr_free(snhnd);
 }
 
-int credis_psubscribe(REDIS rhnd, const char *pattern)
+int credis_sentinel_refresh(REDIS_SENTINEL snhnd)
 {
-  return cr_sendandwaitforpubsub(rhnd, "PSUBSCRIBE", pattern);
+  return cr_sentinelresolve(snhnd);
 }
 
-int credis_punsubscribe(REDIS rhnd, const char *pattern)
+int credis_sentinel_readreplicas(REDIS_SENTINEL snhnd, int enable)
 {
-  return cr_sendandwaitforpubsub(rhnd, "PUNSUBSCRIBE", pattern);
+  snhnd->readreplicas = enable;
+  if (!enable || snhnd->replicalen > 0)
+    return 0;
+
+  return cr_sentinelresolve(snhnd);
 }
 
-int credis_publish(REDIS rhnd, const char *channel, const char *message)
+REDIS credis_sentinel_master(REDIS_SENTINEL snhnd)
 {
-  int rc;
+  REDIS rhnd;
 
-  if (rhnd->version.number >= CR_VERSION(2,2,2))
-    rc = cr_sendfandreceive(rhnd, CR_INT, "PUBLISH %s %s\r\n", 
-			    channel, message);
-  else
-    rc = cr_sendfandreceive(rhnd, CR_INT, "PUBLISH %s %zu\r\n%s\r\n", 
-			    channel, strlen(message), message);
+  cr_sentinelpoll(snhnd);
+  if (snhnd->stale)
+    cr_sentinelresolve(snhnd);
 
-  if (rc == 0)
-    rc = rhnd->reply.integer;
+  /* the master we knew may have failed over, sentinels will know */
+  if ((rhnd = cr_sentinelhandle(snhnd, &(snhnd->master))) == NULL &&
+      cr_sentinelresolve(snhnd) == 0)
+    rhnd = cr_sentinelhandle(snhnd, &(snhnd->master));
 
-  return rc;                            
+  return rhnd;
 }
 
-int credis_listen(REDIS rhnd, char **pattern, char **channel, char **message)
-{
-  int rc;
+REDIS credis_sentinel_replica(REDIS_SENTINEL snhnd)
+{
+  cr_sentinelnode *node;
+  REDIS rhnd, best = NULL;
+  int i, n, start, outstanding, least = 0;
+
+  cr_sentinelpoll(snhnd);
+  if (snhnd->stale)
+    cr_sentinelresolve(snhnd);
+
+  /* replica with fewest replies outstanding, starting with the one after 
+   * the last picked so that ties are spread round-robin */
+  for (i = 0, start = snhnd->next; snhnd->readreplicas && i < snhnd->replicalen; i++) {
+    n = (start + i) % snhnd->replicalen;
+    node = &(snhnd->replicas[n]);
+    if ((rhnd = cr_sentinelhandle(snhnd, node)) == NULL)
+      continue;
+    outstanding = rhnd->pipeline.queued + rhnd->pipeline.pending;
+    if (best == NULL || outstanding < least) {
+      best = rhnd;
+      least = outstanding;
+      snhnd->next = n + 1;
+    }
+    if (least == 0)
+      break;
+  }
 
-  if (rhnd->pubsub.msg != NULL)
-    cr_freemessage(rhnd->pubsub.msg);
+  return best != NULL ? best : credis_sentinel_master(snhnd);
+}
 
-  /* check message queue first */
-  if ((rhnd->pubsub.msg = cr_getmessage(rhnd)) != NULL) {
-    *pattern = rhnd->pubsub.msg->pattern;
-    *channel = rhnd->pubsub.msg->channel;
-    *message = rhnd->pubsub.msg->message;
-    return 0;
+int credis_sentinel_command(REDIS_SENTINEL snhnd, int argc, const char **argv, 
+                            const int *argvlen, REDIS_REPLY *reply)
+{
+  REDIS rhnd;
+  int rc, readonly = argc > 0 && 
+    cr_readonlycommand(argv[0], argvlen != NULL ? argvlen[0] : strlen(argv[0]));
+
+  if (readonly && snhnd->readreplicas &&
+      (rhnd = credis_sentinel_replica(snhnd)) != NULL) {
+    rc = credis_command(rhnd, argc, argv, argvlen, reply);
+    if (rhnd->error == 0)
+      return rc;
   }
 
-  /* wait for message */
-  if ((rc = cr_receivereply(rhnd, CR_MULTIBULK)) == 0)
-    rc = cr_parsepubsubmessage(rhnd, pattern, channel, message);
+  if ((rhnd = credis_sentinel_master(snhnd)) == NULL)
+    return CREDIS_ERR_CONNECT;
+  rc = credis_command(rhnd, argc, argv, argvlen, reply);
+
+  /* master may have failed over, sentinels are asked again. Only a read-only
+   * command is safe to send again, others may have been carried out */
+  if (rhnd->error != 0) {
+    snhnd->stale = 1;
+    if (readonly && cr_sentinelresolve(snhnd) == 0 &&
+        (rhnd = cr_sentinelhandle(snhnd, &(snhnd->master))) != NULL)
+      rc = credis_command(rhnd, argc, argv, argvlen, reply);
+  }
 
   return rc;
 }
 
+void credis_setallocator(void *(*malloc_fn)(size_t size), 
+                         void *(*realloc_fn)(void *ptr, size_t size),
+                         void (*free_fn)(void *ptr))
+{
+  if (malloc_fn == NULL || realloc_fn == NULL || free_fn == NULL) {
+    malloc_fn = malloc;
+    realloc_fn = realloc;
+    free_fn = free;
+  }
+
+  cr_mallocfn = malloc_fn;
+  cr_reallocfn = realloc_fn;
+  cr_freefn = free_fn;
+}
+
+void credis_setbufferpolicy(int baseline, int maxgrowth, int shrinkafter)
+{
+  cr_bufferbaseline = baseline > CR_BUFFER_SIZE ? baseline : CR_BUFFER_SIZE;
+  cr_buffermaxgrowth = maxgrowth > 0 ? maxgrowth : 0;
+  cr_buffershrinkafter = shrinkafter > 0 ? shrinkafter : 0;
+}
+
+int credis_getstats(REDIS rhnd, REDIS_STATS *stats)
+{
+#ifdef CREDIS_STATS
+  *stats = rhnd->stats;
+  stats->buffer_reallocs = rhnd->buf.reallocs;
+  stats->multibulk_reallocs = rhnd->reply.multibulk.reallocs + rhnd->parser.reallocs;
+  return 0;
+#else
+  memset(stats, 0, sizeof(REDIS_STATS));
+  return CREDIS_ERR;
+#endif
+}
+
+void credis_resetstats(REDIS rhnd)
+{
+#ifdef CREDIS_STATS
+  memset(&(rhnd->stats), 0, sizeof(REDIS_STATS));
+  rhnd->buf.reallocs = 0;
+  rhnd->reply.multibulk.reallocs = 0;
+  rhnd->parser.reallocs = 0;
+#endif
+}
 
+int credis_setcommandhook(REDIS rhnd, credis_commandhook hook, void *data)
+{
+#ifdef CREDIS_STATS
+  rhnd->hook = hook;
+  rhnd->hookdata = data;
+  return 0;
+#else
+  return CREDIS_ERR;
+#endif
+}
@@ -31,6 +31,8 @@
 #ifndef __CREDIS_H
 #define __CREDIS_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -52,9 +54,12 @@ extern "C" {
  * internally. Subsequent calls to credis functions _will_ destroy the data 
  * to which returned values reference to. If for instance the returned value 
  * by a call to credis_get() is to be used later in the program, a strdup() 
- * is highly recommended. However, each `REDIS' handle has its own state and 
+ * is highly recommended, or credis_detach() to take over the buffers without
+ * copying. However, each `REDIS' handle has its own state and 
  * manages its own memory buffers independently. That means that one of two 
  * handles can be destroyed while the other keeps its connection and data.
+ * A handle must not be used by more than one thread at a time, use a 
+ * connection pool to share connections between threads.
  * 
  * EXAMPLE
  * 
@@ -67,14 +72,28 @@ extern "C" {
  * TODO
  *
  *  - Add support for missing Redis commands marked as TODO below
- *  - Currently only support for zero-terminated strings, not for storing 
- *    abritary binary data as bulk data. Basically an API issue since it is 
- *    partially supported internally.
+ *  - Binary data is only supported by the `*bin' variants of commands and
+ *    by credis_command(), all other functions expect zero-terminated strings.
+ *    The `*bin' variants of commands returning data also return the length
+ *    of each returned value, which refers directly into credis' internal 
+ *    buffers. Returned values are always zero-terminated as well.
  *  - Test 
+ *
+ * All commands are sent using the unified request protocol, hence Redis 
+ * server version 1.2 or later is required.
  */
 
 /* handle to a Redis server connection */
 typedef struct _cr_redis* REDIS;
+typedef struct _cr_async* REDIS_ASYNC;
+typedef struct _cr_pool* REDIS_POOL;
+typedef struct _cr_executor* REDIS_EXECUTOR;
+typedef struct _cr_cluster* REDIS_CLUSTER;
+typedef struct _cr_shards* REDIS_SHARDS;
+typedef struct _cr_sentinel* REDIS_SENTINEL;
+typedef struct _cr_detached* REDIS_DETACHED;
+typedef struct _cr_scan* REDIS_SCAN;
+typedef struct _cr_script* REDIS_SCRIPT;
 
 #define CREDIS_OK 0
 #define CREDIS_ERR -90
@@ -86,6 +105,11 @@ typedef struct _cr_redis* REDIS;
 #define CREDIS_ERR_TIMEOUT -96
 #define CREDIS_ERR_PROTOCOL -97
 #define CREDIS_ERR_PUBSUB -98
+#define CREDIS_ERR_PIPELINE -99
+
+/* returned by command functions while in pipeline mode, refer to
+ * credis_pipeline_begin() */
+#define CREDIS_QUEUED 1
 
 #define CREDIS_TYPE_NONE 1
 #define CREDIS_TYPE_STRING 2
@@ -95,6 +119,19 @@ typedef struct _cr_redis* REDIS;
 #define CREDIS_SERVER_MASTER 1
 #define CREDIS_SERVER_SLAVE 2
 
+#define CREDIS_REPLY_STATUS 1
+#define CREDIS_REPLY_ERROR 2
+#define CREDIS_REPLY_INTEGER 3
+#define CREDIS_REPLY_BULK 4
+#define CREDIS_REPLY_MULTIBULK 5
+/* RESP3 reply types, only received after credis_hello(rhnd, 3) */
+#define CREDIS_REPLY_DOUBLE 6
+#define CREDIS_REPLY_NIL 7
+#define CREDIS_REPLY_BOOLEAN 8
+#define CREDIS_REPLY_MAP 9
+#define CREDIS_REPLY_SET 10
+#define CREDIS_REPLY_PUSH 11
+
 typedef enum _cr_aggregate {
   NONE,
   SUM, 
@@ -135,28 +172,136 @@ typedef struct _cr_info {
   int role;
 } REDIS_INFO;
 
+/* A generic reply, as returned for instance when iterating over replies to
+ * pipelined commands. Just like all other data returned by credis, `str' and
+ * `elementv' refer to memory managed by the `REDIS' handle. */
+typedef struct _cr_replyview {
+  int type;         /* refer to CREDIS_REPLY_* defines */
+  int integer;      /* integer reply, 0 or 1 for boolean reply */
+  long long integer64; /* integer reply, not truncated to an int */
+  double number;    /* double reply, its text is available in `str' */
+  char *str;        /* status, error or bulk reply, NULL if bulk is nil */
+  int len;          /* length of `str' */
+  int elements;     /* number of elements in `elementv', a map has
+                       alternating keys and values */
+  char **elementv;  /* multi-bulk reply, only set for the outermost reply and
+                       NULL for elements that are multi-bulks themselves */
+  int *elementlenv; /* length of each element in `elementv' */
+  struct _cr_replyview *element; /* each of the `elements' of multi-bulk 
+                                    reply, including nested multi-bulks */
+} REDIS_REPLY;
+
+
+/*
+ * Memory allocation
+ *
+ * By default credis allocates memory with malloc(), realloc() and free(). 
+ * Another allocator, e.g. jemalloc or one with per-thread arenas, can be 
+ * plugged in for all of the library. Pub/sub messages queued while waiting
+ * for a subscription reply are taken from a per-handle arena that is reset
+ * as a whole once the queue has been consumed, so they cause no allocations
+ * once the arena has grown to hold them.
+ *
+ * IMPORTANT! The allocator must be set before any handle is created and not
+ * changed while any handle exists.
+ */
+
+/* setting any of the functions to NULL restores the default allocator */
+void credis_setallocator(void *(*malloc_fn)(size_t size), 
+                         void *(*realloc_fn)(void *ptr, size_t size),
+                         void (*free_fn)(void *ptr));
+
+
+/* Message buffers start out at `baseline' bytes, at least 4096, and grow 
+ * geometrically, by at most `maxgrowth' bytes at a time unless a reply 
+ * needs more. 0 lets buffers double without limit. A buffer drops back to
+ * `baseline' once `shrinkafter' consecutive commands have used less than a
+ * quarter of it, 0 never shrinks buffers. Defaults are 4096 bytes, 8 MB 
+ * and 64 commands. Should be set before any handle is created */
+void credis_setbufferpolicy(int baseline, int maxgrowth, int shrinkafter);
+
+/* Takes over the buffers holding the last reply of `rhnd', so that values 
+ * returned by the last call, e.g. by credis_mget() or credis_lrange(), stay
+ * valid after further commands without being copied. The handle continues
+ * with spare buffers, recycled from earlier detached replies if possible.
+ * Returns NULL if out of memory, in pipeline mode or while subscribed, when
+ * buffers hold more than the last reply */
+REDIS_DETACHED credis_detach(REDIS rhnd);
+
+/* Releases values of a detached reply. Buffers are kept as spares by `rhnd' 
+ * for later calls to credis_detach(), or freed if `rhnd' is NULL or holds 
+ * enough spares already. `rhnd' need not be the handle detached from but 
+ * must not be used by another thread meanwhile */
+void credis_detach_free(REDIS rhnd, REDIS_DETACHED dhnd);
 
 /*
  * Connection handling
  */
 
-/* `host' is the host to connect to, either as an host name or a IP address, 
- * if set to NULL connection is made to "localhost". `port' is the TCP port 
- * that Redis is listening to, set to 0 will use default port (6379). 
- * `timeout' is the time in milliseconds to use as timeout, when connecting 
- * to a Redis server and waiting for reply, it can be changed after a
- * connection has been made using credis_settimeout() */
+/* `host' is the host to connect to, either as an host name or a IPv4 or IPv6
+ * address, if set to NULL connection is made to "localhost". `host' can also
+ * be the path of a unix domain socket, starting with '/', which saves much
+ * of the per-command latency of TCP when the server is on the same machine.
+ * `port' is the TCP port that Redis is listening to, set to 0 will use 
+ * default port (6379). `timeout' is the time in milliseconds to use as 
+ * timeout, when connecting to a Redis server and waiting for reply, it can
+ * be changed after a connection has been made using credis_settimeout(). 
+ * The address a host name resolves to is remembered for a minute, so that 
+ * reconnects do not wait for name resolution. An address that can no longer
+ * be connected to is resolved again */
 REDIS credis_connect(const char *host, int port, int timeout);
 
+/* Server version is detected with INFO as part of connecting, costing a 
+ * round trip per connection. If all servers are known to be of the same 
+ * `version', e.g. "7.2.4", it can be given instead, detection is then 
+ * skipped for all handles connected from then on. NULL turns on detection
+ * again. Returns CREDIS_ERR if `version' could not be parsed.
+ *
+ * IMPORTANT! The version is shared by all handles and not protected by any
+ * lock, it must be set before any handle is created or any thread that may
+ * connect handles is started, and not changed while other threads run. */
+int credis_setserverversion(const char *version);
+
 /* set Redis server reply `timeout' in millisecs */ 
 void credis_settimeout(REDIS rhnd, int timeout);
 
+/* Variadic writes, e.g. credis_mset() and credis_saddv(), with more than 
+ * `size' elements (pairs for credis_mset() and credis_hmset()) are split in 
+ * commands of at most `size' elements which are pipelined. That saves round
+ * trips without blocking the server on a single huge command. Default is 
+ * 1024. In pipeline mode all of the commands are queued */
+void credis_setbatchsize(REDIS rhnd, int size);
+
+/* Reconnects transparently when the connection is found to be lost, making 
+ * up to `attempts' attempts with exponential backoff from `mindelay' to 
+ * `maxdelay' milliseconds. Each delay is picked at random between half and
+ * all of it, so that clients losing the same server spread their attempts.
+ * Authentication, protocol version and the selected database are restored.
+ * A read-only command, e.g. GET or LRANGE, is sent again, as are flushed 
+ * pipelined commands not yet answered if all of them are read-only, at most
+ * 3 times. Other commands return the error, since they may or may not have 
+ * been carried out, but the handle is usable again. Subscribed handles are
+ * not reconnected and the client-side cache is bypassed after reconnecting.
+ * `attempts' set to 0, the default, turns reconnecting off */
+void credis_setreconnect(REDIS rhnd, int attempts, int mindelay, int maxdelay);
+
 void credis_close(REDIS rhnd);
 
 int credis_quit(REDIS rhnd);
 
 int credis_auth(REDIS rhnd, const char *password);
 
+/* Switches to protocol version `protover', 2 or 3, typically right after 
+ * connecting. With RESP3 doubles, nulls, booleans, maps, sets and pushes are 
+ * received as such and reported by their own CREDIS_REPLY_* types through 
+ * REDIS_REPLY, while functions of specific commands work just as with RESP2.
+ * Verbatim strings and big numbers are reported as bulks, without the format
+ * prefix of verbatim strings, and blob errors as errors.
+ * Pushes not asked for, e.g. invalidation messages of CLIENT TRACKING without
+ * REDIRECT, are skipped as they arrive in between replies. Returns 
+ * CREDIS_ERR_PROTOCOL if the server does not support `protover' */
+int credis_hello(REDIS rhnd, int protover);
+
 int credis_ping(REDIS rhnd);
 
 int credis_echo(REDIS rhnd, const char *message, char **reply);
@@ -165,6 +310,43 @@ int credis_echo(REDIS rhnd, const char *message, char **reply);
  * replied with an error message. It is returned by this function. */
 char* credis_errorreply(REDIS rhnd);
 
+/* Returns the last integer reply of the Redis server in full, e.g. to 
+ * credis_incr() or credis_dbsize(). Functions return integer replies as 
+ * int, which large counters may not fit in. */
+long long credis_integerreply(REDIS rhnd);
+
+/* Sends any command, made up of `argc' arguments in `argv', and returns the 
+ * reply in `reply' (if not NULL). The first argument is the command name. The 
+ * length of each argument is given by `argvlen', making it possible to send 
+ * binary data. If `argvlen' is NULL all arguments must be zero-terminated 
+ * strings. If Redis replies with an error CREDIS_ERR_PROTOCOL is returned and
+ * the error message is available in `reply' as well as by credis_errorreply() */
+int credis_command(REDIS rhnd, int argc, const char **argv, const int *argvlen, 
+                   REDIS_REPLY *reply);
+
+/* Called by credis_commandstream() for each element of a reply as soon as it
+ * has been received. Multi-bulks are announced by an element of type 
+ * CREDIS_REPLY_MULTIBULK holding the number of `elements' that follow, 
+ * `depth' is the nesting level of `element', 0 for the reply itself. Bulks 
+ * too large to be buffered at once are handed over in consecutive parts, 
+ * `offset' is the position of a part within its bulk and `remaining' the 
+ * number of bytes still to come, only the last part is zero-terminated. 
+ * `element' and its data are valid until the callback returns. Returning
+ * non-zero skips the rest of the reply. */
+typedef int (*credis_streamcallback)(const REDIS_REPLY *element, int depth, 
+                                     int offset, int remaining, void *data);
+
+/* Same as credis_command() but the reply is handed to `callback' element by
+ * element while it is being received, instead of being buffered in full. 
+ * Client memory is thereby kept small regardless of the size of the reply,
+ * e.g. of a KEYS or LRANGE with millions of elements. Returns 0 on success,
+ * the value returned by `callback' if it stopped the stream or a negative 
+ * value on error. Not available in pipeline mode or while subscribed. With 
+ * reconnect enabled a read-only command is sent again after a lost 
+ * connection only if no element has been handed to `callback' yet */
+int credis_commandstream(REDIS rhnd, int argc, const char **argv, const int *argvlen,
+                         credis_streamcallback callback, void *data);
+
 /* 
  * Commands operating on all the kind of values
  */
@@ -218,11 +400,17 @@ int credis_flushall(REDIS rhnd);
 
 int credis_set(REDIS rhnd, const char *key, const char *val);
 
+/* binary safe version of credis_set(), `vallen' is the length of `val' */
+int credis_setbin(REDIS rhnd, const char *key, const char *val, int vallen);
+
 int credis_setex(REDIS rhnd, const char *key, const char *val, int seconds);
 
 /* returns -1 if the key doesn't exists */
 int credis_get(REDIS rhnd, const char *key, char **val);
 
+/* binary safe version of credis_get(), length of `val' is returned in `vallen' */
+int credis_getbin(REDIS rhnd, const char *key, char **val, int *vallen);
+
 /* returns -1 if the key doesn't exists */
 int credis_getset(REDIS rhnd, const char *key, const char *set_val, char **get_val);
 
@@ -230,13 +418,26 @@ int credis_getset(REDIS rhnd, const char *key, const char *set_val, char **get_v
  * keys stored in `keyv'. */
 int credis_mget(REDIS rhnd, int keyc, const char **keyv, char ***valv);
 
+/* binary safe version of credis_mget(), length of each value is returned in 
+ * vector `vallenv' */
+int credis_mgetbin(REDIS rhnd, int keyc, const char **keyv, char ***valv, int **vallenv);
+
 /* returns -1 if the key already exists and hence not set */
 int credis_setnx(REDIS rhnd, const char *key, const char *val);
 
-/* TODO
- * MSET key1 value1 key2 value2 ... keyN valueN set a multiple keys to multiple values in a single atomic operation
- * MSETNX key1 value1 key2 value2 ... keyN valueN set a multiple keys to multiple values in a single atomic operation if none of
- */
+/* sets `keyc' keys of `keyv' to values of `valv'. Note that more keys than
+ * the handle's batch size, refer to credis_setbatchsize(), are set with 
+ * several pipelined commands and hence not in a single atomic operation */
+int credis_mset(REDIS rhnd, int keyc, const char **keyv, const char **valv);
+
+/* binary safe version of credis_mset(), length of each value is given by
+ * `vallenv' */
+int credis_msetbin(REDIS rhnd, int keyc, const char **keyv, const char **valv, 
+                   const int *vallenv);
+
+/* returns -1 if any of the keys already exists and hence none was set. Always
+ * sent as a single command */
+int credis_msetnx(REDIS rhnd, int keyc, const char **keyv, const char **valv);
 
 /* if `new_val' is not NULL it will return the value after the increment was performed */
 int credis_incr(REDIS rhnd, const char *key, int *new_val);
@@ -268,16 +469,40 @@ int credis_getrange(REDIS rhnd, const char *key, int start, int end, char **subs
  * after the push operation is returned on success */
 int credis_rpush(REDIS rhnd, const char *key, const char *element);
 
+/* binary safe version of credis_rpush(), `elementlen' is the length of `element' */
+int credis_rpushbin(REDIS rhnd, const char *key, const char *element, int elementlen);
+
 /* if Redis server version is 2.0 or later the number of elements inside the list 
  * after the push operation is returned on success */
 int credis_lpush(REDIS rhnd, const char *key, const char *element);
 
+/* binary safe version of credis_lpush(), `elementlen' is the length of `element' */
+int credis_lpushbin(REDIS rhnd, const char *key, const char *element, int elementlen);
+
+/* pushes `valc' elements of `valv' in order, returns the number of elements 
+ * inside the list after the push operation */
+int credis_rpushv(REDIS rhnd, const char *key, int valc, const char **valv);
+
+int credis_rpushvbin(REDIS rhnd, const char *key, int valc, const char **valv, 
+                     const int *vallenv);
+
+/* each element is pushed to the head in turn, leaving the last one first */
+int credis_lpushv(REDIS rhnd, const char *key, int valc, const char **valv);
+
+int credis_lpushvbin(REDIS rhnd, const char *key, int valc, const char **valv, 
+                     const int *vallenv);
+
 /* returns length of list */
 int credis_llen(REDIS rhnd, const char *key);
 
 /* returns number of elements returned in vector `elementv' */
 int credis_lrange(REDIS rhnd, const char *key, int start, int range, char ***elementv);
 
+/* binary safe version of credis_lrange(), length of each element is returned 
+ * in vector `elementlenv' */
+int credis_lrangebin(REDIS rhnd, const char *key, int start, int range, char ***elementv,
+                     int **elementlenv);
+
 int credis_ltrim(REDIS rhnd, const char *key, int start, int end);
 
 /* returns -1 if the key doesn't exists */
@@ -308,6 +533,10 @@ int credis_rpop(REDIS rhnd, const char *key, char **val);
 /* returns -1 if the given member was already a member of the set */
 int credis_sadd(REDIS rhnd, const char *key, const char *member);
 
+/* adds `memberc' members of `memberv', returns number of members that were 
+ * not already members of the set */
+int credis_saddv(REDIS rhnd, const char *key, int memberc, const char **memberv);
+
 /* returns -1 if the given member is not a member of the set */
 int credis_srem(REDIS rhnd, const char *key, const char *member);
 
@@ -348,6 +577,10 @@ int credis_sdiffstore(REDIS rhnd, const char *destkey, int keyc, const char **ke
 /* returns number of members returned in vector `members' */
 int credis_smembers(REDIS rhnd, const char *key, char ***members);
 
+/* binary safe version of credis_smembers(), length of each member is returned 
+ * in vector `memberlenv' */
+int credis_smembersbin(REDIS rhnd, const char *key, char ***members, int **memberlenv);
+
 /* TODO Redis >= 1.1
  * SRANDMEMBER key Return a random member of the Set value at key
  */
@@ -361,6 +594,11 @@ int credis_smembers(REDIS rhnd, const char *key, char ***members);
  * 0 is returned if the new element was added */
 int credis_zadd(REDIS rhnd, const char *key, double score, const char *member);
 
+/* adds `memberc' members of `memberv' with scores of `scorev', returns number
+ * of members that were added rather than only had their score updated */
+int credis_zaddv(REDIS rhnd, const char *key, int memberc, const double *scorev, 
+                 const char **memberv);
+
 /* returns -1 if the member was not a member of the sorted set */
 int credis_zrem(REDIS rhnd, const char *key, const char *member);
 
@@ -422,9 +660,17 @@ int credis_zunionstore(REDIS rhnd, const char *destkey, int keyc, const char **k
  * returned if the field is created */
 int credis_hset(REDIS rhnd, const char *key, const char *field, const char *value);
 
+/* binary safe version of credis_hset(), `valuelen' is the length of `value' */
+int credis_hsetbin(REDIS rhnd, const char *key, const char *field, const char *value, 
+                   int valuelen);
+
 /* returns -1 if key or field don't exist */
 int credis_hget(REDIS rhnd, const char *key, const char *field, char **value);
 
+/* binary safe version of credis_hget(), length of `value' is returned in `valuelen' */
+int credis_hgetbin(REDIS rhnd, const char *key, const char *field, char **value, 
+                   int *valuelen);
+
 /* returns number of field names returned in vector `fieldv'. 0 is returned if `key' 
  * is empty or does not exist */
 int credis_hkeys(REDIS rhnd, const char *key, char ***fieldv);
@@ -436,8 +682,20 @@ int credis_hlen(REDIS rhnd, const char *key);
  * of fields stored in `fieldv'. */
 int credis_hmget(REDIS rhnd, const char *key, int fieldc, const char **fieldv, char ***valv);
 
+/* binary safe version of credis_hmget(), length of each value is returned in 
+ * vector `vallenv' */
+int credis_hmgetbin(REDIS rhnd, const char *key, int fieldc, const char **fieldv, 
+                    char ***valv, int **vallenv);
+
+/* sets `fieldc' fields of `fieldv' to values of `valv', split in several 
+ * pipelined commands above the handle's batch size just like credis_mset() */
+int credis_hmset(REDIS rhnd, const char *key, int fieldc, const char **fieldv, 
+                 const char **valv);
+
+int credis_hmsetbin(REDIS rhnd, const char *key, int fieldc, const char **fieldv, 
+                    const char **valv, const int *vallenv);
+
 /* TODO
- * HMSET key field1 value1 ... fieldN valueN Set the hash fields to their respective values.
  * HINCRBY key field integer Increment the integer value of the hash at _key_ on _field_ with _integer_.
  * HEXISTS key field Test for existence of a specified field in a hash
  * HDEL key field Remove the specified field from a hash
@@ -446,6 +704,54 @@ int credis_hmget(REDIS rhnd, const char *key, int fieldc, const char **fieldv, c
  */
 
 
+/*
+ * Incremental iteration
+ *
+ * Iterators over SCAN, SSCAN, HSCAN and ZSCAN walk a keyspace, set, hash or
+ * sorted set in batches instead of fetching it with a single blocking 
+ * command like KEYS or SMEMBERS. The cursor is kept by the iterator and the
+ * next batch is requested as soon as one has been returned, so the server 
+ * works on it while the caller processes the current batch. HSCAN and ZSCAN
+ * return fields and values, or members and scores, as consecutive elements.
+ *
+ * EXAMPLE
+ *
+ *   REDIS_SCAN shnd = credis_scan(rh, "user:*", 100);
+ *   char **keyv;
+ *   int i, n;
+ *
+ *   while ((n = credis_scan_next(shnd, &keyv, NULL)) > 0)
+ *     for (i = 0; i < n; i++)
+ *       printf("%s\n", keyv[i]);
+ *   credis_scan_close(shnd);
+ *
+ * IMPORTANT! Elements of a batch are valid until the iterator is advanced or
+ * the handle is used for another command. Using the handle for other 
+ * commands between batches is possible, the batch requested ahead is then
+ * received before the other command is sent and copied aside until the 
+ * iterator is advanced, which requests the next batch ahead again. 
+ * Iterators must be closed before their handle.
+ */
+
+/* `pattern' is a MATCH pattern or NULL to return all elements, `count' a 
+ * COUNT hint for the batch size or 0 to leave it to the server. Returns NULL 
+ * if more memory is not available */
+REDIS_SCAN credis_scan(REDIS rhnd, const char *pattern, int count);
+
+REDIS_SCAN credis_sscan(REDIS rhnd, const char *key, const char *pattern, int count);
+
+REDIS_SCAN credis_hscan(REDIS rhnd, const char *key, const char *pattern, int count);
+
+REDIS_SCAN credis_zscan(REDIS rhnd, const char *key, const char *pattern, int count);
+
+/* returns number of elements of next batch returned in vector `elementv', 
+ * and their lengths in `elementlenv' if not NULL. 0 is returned when the 
+ * iteration is complete */
+int credis_scan_next(REDIS_SCAN shnd, char ***elementv, int **elementlenv);
+
+void credis_scan_close(REDIS_SCAN shnd);
+
+
 /*
  * Sorting 
  */
@@ -456,12 +762,514 @@ int credis_sort(REDIS rhnd, const char *query, char ***elementv);
 
 /*
  * Transactions
+ *
+ * Commands issued in between credis_multi() and credis_exec() are queued in 
+ * the handle's buffer, just like in pipeline mode, and return CREDIS_QUEUED.
+ * credis_exec() sends MULTI, the queued commands and EXEC in one go, consumes
+ * the acknowledgements of queued commands and returns the reply of each 
+ * command as an element of the nested `reply'. WATCH and UNWATCH are sent 
+ * immediately and must precede credis_multi().
+ *
+ * EXAMPLE
+ *
+ *    REDIS_REPLY reply;
+ *    const char *keyv[] = {"counter"};
+ *
+ *    credis_watch(rh, 1, keyv);
+ *    credis_get(rh, "counter", &val);
+ *    credis_multi(rh);
+ *    credis_set(rh, "counter", next(val));
+ *    credis_expire(rh, "counter", 60);
+ *    if (credis_exec(rh, &reply) == -1)
+ *      printf("counter was modified, try again\n");
+ *
+ * IMPORTANT! Transactions can not be combined with pipeline mode.
  */
 
-/* TODO
- * MULTI/EXEC/DISCARD Redis atomic transactions
+int credis_multi(REDIS rhnd);
+
+/* returns number of replies in `reply' (if not NULL), -1 if the transaction
+ * was aborted because a watched key was modified. If EXEC fails, e.g. since
+ * a command was refused when queued, CREDIS_ERR_PROTOCOL is returned and 
+ * the error message is available in `reply' */
+int credis_exec(REDIS rhnd, REDIS_REPLY *reply);
+
+/* discards queued commands and leaves transaction, nothing is sent */
+int credis_discard(REDIS rhnd);
+
+int credis_watch(REDIS rhnd, int keyc, const char **keyv);
+
+int credis_unwatch(REDIS rhnd);
+
+
+/*
+ * Scripting
+ *
+ * A script is created once, which computes its SHA1 digest, and is then run
+ * with EVALSHA so that only the digest is sent. If the server does not have
+ * the script cached, e.g. after a restart or failover, it is loaded with 
+ * SCRIPT LOAD and run again transparently. Registering a script with a 
+ * handle loads it right away. Registered scripts are loaded again when a 
+ * pool, cluster or sharded handle replaces a handle after a reconnect.
+ *
+ * EXAMPLE
+ *
+ *    REDIS_SCRIPT incrmax = credis_script_create(
+ *      "local v = redis.call('INCR', KEYS[1]) "
+ *      "if v > tonumber(ARGV[1]) then redis.call('SET', KEYS[1], 0) end "
+ *      "return v");
+ *    const char *keyv[] = {"counter"}, *argv[] = {"100"};
+ *    REDIS_REPLY reply;
+ *
+ *    credis_evalsha(rh, incrmax, 1, keyv, NULL, 1, argv, NULL, &reply);
+ *
+ * IMPORTANT! A script must not be destroyed while it is registered with 
+ * handles that are still open. In pipeline mode and in transactions a
+ * script that is not cached by the server can not be loaded on the fly, 
+ * register it first.
  */
 
+/* `body' is a zero-terminated Lua script. Returns NULL if more memory is not
+ * available */
+REDIS_SCRIPT credis_script_create(const char *body);
+
+void credis_script_destroy(REDIS_SCRIPT script);
+
+/* returns SHA1 digest of script as 40 hex digits */
+const char *credis_script_sha(REDIS_SCRIPT script);
+
+int credis_script_register(REDIS rhnd, REDIS_SCRIPT script);
+
+/* Runs `script' with `keyc' keys in `keyv' and `argc' arguments in `argv', 
+ * lengths are given by `keylenv' and `argvlen' or, if NULL, keys and 
+ * arguments are zero-terminated strings. Reply is returned as described for
+ * credis_command() */
+int credis_evalsha(REDIS rhnd, REDIS_SCRIPT script, int keyc, const char **keyv, 
+                   const int *keylenv, int argc, const char **argv, const int *argvlen,
+                   REDIS_REPLY *reply);
+
+
+/*
+ * Pipelining
+ *
+ * In pipeline mode commands are not sent immediately but queued in the
+ * handle's buffer. All command functions return CREDIS_QUEUED (or a negative
+ * error code) instead of waiting for a reply. A call to credis_pipeline_flush()
+ * sends all queued commands in one go and replies are then read, in the order
+ * commands were queued, using credis_pipeline_next().
+ *
+ * EXAMPLE
+ *
+ *    REDIS_REPLY reply;
+ *
+ *    credis_pipeline_begin(rh);
+ *    for (i = 0; i < 1000; i++)
+ *      credis_set(rh, keyv[i], valv[i]);
+ *    credis_pipeline_flush(rh);
+ *    while (credis_pipeline_next(rh, &reply) == 0)
+ *      if (reply.type == CREDIS_REPLY_ERROR)
+ *        printf("error: %s\n", reply.str);
+ *    credis_pipeline_end(rh);
+ *
+ * IMPORTANT! New commands can not be queued until all replies of a flushed
+ * pipeline have been read. Publish/subscribe commands can not be pipelined.
+ */
+
+int credis_pipeline_begin(REDIS rhnd);
+
+/* returns number of replies waiting to be read by credis_pipeline_next() */
+int credis_pipeline_flush(REDIS rhnd);
+
+/* returns -1 when there are no more replies to read. Note that a Redis error
+ * reply is returned as any other reply, with type CREDIS_REPLY_ERROR */
+int credis_pipeline_next(REDIS rhnd, REDIS_REPLY *reply);
+
+/* leaves pipeline mode, any queued commands not flushed are discarded and 
+ * replies not yet read are received and discarded */
+int credis_pipeline_end(REDIS rhnd);
+
+
+/*
+ * Asynchronous API
+ *
+ * An asynchronous handle never blocks once connected and is meant to be 
+ * driven by an event loop, e.g. epoll or libevent. Commands are queued with a
+ * callback that is called when the reply has been received. The application 
+ * watches the handle's socket, credis_async_fd(), for the events returned by
+ * credis_async_events() and calls credis_async_onreadable() and 
+ * credis_async_onwritable() as the socket becomes readable or writable. An
+ * event hook can be set to be notified whenever the events of interest change.
+ * Ready-made adapters for epoll and libevent are found in credis-epoll.h and 
+ * credis-libevent.h.
+ *
+ * EXAMPLE
+ *
+ *    void onget(REDIS_ASYNC ah, REDIS_REPLY *reply, void *privdata)
+ *    {
+ *      if (reply != NULL && reply->type == CREDIS_REPLY_BULK)
+ *        printf("%s: %s\n", (char *)privdata, reply->str);
+ *    }
+ *
+ *    const char *argv[] = {"GET", "key"};
+ *    credis_async_command(ah, onget, "key", 2, argv, NULL);
+ *
+ * IMPORTANT! The reply passed to a callback refers to internal buffers and is
+ * only valid until the callback returns. Callbacks may queue new commands but
+ * must not close the handle. Connecting is blocking and honors `timeout'.
+ */
+
+#define CREDIS_ASYNC_READ 1
+#define CREDIS_ASYNC_WRITE 2
+/* passed to event hook along with events when the handle has reconnected,
+ * credis_async_fd() then returns a new socket to watch instead */
+#define CREDIS_ASYNC_RECONNECTED 4
+
+/* `reply' is NULL if the handle is closed before the reply was received */
+typedef void (*credis_async_callback)(REDIS_ASYNC ahnd, REDIS_REPLY *reply, void *privdata);
+
+/* called with the new set of CREDIS_ASYNC_* events of interest */
+typedef void (*credis_async_eventhook)(REDIS_ASYNC ahnd, int events, void *data);
+
+REDIS_ASYNC credis_async_connect(const char *host, int port, int timeout);
+
+/* callbacks of commands still waiting for a reply are called with a NULL reply */
+void credis_async_close(REDIS_ASYNC ahnd);
+
+int credis_async_fd(REDIS_ASYNC ahnd);
+
+/* returns CREDIS_ASYNC_READ, always set, or'ed with CREDIS_ASYNC_WRITE when 
+ * there is data waiting to be sent */
+int credis_async_events(REDIS_ASYNC ahnd);
+
+/* returns number of commands waiting for a reply */
+int credis_async_pending(REDIS_ASYNC ahnd);
+
+void credis_async_seteventhook(REDIS_ASYNC ahnd, credis_async_eventhook hook, void *data);
+
+/* queues command, see credis_command() for a description of `argc', `argv' 
+ * and `argvlen'. `fn' may be NULL if the reply is of no interest */
+int credis_async_command(REDIS_ASYNC ahnd, credis_async_callback fn, void *privdata,
+                         int argc, const char **argv, const int *argvlen);
+
+/* same as credis_setreconnect(), but must be called before the first command
+ * is queued as commands are from then on kept until answered. Returns 
+ * CREDIS_ERR if commands are waiting for replies. Read-only commands not 
+ * answered when the connection was lost are sent again, callbacks of others
+ * are called with a NULL reply. Reconnecting blocks as connecting does */
+int credis_async_setreconnect(REDIS_ASYNC ahnd, int attempts, int mindelay, int maxdelay);
+
+/* receives available data and calls callbacks of all completely received 
+ * replies. Returns number of replies received. On error the connection 
+ * should be closed */
+int credis_async_onreadable(REDIS_ASYNC ahnd);
+
+/* sends as much queued data as possible without blocking */
+int credis_async_onwritable(REDIS_ASYNC ahnd);
+
+
+/*
+ * Connection pool
+ *
+ * A pool holds up to `size' handles that threads check out for exclusive use
+ * and check in when done. Checking out is lock-free and a thread first tries
+ * the handle it used last time, so that threads tend to keep to their own
+ * handles. Handles are connected lazily at check-out. A handle that has been
+ * idle for a while is health checked with credis_ping() at check-out and 
+ * reconnected if that fails, as is a handle checked in after a send or 
+ * receive error.
+ *
+ * EXAMPLE
+ *
+ *    REDIS_POOL pool = credis_pool_create("localhost", 6789, 2000, 16);
+ *
+ *    REDIS rh = credis_pool_checkout(pool);
+ *    if (rh != NULL) {
+ *      credis_set(rh, "fruit", "banana");
+ *      credis_pool_checkin(pool, rh);
+ *    }
+ *
+ * IMPORTANT! A checked out handle must not be closed, and all handles must
+ * be checked in before the pool is destroyed.
+ */
+
+REDIS_POOL credis_pool_create(const char *host, int port, int timeout, int size);
+
+void credis_pool_destroy(REDIS_POOL pool);
+
+/* handles idle for at least `msecs' milliseconds are health checked at 
+ * check-out, 0 checks at every check-out and -1 turns off health checks. 
+ * Default is 1000 msecs */
+void credis_pool_sethealthcheck(REDIS_POOL pool, int msecs);
+
+/* returns NULL if all handles are checked out or connecting failed */
+REDIS credis_pool_checkout(REDIS_POOL pool);
+
+void credis_pool_checkin(REDIS_POOL pool, REDIS rhnd);
+
+
+/*
+ * Parallel executor
+ *
+ * An executor runs multi-key commands with many keys on several handles of
+ * a connection pool at once. Keys are split into chunks, and each chunk is 
+ * sent as one command. Chunks are spread evenly over `threads' workers: the
+ * calling thread and `threads' - 1 worker threads started at creation. A 
+ * worker that is done with its own chunks takes the last chunks of workers
+ * that are still busy. Workers only run while a call is in progress. A 
+ * worker that cannot check out a handle, because the pool has fewer handles 
+ * than there are workers, leaves its chunks to the others.
+ *
+ * EXAMPLE
+ *
+ *    REDIS_POOL pool = credis_pool_create("localhost", 6789, 2000, 4);
+ *    REDIS_EXECUTOR ex = credis_executor_create(pool, 4, 0);
+ *
+ *    n = credis_executor_mget(ex, keyc, keyv, &valv);
+ *    ...
+ *    credis_executor_destroy(ex);
+ *    credis_pool_destroy(pool);
+ *
+ * Only connection pools of a single server are supported. Keys are not 
+ * routed by slot or shard, so an executor cannot be built on a cluster or
+ * shard router; keys spread over several servers must first be grouped per
+ * server, each group then run by an executor on a pool to that server.
+ *
+ * IMPORTANT! An executor runs one call at a time and must not be used by 
+ * several threads at once. It must be destroyed before its pool.
+ */
+
+/* `chunk' is the number of keys sent per command, 0 for a default of 256 */
+REDIS_EXECUTOR credis_executor_create(REDIS_POOL pool, int threads, int chunk);
+
+void credis_executor_destroy(REDIS_EXECUTOR ehnd);
+
+/* Like credis_mget(), values are returned in the order of keys in `keyv' and
+ * are managed by the executor until its next call. Returns number of values
+ * or, if any chunk fails, its error. */
+int credis_executor_mget(REDIS_EXECUTOR ehnd, int keyc, const char **keyv, char ***valv);
+
+/* returns number of keys deleted */
+int credis_executor_del(REDIS_EXECUTOR ehnd, int keyc, const char **keyv);
+
+
+/*
+ * Cluster
+ *
+ * A cluster handle routes commands to the nodes of a Redis Cluster. The map
+ * of which node serves each of the 16384 hash slots is fetched from the 
+ * first reachable seed node with CLUSTER SLOTS and cached. Keys are mapped
+ * to slots by CRC16, only hashing the part of a key between the first `{'
+ * and the following `}', if that part is non-empty, so that related keys
+ * can be forced into the same slot, e.g. "{user1000}.following" and 
+ * "{user1000}.followers". One connection is kept per node and connected 
+ * when first needed. MOVED replies update the slot map and ASK replies are 
+ * followed for a single command, both transparently to the caller.
+ *
+ * EXAMPLE
+ *
+ *    REDIS_CLUSTER ch = credis_cluster_connect("10.0.0.1:7000,10.0.0.2:7000", 2000);
+ *
+ *    credis_cluster_set(ch, "fruit", "banana");
+ *    credis_cluster_close(ch);
+ *
+ * IMPORTANT! Returned data refers to memory managed by the cluster handle
+ * or its node handles and is only valid until the next call using the 
+ * cluster handle.
+ */
+
+/* `seeds' is a comma separated list of "host:port" nodes to fetch the slot
+ * map from, port defaults to 6379. Returns NULL if the slot map could not be 
+ * fetched from any of the seeds */
+REDIS_CLUSTER credis_cluster_connect(const char *seeds, int timeout);
+
+void credis_cluster_close(REDIS_CLUSTER chnd);
+
+/* fetches slot map again, from the first reachable node */
+int credis_cluster_refresh(REDIS_CLUSTER chnd);
+
+/* returns hash slot of `key' of length `keylen' */
+int credis_cluster_keyslot(const char *key, int keylen);
+
+/* returns handle of node serving `key', for commands that lack a cluster 
+ * function. Such commands are not redirected. Returns NULL if connecting
+ * to the node failed */
+REDIS credis_cluster_handle(REDIS_CLUSTER chnd, const char *key);
+
+/* same as credis_command(), `argv[1]' is taken to be the key that decides
+ * which node the command is sent to */
+int credis_cluster_command(REDIS_CLUSTER chnd, int argc, const char **argv, 
+                           const int *argvlen, REDIS_REPLY *reply);
+
+int credis_cluster_set(REDIS_CLUSTER chnd, const char *key, const char *val);
+
+int credis_cluster_get(REDIS_CLUSTER chnd, const char *key, char **val);
+
+int credis_cluster_del(REDIS_CLUSTER chnd, const char *key);
+
+/* keys are grouped by slot and one MGET per slot is pipelined to each of the
+ * nodes concerned, so that all nodes work on their part at the same time. 
+ * Values are returned in the order of `keyv' */
+int credis_cluster_mget(REDIS_CLUSTER chnd, int keyc, const char **keyv, char ***valv);
+
+
+/*
+ * Sharding
+ *
+ * A sharded handle spreads keys over a number of standalone Redis servers,
+ * the shards, using consistent hashing. Each shard is given points on a 
+ * hash ring in proportion to its weight and a key belongs to the shard of
+ * the first point following the hash of the key. Adding or removing one of
+ * N shards therefore only moves about 1/N of the keys. One connection is 
+ * kept per shard and connected when first needed.
+ *
+ * EXAMPLE
+ *
+ *    REDIS_SHARDS sh = credis_shards_create(2000);
+ *    credis_shards_add(sh, "10.0.0.1", 6379, 1);
+ *    credis_shards_add(sh, "10.0.0.2", 6379, 2);
+ *
+ *    credis_set(credis_shards_handle(sh, "fruit"), "fruit", "banana");
+ *    credis_shards_destroy(sh);
+ *
+ * IMPORTANT! Returned data refers to memory managed by the sharded handle or
+ * its shard handles and is only valid until the next call using the sharded
+ * handle.
+ */
+
+REDIS_SHARDS credis_shards_create(int timeout);
+
+void credis_shards_destroy(REDIS_SHARDS shnd);
+
+/* `weight' is relative to the weights of other shards and must be > 0. A 
+ * shard can only be added once */
+int credis_shards_add(REDIS_SHARDS shnd, const char *host, int port, int weight);
+
+/* returns -1 if shard was not found */
+int credis_shards_remove(REDIS_SHARDS shnd, const char *host, int port);
+
+/* returns handle of shard of `key', to be used with any single key command.
+ * Returns NULL if there are no shards or connecting failed */
+REDIS credis_shards_handle(REDIS_SHARDS shnd, const char *key);
+
+/* same as credis_command(), `argv[1]' is taken to be the key that decides
+ * which shard the command is sent to */
+int credis_shards_command(REDIS_SHARDS shnd, int argc, const char **argv, 
+                          const int *argvlen, REDIS_REPLY *reply);
+
+/* keys are grouped by shard and the command for each group is pipelined to
+ * its shard, so that all shards work on their part at the same time. Values
+ * are returned in the order of `keyv' */
+int credis_shards_mget(REDIS_SHARDS shnd, int keyc, const char **keyv, char ***valv);
+
+/* returns total number of keys deleted */
+int credis_shards_del(REDIS_SHARDS shnd, int keyc, const char **keyv);
+
+
+/*
+ * Sentinel
+ *
+ * A Sentinel handle follows the master of a replicated set of servers that
+ * is monitored by Redis Sentinel. The address of the master is asked for
+ * from the first sentinel that answers, and a connection to that sentinel 
+ * is subscribed to +switch-master. Switch messages are applied, without 
+ * waiting for them, at most once per millisecond before a handle is returned.
+ * Hence a failover is followed as soon as it is announced, rather than when
+ * the old master times out. If the master can not be reached sentinels are
+ * asked again.
+ *
+ * Optionally read-only commands, e.g. GET, MGET, LRANGE and ZRANGE, are sent
+ * to replicas to take load off the master. The replica with the fewest 
+ * replies outstanding, i.e. commands queued or flushed in pipeline mode but
+ * not yet read, is picked and ties are spread round-robin. Replicas flagged 
+ * as down by sentinels are left out and one that can not be reached is not
+ * tried again for a second. Note that what is read from a replica may lag 
+ * behind the master.
+ *
+ * EXAMPLE
+ *
+ *    REDIS_SENTINEL sn = credis_sentinel_connect("10.0.0.1,10.0.0.2:26380", "mymaster", 2000);
+ *    credis_sentinel_readreplicas(sn, 1);
+ *
+ *    credis_set(credis_sentinel_master(sn), "fruit", "banana");
+ *    credis_get(credis_sentinel_replica(sn), "fruit", &val);
+ *    credis_sentinel_close(sn);
+ *
+ * IMPORTANT! Returned handles are managed by the Sentinel handle and must not
+ * be closed. A handle, and data returned through it, is only valid until the
+ * next call using the Sentinel handle.
+ */
+
+/* `sentinels' is a comma separated list of "host:port" sentinels, port 
+ * defaults to 26379. `name' is the name sentinels know the master by. 
+ * Returns NULL if no sentinel knew the address of the master */
+REDIS_SENTINEL credis_sentinel_connect(const char *sentinels, const char *name, int timeout);
+
+void credis_sentinel_close(REDIS_SENTINEL snhnd);
+
+/* asks sentinels for the address of the master, and replicas if read from */
+int credis_sentinel_refresh(REDIS_SENTINEL snhnd);
+
+/* `enable' set to 1 sends read-only commands of credis_sentinel_command() to
+ * replicas, 0 sends all to master. Default is 0 */
+int credis_sentinel_readreplicas(REDIS_SENTINEL snhnd, int enable);
+
+/* returns handle of master, or NULL if it could not be reached */
+REDIS credis_sentinel_master(REDIS_SENTINEL snhnd);
+
+/* returns handle of a replica, or of master if replicas are not read from or
+ * none can be reached */
+REDIS credis_sentinel_replica(REDIS_SENTINEL snhnd);
+
+/* same as credis_command() sent to master, or to a replica if the command is
+ * read-only and replicas are read from. A read-only command is sent again if
+ * the connection is lost, others are not since they may have been carried 
+ * out */
+int credis_sentinel_command(REDIS_SENTINEL snhnd, int argc, const char **argv, 
+                            const int *argvlen, REDIS_REPLY *reply);
+
+
+/*
+ * Statistics
+ *
+ * When credis is built with CREDIS_STATS defined, e.g. by adding 
+ * -DCREDIS_STATS to CPPFLAGS in Makefile, each handle keeps statistics of 
+ * commands, I/O and memory reallocations as well as a histogram of command 
+ * latencies measured from sending a command until its reply has been 
+ * received. A hook can be set to be called after each such command, for 
+ * instance to feed a tracing system. Without CREDIS_STATS defined no 
+ * statistics are collected and the functions below return CREDIS_ERR.
+ */
+
+#define CREDIS_STATS_BUCKETS 32
+
+typedef struct _cr_stats {
+  unsigned long long commands;           /* including pipelined commands */
+  unsigned long long bytes_sent;
+  unsigned long long bytes_received;
+  unsigned long long send_calls;         /* number of send() system calls */
+  unsigned long long recv_calls;         /* number of recv() system calls */
+  unsigned long long buffer_reallocs;    /* message buffer reallocations */
+  unsigned long long multibulk_reallocs; /* multi-bulk storage reallocations */
+  unsigned long long timeouts;
+  unsigned long long cache_hits;         /* refer to credis_cache_enable() */
+  unsigned long long cache_misses;
+  /* `latency[i]' is the number of commands that took 2^i to 2^(i+1)-1 
+   * microseconds, latency[0] also holds commands taking 0 microseconds */
+  unsigned long long latency[CREDIS_STATS_BUCKETS];
+} REDIS_STATS;
+
+/* `command' is the zero-terminated command name, possibly truncated, `rc' 
+ * the value returned to the caller and `usecs' the command latency */
+typedef void (*credis_commandhook)(REDIS rhnd, const char *command, int rc, 
+                                   long long usecs, void *data);
+
+int credis_getstats(REDIS rhnd, REDIS_STATS *stats);
+
+void credis_resetstats(REDIS rhnd);
+
+/* setting `hook' to NULL removes a previously set hook */
+int credis_setcommandhook(REDIS rhnd, credis_commandhook hook, void *data);
+
 
 /*
  * Publish/Subscribe 
@@ -480,6 +1288,11 @@ int credis_sort(REDIS rhnd, const char *query, char ***elementv);
  * stored on an internal FIFO. When the client is ready to receive messages a 
  * call to listen function is made and if there is a message in the FIFO it is 
  * immediately returned else Credis waits for a message being pushed from Redis.
+ * The FIFO is a ring of messages allocated upfront, with message data kept in
+ * a per-handle arena.
+ *
+ * For high message rates credis_listenbatch() returns all messages that have
+ * been received with a single read, parsing them in place.
  *
  * IMPORTANT! Note that while subscribing to one or more channels (or patterns) 
  * the client is in a publish/subscribe state in which is not allowed to perform 
@@ -487,7 +1300,8 @@ int credis_sort(REDIS rhnd, const char *query, char ***elementv);
  */
 
 /* On success the number of channels we are currently subscribed to is
- * returned. */
+ * returned. CREDIS_ERR_TIMEOUT is returned if no acknowledgement has been 
+ * received within the handle's timeout, even if messages keep arriving. */
 int credis_subscribe(REDIS rhnd, const char *channel);
 
 /* `channel' specifies the channel to unsubscribe from. If set to NULL
@@ -510,6 +1324,59 @@ int credis_publish(REDIS rhnd, const char *channel, const char *message);
 /* Listen for messages from channels and/or patterns subscribed to */
 int credis_listen(REDIS rhnd, char **pattern, char **channel, char **message);
 
+typedef struct _cr_pubsubmessage {
+  char *pattern; /* NULL unless received through a pattern subscription */
+  char *channel;
+  char *message; /* zero-terminated, but may hold binary data */
+  int len;       /* length of `message' */
+} REDIS_MESSAGE;
+
+/* Stores at most `max' messages in `msgv', queued messages first, waiting 
+ * `timeout' milliseconds for the first message if none has been received. 
+ * Returns number of messages stored, 0 on timeout. Messages refer to 
+ * internal buffers and are valid until the next call using the handle */
+int credis_listenbatch(REDIS rhnd, REDIS_MESSAGE *msgv, int max, int timeout);
+
+
+/*
+ * Client-side caching
+ *
+ * Values of hot keys read with credis_get() and credis_hget(), and their
+ * binary counterparts, can be kept in a bounded local cache of the handle. 
+ * A cache hit returns without touching the socket. The cache is kept coherent
+ * by the server, which tracks keys read through the handle and pushes 
+ * invalidation messages when they are modified (CLIENT TRACKING, Redis 6.0 
+ * and later). These messages are received by a second connection subscribed 
+ * to the invalidation channel and are applied before a lookup, checking for 
+ * them at most once per millisecond. Hence a change made by another client 
+ * is seen after about a millisecond plus the time it takes for the server to 
+ * push the invalidation. Commands sent through the handle itself remove 
+ * entries of the keys among their arguments right away.
+ *
+ * When the cache is full an entry that has not been hit since the clock hand
+ * last passed it is evicted (CLOCK). Nil values are cached as well.
+ *
+ * EXAMPLE
+ *
+ *   credis_cache_enable(rh, 10000, 1024*1024);
+ *   credis_get(rh, "config:limit", &val);  (sent to server)
+ *   credis_get(rh, "config:limit", &val);  (cache hit)
+ *
+ * IMPORTANT! A value returned from the cache is valid until the next call 
+ * using the handle, just as a received value is. The cache is per handle and 
+ * is not carried over when a pool, cluster or shards handle reconnects. If 
+ * the invalidation connection is lost the cache is cleared and bypassed.
+ */
+
+/* Enables cache of at most `maxentries' values taking at most `maxbytes' of
+ * memory, including overhead. Returns 0 on success, CREDIS_ERR if cache is 
+ * already enabled or CREDIS_ERR_CONNECT if the invalidation connection could
+ * not be established */
+int credis_cache_enable(REDIS rhnd, int maxentries, int maxbytes);
+
+/* Turns off tracking and releases all cached values */
+int credis_cache_disable(REDIS rhnd);
+
 
 /* 
  * Persistence control commands 